@@ -0,0 +1,628 @@
+/* The MIT License
+
+    Copyright (c) 2018-  by Christopher Wilks <cwilks3@jhu.edu> and Ben Langmead
+                         <langmea@cs.jhu.edu>
+
+    See LICENSE.txt in the top level of this repository for the full text.
+*/
+
+//Deterministic synthetic input generator for the megadepth benchmark suite.
+//Writes a random reference (FASTA+FAI), a coordinate sorted BAM (+BAI) and CRAM (+CRAI)
+//with MD:Z/NM:i tags, the raw M-op coverage of those alignments as one or more BigWigs
+//(plus a .txt list of them for BigWig list mode), and a BED of exon-like regions.
+//Everything is a pure function of the seed and the parameters, so the same command line
+//produces the same inputs on every machine and every release.
+#define __STDC_FORMAT_MACROS
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <climits>
+#include <sys/stat.h>
+
+#include <htslib/sam.h>
+#include <htslib/hts.h>
+#include <htslib/faidx.h>
+#include "bigWig.h"
+
+static const char USAGE[] = "make_synthetic: deterministic BAM/CRAM/BigWig/BED inputs for benchmarking megadepth\n\n"
+    "Usage:\n"
+    "  make_synthetic --prefix <path_prefix> [options]\n\n"
+    "Options:\n"
+    "  --seed <int>                 PRNG seed (default: 1)\n"
+    "  --genome-size <int>          Total reference length in bases (default: 10000000)\n"
+    "  --chromosomes <int>          Number of chromosomes to split the reference into (default: 4)\n"
+    "  --depth <float>              Mean aligned depth (default: 30)\n"
+    "  --read-length <int>          Read length (default: 100)\n"
+    "  --paired-fraction <float>    Fraction of fragments sequenced as pairs (default: 0.8)\n"
+    "  --spliced-fraction <float>   Fraction of reads with an N (intron) operation (default: 0.2)\n"
+    "  --overlap-rate <float>       Fraction of pairs whose mates overlap (default: 0.3)\n"
+    "  --mismatch-rate <float>      Per-base substitution rate (default: 0.005)\n"
+    "  --indel-fraction <float>     Fraction of reads with a 1-3bp insertion or deletion (default: 0.05)\n"
+    "  --softclip-fraction <float>  Fraction of reads with a leading soft clip (default: 0.05)\n"
+    "  --multimap-fraction <float>  Fraction of reads given MAPQ 0 (default: 0.05)\n"
+    "  --exons <int>                Number of BED regions to write (default: 20000)\n"
+    "  --bigwigs <int>              Number of BigWigs written for BigWig list mode (default: 4)\n"
+    "  --no-cram                    Skip writing the CRAM\n"
+    "  --force                      Regenerate even if <path_prefix>.info.tsv matches these parameters\n";
+
+struct SynthParams {
+    uint64_t seed = 1;
+    uint64_t genome_size = 10000000;
+    int chromosomes = 4;
+    double depth = 30.0;
+    int read_length = 100;
+    double paired_fraction = 0.8;
+    double spliced_fraction = 0.2;
+    double overlap_rate = 0.3;
+    double mismatch_rate = 0.005;
+    double indel_fraction = 0.05;
+    double softclip_fraction = 0.05;
+    double multimap_fraction = 0.05;
+    uint64_t exons = 20000;
+    int bigwigs = 4;
+    bool cram = true;
+};
+
+//splitmix64, small and good enough to drive a data generator
+struct Rng {
+    uint64_t s;
+    explicit Rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    //uniform in [0,n)
+    uint32_t below(uint32_t n) { return (uint32_t) (((next() >> 32) * (uint64_t) n) >> 32); }
+    //uniform in [lo,hi]
+    int32_t range(int32_t lo, int32_t hi) { return lo + (int32_t) below((uint32_t) (hi - lo + 1)); }
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    bool chance(double p) { return unit() < p; }
+};
+
+static uint64_t mix_seed(uint64_t seed, uint64_t a, uint64_t b) {
+    Rng r(seed ^ (a * 0xD1B54A32D192ED03ULL) ^ (b * 0xABC98388FB8FAC03ULL));
+    return r.next();
+}
+
+static const int MAX_OPS = 8;
+//one alignment's reference layout; bases/quals are only materialized at write time
+struct ReadLayout {
+    int32_t pos;
+    int32_t ref_len;
+    uint8_t n_ops;
+    uint32_t ops[MAX_OPS];
+};
+
+struct Fragment {
+    bool paired;
+    ReadLayout mates[2];
+};
+
+static void push_op(ReadLayout* r, int op, int len) {
+    if(len <= 0)
+        return;
+    if(r->n_ops > 0 && bam_cigar_op(r->ops[r->n_ops-1]) == op) {
+        r->ops[r->n_ops-1] += len << BAM_CIGAR_SHIFT;
+        return;
+    }
+    r->ops[r->n_ops++] = bam_cigar_gen(len, op);
+}
+
+//lay out one read of read_length query bases starting at pos
+static void layout_read(const SynthParams& p, Rng& rng, int32_t pos, ReadLayout* r) {
+    r->pos = pos;
+    r->n_ops = 0;
+    int qleft = p.read_length;
+    if(rng.chance(p.softclip_fraction)) {
+        int sc = rng.range(3, std::max(3, p.read_length / 5));
+        push_op(r, BAM_CSOFT_CLIP, sc);
+        qleft -= sc;
+    }
+    int intron_at = -1, intron_len = 0;
+    if(rng.chance(p.spliced_fraction) && qleft > 20) {
+        intron_at = rng.range(8, qleft - 8);
+        intron_len = rng.range(50, 5000);
+    }
+    int indel_at = -1, indel_op = BAM_CINS, indel_len = 0;
+    if(rng.chance(p.indel_fraction) && qleft > 20) {
+        indel_at = rng.range(6, qleft - 10);
+        indel_op = rng.chance(0.5) ? BAM_CINS : BAM_CDEL;
+        indel_len = rng.range(1, 3);
+        if(intron_at >= 0 && std::abs(indel_at - intron_at) < 4)
+            indel_at = -1;
+    }
+    //walk query bases, dropping in the intron/indel at their query offsets
+    int q = 0;
+    while(q < qleft) {
+        int next = qleft;
+        if(intron_at > q && intron_at < next)
+            next = intron_at;
+        if(indel_at > q && indel_at < next)
+            next = indel_at;
+        push_op(r, BAM_CMATCH, next - q);
+        if(next == intron_at)
+            push_op(r, BAM_CREF_SKIP, intron_len);
+        if(next == indel_at) {
+            if(indel_op == BAM_CINS) {
+                int ilen = std::min(indel_len, qleft - next - 1);
+                push_op(r, BAM_CINS, ilen);
+                next += ilen;
+            }
+            else
+                push_op(r, BAM_CDEL, indel_len);
+        }
+        q = next;
+    }
+    r->ref_len = 0;
+    for(int i = 0; i < r->n_ops; i++) {
+        int op = bam_cigar_op(r->ops[i]);
+        if(bam_cigar_type(op) & 2)
+            r->ref_len += bam_cigar_oplen(r->ops[i]);
+    }
+}
+
+//fragment layout is a pure function of (seed, tid, fragment id, start)
+//so it can be recomputed when each mate is written out
+static void layout_fragment(const SynthParams& p, int tid, uint32_t frag_id, int32_t start, int32_t chrm_len, Fragment* f) {
+    Rng rng(mix_seed(p.seed, tid + 1, frag_id));
+    f->paired = rng.chance(p.paired_fraction);
+    layout_read(p, rng, start, &f->mates[0]);
+    if(!f->paired)
+        return;
+    int32_t mate_start;
+    if(rng.chance(p.overlap_rate))
+        mate_start = start + rng.range(0, std::max(0, f->mates[0].ref_len - 1));
+    else
+        mate_start = start + f->mates[0].ref_len + rng.range(0, 300);
+    layout_read(p, rng, mate_start, &f->mates[1]);
+    //drop the mate if it would hang off the end of the chromosome
+    if(mate_start + f->mates[1].ref_len > chrm_len)
+        f->paired = false;
+}
+
+struct RecordKey {
+    int32_t pos;
+    uint32_t frag_id;
+    int32_t frag_start;
+    uint8_t mate;
+    bool operator<(const RecordKey& o) const {
+        if(pos != o.pos)
+            return pos < o.pos;
+        if(frag_id != o.frag_id)
+            return frag_id < o.frag_id;
+        return mate < o.mate;
+    }
+};
+
+static const char BASES[] = "ACGT";
+static const uint8_t NT16[] = {1, 2, 4, 8};
+
+static void write_fasta(const char* fn, const std::vector<std::string>& names, const std::vector<std::string>& seqs) {
+    FILE* fp = fopen(fn, "w");
+    if(!fp) {
+        fprintf(stderr, "Unable to write %s, exiting\n", fn);
+        exit(-1);
+    }
+    for(size_t i = 0; i < names.size(); i++) {
+        fprintf(fp, ">%s\n", names[i].c_str());
+        const std::string& s = seqs[i];
+        for(size_t j = 0; j < s.size(); j += 60)
+            fprintf(fp, "%.*s\n", (int) std::min((size_t) 60, s.size() - j), s.c_str() + j);
+    }
+    fclose(fp);
+    if(fai_build(fn) != 0) {
+        fprintf(stderr, "Unable to index %s, exiting\n", fn);
+        exit(-1);
+    }
+}
+
+//fills b with one alignment, returns the number of aligned (M) bases
+static int build_record(const SynthParams& p, bam1_t* b, int tid, const Fragment& f, uint32_t frag_id, int mate, const std::string& ref, std::string& mdz, std::vector<uint8_t>& scratch) {
+    const ReadLayout& r = f.mates[mate];
+    Rng rng(mix_seed(p.seed ^ 0x5EEDULL, tid + 1, ((uint64_t) frag_id << 1) | mate));
+    char qname[64];
+    int qlen = snprintf(qname, sizeof(qname), "r%d.%u", tid, frag_id) + 1;
+    int extranul = (4 - (qlen & 3)) & 3;
+    int lseq = p.read_length;
+
+    b->core.tid = tid;
+    b->core.pos = r.pos;
+    b->core.bin = hts_reg2bin(r.pos, r.pos + r.ref_len, 14, 5);
+    b->core.qual = rng.chance(p.multimap_fraction) ? 0 : 60;
+    b->core.l_qname = qlen + extranul;
+    b->core.l_extranul = extranul;
+    b->core.n_cigar = r.n_ops;
+    b->core.l_qseq = lseq;
+    b->core.flag = 0;
+    b->core.mtid = -1;
+    b->core.mpos = -1;
+    b->core.isize = 0;
+    bool reverse = (frag_id & 1) != (uint32_t) mate;
+    if(reverse)
+        b->core.flag |= BAM_FREVERSE;
+    if(f.paired) {
+        const ReadLayout& m = f.mates[mate ^ 1];
+        b->core.flag |= BAM_FPAIRED | BAM_FPROPER_PAIR | (mate == 0 ? BAM_FREAD1 : BAM_FREAD2);
+        if(!reverse)
+            b->core.flag |= BAM_FMREVERSE;
+        b->core.mtid = tid;
+        b->core.mpos = m.pos;
+        int32_t left = f.mates[0].pos;
+        int32_t right = std::max(f.mates[0].pos + f.mates[0].ref_len, f.mates[1].pos + f.mates[1].ref_len);
+        b->core.isize = (mate == 0 ? 1 : -1) * (right - left);
+    }
+
+    size_t l_data = b->core.l_qname + r.n_ops * 4 + ((lseq + 1) >> 1) + lseq;
+    if(b->m_data < l_data) {
+        b->m_data = l_data + 64;
+        b->data = (uint8_t*) realloc(b->data, b->m_data);
+    }
+    b->l_data = l_data;
+    uint8_t* d = b->data;
+    memcpy(d, qname, qlen);
+    memset(d + qlen, 0, extranul);
+    memcpy(bam_get_cigar(b), r.ops, r.n_ops * 4);
+
+    //walk the CIGAR to produce read bases against the reference, building MD:Z as we go
+    scratch.resize(lseq);
+    mdz.clear();
+    int md_run = 0, nm = 0, aligned = 0;
+    int32_t rpos = r.pos;
+    int q = 0;
+    for(int i = 0; i < r.n_ops; i++) {
+        int op = bam_cigar_op(r.ops[i]);
+        int len = bam_cigar_oplen(r.ops[i]);
+        switch(op) {
+            case BAM_CMATCH:
+                for(int j = 0; j < len; j++, q++, rpos++) {
+                    char rb = ref[rpos];
+                    if(rng.chance(p.mismatch_rate)) {
+                        char alt = BASES[(strchr(BASES, rb) - BASES + rng.range(1, 3)) & 3];
+                        scratch[q] = alt;
+                        mdz += std::to_string(md_run);
+                        mdz += rb;
+                        md_run = 0;
+                        nm++;
+                    }
+                    else {
+                        scratch[q] = rb;
+                        md_run++;
+                    }
+                }
+                aligned += len;
+                break;
+            case BAM_CINS:
+            case BAM_CSOFT_CLIP:
+                for(int j = 0; j < len; j++, q++)
+                    scratch[q] = BASES[rng.below(4)];
+                if(op == BAM_CINS)
+                    nm += len;
+                break;
+            case BAM_CDEL:
+                mdz += std::to_string(md_run);
+                mdz += '^';
+                mdz.append(ref, rpos, len);
+                md_run = 0;
+                rpos += len;
+                nm += len;
+                break;
+            case BAM_CREF_SKIP:
+                rpos += len;
+                break;
+        }
+    }
+    mdz += std::to_string(md_run);
+
+    uint8_t* s = bam_get_seq(b);
+    memset(s, 0, (lseq + 1) >> 1);
+    for(int j = 0; j < lseq; j++)
+        s[j >> 1] |= NT16[strchr(BASES, scratch[j]) - BASES] << ((~j & 1) << 2);
+    uint8_t* qual = bam_get_qual(b);
+    for(int j = 0; j < lseq; j++)
+        qual[j] = (uint8_t) rng.range(2, 40);
+
+    bam_aux_append(b, "MD", 'Z', mdz.size() + 1, (const uint8_t*) mdz.c_str());
+    int32_t nm32 = nm;
+    bam_aux_append(b, "NM", 'i', 4, (const uint8_t*) &nm32);
+    return aligned;
+}
+
+static void add_coverage(std::vector<int32_t>& diffs, const ReadLayout& r) {
+    int32_t rpos = r.pos;
+    for(int i = 0; i < r.n_ops; i++) {
+        int op = bam_cigar_op(r.ops[i]);
+        int len = bam_cigar_oplen(r.ops[i]);
+        if(op == BAM_CMATCH) {
+            diffs[rpos]++;
+            diffs[rpos + len]--;
+        }
+        if(bam_cigar_type(op) & 2)
+            rpos += len;
+    }
+}
+
+//each extra BigWig gets its coverage scaled by a different factor so list-mode outputs differ
+static void write_bigwigs(const SynthParams& p, const char* prefix, const std::vector<std::string>& names, std::vector<uint32_t>& lens, const std::vector<std::vector<int32_t> >& covs, uint64_t* intervals) {
+    std::string list_fn = std::string(prefix) + ".bigwigs.txt";
+    FILE* list_fp = fopen(list_fn.c_str(), "w");
+    if(!list_fp) {
+        fprintf(stderr, "Unable to write %s, exiting\n", list_fn.c_str());
+        exit(-1);
+    }
+    std::vector<char*> cnames;
+    for(auto& n : names)
+        cnames.push_back(const_cast<char*>(n.c_str()));
+    if(bwInit(1<<17) != 0) {
+        fprintf(stderr, "Failed when calling bwInit with 1<<17 buffer size, exiting\n");
+        exit(-1);
+    }
+    *intervals = 0;
+    std::vector<uint32_t> starts, ends;
+    std::vector<float> vals;
+    for(int k = 0; k < p.bigwigs; k++) {
+        char fn[4096];
+        if(k == 0)
+            snprintf(fn, sizeof(fn), "%s.bw", prefix);
+        else
+            snprintf(fn, sizeof(fn), "%s.%d.bw", prefix, k);
+        bigWigFile_t* bw = bwOpen(fn, nullptr, "w");
+        if(!bw || bwCreateHdr(bw, 10) != 0) {
+            fprintf(stderr, "Unable to create BigWig %s, exiting\n", fn);
+            exit(-1);
+        }
+        bw->cl = bwCreateChromList(cnames.data(), lens.data(), names.size());
+        bwWriteHdr(bw);
+        float scale = 1.0f + 0.25f * k;
+        for(size_t tid = 0; tid < names.size(); tid++) {
+            const std::vector<int32_t>& cov = covs[tid];
+            starts.clear(); ends.clear(); vals.clear();
+            int32_t running = 0, run_val = 0;
+            uint32_t run_start = 0;
+            for(uint32_t i = 0; i < lens[tid]; i++) {
+                running += cov[i];
+                if(running == run_val)
+                    continue;
+                if(run_val != 0) {
+                    starts.push_back(run_start); ends.push_back(i); vals.push_back(run_val * scale);
+                }
+                run_start = i;
+                run_val = running;
+            }
+            if(run_val != 0) {
+                starts.push_back(run_start); ends.push_back(lens[tid]); vals.push_back(run_val * scale);
+            }
+            if(starts.empty())
+                continue;
+            char* cn = cnames[tid];
+            if(bwAddIntervals(bw, &cn, &starts[0], &ends[0], &vals[0], 1) != 0
+                    || (starts.size() > 1 && bwAppendIntervals(bw, &starts[1], &ends[1], &vals[1], starts.size() - 1) != 0)) {
+                fprintf(stderr, "Unable to write intervals to BigWig %s, exiting\n", fn);
+                exit(-1);
+            }
+            if(k == 0)
+                *intervals += starts.size();
+        }
+        bwClose(bw);
+        char full[PATH_MAX];
+        fprintf(list_fp, "%s\n", realpath(fn, full) ? full : fn);
+    }
+    bwCleanup();
+    fclose(list_fp);
+}
+
+static void write_exons(const SynthParams& p, const char* prefix, const std::vector<std::string>& names, const std::vector<uint32_t>& lens) {
+    std::string fn = std::string(prefix) + ".exons.bed";
+    FILE* fp = fopen(fn.c_str(), "w");
+    if(!fp) {
+        fprintf(stderr, "Unable to write %s, exiting\n", fn.c_str());
+        exit(-1);
+    }
+    Rng rng(mix_seed(p.seed, 0xBED, 0));
+    uint64_t per_chrm = std::max((uint64_t) 1, p.exons / names.size());
+    std::vector<std::pair<uint32_t, uint32_t> > exons;
+    for(size_t tid = 0; tid < names.size(); tid++) {
+        exons.clear();
+        for(uint64_t i = 0; i < per_chrm; i++) {
+            uint32_t len = rng.range(50, 2000);
+            if(len >= lens[tid])
+                len = lens[tid] - 1;
+            uint32_t start = rng.below(lens[tid] - len);
+            exons.push_back(std::make_pair(start, start + len));
+        }
+        std::sort(exons.begin(), exons.end());
+        for(auto& e : exons)
+            fprintf(fp, "%s\t%u\t%u\n", names[tid].c_str(), e.first, e.second);
+    }
+    fclose(fp);
+}
+
+static std::string params_line(const SynthParams& p) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "seed=%" PRIu64 ",genome_size=%" PRIu64 ",chromosomes=%d,depth=%g,read_length=%d,paired=%g,spliced=%g,overlap=%g,mismatch=%g,indel=%g,softclip=%g,multimap=%g,exons=%" PRIu64 ",bigwigs=%d,cram=%d",
+            p.seed, p.genome_size, p.chromosomes, p.depth, p.read_length, p.paired_fraction, p.spliced_fraction, p.overlap_rate,
+            p.mismatch_rate, p.indel_fraction, p.softclip_fraction, p.multimap_fraction, p.exons, p.bigwigs, p.cram);
+    return std::string(buf);
+}
+
+static bool up_to_date(const char* info_fn, const std::string& params) {
+    FILE* fp = fopen(info_fn, "r");
+    if(!fp)
+        return false;
+    char line[2048];
+    bool match = false;
+    while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if(strncmp(line, "params\t", 7) == 0)
+            match = params == (line + 7);
+    }
+    fclose(fp);
+    return match;
+}
+
+static const char* get_arg(int argc, char** argv, const char* name) {
+    for(int i = 1; i < argc; i++)
+        if(strcmp(argv[i], name) == 0)
+            return i + 1 < argc ? argv[i+1] : nullptr;
+    return nullptr;
+}
+
+static bool has_arg(int argc, char** argv, const char* name) {
+    for(int i = 1; i < argc; i++)
+        if(strcmp(argv[i], name) == 0)
+            return true;
+    return false;
+}
+
+int main(int argc, char** argv) {
+    const char* prefix = get_arg(argc, argv, "--prefix");
+    if(!prefix || has_arg(argc, argv, "--help")) {
+        fprintf(stderr, "%s", USAGE);
+        return prefix ? 0 : -1;
+    }
+    SynthParams p;
+    const char* v;
+    if((v = get_arg(argc, argv, "--seed"))) p.seed = strtoull(v, nullptr, 10);
+    if((v = get_arg(argc, argv, "--genome-size"))) p.genome_size = strtoull(v, nullptr, 10);
+    if((v = get_arg(argc, argv, "--chromosomes"))) p.chromosomes = atoi(v);
+    if((v = get_arg(argc, argv, "--depth"))) p.depth = atof(v);
+    if((v = get_arg(argc, argv, "--read-length"))) p.read_length = atoi(v);
+    if((v = get_arg(argc, argv, "--paired-fraction"))) p.paired_fraction = atof(v);
+    if((v = get_arg(argc, argv, "--spliced-fraction"))) p.spliced_fraction = atof(v);
+    if((v = get_arg(argc, argv, "--overlap-rate"))) p.overlap_rate = atof(v);
+    if((v = get_arg(argc, argv, "--mismatch-rate"))) p.mismatch_rate = atof(v);
+    if((v = get_arg(argc, argv, "--indel-fraction"))) p.indel_fraction = atof(v);
+    if((v = get_arg(argc, argv, "--softclip-fraction"))) p.softclip_fraction = atof(v);
+    if((v = get_arg(argc, argv, "--multimap-fraction"))) p.multimap_fraction = atof(v);
+    if((v = get_arg(argc, argv, "--exons"))) p.exons = strtoull(v, nullptr, 10);
+    if((v = get_arg(argc, argv, "--bigwigs"))) p.bigwigs = std::max(1, atoi(v));
+    p.cram = !has_arg(argc, argv, "--no-cram");
+    if(p.chromosomes < 1 || p.read_length < 30 || p.genome_size < (uint64_t) p.chromosomes * 20000) {
+        fprintf(stderr, "need at least 1 chromosome, reads of >= 30bp, and >= 20kb per chromosome, exiting\n");
+        return -1;
+    }
+
+    std::string params = params_line(p);
+    std::string info_fn = std::string(prefix) + ".info.tsv";
+    if(!has_arg(argc, argv, "--force") && up_to_date(info_fn.c_str(), params)) {
+        fprintf(stderr, "%s is up to date, skipping generation\n", info_fn.c_str());
+        return 0;
+    }
+
+    //reference
+    std::vector<std::string> names;
+    std::vector<std::string> seqs;
+    std::vector<uint32_t> lens;
+    Rng ref_rng(mix_seed(p.seed, 0, 0));
+    for(int i = 0; i < p.chromosomes; i++) {
+        uint32_t len = p.genome_size / p.chromosomes;
+        names.push_back("chr" + std::to_string(i + 1));
+        std::string s(len, 'A');
+        for(uint32_t j = 0; j < len; j++)
+            s[j] = BASES[ref_rng.next() >> 62];
+        seqs.push_back(s);
+        lens.push_back(len);
+    }
+    std::string fasta_fn = std::string(prefix) + ".fa";
+    write_fasta(fasta_fn.c_str(), names, seqs);
+
+    std::string hdr_text = "@HD\tVN:1.6\tSO:coordinate\n";
+    for(size_t i = 0; i < names.size(); i++)
+        hdr_text += "@SQ\tSN:" + names[i] + "\tLN:" + std::to_string(lens[i]) + "\n";
+    hdr_text += "@PG\tID:make_synthetic\tPN:make_synthetic\tCL:" + params + "\n";
+    sam_hdr_t* hdr = sam_hdr_parse(hdr_text.size(), hdr_text.c_str());
+    if(!hdr) {
+        fprintf(stderr, "Unable to build synthetic BAM header, exiting\n");
+        return -1;
+    }
+
+    std::string bam_fn = std::string(prefix) + ".bam";
+    std::string cram_fn = std::string(prefix) + ".cram";
+    htsFile* bam_fh = sam_open(bam_fn.c_str(), "wb");
+    htsFile* cram_fh = nullptr;
+    if(p.cram) {
+        cram_fh = sam_open(cram_fn.c_str(), "wc");
+        if(cram_fh && hts_set_fai_filename(cram_fh, fasta_fn.c_str()) != 0) {
+            fprintf(stderr, "Unable to use %s as the CRAM reference, exiting\n", fasta_fn.c_str());
+            return -1;
+        }
+    }
+    if(!bam_fh || (p.cram && !cram_fh) || sam_hdr_write(bam_fh, hdr) < 0 || (cram_fh && sam_hdr_write(cram_fh, hdr) < 0)) {
+        fprintf(stderr, "Unable to write synthetic BAM/CRAM %s, exiting\n", bam_fn.c_str());
+        return -1;
+    }
+
+    //fragment starts are uniform along each chromosome, the number chosen to hit the requested depth
+    uint64_t records = 0, aligned_bases = 0;
+    std::vector<std::vector<int32_t> > covs(names.size());
+    std::vector<RecordKey> keys;
+    bam1_t* b = bam_init1();
+    std::string mdz;
+    std::vector<uint8_t> scratch;
+    Fragment f;
+    double reads_per_frag = 1.0 + p.paired_fraction;
+    for(size_t tid = 0; tid < names.size(); tid++) {
+        int32_t len = lens[tid];
+        //leave room for the longest possible fragment (soft clip excluded, max intron, max gap)
+        int32_t max_span = 2 * p.read_length + 300 + 2 * (5000 + 3);
+        uint64_t nfrags = (uint64_t) ((p.depth * len) / (p.read_length * reads_per_frag));
+        Rng pos_rng(mix_seed(p.seed, tid + 1, 0xFFFFFFFFULL));
+        keys.clear();
+        keys.reserve(nfrags * 2);
+        for(uint32_t id = 0; id < nfrags; id++) {
+            int32_t start = pos_rng.below(len - max_span);
+            layout_fragment(p, tid, id, start, len, &f);
+            keys.push_back({f.mates[0].pos, id, start, 0});
+            if(f.paired)
+                keys.push_back({f.mates[1].pos, id, start, 1});
+        }
+        std::sort(keys.begin(), keys.end());
+        covs[tid].assign(len + 1, 0);
+        for(auto& k : keys) {
+            layout_fragment(p, tid, k.frag_id, k.frag_start, len, &f);
+            aligned_bases += build_record(p, b, tid, f, k.frag_id, k.mate, seqs[tid], mdz, scratch);
+            add_coverage(covs[tid], f.mates[k.mate]);
+            if(sam_write1(bam_fh, hdr, b) < 0 || (cram_fh && sam_write1(cram_fh, hdr, b) < 0)) {
+                fprintf(stderr, "Failed writing record %" PRIu64 ", exiting\n", records);
+                return -1;
+            }
+            records++;
+        }
+        std::vector<RecordKey>().swap(keys);
+        std::string().swap(seqs[tid]);
+    }
+    bam_destroy1(b);
+    sam_close(bam_fh);
+    if(cram_fh)
+        sam_close(cram_fh);
+    if(sam_index_build(bam_fn.c_str(), 0) != 0 || (p.cram && sam_index_build(cram_fn.c_str(), 0) != 0)) {
+        fprintf(stderr, "Unable to index %s, exiting\n", bam_fn.c_str());
+        return -1;
+    }
+
+    uint64_t bw_intervals = 0;
+    write_bigwigs(p, prefix, names, lens, covs, &bw_intervals);
+    write_exons(p, prefix, names, lens);
+
+    //info is written last so an interrupted run is never mistaken for a complete one
+    FILE* info = fopen(info_fn.c_str(), "w");
+    if(!info) {
+        fprintf(stderr, "Unable to write %s, exiting\n", info_fn.c_str());
+        return -1;
+    }
+    fprintf(info, "params\t%s\n", params.c_str());
+    fprintf(info, "genome_size\t%" PRIu64 "\n", (uint64_t) lens[0] * lens.size());
+    fprintf(info, "records\t%" PRIu64 "\n", records);
+    fprintf(info, "aligned_bases\t%" PRIu64 "\n", aligned_bases);
+    fprintf(info, "bigwigs\t%d\n", p.bigwigs);
+    fprintf(info, "bigwig_intervals\t%" PRIu64 "\n", bw_intervals);
+    fprintf(info, "exons\t%" PRIu64 "\n", (p.exons / names.size()) * names.size());
+    fclose(info);
+    fprintf(stderr, "wrote %" PRIu64 " records (%" PRIu64 " aligned bases) over %" PRIu64 " bases to %s.*\n", records, aligned_bases, (uint64_t) lens[0] * lens.size(), prefix);
+    return 0;
+}
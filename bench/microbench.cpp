@@ -0,0 +1,419 @@
+/* The MIT License
+
+    Copyright (c) 2018-  by Christopher Wilks <cwilks3@jhu.edu> and Ben Langmead
+                         <langmea@cs.jhu.edu>
+
+    See LICENSE.txt in the top level of this repository for the full text.
+*/
+
+//Microbenchmarks for megadepth's hot kernels, timed in isolation on synthetic but
+//RNA-seq shaped inputs: reads concentrated on exon-like blocks with a long tail of
+//expression, a fraction of them spliced, and MD:Z strings mostly without mismatches.
+//megadepth.cpp is compiled into this file (without its main()) so the kernels
+//measured are exactly the ones the tool runs, with the same compile flags.
+#define MEGADEPTH_NO_MAIN
+#include "../megadepth.cpp"
+
+#include <chrono>
+
+static const char MB_USAGE[] = "megadepth_microbench: time megadepth's inner loops in isolation\n\n"
+    "Usage:\n"
+    "  megadepth_microbench [options]\n\n"
+    "Options:\n"
+    "  --chr-len <int>      Length of the simulated chromosome (default: 20000000)\n"
+    "  --reads <int>        Number of simulated reads (default: 2000000)\n"
+    "  --read-length <int>  Simulated read length (default: 100)\n"
+    "  --exons <int>        Number of exon-like blocks reads are drawn from (default: 20000)\n"
+    "  --reps <int>         Timed repetitions of each kernel, the fastest is reported (default: 5)\n"
+    "  --seed <int>         PRNG seed (default: 1)\n"
+    "  --only <substring>   Only run kernels whose name contains this\n";
+
+//xorshift64*, deterministic across platforms
+struct MbRng {
+    uint64_t s;
+    explicit MbRng(uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+    uint64_t next() {
+        s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+        return s * 0x2545F4914F6CDD1DULL;
+    }
+    uint32_t below(uint32_t n) { return (uint32_t) (((next() >> 32) * (uint64_t) n) >> 32); }
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+//one aligned (M) block of a read, what calculate_coverage passes to the coverage kernels
+struct MbBlock {
+    int32_t start;
+    int32_t len;
+};
+
+struct MbData {
+    long chr_len;
+    std::vector<MbBlock> blocks;
+    uint64_t aligned_bases;
+    std::vector<std::pair<uint32_t, uint32_t> > exons;
+    std::vector<std::string> mdzs;
+    //coverage as a difference array (no_region) and as direct values
+    std::unique_ptr<uint32_t[]> diffs;
+    std::unique_ptr<uint32_t[]> values;
+};
+
+static uint64_t mb_sink = 0;
+#if USE_SIMD_ZERO
+static const int MB_SIMD_ZERO = 1;
+#else
+static const int MB_SIMD_ZERO = 0;
+#endif
+
+static void build_data(MbData* d, long chr_len, uint32_t nreads, int read_len, uint32_t nexons, uint64_t seed) {
+    MbRng rng(seed);
+    d->chr_len = chr_len;
+    //exon-like blocks of 50bp-2kb (log-uniform), sorted and non-overlapping
+    std::vector<uint32_t> starts;
+    for(uint32_t i = 0; i < nexons; i++)
+        starts.push_back(rng.below(chr_len - 4000));
+    std::sort(starts.begin(), starts.end());
+    uint32_t last_end = 0;
+    for(auto s : starts) {
+        uint32_t len = (uint32_t) (50.0 * pow(40.0, rng.unit()));
+        if(s < last_end)
+            continue;
+        d->exons.push_back(std::make_pair(s, s + len));
+        last_end = s + len;
+    }
+    //expression is heavy tailed: exon i gets weight ~ 1/(rank+1)
+    std::vector<double> cum;
+    double total = 0.0;
+    std::vector<uint32_t> rank(d->exons.size());
+    std::iota(rank.begin(), rank.end(), 0);
+    for(size_t i = rank.size(); i > 1; i--)
+        std::swap(rank[i-1], rank[rng.below(i)]);
+    for(size_t i = 0; i < d->exons.size(); i++) {
+        total += 1.0 / (rank[i] + 1);
+        cum.push_back(total);
+    }
+    //90% of reads come from exons (20% of those spliced into the next exon), 10% are background
+    d->aligned_bases = 0;
+    for(uint32_t r = 0; r < nreads; r++) {
+        int32_t pos;
+        size_t e = 0;
+        bool from_exon = rng.unit() < 0.9;
+        if(from_exon) {
+            e = std::lower_bound(cum.begin(), cum.end(), rng.unit() * total) - cum.begin();
+            if(e >= d->exons.size())
+                e = d->exons.size() - 1;
+            pos = d->exons[e].first + rng.below(d->exons[e].second - d->exons[e].first);
+        }
+        else
+            pos = rng.below(chr_len - 2 * read_len);
+        if(from_exon && e + 1 < d->exons.size() && rng.unit() < 0.2) {
+            int32_t first = std::max((int32_t) 1, std::min((int32_t) read_len - 1, (int32_t) (d->exons[e].second - pos)));
+            d->blocks.push_back({pos, first});
+            d->blocks.push_back({(int32_t) d->exons[e+1].first, read_len - first});
+        }
+        else
+            d->blocks.push_back({pos, read_len});
+        d->aligned_bases += read_len;
+    }
+    //alignments come off a sorted BAM
+    std::sort(d->blocks.begin(), d->blocks.end(), [](const MbBlock& a, const MbBlock& b) { return a.start < b.start; });
+    for(auto& b : d->blocks)
+        if(b.start + b.len >= chr_len)
+            b.len = chr_len - b.start - 1;
+
+    //MD:Z strings: 70% perfect matches, 25% with 1-3 mismatches, 5% with a deletion
+    for(uint32_t i = 0; i < 100000; i++) {
+        double u = rng.unit();
+        std::string md;
+        if(u < 0.7)
+            md = std::to_string(read_len);
+        else {
+            int nmm = u < 0.95 ? 1 + rng.below(3) : 1;
+            int left = read_len;
+            for(int m = 0; m < nmm; m++) {
+                int run = rng.below(left / (nmm - m));
+                md += std::to_string(run);
+                if(u >= 0.95)
+                    md += "^AC";
+                else
+                    md += "ACGT"[rng.below(4)];
+                left -= run + (u >= 0.95 ? 0 : 1);
+            }
+            md += std::to_string(left);
+        }
+        d->mdzs.push_back(md);
+    }
+
+    d->diffs.reset(new uint32_t[chr_len + 1]);
+    d->values.reset(new uint32_t[chr_len + 1]);
+    reset_array(d->diffs.get(), chr_len + 1);
+    for(auto& b : d->blocks)
+        increment_coverages(d->diffs.get() + b.start, b.len, true);
+    int32_t running = 0;
+    for(long i = 0; i < chr_len; i++) {
+        running += (int32_t) d->diffs[i];
+        d->values[i] = running;
+    }
+}
+
+//runs f reps times (after setup() each time, untimed) and returns the fastest run in ns
+template <typename S, typename F>
+static double time_best(int reps, S setup, F f) {
+    double best = -1.0;
+    for(int r = 0; r < reps; r++) {
+        setup();
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        auto t1 = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+        if(best < 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static void report(const char* kernel, const char* variant, double ns, const char* unit, uint64_t n, const char* unit2 = nullptr, uint64_t n2 = 0) {
+    fprintf(stdout, "%s\t%s\t%.3f\t%s", kernel, variant, ns / n, unit);
+    if(unit2)
+        fprintf(stdout, "\t%.3f\t%s", ns / n2, unit2);
+    else
+        fprintf(stdout, "\t\t");
+    fprintf(stdout, "\t%.3f\n", ns / 1e6);
+    fflush(stdout);
+}
+
+static bool selected(const char* only, const char* kernel) {
+    return !only || strstr(kernel, only) != nullptr;
+}
+
+static const char* mb_get_arg(int argc, const char** argv, const char* name, const char* dflt) {
+    for(int i = 1; i + 1 < argc; i++)
+        if(strcmp(argv[i], name) == 0)
+            return argv[i+1];
+    return dflt;
+}
+
+int main(int argc, const char** argv) {
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--help") == 0) {
+            fprintf(stderr, "%s", MB_USAGE);
+            return 0;
+        }
+    }
+    long chr_len = atol(mb_get_arg(argc, argv, "--chr-len", "20000000"));
+    uint32_t nreads = atol(mb_get_arg(argc, argv, "--reads", "2000000"));
+    int read_len = atoi(mb_get_arg(argc, argv, "--read-length", "100"));
+    uint32_t nexons = atol(mb_get_arg(argc, argv, "--exons", "20000"));
+    int reps = std::max(1, atoi(mb_get_arg(argc, argv, "--reps", "5")));
+    uint64_t seed = strtoull(mb_get_arg(argc, argv, "--seed", "1"), nullptr, 10);
+    const char* only = mb_get_arg(argc, argv, "--only", nullptr);
+    if(chr_len < 100000 || read_len < 2) {
+        fprintf(stderr, "--chr-len must be >= 100000 and --read-length >= 2, exiting\n");
+        return -1;
+    }
+
+    MbData d;
+    build_data(&d, chr_len, nreads, read_len, nexons, seed);
+    const uint64_t nblocks = d.blocks.size();
+    FILE* devnull = fopen("/dev/null", "w");
+    std::unique_ptr<uint32_t[]> cov(new uint32_t[chr_len + 1]);
+    std::unique_ptr<uint32_t[]> ucov(new uint32_t[chr_len + 1]);
+    uint32_t* c = cov.get();
+    uint32_t* u = ucov.get();
+    auto zero_both = [&]() { reset_array(c, chr_len + 1); reset_array(u, chr_len + 1); };
+    //all + unique, and all + 3 --min-unique-qual tiers (as with e.g. --min-unique-qual 10,255,nh1)
+    uint32_t* cu[2] = { c, u };
+    std::unique_ptr<uint32_t[]> tcov(new uint32_t[3 * (chr_len + 1)]);
+    uint32_t* tiers[4] = { c, tcov.get(), tcov.get() + (chr_len + 1), tcov.get() + 2 * (chr_len + 1) };
+    auto zero_tiers = [&]() { reset_array(c, chr_len + 1); reset_array(tcov.get(), 3 * (chr_len + 1)); };
+
+    //the SIMD kernels are timed for every ISA level the CPU supports, then put back to the one megadepth picked
+    const SimdKernels selected_simd = SIMD;
+    const std::vector<const SimdKernels*> simd_sets = supported_simd_kernels();
+    fprintf(stdout, "#isa=%s\tUSE_SIMD_ZERO=%d\tchr_len=%ld\treads=%u\tblocks=%" PRIu64 "\taligned_bases=%" PRIu64 "\texons=%zu\treps=%d\n",
+            selected_simd.name, MB_SIMD_ZERO, chr_len, nreads, nblocks, d.aligned_bases, d.exons.size(), reps);
+    fprintf(stdout, "kernel\tvariant\tns_per_unit\tunit\tns_per_unit2\tunit2\tbest_ms\n");
+
+    //coverage kernels, once per aligned block as calculate_coverage calls them
+    if(selected(only, "increment_coverages")) {
+        double ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) increment_coverages(c + b.start, b.len, true); });
+        report("increment_coverages", "no_region_diff", ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) add_coverages(cu, 2, b.start, b.len, 1, true); });
+        report("increment_coverages", "unique_no_region_diff", ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        for(const SimdKernels* k : simd_sets) {
+            SIMD = *k;
+            std::string variant = std::string("simd_") + k->name;
+            ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) increment_coverages(c + b.start, b.len, false); });
+            report("increment_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+            variant = std::string("unique_simd_") + k->name;
+            ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) add_coverages(cu, 2, b.start, b.len, 1, false); });
+            report("increment_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+            variant = std::string("tiers3_simd_") + k->name;
+            ns = time_best(reps, zero_tiers, [&]() { for(auto& b : d.blocks) add_coverages(tiers, 4, b.start, b.len, 1, false); });
+            report("increment_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+            variant = std::string("tiers3_unfused_simd_") + k->name;
+            ns = time_best(reps, zero_tiers, [&]() { for(auto& b : d.blocks) for(uint32_t* t : tiers) increment_coverages(t + b.start, b.len, false); });
+            report("increment_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        }
+        SIMD = selected_simd;
+        mb_sink += c[d.blocks[nblocks/2].start];
+    }
+    if(selected(only, "decrement_coverages")) {
+        double ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) decrement_coverages(c + b.start, b.len, true); });
+        report("decrement_coverages", "no_region_diff", ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) add_coverages(cu, 2, b.start, b.len, -1, true); });
+        report("decrement_coverages", "unique_no_region_diff", ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        for(const SimdKernels* k : simd_sets) {
+            SIMD = *k;
+            std::string variant = std::string("simd_") + k->name;
+            ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) decrement_coverages(c + b.start, b.len, false); });
+            report("decrement_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+            variant = std::string("unique_simd_") + k->name;
+            ns = time_best(reps, zero_both, [&]() { for(auto& b : d.blocks) add_coverages(cu, 2, b.start, b.len, -1, false); });
+            report("decrement_coverages", variant.c_str(), ns, "ns/block", nblocks, "ns/base", d.aligned_bases);
+        }
+        SIMD = selected_simd;
+        mb_sink += c[d.blocks[nblocks/2].start];
+    }
+
+    //per chromosome array reset, dirty the array first so the stores aren't to untouched pages
+    if(selected(only, "reset_array")) {
+        auto dirty = [&]() { memcpy(c, d.values.get(), sizeof(uint32_t) * chr_len); };
+        double ns = time_best(reps, dirty, [&]() { std::memset(c, 0, sizeof(uint32_t) * (chr_len + 1)); });
+        report("reset_array", "memset", ns, "ns/base", chr_len + 1);
+        for(const SimdKernels* k : simd_sets) {
+            SIMD = *k;
+            std::string variant = std::string("simd_zero_") + k->name;
+            ns = time_best(reps, dirty, [&]() { reset_array_simd(c, chr_len + 1); });
+            report("reset_array", variant.c_str(), ns, "ns/base", chr_len + 1);
+        }
+        SIMD = selected_simd;
+        mb_sink += c[chr_len / 2];
+    }
+
+    //per annotation statistics (sum, min, max, breadth) over the exons, as sum_annotations calls it
+    if(selected(only, "interval_stats")) {
+        auto nop = []() {};
+        uint64_t exon_bases = 0;
+        for(auto& e : d.exons)
+            exon_bases += e.second - e.first;
+        IntervalStats st;
+        for(const SimdKernels* k : simd_sets) {
+            SIMD = *k;
+            std::string variant = std::string("simd_") + k->name;
+            double ns = time_best(reps, nop, [&]() { for(auto& e : d.exons) { SIMD.interval_stats(d.values.get() + e.first, e.second - e.first, 1, &st); mb_sink += st.sum; } });
+            report("interval_stats", variant.c_str(), ns, "ns/exon", d.exons.size(), "ns/base", exon_bases);
+        }
+        SIMD = selected_simd;
+    }
+
+    //coverage TSV/AUC emission for the whole chromosome
+    if(selected(only, "print_array")) {
+        char chrm[] = "chr1";
+        auto nop = []() {};
+        uint64_t auc = 0;
+        double ns = time_best(reps, nop, [&]() { auc += print_array(nullptr, chrm, 0, d.diffs.get(), chr_len, false, nullptr, devnull, false, true); });
+        report("print_array", "no_region_diff_tsv", ns, "ns/base", chr_len);
+        ns = time_best(reps, nop, [&]() { auc += print_array(nullptr, chrm, 0, d.values.get(), chr_len, false, nullptr, devnull, false, false); });
+        report("print_array", "values_tsv", ns, "ns/base", chr_len);
+        ns = time_best(reps, nop, [&]() { auc += print_array(nullptr, chrm, 0, d.diffs.get(), chr_len, false, nullptr, devnull, true, true); });
+        report("print_array", "no_region_diff_auc_only", ns, "ns/base", chr_len);
+        mb_sink += auc;
+    }
+
+    //integer formatting, over coordinates (up to chromosome length) and small coverage values
+    if(selected(only, "u32toa")) {
+        const uint32_t nvals = 1 << 20;
+        std::vector<uint32_t> vals(nvals);
+        MbRng rng(seed ^ 0xA5A5);
+        for(uint32_t i = 0; i < nvals; i++)
+            vals[i] = (i & 1) ? rng.below(chr_len) : d.values[rng.below(chr_len)];
+        char buf[32];
+        auto nop = []() {};
+        double ns = time_best(reps, nop, [&]() { for(auto v : vals) mb_sink += u32toa_countlut(v, buf, '\t'); });
+        report("u32toa", "u32toa_countlut", ns, "ns/value", nvals);
+        ns = time_best(reps, nop, [&]() { for(auto v : vals) mb_sink += sprintf(buf, "%u\t", v); });
+        report("u32toa", "sprintf", ns, "ns/value", nvals);
+    }
+
+    //BAM annotation path: per exon sums over direct coverage values
+    std::vector<long*> annotations;
+    uint64_t annotated_bases = 0;
+    for(auto& e : d.exons) {
+        long* coords = new long[4];
+        coords[0] = e.first; coords[1] = e.second; coords[2] = 0; coords[3] = 0;
+        annotations.push_back(coords);
+        annotated_bases += e.second - e.first;
+    }
+    if(selected(only, "sum_annotations")) {
+        auto nop = []() {};
+        uint64_t annotated_auc = 0;
+        double ns = time_best(reps, nop, [&]() { sum_annotations(d.values.get(), annotations, chr_len, "chr1", devnull, &annotated_auc, csum, false); });
+        report("sum_annotations", "sum_tsv", ns, "ns/annotated_base", annotated_bases, "ns/annotation", annotations.size());
+        ns = time_best(reps, nop, [&]() { sum_annotations(d.values.get(), annotations, chr_len, "chr1", devnull, &annotated_auc, csum, true); });
+        report("sum_annotations", "auc_only", ns, "ns/annotated_base", annotated_bases, "ns/annotation", annotations.size());
+        mb_sink += annotated_auc;
+    }
+
+    //MD:Z decoding, walking each string op by op as output_from_cigar_mdz does
+    if(selected(only, "mdz")) {
+        uint64_t nmd_bytes = 0;
+        for(auto& m : d.mdzs)
+            nmd_bytes += m.size();
+        auto nop = []() {};
+        double ns = time_best(reps, nop, [&]() {
+            for(auto& m : d.mdzs) {
+                MdzCursor mc((const uint8_t*) m.c_str());
+                while(!mc.done()) {
+                    mb_sink += mc.op().op;
+                    mc.consume(mc.left());
+                }
+            }
+        });
+        report("mdz", "MdzCursor", ns, "ns/record", d.mdzs.size(), "ns/byte", nmd_bytes);
+    }
+
+    //BigWig annotation path: the interval/annotation overlap loop from process_bigwig,
+    //the intervals tile the chromosome with runs of equal coverage (including 0's) as bedGraph-derived BigWigs do
+    if(selected(only, "sum_bigwig_intervals")) {
+        std::vector<uint32_t> istarts, iends;
+        std::vector<float> ivals;
+        uint32_t run_start = 0;
+        for(long i = 1; i <= chr_len; i++) {
+            if(i == chr_len || d.values[i] != d.values[run_start]) {
+                istarts.push_back(run_start);
+                iends.push_back(i);
+                ivals.push_back(d.values[run_start]);
+                run_start = i;
+            }
+        }
+        bwOverlappingIntervals_t intervals;
+        memset(&intervals, 0, sizeof(intervals));
+        intervals.l = intervals.m = istarts.size();
+        intervals.start = istarts.data();
+        intervals.end = iends.data();
+        intervals.value = ivals.data();
+        std::vector<double*> bw_annotations;
+        for(auto& e : d.exons) {
+            double* coords = new double[4];
+            coords[0] = e.first; coords[1] = e.second; coords[2] = 0; coords[3] = 0;
+            bw_annotations.push_back(coords);
+        }
+        char buf[1024];
+        double annotated_auc = 0.0;
+        auto nop = []() {};
+        double ns = time_best(reps, nop, [&]() { sum_bigwig_intervals(&intervals, bw_annotations, "chr1", &annotated_auc, devnull, -1, csum, (double*) nullptr, buf); });
+        report("sum_bigwig_intervals", "sum_tsv", ns, "ns/annotated_base", annotated_bases, "ns/interval", istarts.size());
+        ns = time_best(reps, nop, [&]() { sum_bigwig_intervals(&intervals, bw_annotations, "chr1", &annotated_auc, devnull, 2, cmean, (double*) nullptr, buf); });
+        report("sum_bigwig_intervals", "mean_keep_order", ns, "ns/annotated_base", annotated_bases, "ns/interval", istarts.size());
+        ns = time_best(reps, nop, [&]() { sum_bigwig_intervals(&intervals, bw_annotations, "chr1", &annotated_auc, devnull, 2, cmax, (double*) nullptr, buf); });
+        report("sum_bigwig_intervals", "max_keep_order", ns, "ns/annotated_base", annotated_bases, "ns/interval", istarts.size());
+        mb_sink += (uint64_t) annotated_auc;
+        for(auto a : bw_annotations)
+            delete[] a;
+    }
+    for(auto a : annotations)
+        delete[] a;
+    fclose(devnull);
+    fprintf(stderr, "checksum %" PRIu64 "\n", mb_sink);
+    return 0;
+}
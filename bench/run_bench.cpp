@@ -0,0 +1,410 @@
+/* The MIT License
+
+    Copyright (c) 2018-  by Christopher Wilks <cwilks3@jhu.edu> and Ben Langmead
+                         <langmea@cs.jhu.edu>
+
+    See LICENSE.txt in the top level of this repository for the full text.
+*/
+
+//End-to-end benchmark driver: runs a megadepth binary over the inputs written by
+//make_synthetic for each subcommand combination, and reports wall/user/sys time,
+//records/s, bases/s, peak RSS and bytes written as JSON.
+//Each combination runs in its own output directory so output sizes (including stdout)
+//can be totaled and BigWig list mode's per-file outputs don't collide.
+#define __STDC_FORMAT_MACROS
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static const char USAGE[] = "run_bench: time megadepth subcommand combinations over make_synthetic inputs\n\n"
+    "Usage:\n"
+    "  run_bench --megadepth <path> --data <path_prefix> --out <dir> [options]\n\n"
+    "Options:\n"
+    "  --reps <int>       Number of timed runs of each combination, best and median are reported (default: 3)\n"
+    "  --threads <int>    Passed as --threads to each run, BigWig list mode always uses at least 1 (default: 0)\n"
+    "  --only <names>     Comma separated list of combinations to run (default: all)\n"
+    "  --json <file>      Also write the JSON report to this file (it always goes to stdout)\n"
+    "  --list             Print the combination names and arguments and exit\n";
+
+enum InputKind { BAM_INPUT, BW_INPUT, BW_LIST_INPUT };
+
+struct Combo {
+    const char* name;
+    InputKind kind;
+    //placeholders: {bam} {cram} {fa} {bw} {bwlist} {bed} {threads} {bw_threads}
+    const char* args;
+};
+
+static const Combo COMBOS[] = {
+    {"coverage", BAM_INPUT, "{bam} --coverage --no-coverage-stdout --prefix out {threads}"},
+    {"coverage_gzip", BAM_INPUT, "{bam} --coverage --gzip --prefix out {threads}"},
+    {"bigwig", BAM_INPUT, "{bam} --bigwig --prefix out {threads}"},
+    {"auc", BAM_INPUT, "{bam} --auc --prefix out {threads}"},
+    {"annotation", BAM_INPUT, "{bam} --annotation {bed} --no-annotation-stdout --prefix out {threads}"},
+    {"annotation_window", BAM_INPUT, "{bam} --annotation 1000 --prefix out {threads}"},
+    {"annotation_windows", BAM_INPUT, "{bam} --annotation 25,1000,100000 --op sum,mean --prefix out {threads}"},
+    {"unique", BAM_INPUT, "{bam} --coverage --no-coverage-stdout --bigwig --min-unique-qual 10 --prefix out {threads}"},
+    {"alts", BAM_INPUT, "{bam} --alts --include-softclip --prefix out {threads}"},
+    {"junctions", BAM_INPUT, "{bam} --junctions --prefix out {threads}"},
+    {"frag_dist", BAM_INPUT, "{bam} --frag-dist --prefix out {threads}"},
+    {"read_ends", BAM_INPUT, "{bam} --read-ends --prefix out {threads}"},
+    {"everything", BAM_INPUT, "{bam} --coverage --no-coverage-stdout --bigwig --auc --annotation {bed} --no-annotation-stdout --min-unique-qual 10 --alts --junctions --frag-dist --read-ends --prefix out {threads}"},
+    {"cram_coverage", BAM_INPUT, "{cram} --fasta {fa} --coverage --no-coverage-stdout --prefix out {threads}"},
+    {"cram_alts", BAM_INPUT, "{cram} --fasta {fa} --alts --prefix out {threads}"},
+    {"bw_auc", BW_INPUT, "{bw} --auc"},
+    {"bw_annotation", BW_INPUT, "{bw} --annotation {bed} --prefix out"},
+    {"bw_list", BW_LIST_INPUT, "{bwlist} --annotation {bed} --prefix out {bw_threads}"},
+};
+static const int NUM_COMBOS = sizeof(COMBOS) / sizeof(Combo);
+
+//what make_synthetic recorded about the inputs
+struct DataInfo {
+    std::string params;
+    uint64_t genome_size = 0;
+    uint64_t records = 0;
+    uint64_t aligned_bases = 0;
+    uint64_t bigwigs = 0;
+    uint64_t bigwig_intervals = 0;
+};
+
+struct RunResult {
+    int status;
+    double wall_s;
+    double user_s;
+    double sys_s;
+    long peak_rss_kb;
+    uint64_t output_bytes;
+};
+
+static const char* get_arg(int argc, char** argv, const char* name) {
+    for(int i = 1; i < argc; i++)
+        if(strcmp(argv[i], name) == 0)
+            return i + 1 < argc ? argv[i+1] : nullptr;
+    return nullptr;
+}
+
+static bool has_arg(int argc, char** argv, const char* name) {
+    for(int i = 1; i < argc; i++)
+        if(strcmp(argv[i], name) == 0)
+            return true;
+    return false;
+}
+
+static bool file_exists(const std::string& fn) {
+    struct stat st;
+    return stat(fn.c_str(), &st) == 0;
+}
+
+static void read_info(const std::string& fn, DataInfo* info) {
+    FILE* fp = fopen(fn.c_str(), "r");
+    if(!fp) {
+        fprintf(stderr, "Unable to read %s (run make_synthetic first), exiting\n", fn.c_str());
+        exit(-1);
+    }
+    char line[4096];
+    while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* val = strchr(line, '\t');
+        if(!val)
+            continue;
+        *val++ = '\0';
+        if(strcmp(line, "params") == 0)
+            info->params = val;
+        else if(strcmp(line, "genome_size") == 0)
+            info->genome_size = strtoull(val, nullptr, 10);
+        else if(strcmp(line, "records") == 0)
+            info->records = strtoull(val, nullptr, 10);
+        else if(strcmp(line, "aligned_bases") == 0)
+            info->aligned_bases = strtoull(val, nullptr, 10);
+        else if(strcmp(line, "bigwigs") == 0)
+            info->bigwigs = strtoull(val, nullptr, 10);
+        else if(strcmp(line, "bigwig_intervals") == 0)
+            info->bigwig_intervals = strtoull(val, nullptr, 10);
+    }
+    fclose(fp);
+}
+
+static void replace_all(std::string& s, const std::string& from, const std::string& to) {
+    size_t pos = 0;
+    while((pos = s.find(from, pos)) != std::string::npos) {
+        s.replace(pos, from.size(), to);
+        pos += to.size();
+    }
+}
+
+static std::vector<std::string> split_args(const std::string& s) {
+    std::vector<std::string> out;
+    size_t i = 0;
+    while(i < s.size()) {
+        size_t j = s.find(' ', i);
+        if(j == std::string::npos)
+            j = s.size();
+        if(j > i)
+            out.push_back(s.substr(i, j - i));
+        i = j + 1;
+    }
+    return out;
+}
+
+static void make_dir(const std::string& dir) {
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create directory %s: %s, exiting\n", dir.c_str(), strerror(errno));
+        exit(-1);
+    }
+}
+
+//sums (or removes) the regular files in dir, megadepth doesn't write subdirectories
+static uint64_t scan_dir(const std::string& dir, bool remove) {
+    uint64_t total = 0;
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return 0;
+    struct dirent* e;
+    while((e = readdir(d)) != nullptr) {
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        std::string fn = dir + "/" + e->d_name;
+        if(remove) {
+            unlink(fn.c_str());
+            continue;
+        }
+        //stderr is progress chatter, not output
+        if(strcmp(e->d_name, "stderr.txt") == 0)
+            continue;
+        struct stat st;
+        if(stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            total += st.st_size;
+    }
+    closedir(d);
+    return total;
+}
+
+static double timeval_s(const struct timeval& tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static RunResult run_once(const std::string& megadepth, const std::vector<std::string>& args, const std::string& dir) {
+    RunResult r;
+    memset(&r, 0, sizeof(r));
+    scan_dir(dir, true);
+    std::vector<char*> cargv;
+    cargv.push_back(const_cast<char*>(megadepth.c_str()));
+    for(auto& a : args)
+        cargv.push_back(const_cast<char*>(a.c_str()));
+    cargv.push_back(nullptr);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if(pid < 0) {
+        fprintf(stderr, "fork failed: %s, exiting\n", strerror(errno));
+        exit(-1);
+    }
+    if(pid == 0) {
+        if(chdir(dir.c_str()) != 0)
+            _exit(126);
+        int out = open("stdout.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int err = open("stderr.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out < 0 || err < 0)
+            _exit(126);
+        dup2(out, 1);
+        dup2(err, 2);
+        execv(cargv[0], cargv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage ru;
+    if(wait4(pid, &status, 0, &ru) < 0) {
+        fprintf(stderr, "wait4 failed: %s, exiting\n", strerror(errno));
+        exit(-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    r.wall_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    r.user_s = timeval_s(ru.ru_utime);
+    r.sys_s = timeval_s(ru.ru_stime);
+#ifdef __APPLE__
+    //bytes on MacOS, KB on Linux
+    r.peak_rss_kb = ru.ru_maxrss / 1024;
+#else
+    r.peak_rss_kb = ru.ru_maxrss;
+#endif
+    r.output_bytes = scan_dir(dir, false);
+    return r;
+}
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    for(char c : s) {
+        if(c == '"' || c == '\\')
+            out += '\\';
+        if(c == '\n') {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+    return out;
+}
+
+static std::string megadepth_version(const std::string& megadepth) {
+    std::string cmd = "\"" + megadepth + "\" --version 2>&1";
+    FILE* fp = popen(cmd.c_str(), "r");
+    if(!fp)
+        return "unknown";
+    char buf[256];
+    std::string v;
+    if(fgets(buf, sizeof(buf), fp))
+        v = buf;
+    pclose(fp);
+    v.erase(v.find_last_not_of(" \n\r\t") + 1);
+    return v.empty() ? "unknown" : v;
+}
+
+int main(int argc, char** argv) {
+    const char* megadepth_ = get_arg(argc, argv, "--megadepth");
+    const char* data_ = get_arg(argc, argv, "--data");
+    const char* out_ = get_arg(argc, argv, "--out");
+    if(has_arg(argc, argv, "--help") || ((!megadepth_ || !data_ || !out_) && !has_arg(argc, argv, "--list"))) {
+        fprintf(stderr, "%s", USAGE);
+        return has_arg(argc, argv, "--help") ? 0 : -1;
+    }
+    if(has_arg(argc, argv, "--list")) {
+        for(int i = 0; i < NUM_COMBOS; i++)
+            fprintf(stdout, "%s\t%s\n", COMBOS[i].name, COMBOS[i].args);
+        return 0;
+    }
+    int reps = 3;
+    int threads = 0;
+    const char* v;
+    if((v = get_arg(argc, argv, "--reps"))) reps = std::max(1, atoi(v));
+    if((v = get_arg(argc, argv, "--threads"))) threads = atoi(v);
+    std::string only = "";
+    if((v = get_arg(argc, argv, "--only"))) only = "," + std::string(v) + ",";
+
+    char abs_path[PATH_MAX];
+    std::string megadepth = realpath(megadepth_, abs_path) ? abs_path : megadepth_;
+    std::string data = data_;
+    make_dir(out_);
+    std::string out = realpath(out_, abs_path) ? abs_path : out_;
+    //the runs happen in their own directories, so make the input prefix absolute
+    if(data[0] != '/') {
+        size_t slash = data.rfind('/');
+        std::string data_dir = slash == std::string::npos ? "." : data.substr(0, slash);
+        std::string base = slash == std::string::npos ? data : data.substr(slash + 1);
+        if(realpath(data_dir.c_str(), abs_path))
+            data = std::string(abs_path) + "/" + base;
+    }
+
+    DataInfo info;
+    read_info(data + ".info.tsv", &info);
+    std::string version = megadepth_version(megadepth);
+
+    std::string report = "{\n";
+    report += "  \"megadepth\": \"" + json_escape(megadepth) + "\",\n";
+    report += "  \"version\": \"" + json_escape(version) + "\",\n";
+    char buf[8192];
+    snprintf(buf, sizeof(buf), "  \"data\": {\"prefix\": \"%s\", \"params\": \"%s\", \"genome_size\": %" PRIu64 ", \"records\": %" PRIu64 ", \"aligned_bases\": %" PRIu64 ", \"bigwigs\": %" PRIu64 ", \"bigwig_intervals\": %" PRIu64 "},\n",
+            json_escape(data).c_str(), json_escape(info.params).c_str(), info.genome_size, info.records, info.aligned_bases, info.bigwigs, info.bigwig_intervals);
+    report += buf;
+    snprintf(buf, sizeof(buf), "  \"reps\": %d,\n  \"threads\": %d,\n  \"results\": [\n", reps, threads);
+    report += buf;
+
+    bool first = true;
+    int failures = 0;
+    for(int i = 0; i < NUM_COMBOS; i++) {
+        const Combo& c = COMBOS[i];
+        if(!only.empty() && only.find("," + std::string(c.name) + ",") == std::string::npos)
+            continue;
+        std::string args = c.args;
+        replace_all(args, "{bam}", data + ".bam");
+        replace_all(args, "{cram}", data + ".cram");
+        replace_all(args, "{fa}", data + ".fa");
+        replace_all(args, "{bw}", data + ".bw");
+        replace_all(args, "{bwlist}", data + ".bigwigs.txt");
+        replace_all(args, "{bed}", data + ".exons.bed");
+        replace_all(args, "{threads}", threads > 0 ? "--threads " + std::to_string(threads) : "");
+        //list mode splits the BigWigs across --threads workers, 0 workers would process nothing
+        replace_all(args, "{bw_threads}", "--threads " + std::to_string(std::max(1, threads)));
+        args.erase(args.find_last_not_of(' ') + 1);
+        std::vector<std::string> argv_ = split_args(args);
+        if(!file_exists(argv_[0])) {
+            fprintf(stderr, "skipping %s, %s doesn't exist\n", c.name, argv_[0].c_str());
+            continue;
+        }
+        std::string dir = out + "/" + c.name;
+        make_dir(dir);
+
+        std::vector<RunResult> runs;
+        for(int rep = 0; rep < reps; rep++) {
+            runs.push_back(run_once(megadepth, argv_, dir));
+            fprintf(stderr, "%s rep %d: %.3fs, %ld KB peak RSS, exit %d\n", c.name, rep + 1, runs.back().wall_s, runs.back().peak_rss_kb, runs.back().status);
+            if(runs.back().status != 0)
+                break;
+        }
+        int status = runs.back().status;
+        if(status != 0)
+            failures++;
+        std::vector<double> walls;
+        double user = 0.0, sys = 0.0;
+        long peak_rss = 0;
+        for(auto& r : runs) {
+            walls.push_back(r.wall_s);
+            user += r.user_s;
+            sys += r.sys_s;
+            peak_rss = std::max(peak_rss, r.peak_rss_kb);
+        }
+        std::vector<double> sorted = walls;
+        std::sort(sorted.begin(), sorted.end());
+        double best = sorted[0];
+        double median = sorted[sorted.size() / 2];
+        uint64_t records = info.records, bases = info.aligned_bases;
+        if(c.kind != BAM_INPUT) {
+            uint64_t nfiles = c.kind == BW_LIST_INPUT ? info.bigwigs : 1;
+            records = info.bigwig_intervals * nfiles;
+            bases = info.genome_size * nfiles;
+        }
+
+        std::string walls_s = "[";
+        for(size_t j = 0; j < walls.size(); j++) {
+            snprintf(buf, sizeof(buf), "%s%.4f", j > 0 ? ", " : "", walls[j]);
+            walls_s += buf;
+        }
+        walls_s += "]";
+        if(!first)
+            report += ",\n";
+        first = false;
+        snprintf(buf, sizeof(buf), "    {\"name\": \"%s\", \"args\": \"%s\", \"status\": %d, \"wall_s\": %s, \"best_wall_s\": %.4f, \"median_wall_s\": %.4f, \"mean_user_s\": %.4f, \"mean_sys_s\": %.4f, \"peak_rss_kb\": %ld, \"output_bytes\": %" PRIu64 ", \"records_per_s\": %.1f, \"bases_per_s\": %.1f}",
+                c.name, json_escape(args).c_str(), status, walls_s.c_str(), best, median, user / runs.size(), sys / runs.size(),
+                peak_rss, runs.back().output_bytes, status == 0 ? records / best : 0.0, status == 0 ? bases / best : 0.0);
+        report += buf;
+    }
+    report += "\n  ]\n}\n";
+
+    fputs(report.c_str(), stdout);
+    if((v = get_arg(argc, argv, "--json"))) {
+        FILE* fp = fopen(v, "w");
+        if(!fp) {
+            fprintf(stderr, "Unable to write %s, exiting\n", v);
+            return -1;
+        }
+        fputs(report.c_str(), fp);
+        fclose(fp);
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -47,10 +47,16 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <set>
+#include <queue>
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <atomic>
 #include <iterator>
 #include <numeric>
+#include <chrono>
+#include <ctime>
 
 #include <zlib.h>
 
@@ -59,6 +65,9 @@
 #include <htslib/bgzf.h>
 #include <htslib/tbx.h>
 #include <sys/stat.h>
+#ifndef WINDOWS_MINGW
+#include <sys/resource.h>
+#endif
 #include "bigWig.h"
 #include "countlut.hpp"
 #ifdef WINDOWS_MINGW
@@ -80,6 +89,12 @@
 #if defined(__AVX2__) || defined(__SSE2__)
 #include <x86intrin.h>
 #endif
+//SIMD kernels are built for several ISA levels and selected at runtime, see SimdKernels
+//(needs target attributes and intrinsics headers which don't depend on -m flags, i.e. GCC >= 4.9 or clang)
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SIMD_DISPATCH 1
+#include <immintrin.h>
+#endif
 #if defined(__GNUC__) || defined(__clang__)
 #  ifndef unlikely
 #    define unlikely(x) __builtin_expect(!!(x), 0)
@@ -126,7 +141,70 @@ static double SOFTCLIP_POLYA_RATIO_MIN=0.8;
 static const int OUT_BUFF_SZ=4000000;
 static const int COORD_STR_LEN=34;
 
-enum Op { csum, cmean, cmin, cmax };
+enum Op { csum, cmean, cmin, cmax, cbreadth };
+static const char* OP_NAMES[] = { "sum", "mean", "min", "max", "breadth" };
+//statistics reported for each annotated interval of a BAM/CRAM (--op), one column each in this order
+static std::vector<Op> ANNOTATION_OPS(1, csum);
+//breadth is the fraction of an interval's bases with at least this much coverage (--breadth-depth)
+static uint32_t BREADTH_MIN_DEPTH = 1;
+//library types for --stranded, how the transcript strand of an alignment is worked out
+static const int STRAND_NONE = 0;
+//dUTP/TruSeq stranded: read 1 (or a single end read) is on the opposite strand of the transcript
+static const int STRAND_FR_FIRST = 1;
+//ligation/SOLiD: read 1 is on the same strand as the transcript
+static const int STRAND_FR_SECOND = 2;
+//from the aligner's XS:A tag (e.g. HISAT2/STAR for spliced alignments), no strand if it's missing
+static const int STRAND_XS = 3;
+static int LIBRARY_STRAND = STRAND_NONE;
+//--split-by: the aux tag (RG or tag:XX) whose value puts an alignment into a group, empty if not splitting
+static char SPLIT_TAG[3] = "";
+//--normalize: how the coverage BigWigs are scaled, on top of any --scale-factor
+static const int NORM_NONE = 0;
+//counts per million mapped reads
+static const int NORM_CPM = 1;
+//reads per genomic content, i.e. an average depth of 1 over the (--effective-genome-size) genome
+static const int NORM_RPGC = 2;
+static int NORMALIZE = NORM_NONE;
+//the coverage BigWigs' values are multiplied by this (--scale-factor times any --normalize factor)
+static double BIGWIG_SCALE = 1.0;
+//--bigwig-bin: the coverage BigWigs get the mean coverage of each bin of this many bases, 0 for per base
+static uint32_t BIGWIG_BIN = 0;
+//--bigwig-quantize: increasing bucket boundaries, a coverage BigWig value is replaced by the highest boundary <= it
+static std::vector<double> BIGWIG_QUANTA;
+//--read-count-overlap: what --read-counts does with a fragment which overlaps more than one interval (or name)
+//not counted
+static const int OVERLAP_UNIQUE = 0;
+//counted once toward each
+static const int OVERLAP_ALL = 1;
+//split evenly between them
+static const int OVERLAP_FRACTION = 2;
+static int READ_COUNT_OVERLAP = OVERLAP_UNIQUE;
+//--subsample: the fraction of templates (read names) kept, both mates of a pair are kept or dropped together
+static double SUBSAMPLE_FRACTION = 1.0;
+//a read name is kept when its seeded hash is below this
+static uint64_t SUBSAMPLE_THRESHOLD = UINT64_MAX;
+//--subsample-seed
+static uint64_t SUBSAMPLE_SEED = 0;
+//--min-unique-qual tiers, each gets its own coverage counting only the alignments which pass its filter
+static const int MAX_COVERAGE_TIERS = 8;
+struct CoverageTier {
+    //alignments need at least this MAPQ
+    int min_qual;
+    //and with nh1 also NH:i:1 (or no NH tag)
+    bool nh1;
+    //output suffix, "unique" for a single tier, otherwise e.g. "unique.q10" or "unique.nh1"
+    std::string name;
+    //AUC label, e.g. "UNIQUE" or "UNIQUE_Q10"
+    std::string label;
+};
+static std::vector<CoverageTier> COVERAGE_TIERS;
+
+//with keep order an annotated interval's array holds its start, end and then a value per ANNOTATION_OPS
+//for all alignments, each of the COVERAGE_TIERS and the plus and minus strands (--stranded), in that order,
+//this is where the k'th set of values starts
+static inline int annotation_vals_idx(const size_t k) {
+    return 2 + k * ANNOTATION_OPS.size();
+}
 
 static const void print_version() {
     std::cout << "megadepth " << std::string(MEGADEPTH_VERSION) << std::endl;
@@ -181,10 +259,29 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "  --longreads          Modifies certain buffer sizes to accommodate longer reads such as PB/Oxford.\n"
     "  --filter-in          Integer bitmask, any bits of which alignments need to have to be kept (similar to samtools view -f).\n"
     "  --filter-out         Integer bitmask, any bits of which alignments need to have to be skipped (similar to samtools view -F).\n"
+    "  --subsample <fraction>\n"
+    "                       Only keep this fraction (> 0 and <= 1) of the templates, decided by a hash of the read name\n"
+    "                       so both mates are kept or dropped together, the AUCs are also reported scaled up by 1/fraction\n"
+    "                       (ALL_READS_ALL_BASES_SCALED, ALL_READS_ANNOTATED_BASES_SCALED)\n"
+    "  --subsample-seed <int>\n"
+    "                       Seed for the --subsample hash, a different seed keeps a different subset (default: 0)\n"
+    "  --max-depth <int>    Drop an alignment when this many of the alignments kept before it still overlap its start\n"
+    "                       (decided per alignment, so a pair's mates can be split)\n"
     "\n"
     "Non-reference summaries:\n"
     "  --alts                       Print differing from ref per-base coverages\n"
     "                               Writes to a CSV file <prefix>.alts.tsv\n"
+    "  --gzip-alts                  BGZF compress the alts output and build a CSI index for it\n"
+    "                               Writes to <prefix>.alts.tsv.gz and <prefix>.alts.tsv.gz.csi\n"
+    "  --pileup                     Print per-position counts of mismatching bases (A,C,G,T,N), deletion starts,\n"
+    "                               and insertions, only for positions which have at least one\n"
+    "                               Writes to a TSV file <prefix>.pileup.tsv\n"
+    "  --pileup-af                  Same as --pileup but also adds the coverage depth and the fraction of\n"
+    "                               mismatching bases at each position\n"
+    "  --sites <VCF|BED>            Only count the bases (A,C,G,T,N and deletions) of the alignments at these\n"
+    "                               positions, one row per site with its depth and ref/alt counts (VCF),\n"
+    "                               uses the index when the sites are sparse, no other output is computed\n"
+    "                               Writes to a TSV file <prefix>.sites.tsv (.gz with --gzip)\n"
     "  --include-softclip           Print a record to the alts CSV for soft-clipped bases\n"
     "                               Writes total counts to a separate TSV file <prefix>.softclip.tsv\n"
     "  --only-polya                 If --include-softclip, only print softclips which are mostly A's or T's\n"
@@ -204,17 +301,82 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "  --bigwig             Output coverage as BigWig file(s).  Writes to <prefix>.bw\n"
     "                       (also <prefix>.unique.bw when --min-unique-qual is specified).\n"
     "                       Requires libBigWig.\n"
+    "  --scale-factor <float>\n"
+    "                       Multiply the coverage values written to the BigWig(s) (all, unique and strand) by this\n"
+    "  --normalize <cpm|rpgc>\n"
+    "                       Also scale the coverage BigWig(s) to counts per million mapped reads (cpm) or to\n"
+    "                       an average depth of 1 (rpgc, reads per genomic content), from the mapped read\n"
+    "                       count in the index (or a quick count of the records without one), in the same pass\n"
+    "  --effective-genome-size <int>\n"
+    "                       Mappable genome size for --normalize rpgc (default: sum of the reference lengths)\n"
+    "  --bigwig-bin <int>   Write the mean coverage of each bin of this many bases to the coverage BigWig(s)\n"
+    "                       instead of the per base coverage\n"
+    "  --bigwig-quantize <int>:<int>[:<int>...]\n"
+    "                       Write the coverage to the BigWig(s) as the lower boundary of the bucket it falls in\n"
+    "                       (e.g. 0:1:5:150: writes 0, 1, 5 or 150), same format as mosdepth's --quantize,\n"
+    "                       adjacent bases (or bins) in the same bucket get merged into one interval\n"
     "  --annotation <BED|window_size>   Path to BED file containing list of regions to sum coverage over\n"
-    "                       (tab-delimited: chrm,start,end). Or this can specify a contiguous region size in bp.\n"
-    "  --op <sum[default], mean>     Statistic to run on the intervals provided by --annotation\n"
+    "                       (tab-delimited: chrm,start,end). Or this can specify a contiguous region size in bp,\n"
+    "                       or a comma separated list of sizes (e.g. 25,1000,100000), all computed in one pass.\n"
+    "                       Or a comma separated list of BED files (e.g. exons.bed,genes=genes.bed), all summed from\n"
+    "                       the same pass: the first one is output as usual, each of the others to\n"
+    "                       <prefix>.<label>.annotation.tsv[.gz] (label=BED, or the BED's file name without .bed)\n"
+    "                       with its own ALL_READS_ANNOTATED_BASES_<label> AUC.\n"
+    "  --op <sum[default], mean, min, max, breadth>     Statistic to run on the intervals provided by --annotation\n"
+    "                       This can be a comma separated list (e.g. sum,mean,breadth), all computed in one pass,\n"
+    "                       for a BED file each is output as its own column, in the same order.\n"
+    "                       For window sizes more than one size or op writes each to <prefix>.window.<size>.<op>.tsv[.gz]\n"
+    "  --breadth-depth <int>  --op breadth is the fraction of bases with at least this coverage (default: 1)\n"
+    "  --read-counts        Also count the reads (fragments for pairs) overlapping each --annotation BED interval\n"
+    "                       (featureCounts style, from the same pass) into <prefix>.read_counts.tsv[.gz],\n"
+    "                       per name (BED 4th column, e.g. gene) into <prefix>.read_counts.names.tsv[.gz]\n"
+    "                       and the assigned/ambiguous/no feature totals into <prefix>.read_counts.summary.tsv\n"
+    "  --read-count-overlap <unique[default], all, fraction>\n"
+    "                       A fragment overlapping more than one interval (or name) isn't counted (unique),\n"
+    "                       is counted for each of them (all) or is split evenly between them (fraction)\n"
+    "  --depth-dist         Write the # of bases at each depth and the fraction at or above it, per chromosome\n"
+    "                       and in total, to <prefix>.depth.dist.tsv[.gz] (from the same pass as the coverage)\n"
+    "  --callable <int>[,<int>...]\n"
+    "                       Write the merged intervals with at least this coverage to <prefix>.callable.bed[.gz],\n"
+    "                       or with several depths each to <prefix>.callable.<depth>.bed[.gz]\n"
     "  --no-index           If using --annotation, skip the use of the BAM index (BAI) for pulling out regions.\n"
-    "                       Setting this can be faster if doing windows across the whole genome.\n"
+    "                       By default the index is used unless the bytes it would read (from the index's\n"
+    "                       chunk offsets) cost more than a full scan, chromosomes dense with annotations\n"
+    "                       are read whole rather than through the index.\n"
     "                       This will be turned on automatically if a window size is passed to --annotation.\n"
+    "  --region <chr:start-end>\n"
+    "  --regions <BED>      Only fetch (using the BAM/CRAM index, required) and report the alignments in\n"
+    "                       these regions (base-1 inclusive for --region, base-0 half-open for --regions),\n"
+    "                       overlapping regions are merged.  --coverage, --bigwig, --auc, window sums,\n"
+    "                       --read-ends are reported only for the regions' bases, --alts, --junctions,\n"
+    "                       --frag-dist for each alignment overlapping a region (once).\n"
+    "                       Can't be used with an --annotation BED file or --pileup.\n"
     "  --min-unique-qual <int>\n"
     "                       Output second bigWig consisting built only from alignments\n"
     "                       with at least this mapping quality.  --bigwig must be specified.\n"
     "                       Also produces second set of annotation sums based on this coverage\n"
     "                       if --annotation is enabled\n"
+    "                       Can be a comma separated list of MAPQ thresholds and/or nh1 (NH:i:1), e.g. 10,255,nh1,\n"
+    "                       each tier is computed in the same pass and gets its own outputs: <prefix>.unique.q10.bw,\n"
+    "                       <prefix>.unique.q10.tsv, UNIQUE_Q10_READS_ALL_BASES, etc.\n"
+    "  --stranded <fr-firststrand|fr-secondstrand|xs>\n"
+    "                       Also split the coverage by the transcript strand of each alignment, taken from\n"
+    "                       the read's strand and which mate it is (fr-firststrand: dUTP, read 1 is antisense;\n"
+    "                       fr-secondstrand: read 1 is sense) or from the XS:A tag (xs, alignments without it\n"
+    "                       only count toward the unstranded coverage).  In the same pass writes\n"
+    "                       <prefix>.plus.bw and <prefix>.minus.bw (with --bigwig), PLUS/MINUS_READS AUCs\n"
+    "                       and <prefix>.annotation.plus.tsv, <prefix>.annotation.minus.tsv (with --annotation <BED>).\n"
+    "                       Can't be used with --region(s).\n"
+    "  --split-by <RG|tag:XX>\n"
+    "                       Also compute the coverage of each group of alignments sharing the value of\n"
+    "                       their RG (read group) or XX aux tag (e.g. tag:CB for cell barcodes), alignments\n"
+    "                       without it only count toward the overall coverage.  In the same pass writes\n"
+    "                       <prefix>.groups.auc.tsv, <prefix>.group.<group>.bw (with --bigwig) and\n"
+    "                       <prefix>.groups.annotation.tsv, an annotated interval x group matrix (with --annotation <BED>).\n"
+    "                       Can't be used with --region(s).\n"
+    "  --split-groups <file>\n"
+    "                       2 column TSV mapping --split-by tag values to groups (e.g. cell barcodes\n"
+    "                       to pseudobulk clusters), alignments with values not listed are ignored\n"
     "  --double-count       Allow overlapping ends of PE read to count twice toward\n"
     "                       coverage\n"
     "  --num-bases          Report total sum of bases in alignments processed (that pass filters)\n"
@@ -225,14 +387,92 @@ static const char USAGE[] = "BAM and BigWig utility.\n"
     "  --read-ends          Print counts of read starts/ends, if --min-unique-qual is set\n"
     "                       then only the alignments that pass that filter will be counted here\n"
     "                       Writes to 2 TSV files: <prefix>.starts.tsv, <prefix>.ends.tsv\n"
+    "  --gzip-read-ends     BGZF compress the read starts/ends TSVs and build a CSI index for each\n"
+    "                       Writes to <prefix>.starts.tsv.gz, <prefix>.ends.tsv.gz (+ .csi)\n"
+    "  --read-ends-bigwig   Write the read starts/ends counts as BigWigs instead of TSVs\n"
+    "                       Writes to <prefix>.starts.bw, <prefix>.ends.bw\n"
     "  --frag-dist          Print fragment length distribution across the genome\n"
     "                       Writes to a TSV file <prefix>.frags.tsv\n"
     "  --echo-sam           Print a SAM record for each aligned read\n"
     "  --ends               Report end coordinate for each read (useful for debugging)\n"
     "  --test-polya         Lower Poly-A filter minimums for testing (only useful for debugging/testing)\n"
+    "  --stats <file>       Write wall/CPU time per processing phase and per chromosome, records/s,\n"
+    "                       hash table peak sizes, coverage array bytes, peak RSS, and the size of each\n"
+    "                       output file (and what went to STDOUT) to <file> as JSON (adds a small per-record timing overhead)\n"
+    "  --progress <secs>    Print the # of records read, records/s, current position, % done and ETA\n"
+    "                       to STDERR every <secs> seconds\n"
+    "  --progress-file <file>\n"
+    "                       Write the same progress as Prometheus metrics to <file>, e.g. for node_exporter's\n"
+    "                       textfile collector (every --progress seconds, 30 by default)\n"
     "\n";
 
+//--stats/--progress(-file): the output files of this run, registered as they're opened so their sizes can be
+//reported without picking up anything else in the directory, plus the bytes written to STDOUT
+//(by the writers which can print there: my_write, i.e. coverage and annotation, and BufferedWriter)
+class OutputFiles {
+    std::mutex mtx;
+    std::vector<std::string> names;
+    std::atomic<uint64_t> stdout_bytes;
+
+public:
+    OutputFiles() : stdout_bytes(0) {}
+
+    void add(const char* fn) {
+        std::lock_guard<std::mutex> lock(mtx);
+        names.push_back(fn);
+    }
+
+    inline void count_stdout(uint64_t n) { stdout_bytes.fetch_add(n, std::memory_order_relaxed); }
+
+    //the current size of each output (except skip, e.g. the stats file itself), then STDOUT if anything went there
+    void sizes(const char* skip, std::vector<std::pair<std::string, uint64_t>>& files) {
+        std::vector<std::string> fns;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            fns = names;
+        }
+        std::sort(fns.begin(), fns.end());
+        fns.erase(std::unique(fns.begin(), fns.end()), fns.end());
+        for(auto& fn : fns) {
+            if(skip && fn == skip)
+                continue;
+            struct stat st;
+            if(stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                files.push_back(std::make_pair(fn, (uint64_t) st.st_size));
+        }
+        uint64_t n = stdout_bytes.load(std::memory_order_relaxed);
+        if(n > 0)
+            files.push_back(std::make_pair(std::string("STDOUT"), n));
+    }
+};
+static OutputFiles OUTPUT_FILES;
+
+//fopen/bgzf_open for writing one of the outputs
+static FILE* fopen_output(const char* fn) {
+    FILE* fh = fopen(fn, "w");
+    if(fh)
+        OUTPUT_FILES.add(fn);
+    return fh;
+}
+
+static BGZF* bgzf_open_output(const char* fn) {
+    BGZF* fh = bgzf_open(fn, "w10");
+    if(fh)
+        OUTPUT_FILES.add(fn);
+    return fh;
+}
+
+//tbx_index_build for one of the BGZF outputs, which writes <fn>.csi
+static int index_output(const char* fn, int min_shift, const tbx_conf_t* conf) {
+    int ret = tbx_index_build(fn, min_shift, conf);
+    if(ret == 0)
+        OUTPUT_FILES.add((std::string(fn) + ".csi").c_str());
+    return ret;
+}
+
 int my_write(void* fh, char* buf, uint32_t buf_len) {
+    if(fh == stdout)
+        OUTPUT_FILES.count_stdout(buf_len);
 #if USE_POSIX
     return ::write(::fileno(fh), buf, bu_len);
 #else
@@ -300,6 +540,31 @@ int print_local_sums_only<double>(char* buf, const char* c, long start, long end
         return sprintf(buf, "%.2f\n", (round(local_vals[z]*100.)/100.));
 }
 
+//one --op value of an annotated interval
+static inline int print_annotation_stat(char* buf, const Op op, const double val) {
+    switch(op) {
+        case cmean: return sprintf(buf, "%.2f", (round(val*100.)/100.));
+        case cbreadth: return sprintf(buf, "%.4f", val);
+        default: return sprintf(buf, "%lu", (long) val);
+    }
+}
+
+//a line for one annotated interval of a BAM/CRAM, with a column per ANNOTATION_OPS
+template <typename T>
+static int print_annotation_stats(char* buf, const char* c, long start, long end, const T* vals) {
+    char* bufptr = buf;
+    if(!SUMS_ONLY)
+        bufptr += sprintf(bufptr, "%s\t%lu\t%lu\t", c, start, end);
+    for(size_t k = 0; k < ANNOTATION_OPS.size(); k++) {
+        if(k > 0)
+            *bufptr++ = '\t';
+        bufptr += print_annotation_stat(bufptr, ANNOTATION_OPS[k], (double) vals[k]);
+    }
+    *bufptr++ = '\n';
+    *bufptr = '\0';
+    return bufptr - buf;
+}
+
 static const char* get_positional_n(const char ** begin, const char ** end, size_t n) {
     size_t i = 0;
     for(const char **itr = begin; itr != end; itr++) {
@@ -331,12 +596,13 @@ static const char** get_option(
 
 /**
  * Holds an MDZ "operation"
- * op can be
+ * op can be '=' (matching run), 'X' (mismatched bases), or '^' (deleted bases)
+ * for 'X' and '^', off is where the reference bases start in the MD:Z string
  */
 struct MdzOp {
     char op;
     int run;
-    char str[1024];
+    uint32_t off;
 };
 
 //from https://github.com/samtools/htslib/blob/7c04ea5c328547e9e8a9af4b932b87a3cb1939e6/hts.c#L82
@@ -375,26 +641,6 @@ static inline std::ostream& seq_substring(std::ostream& os, const uint8_t *str,
     return os;
 }
 
-static inline char* seq_substring(const uint8_t *str, size_t off, size_t run, bool reverse=false) {
-    char* seq = new char[off + run + 1];
-    int k = 0;
-    if(reverse) {
-        int i=(off+run)-1;
-        while(((int) off) <= i) {
-            int io = bam_seqi(str, i);
-            seq[k++] = seq_rev_nt16_str[io];
-            i--;
-        }
-        seq[k]='\0';
-        return seq;
-    }
-    for(size_t i = off; i < off + run; i++) {
-        seq[k++] = seq_nt16_str[bam_seqi(str, i)];
-    }
-    seq[k]='\0';
-    return seq;
-}
-
 static inline std::ostream& kstring_out(std::ostream& os, const kstring_t *str) {
     for(size_t i = 0; i < str->l; i++) {
         os << str->s[i];
@@ -402,22 +648,6 @@ static inline std::ostream& kstring_out(std::ostream& os, const kstring_t *str)
     return os;
 }
 
-static inline std::ostream& cstr_substring(std::ostream& os, const uint8_t *str, size_t off, size_t run) {
-    for(size_t i = off; i < off + run; i++) {
-        os << (char)str[i];
-    }
-    return os;
-}
-
-static inline char* cstr_substring(const uint8_t *str, size_t off, size_t run) {
-    char* quals = new char[off + run];
-    int k = 0;
-    for(size_t i = off; i < off + run; i++)
-        quals[k++] = (char)str[i];
-    quals[k]='\0';
-    return quals;
-}
-
 static inline std::ostream& qstr_substring(std::ostream& os, const uint8_t *str, size_t off, size_t run, bool reverse=false) {
     if(reverse) {
         int i=(off+run)-1;
@@ -433,107 +663,376 @@ static inline std::ostream& qstr_substring(std::ostream& os, const uint8_t *str,
     return os;
 }
 
+//each packed BAM sequence byte holds 2 bases, so decode a whole byte per lookup
+struct SeqPairLut {
+    char pairs[256][2];
+    SeqPairLut() {
+        for(int b = 0; b < 256; b++) {
+            pairs[b][0] = seq_nt16_str[b >> 4];
+            pairs[b][1] = seq_nt16_str[b & 0xf];
+        }
+    }
+};
+static const SeqPairLut SEQ_PAIR_LUT;
+
+static inline char* decode_seq(char* out, const uint8_t *str, size_t off, size_t run) {
+    size_t i = off;
+    const size_t end = off + run;
+    //odd start, get onto a byte boundary first
+    if((i & 1) && i < end) {
+        *out++ = seq_nt16_str[bam_seqi(str, i)];
+        i++;
+    }
+    for(; i + 1 < end; i += 2) {
+        memcpy(out, SEQ_PAIR_LUT.pairs[str[i >> 1]], 2);
+        out += 2;
+    }
+    if(i < end)
+        *out++ = seq_nt16_str[bam_seqi(str, i)];
+    return out;
+}
+
+int finalize_tabix_index(const char* fname, const char* ifname, BGZF* bfh, hts_idx_t* cidx, int* chrms_in_cidx, const bam_hdr_t *hdr, const tbx_conf_t* conf = &tbx_conf_bed);
+
+//tabix layout of the --read-ends TSVs: chrm, 1-based position, count
+static const tbx_conf_t TBX_CONF_READ_ENDS = { TBX_GENERIC, 1, 2, 0, '#', 0 };
+
+//writer for the high volume text outputs (e.g. --alts)
+//records are formatted directly into a large reusable buffer (u32toa_countlut for numbers)
+//which is written out only when it fills up.
+//optionally writes BGZF and builds a CSI index on the fly, in which case each record
+//is passed through to the BGZF stream as it's finished so it gets an exact virtual offset
+class BufferedWriter {
+    char* buf;
+    char* bufptr;
+    size_t buf_sz;
+    FILE* fh;
+    BGZF* gfh;
+    hts_idx_t* idx;
+    //same convention as print_array: [0] is the # of chrms seen, [tid+1] is the order (1-based) a chrm was first seen
+    int* chrms_in_idx;
+    const bam_hdr_t* hdr;
+    //if >= 0, used as the start coordinate of every record pushed into the index
+    int64_t index_floor;
+    //how tabix should parse the records, stored in the index metadata
+    tbx_conf_t index_conf;
+    char fn[1024];
+
+    void write_out(const char* data, size_t len) {
+        if(len == 0)
+            return;
+        if(gfh) {
+            if(bgzf_write(gfh, data, len) < 0) {
+                fprintf(stderr, "error writing to %s, exiting\n", fn);
+                exit(-1);
+            }
+        }
+        else {
+            fwrite(data, 1, len, fh);
+            if(fh == stdout)
+                OUTPUT_FILES.count_stdout(len);
+        }
+    }
+
+public:
+    BufferedWriter(const char* fname, const bam_hdr_t* hdr_, bool gzip = false, bool index = false) :
+            buf_sz(OUT_BUFF_SZ),fh(nullptr),gfh(nullptr),idx(nullptr),chrms_in_idx(nullptr),hdr(hdr_),index_floor(-1),index_conf(tbx_conf_bed) {
+        strncpy(fn, fname, sizeof(fn)-1);
+        fn[sizeof(fn)-1] = '\0';
+        OUTPUT_FILES.add(fn);
+        buf = new char[buf_sz];
+        bufptr = buf;
+        if(gzip) {
+            gfh = bgzf_open(fn, "w10");
+            if(!gfh) {
+                fprintf(stderr, "Failed to open %s for writing, exiting\n", fn);
+                exit(-1);
+            }
+            if(index) {
+                int min_shift = 14;
+                int n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3;
+                idx = hts_idx_init(0, HTS_FMT_CSI, 0, min_shift, n_lvls);
+                chrms_in_idx = new int[hdr->n_targets+1]{};
+            }
+        }
+        else {
+            fh = fopen(fn, "w");
+            if(!fh) {
+                fprintf(stderr, "Failed to open %s for writing, exiting\n", fn);
+                exit(-1);
+            }
+        }
+    }
+    //wraps an already open handle (e.g. STDOUT), which close() only flushes
+    BufferedWriter(FILE* fh_, const bam_hdr_t* hdr_) :
+            buf_sz(OUT_BUFF_SZ),fh(fh_),gfh(nullptr),idx(nullptr),chrms_in_idx(nullptr),hdr(hdr_),index_floor(-1),index_conf(tbx_conf_bed) {
+        strcpy(fn, fh == stdout ? "STDOUT" : "");
+        buf = new char[buf_sz];
+        bufptr = buf;
+    }
+    ~BufferedWriter() { delete[] buf; delete[] chrms_in_idx; }
+
+    //make sure there's room for at least n more bytes in the buffer
+    inline void reserve(size_t n) {
+        if(likely((bufptr - buf) + n <= buf_sz))
+            return;
+        flush();
+        if(n > buf_sz) {
+            delete[] buf;
+            buf_sz = n;
+            buf = new char[buf_sz];
+            bufptr = buf;
+        }
+    }
+    inline void put(char c) { *bufptr++ = c; }
+    inline void put(const char* s, size_t len) { memcpy(bufptr, s, len); bufptr += len; }
+    inline void put(const char* s) { put(s, strlen(s)); }
+    //writes the number followed by delim
+    inline void put_u32(uint32_t v, char delim) { bufptr += u32toa_countlut(v, bufptr, delim) + 1; }
+    inline void put_u64(uint64_t v, char delim) {
+        if(likely(v <= UINT32_MAX))
+            put_u32(static_cast<uint32_t>(v), delim);
+        else
+            bufptr += sprintf(bufptr, "%" PRIu64 "%c", v, delim);
+    }
+    inline void put_i32(int32_t v, char delim) {
+        uint32_t u = static_cast<uint32_t>(v);
+        if(v < 0) {
+            *bufptr++ = '-';
+            u = ~u + 1;
+        }
+        put_u32(u, delim);
+    }
+    inline void put_seq(const uint8_t* seq, size_t off, size_t run) { bufptr = decode_seq(bufptr, seq, off, run); }
+
+    bool indexed() const { return idx != nullptr; }
+    void set_index_floor(int64_t floor) { index_floor = floor; }
+    void set_index_conf(const tbx_conf_t& conf) { index_conf = conf; }
+
+    //marks the end of one record (line) covering [beg,end) on tid, only does work when indexing
+    inline void end_record(int32_t tid, int64_t beg, int64_t end) {
+        if(!idx)
+            return;
+        write_out(buf, bufptr - buf);
+        bufptr = buf;
+        if(chrms_in_idx[tid+1] == 0)
+            chrms_in_idx[tid+1] = ++chrms_in_idx[0];
+        if(index_floor >= 0)
+            beg = index_floor;
+        if(hts_idx_push(idx, chrms_in_idx[tid+1]-1, beg, end, bgzf_tell(gfh), 1) < 0) {
+            fprintf(stderr,"error writing line in index for %s at coordinates: %s:%ld-%ld, exiting\n", fn, hdr->target_name[tid], (long) beg, (long) end);
+            exit(-1);
+        }
+    }
+
+    void flush() {
+        write_out(buf, bufptr - buf);
+        bufptr = buf;
+    }
+
+    void close() {
+        flush();
+        if(gfh) {
+            if(idx) {
+                char ifn[1024];
+                sprintf(ifn, "%s.csi", fn);
+                finalize_tabix_index(fn, ifn, gfh, idx, chrms_in_idx, hdr, &index_conf);
+            }
+            bgzf_close(gfh);
+            gfh = nullptr;
+        }
+        else if(fh) {
+            if(fh == stdout)
+                fflush(fh);
+            else
+                fclose(fh);
+            fh = nullptr;
+        }
+    }
+};
+
 /**
- * Parse given MD:Z extra field into a vector of MD:Z operations.
+ * Decodes the MD:Z extra field one operation at a time, as the CIGAR is walked.
+ * The mismatched/deleted reference bases aren't copied out,
+ * the current op just records where they start in the MD:Z string.
  */
-static void parse_mdz(
-        const uint8_t *mdz,
-        std::vector<MdzOp>& ops)
-{
-    int i = 0;
-    size_t mdz_len = strlen((char *)mdz);
-    while(i < mdz_len) {
-        if(isdigit(mdz[i])) {
-            int run = 0;
-            while(i < mdz_len && isdigit(mdz[i])) {
-                run *= 10;
-                run += (int)(mdz[i] - '0');
-                i++;
-            }
-            if(run > 0) {
-                ops.emplace_back(MdzOp{'=', run, ""});
-                ops.back().str[0] = '\0';
-            }
-        } else if(isalpha(mdz[i])) {
-            int st = i;
-            while(i < mdz_len && isalpha(mdz[i])) i++;
-            assert(i > st);
-            ops.emplace_back(MdzOp{'X', i - st, ""});
-            for(int j = 0; j < i ; j++) {
-                ops.back().str[j] = mdz[st + j];
-            }
-            std::memcpy(ops.back().str, mdz + st, (size_t)(i - st));
-            ops.back().str[i - st] = '\0';
-        } else if(mdz[i] == '^') {
-            i++;
-            int st = i;
-            while (i < mdz_len && isalpha(mdz[i])) i++;
-            assert(i > st);
-            ops.emplace_back(MdzOp{'^', i - st, ""});
-            std::memcpy(ops.back().str, mdz + st, (size_t)(i - st));
-            ops.back().str[i - st] = '\0';
-        } else {
-            std::stringstream ss;
-            ss << "Unknown MD:Z operation: \"" << mdz[i] << "\"";
-            throw std::runtime_error(ss.str());
+class MdzCursor {
+    const char* mdz;
+    size_t i;
+    MdzOp op_;
+    //how much of the current op's run hasn't been consumed yet
+    int left_;
+
+    void decode() {
+        while(true) {
+            const char c = mdz[i];
+            unsigned d = (unsigned) (c - '0');
+            if(d <= 9) {
+                int run = 0;
+                do {
+                    run = run * 10 + d;
+                    d = (unsigned) (mdz[++i] - '0');
+                } while(d <= 9);
+                //0's only separate adjacent mismatches/deletions
+                if(run == 0)
+                    continue;
+                op_.op = '=';
+                op_.run = run;
+                op_.off = 0;
+            } else if(c == '^' || isalpha(c)) {
+                op_.op = 'X';
+                if(c == '^') {
+                    op_.op = '^';
+                    i++;
+                }
+                size_t st = i;
+                while(isalpha(mdz[i])) i++;
+                assert(i > st);
+                op_.run = i - st;
+                op_.off = st;
+            } else if(c == '\0') {
+                op_.op = '\0';
+                op_.run = 0;
+            } else {
+                std::stringstream ss;
+                ss << "Unknown MD:Z operation: \"" << c << "\"";
+                throw std::runtime_error(ss.str());
+            }
+            left_ = op_.run;
+            return;
         }
     }
-}
 
-static bool check_for_overlap(std::vector<Coordinate>* overlapping_coords, int starting_idx, int32_t refpos) {
+public:
+    explicit MdzCursor(const uint8_t* mdz_) : mdz((const char*) mdz_), i(0) { decode(); }
+    bool done() const { return op_.op == '\0'; }
+    const MdzOp& op() const { return op_; }
+    int left() const { return left_; }
+    //use up n (<= left()) of the current op's run, moving on to the next op when it's all used
+    void consume(int n) {
+        left_ -= n;
+        if(left_ == 0)
+            decode();
+    }
+};
+
+static bool check_for_overlap(const std::vector<Coordinate>* overlapping_coords, int starting_idx, int32_t refpos) {
     for(auto it : *overlapping_coords)
         if(it.start <= refpos && it.end >= refpos)
             return true;
     return false;
 }
 
+//an alt (X, I, or D) held back from the 1st mate of a possibly overlapping pair
+//until we know which of its positions overlap the 2nd mate.
+//the bases/quals are stored in the per-chromosome OpArena, not allocated per op
 struct CigarOp {
     char op;
     int32_t refidx;
     int32_t refpos;
-    char* seq;
-    char* quals;
-    //std::ostream seq;
-    //std::ostream quals;
+    uint32_t seq_off;
+    uint32_t seq_len;
+    uint32_t qual_off;
+    uint32_t qual_len;
     int32_t del_len;
 };
 
+//bump allocator for the bases/quals of saved CigarOps,
+//reset when switching chromosomes, which is also when the saved ops are dropped
+struct OpArena {
+    std::vector<char> bytes;
+    uint32_t add_seq(const uint8_t *seq, size_t off, size_t run) {
+        uint32_t start = bytes.size();
+        bytes.resize(start + run);
+        decode_seq(bytes.data() + start, seq, off, run);
+        return start;
+    }
+    uint32_t add_raw(const uint8_t *str, size_t off, size_t run) {
+        uint32_t start = bytes.size();
+        bytes.insert(bytes.end(), str + off, str + off + run);
+        return start;
+    }
+    const char* at(uint32_t off) const { return bytes.data() + off; }
+    void clear() { bytes.clear(); }
+};
+
+//room for the numeric/separator part of any one alt record
+static const int ALT_RECORD_FIXED_LEN = 80;
+
+static inline void save_alt_op(std::vector<CigarOp>* saved_ops, OpArena* arena, char op, int32_t refidx, int32_t refpos,
+                               const uint8_t *seq, size_t seq_off, size_t run, const uint8_t *qual = nullptr, int32_t del_len = 0) {
+    CigarOp cig;
+    cig.op = op;
+    cig.refidx = refidx;
+    cig.refpos = refpos;
+    cig.seq_off = 0;
+    cig.seq_len = 0;
+    cig.qual_off = 0;
+    cig.qual_len = 0;
+    cig.del_len = del_len;
+    if(seq) {
+        cig.seq_off = arena->add_seq(seq, seq_off, run);
+        cig.seq_len = run;
+    }
+    if(qual) {
+        cig.qual_off = arena->add_raw(qual, seq_off, run);
+        cig.qual_len = run;
+    }
+    saved_ops->push_back(cig);
+}
+
+//writes the leading "tid,pos,op," shared by all alt records
+static inline void alt_record_prefix(BufferedWriter& out, int32_t tid, int32_t refpos, char op, size_t var_len) {
+    out.reserve(ALT_RECORD_FIXED_LEN + var_len);
+    out.put_i32(tid, ',');
+    out.put_i32(refpos, ',');
+    out.put(op);
+    out.put(',');
+}
+
 typedef hashmap<std::string, std::vector<CigarOp>> read2cigarops;
 //only applies to X,D, and I ops (not S [softclipping])
-static void emit_alt_record(std::fstream& fout, CigarOp& cig, const char* qname) {
-    fout << cig.refidx << ',' << cig.refpos << ',' << cig.op << ',';
-    if(cig.op == 'D')
-        fout << cig.del_len;
-    else
-        fout << cig.seq;
-    //cleanup, assumes there's only 2 mates in a read
-    delete cig.seq;
-    fout << ',' << qname << ',';
-    if(cig.quals) {
-        fout << cig.quals;
-        delete cig.quals;
+static void emit_alt_record(BufferedWriter& out, const CigarOp& cig, const char* qname, const OpArena* arena) {
+    size_t qname_len = strlen(qname);
+    alt_record_prefix(out, cig.refidx, cig.refpos, cig.op, cig.seq_len + cig.qual_len + qname_len);
+    int32_t end = cig.refpos + 1;
+    if(cig.op == 'D') {
+        out.put_i32(cig.del_len, ',');
+        end = cig.refpos + cig.del_len;
     }
-    fout << '\n';
+    else {
+        out.put(arena->at(cig.seq_off), cig.seq_len);
+        out.put(',');
+        if(cig.op == 'X')
+            end = cig.refpos + cig.seq_len;
+    }
+    out.put(qname, qname_len);
+    out.put(',');
+    if(cig.qual_len > 0)
+        out.put(arena->at(cig.qual_off), cig.qual_len);
+    out.put('\n');
+    out.end_record(cig.refidx, cig.refpos, end);
 }
 
-static void check_saved_ops(std::fstream& fout, std::vector<CigarOp>* saved_ops, std::vector<Coordinate>* overlapping_coords, char* real_qname, bool check_for_overlaps_flag = true) {
+static void check_saved_ops(BufferedWriter& out, std::vector<CigarOp>* saved_ops, std::vector<Coordinate>* overlapping_coords, char* real_qname, const OpArena* arena, bool check_for_overlaps_flag = true) {
     int coord_idx = 0;
-    for(auto it : *saved_ops) {
+    for(auto const& it : *saved_ops) {
         char* qname = emptystr;
         if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, it.refpos))
             qname = real_qname; 
-        emit_alt_record(fout, it, qname);
+        emit_alt_record(out, it, qname, arena);
     } 
 }
 
 static bool output_from_cigar_mdz(
         const bam1_t *rec,
-        std::vector<MdzOp>& mdz,
-        std::fstream& fout,
+        const uint8_t *mdz,
+        BufferedWriter& fout,
         uint64_t* total_softclip_count,
         char* real_qname,
         std::vector<Coordinate>* overlapping_coords,
         std::vector<CigarOp>* saved_ops = nullptr,
+        OpArena* arena = nullptr,
         bool save_ops = false,
         bool print_qual = false,
         bool include_sc = false,
@@ -543,19 +1042,21 @@ static bool output_from_cigar_mdz(
 {
     //bool check_for_saved_ops = saved_ops->size() > 0;
     if(saved_ops->size() > 0)
-        check_saved_ops(fout, saved_ops, overlapping_coords, real_qname);
+        check_saved_ops(fout, saved_ops, overlapping_coords, real_qname, arena);
     uint8_t *seq = bam_get_seq(rec);
     uint8_t *qual = bam_get_qual(rec);
     // If QUAL field is *. this array is just a bunch of 255s
     uint32_t *cigar = bam_get_cigar(rec);
-    size_t mdzi = 0, seq_off = 0;
+    MdzCursor md(mdz);
+    size_t seq_off = 0;
     int32_t ref_off = rec->core.pos;
+    int32_t tid = rec->core.tid;
     bool found = false;
     bool check_for_overlaps_flag = overlapping_coords->size() > 0;
     for(unsigned int k = 0; k < rec->core.n_cigar; k++) {
         int op = bam_cigar_op(cigar[k]);
         int run = bam_cigar_oplen(cigar[k]);
-        if((strchr("DNMX=", BAM_CIGAR_STR[op]) != nullptr) && mdzi >= mdz.size()) {
+        if((strchr("DNMX=", BAM_CIGAR_STR[op]) != nullptr) && md.done()) {
             std::stringstream ss;
             ss << "Found read-consuming CIGAR op after MD:Z had been exhausted" << std::endl;
             throw std::runtime_error(ss.str());
@@ -565,70 +1066,57 @@ static bool output_from_cigar_mdz(
         if(op == BAM_CMATCH || op == BAM_CDIFF || op == BAM_CEQUAL) {
             // Look for block matches and mismatches in MD:Z string
             int runleft = run;
-            while(runleft > 0 && mdzi < mdz.size()) {
-                int run_comb = std::min(runleft, mdz[mdzi].run);
+            while(runleft > 0 && !md.done()) {
+                int run_comb = std::min(runleft, md.left());
                 runleft -= run_comb;
-                assert(mdz[mdzi].op == 'X' || mdz[mdzi].op == '=');
-                if(mdz[mdzi].op == '=') {
+                assert(md.op().op == 'X' || md.op().op == '=');
+                if(md.op().op == '=') {
                     // nop
                 } else {
-                    assert(mdz[mdzi].op == 'X');
-                    assert(strlen(mdz[mdzi].str) == run_comb);
                     int cread = bam_seqi(seq, seq_off);
                     if(!include_n_mms && run_comb == 1 && seq_nt16_str[cread] == 'N') {
                         // skip
                     } else {
                         char* qname = emptystr; 
                         if(save_ops) {
-                            CigarOp cig;
-                            cig.refidx = rec->core.tid;
-                            cig.refpos = ref_off;
-                            cig.op = 'X';
-                            cig.seq = seq_substring(seq, seq_off, (size_t)run_comb);
-                            cig.quals = nullptr;
-                            if(print_qual)
-                                cig.quals = cstr_substring(qual, seq_off, (size_t)run_comb);
-                            cig.del_len = 0;
-                            saved_ops->push_back(cig);
+                            save_alt_op(saved_ops, arena, 'X', tid, ref_off, seq, seq_off, (size_t)run_comb, print_qual ? qual : nullptr);
                         }
                         else {
                             if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, ref_off))
                                 qname = real_qname; 
-                            fout << rec->core.tid << ',' << ref_off << ",X,";
-                            seq_substring(fout, seq, seq_off, (size_t)run_comb) << ',' << qname << ',';
+                            size_t qname_len = strlen(qname);
+                            alt_record_prefix(fout, tid, ref_off, 'X', 2*run_comb + qname_len);
+                            fout.put_seq(seq, seq_off, (size_t)run_comb);
+                            fout.put(',');
+                            fout.put(qname, qname_len);
+                            fout.put(',');
                             if(print_qual)
-                                cstr_substring(fout, qual, seq_off, (size_t)run_comb);
-                            fout << '\n';
+                                fout.put((const char*)qual + seq_off, (size_t)run_comb);
+                            fout.put('\n');
+                            fout.end_record(tid, ref_off, ref_off + run_comb);
                             found = true;
                         }
                     }
                 }
                 seq_off += run_comb;
                 ref_off += run_comb;
-                if(run_comb < mdz[mdzi].run) {
-                    assert(mdz[mdzi].op == '=');
-                    mdz[mdzi].run -= run_comb;
-                } else {
-                    mdzi++;
-                }
+                md.consume(run_comb);
             }
         } else if(op == BAM_CINS) {
             char* qname = emptystr; 
             if(save_ops) {
-                CigarOp cig;
-                cig.refidx = rec->core.tid;
-                cig.refpos = ref_off;
-                cig.op = 'I';
-                cig.seq = seq_substring(seq, seq_off, (size_t)run);
-                cig.quals = nullptr;
-                cig.del_len = 0;
-                saved_ops->push_back(cig);
+                save_alt_op(saved_ops, arena, 'I', tid, ref_off, seq, seq_off, (size_t)run);
             }
             else {
                 if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, ref_off))
                     qname = real_qname; 
-                fout << rec->core.tid << ',' << ref_off << ",I,";
-                seq_substring(fout, seq, seq_off, (size_t)run)  << ',' << qname << ",\n";
+                size_t qname_len = strlen(qname);
+                alt_record_prefix(fout, tid, ref_off, 'I', run + qname_len);
+                fout.put_seq(seq, seq_off, (size_t)run);
+                fout.put(',');
+                fout.put(qname, qname_len);
+                fout.put(",\n", 2);
+                fout.end_record(tid, ref_off, ref_off + 1);
                 found = true;
             }
             seq_off += run;
@@ -642,44 +1130,48 @@ static bool output_from_cigar_mdz(
                     char c;
                     int count_polya = polya_check(seq, seq_off, (size_t)run, &c);
                     if(count_polya != -1 && run >= SOFTCLIP_POLYA_TOTAL_COUNT_MIN) {
-                        char* qname = emptystr; 
                         /*if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, ref_off))
                             qname = real_qname;*/
-                        fout << rec->core.tid << ',' << ref_off << ",S,";
-                        fout << run << ',' << qname << ',' << direction << ',' << c << ',' << count_polya << '\n';
+                        alt_record_prefix(fout, tid, ref_off, 'S', 0);
+                        fout.put_i32(run, ',');
+                        fout.put(',');
+                        fout.put(direction);
+                        fout.put(',');
+                        fout.put(c);
+                        fout.put(',');
+                        fout.put_i32(count_polya, '\n');
+                        fout.end_record(tid, ref_off, ref_off + 1);
                         found = true;
                     }
                 }
                 else {
-                    char* qname = emptystr; 
                     /*if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, ref_off))
                         qname = real_qname;*/
-                    fout << rec->core.tid << ',' << ref_off << ",S,";
-                    seq_substring(fout, seq, seq_off, (size_t)run)  << ',' << qname << ",\n";
+                    alt_record_prefix(fout, tid, ref_off, 'S', run);
+                    fout.put_seq(seq, seq_off, (size_t)run);
+                    fout.put(",,\n", 3);
+                    fout.end_record(tid, ref_off, ref_off + 1);
                     found = true;
                 }
             }
             seq_off += run;
         } else if (op == BAM_CDEL) {
-            assert(mdz[mdzi].op == '^');
-            assert(run == mdz[mdzi].run);
-            assert(strlen(mdz[mdzi].str) == run);
-            mdzi++;
+            assert(md.op().op == '^');
+            assert(run == md.left());
+            md.consume(run);
             char* qname = emptystr; 
             if(save_ops) {
-                CigarOp cig;
-                cig.refidx = rec->core.tid;
-                cig.refpos = ref_off;
-                cig.op = 'D';
-                cig.seq = nullptr;
-                cig.quals = nullptr;
-                cig.del_len = run;
-                saved_ops->push_back(cig);
+                save_alt_op(saved_ops, arena, 'D', tid, ref_off, nullptr, 0, 0, nullptr, run);
             }
             else {
                 if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, ref_off))
                     qname = real_qname; 
-                fout << rec->core.tid << ',' << ref_off << ",D," << run << ',' << qname << ",\n";
+                size_t qname_len = strlen(qname);
+                alt_record_prefix(fout, tid, ref_off, 'D', qname_len);
+                fout.put_i32(run, ',');
+                fout.put(qname, qname_len);
+                fout.put(",\n", 2);
+                fout.end_record(tid, ref_off, ref_off + run);
                 found = true;
             }
             ref_off += run;
@@ -693,13 +1185,13 @@ static bool output_from_cigar_mdz(
             throw std::runtime_error(ss.str());
         }
     }
-    assert(mdzi == mdz.size());
+    assert(md.done());
     return found;
 }
 
-static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* total_softclip_count, const bool include_sc, const bool only_polya_sc, char* real_qname, std::vector<Coordinate>* overlapping_coords, std::vector<CigarOp>* saved_ops = nullptr, bool save_ops = false) {
+static bool output_from_cigar(const bam1_t *rec, BufferedWriter& fout, uint64_t* total_softclip_count, const bool include_sc, const bool only_polya_sc, char* real_qname, std::vector<Coordinate>* overlapping_coords, std::vector<CigarOp>* saved_ops = nullptr, OpArena* arena = nullptr, bool save_ops = false) {
     if(saved_ops->size() > 0)
-        check_saved_ops(fout, saved_ops, overlapping_coords, real_qname);
+        check_saved_ops(fout, saved_ops, overlapping_coords, real_qname, arena);
     uint8_t *seq = bam_get_seq(rec);
     uint32_t *cigar = bam_get_cigar(rec);
     uint32_t n_cigar = rec->core.n_cigar;
@@ -708,6 +1200,7 @@ static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* t
         return found;
     int32_t refpos = rec->core.pos;
     int32_t seqpos = 0;
+    int32_t tid = rec->core.tid;
     int coord_idx = 0;
     bool check_for_overlaps_flag = overlapping_coords->size() > 0;
     for(uint32_t k = 0; k < n_cigar; k++) {
@@ -717,19 +1210,17 @@ static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* t
             case BAM_CDEL: {
                 char* qname = emptystr; 
                 if(save_ops) {
-                    CigarOp cig;
-                    cig.refidx = rec->core.tid;
-                    cig.refpos = refpos;
-                    cig.op = 'D';
-                    cig.seq = nullptr;
-                    cig.quals = nullptr;
-                    cig.del_len = run;
-                    saved_ops->push_back(cig);
+                    save_alt_op(saved_ops, arena, 'D', tid, refpos, nullptr, 0, 0, nullptr, run);
                 }
                 else {
                     if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, refpos))
                         qname = real_qname; 
-                    fout << rec->core.tid << ',' << refpos << ",D," << run << "," << qname << ",\n";
+                    size_t qname_len = strlen(qname);
+                    alt_record_prefix(fout, tid, refpos, 'D', qname_len);
+                    fout.put_i32(run, ',');
+                    fout.put(qname, qname_len);
+                    fout.put(",\n", 2);
+                    fout.end_record(tid, refpos, refpos + run);
                 }
                 refpos += run;
                 break;
@@ -744,16 +1235,23 @@ static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* t
                         char c;
                         int count_polya = polya_check(seq, (size_t)seqpos, (size_t)run, &c);
                         if(count_polya != -1 && run >= SOFTCLIP_POLYA_TOTAL_COUNT_MIN) {
-                            char* qname = emptystr; 
-                            fout << rec->core.tid << ',' << refpos << ',' << BAM_CIGAR_STR[op] << ',';
-                            fout << run << ',' << qname << ',' << direction << ',' << c << ',' << count_polya << '\n';
+                            alt_record_prefix(fout, tid, refpos, BAM_CIGAR_STR[op], 0);
+                            fout.put_i32(run, ',');
+                            fout.put(',');
+                            fout.put(direction);
+                            fout.put(',');
+                            fout.put(c);
+                            fout.put(',');
+                            fout.put_i32(count_polya, '\n');
+                            fout.end_record(tid, refpos, refpos + 1);
                             found = true;
                         }
                     }
                     else {
-                        char* qname = emptystr; 
-                        fout << rec->core.tid << ',' << refpos << ',' << BAM_CIGAR_STR[op] << ',';
-                        seq_substring(fout, seq, (size_t)seqpos, (size_t)run) << ',' << qname << ",\n";
+                        alt_record_prefix(fout, tid, refpos, BAM_CIGAR_STR[op], run);
+                        fout.put_seq(seq, (size_t)seqpos, (size_t)run);
+                        fout.put(",,\n", 3);
+                        fout.end_record(tid, refpos, refpos + 1);
                         found = true;
                     }
                 }
@@ -763,20 +1261,18 @@ static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* t
             case BAM_CINS: {
                 char* qname = emptystr; 
                 if(save_ops) {
-                    CigarOp cig;
-                    cig.refidx = rec->core.tid;
-                    cig.refpos = refpos;
-                    cig.op = 'I';
-                    cig.seq = seq_substring(seq, (size_t)seqpos, (size_t)run);
-                    cig.quals = nullptr;
-                    cig.del_len = 0;
-                    saved_ops->push_back(cig);
+                    save_alt_op(saved_ops, arena, 'I', tid, refpos, seq, (size_t)seqpos, (size_t)run);
                 }
                 else {
                     if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, coord_idx, refpos))
                         qname = real_qname; 
-                    fout << rec->core.tid << ',' << refpos << ',' << BAM_CIGAR_STR[op] << ',';
-                    seq_substring(fout, seq, (size_t)seqpos, (size_t)run) << ',' << qname << ",\n";
+                    size_t qname_len = strlen(qname);
+                    alt_record_prefix(fout, tid, refpos, BAM_CIGAR_STR[op], run + qname_len);
+                    fout.put_seq(seq, (size_t)seqpos, (size_t)run);
+                    fout.put(',');
+                    fout.put(qname, qname_len);
+                    fout.put(",\n", 2);
+                    fout.end_record(tid, refpos, refpos + 1);
                     found = true;
                 }
                 seqpos += run;
@@ -805,6 +1301,201 @@ static bool output_from_cigar(const bam1_t *rec, std::fstream& fout, uint64_t* t
     return found;
 }
 
+//columns of the --pileup output, mismatching read bases then deletion starts and insertions
+enum PileupCol { PILEUP_A=0, PILEUP_C, PILEUP_G, PILEUP_T, PILEUP_N, PILEUP_DEL, PILEUP_INS, PILEUP_NUM_COLS };
+
+struct PileupCounts {
+    uint32_t n[PILEUP_NUM_COLS];
+};
+//initial (and per chromosome) size of the --pileup ring buffer, a power of 2
+static const size_t PILEUP_RING_SZ = 1024;
+
+static inline int pileup_col(int nt16) {
+    switch(seq_nt16_str[nt16]) {
+        case 'A': return PILEUP_A;
+        case 'C': return PILEUP_C;
+        case 'G': return PILEUP_G;
+        case 'T': return PILEUP_T;
+        default: return PILEUP_N;
+    }
+}
+
+//per-position alt. base counts for --pileup.
+//since alignments are sorted, nothing before the current alignment's start can change,
+//so only the window from there to the furthest position touched is kept (in a ring buffer)
+//and everything before it is written out as we go.
+//if coverages is passed in, the depth at each position and the fraction of mismatching bases is also written
+class AltPileup {
+    std::vector<PileupCounts> ring;
+    size_t mask;
+    //[start,end) is the window of positions not yet written
+    int64_t start;
+    int64_t end;
+    int32_t tid;
+    BufferedWriter* out;
+    const bam_hdr_t* hdr;
+    const uint32_t* coverages;
+    //coverages is a difference array, so the depth needs to be summed up as we go
+    bool no_region;
+    int64_t depth_pos;
+    int64_t depth;
+
+    void grow(size_t needed) {
+        size_t sz = ring.size();
+        while(sz < needed)
+            sz <<= 1;
+        std::vector<PileupCounts> nring(sz, PileupCounts{});
+        for(int64_t p = start; p < end; p++)
+            nring[p & (sz - 1)] = ring[p & mask];
+        ring.swap(nring);
+        mask = sz - 1;
+    }
+
+    inline uint32_t depth_at(int64_t pos) {
+        if(!no_region)
+            return coverages[pos];
+        for(; depth_pos <= pos; depth_pos++)
+            depth += ((const int32_t*) coverages)[depth_pos];
+        return depth;
+    }
+
+public:
+    AltPileup(BufferedWriter* out_, const bam_hdr_t* hdr_, const uint32_t* coverages_ = nullptr, bool no_region_ = true) :
+            ring(PILEUP_RING_SZ, PileupCounts{}),mask(PILEUP_RING_SZ - 1),start(0),end(0),tid(-1),out(out_),hdr(hdr_),
+            coverages(coverages_),no_region(no_region_),depth_pos(0),depth(0) { }
+
+    inline void add(int64_t pos, int col) {
+        if(pos - start >= (int64_t) ring.size())
+            grow(pos - start + 1);
+        ring[pos & mask].n[col]++;
+        if(pos >= end)
+            end = pos + 1;
+    }
+
+    //write out all positions before pos, which has to be the start of the next alignment
+    void flush(int64_t pos) {
+        if(pos < start) {
+            fprintf(stderr, "--pileup requires a coordinate sorted BAM/CRAM, found alignment at %s:%" PRId64 " after %" PRId64 ", exiting\n", hdr->target_name[tid], pos+1, start+1);
+            exit(-1);
+        }
+        //past everything counted so far, the window starts over at pos (the ring is all cleared by the writes below)
+        //rather than growing the ring across the gap
+        const int64_t next = pos;
+        if(pos > end)
+            pos = end;
+        for(int64_t p = start; p < pos; p++) {
+            PileupCounts& pc = ring[p & mask];
+            uint32_t alts = 0;
+            for(int i = 0; i < PILEUP_NUM_COLS; i++)
+                alts |= pc.n[i];
+            if(alts == 0)
+                continue;
+            out->reserve(1024 + strlen(hdr->target_name[tid]));
+            out->put(hdr->target_name[tid]);
+            out->put('\t');
+            out->put_u32(p, '\t');
+            out->put_u32(p + 1, '\t');
+            for(int i = 0; i < PILEUP_NUM_COLS - 1; i++)
+                out->put_u32(pc.n[i], '\t');
+            if(coverages) {
+                out->put_u32(pc.n[PILEUP_NUM_COLS - 1], '\t');
+                uint32_t d = depth_at(p);
+                uint32_t mms = pc.n[PILEUP_A] + pc.n[PILEUP_C] + pc.n[PILEUP_G] + pc.n[PILEUP_T] + pc.n[PILEUP_N];
+                out->put_u32(d, '\t');
+                char af[32];
+                int af_len = sprintf(af, "%.4f\n", d > 0 ? ((double) mms) / d : 0.0);
+                out->put(af, af_len);
+            }
+            else
+                out->put_u32(pc.n[PILEUP_NUM_COLS - 1], '\n');
+            pc = PileupCounts{};
+        }
+        start = pos;
+        if(next >= end)
+            start = end = next;
+    }
+
+    //write out whatever's left for the current chromosome and start on tid_
+    void reset(int32_t tid_) {
+        if(tid != -1)
+            flush(end);
+        tid = tid_;
+        start = end = 0;
+        depth_pos = depth = 0;
+        //a deep pileup on the last chromosome shouldn't hold on to its ring
+        if(ring.size() > PILEUP_RING_SZ) {
+            std::vector<PileupCounts>(PILEUP_RING_SZ, PileupCounts{}).swap(ring);
+            mask = PILEUP_RING_SZ - 1;
+        }
+    }
+};
+
+//count the mismatches (if MD:Z is present) and indels for one alignment into the pileup,
+//skipping any positions which overlap this alignment's mate (already counted from the mate)
+static void pileup_from_cigar(const bam1_t *rec, const uint8_t* mdz, AltPileup* pileup, const std::vector<Coordinate>* overlapping_coords, bool include_n_mms) {
+    const uint8_t *seq = bam_get_seq(rec);
+    const uint32_t *cigar = bam_get_cigar(rec);
+    MdzCursor md(mdz ? mdz : (const uint8_t*) emptystr);
+    size_t seq_off = 0;
+    int32_t ref_off = rec->core.pos;
+    bool check_for_overlaps_flag = overlapping_coords && overlapping_coords->size() > 0;
+    for(uint32_t k = 0; k < rec->core.n_cigar; k++) {
+        int op = bam_cigar_op(cigar[k]);
+        int run = bam_cigar_oplen(cigar[k]);
+        switch(op) {
+            case BAM_CMATCH:
+            case BAM_CDIFF:
+            case BAM_CEQUAL: {
+                int runleft = run;
+                while(runleft > 0 && !md.done()) {
+                    int run_comb = std::min(runleft, md.left());
+                    if(md.op().op == 'X') {
+                        for(int i = 0; i < run_comb; i++) {
+                            int cread = bam_seqi(seq, seq_off + i);
+                            if(!include_n_mms && run_comb == 1 && seq_nt16_str[cread] == 'N')
+                                continue;
+                            if(check_for_overlaps_flag && check_for_overlap(overlapping_coords, 0, ref_off + i))
+                                continue;
+                            pileup->add(ref_off + i, pileup_col(cread));
+                        }
+                    }
+                    runleft -= run_comb;
+                    seq_off += run_comb;
+                    ref_off += run_comb;
+                    md.consume(run_comb);
+                }
+                //no (or exhausted) MD:Z, no mismatches to count
+                seq_off += runleft;
+                ref_off += runleft;
+                break;
+            }
+            case BAM_CINS: {
+                if(!(check_for_overlaps_flag && check_for_overlap(overlapping_coords, 0, ref_off)))
+                    pileup->add(ref_off, PILEUP_INS);
+                seq_off += run;
+                break;
+            }
+            case BAM_CDEL: {
+                if(!(check_for_overlaps_flag && check_for_overlap(overlapping_coords, 0, ref_off)))
+                    pileup->add(ref_off, PILEUP_DEL);
+                if(md.op().op == '^')
+                    md.consume(md.left());
+                ref_off += run;
+                break;
+            }
+            case BAM_CSOFT_CLIP: {
+                seq_off += run;
+                break;
+            }
+            case BAM_CREF_SKIP: {
+                ref_off += run;
+                break;
+            }
+            default: break;
+        }
+    }
+}
+
 static void print_header(const bam_hdr_t * hdr) {
     for(int32_t i = 0; i < hdr->n_targets; i++) {
         std::cout << '@' << i << ','
@@ -822,137 +1513,953 @@ static const long get_longest_target_size(const bam_hdr_t * hdr) {
     return max;
 }
 
-static void reset_array(uint32_t* arr, const long arr_sz) {
-#if USE_SIMD_ZERO
-    #if __AVX2__
-        __m256i zero = _mm256_setzero_si256();
-        static constexpr size_t nper = sizeof(__m256i) / sizeof(uint32_t);
-        const size_t nsimd = arr_sz / nper;
-        const size_t nsimd4 = (nsimd / 4) * 4;
-        size_t i = 0;
-        for(; i < nsimd4; i += 4) {
-            _mm256_storeu_si256((__m256i *)(arr + nper * i), zero);
-            _mm256_storeu_si256((__m256i *)(arr + nper * (i + 1)), zero);
-            _mm256_storeu_si256((__m256i *)(arr + nper * (i + 2)), zero);
-            _mm256_storeu_si256((__m256i *)(arr + nper * (i + 3)), zero);
-        }
-        for(;i < nsimd; ++i) {
-            _mm256_storeu_si256((__m256i *)(arr + nper * i), zero);
-        }
-        for(i *= sizeof(__m256i) / sizeof(uint32_t); i < arr_sz; ++i) {
-            arr[i] = 0;
-        }
-    #elif __SSE2__
-        __m128i zero = _mm_setzero_si128();
-        const size_t nsimd = arr_sz / 4;
-        const size_t nsimd4 = (nsimd / 4) * 4;
-        size_t i = 0;
-        for(; i < nsimd4; i += 4) {
-            _mm_storeu_si128((__m128i *)(arr + 4 * i), zero);
-            _mm_storeu_si128((__m128i *)(arr + 4 * (i + 1)), zero);
-            _mm_storeu_si128((__m128i *)(arr + 4 * (i + 2)), zero);
-            _mm_storeu_si128((__m128i *)(arr + 4 * (i + 3)), zero);
-        }
-        for(;i < nsimd; ++i) {
-            _mm_storeu_si128((__m128i *)(arr + 4 * i), zero);
-        }
-        for(i *= 4; i < arr_sz; ++i) {
-            arr[i] = 0;
-        }
-    #endif
-#else
-    std::memset(arr, 0, sizeof(uint32_t) * arr_sz);
-#endif
+//how many mapped alignments --normalize rpgc looks at for the mean aligned length
+static const uint64_t RPGC_LENGTH_SAMPLE = 1000000;
+
+//# of mapped records (same as samtools idxstats) for --normalize, taken from the index's per chromosome stats
+//when there's an index which has them (BAI/CSI, not CRAI), otherwise counted in a separate pass over the records;
+//with need_length also the mean # of bases an alignment adds to the coverage (M/=/X) over up to RPGC_LENGTH_SAMPLE of them
+static uint64_t count_mapped_reads(const char* bam_fn, int nthreads, bool need_length, double* mean_aligned_bases) {
+    htsFile* fh = hts_open(bam_fn, "r");
+    if(!fh) {
+        fprintf(stderr, "couldn't open %s to count its mapped reads, exiting\n", bam_fn);
+        exit(-1);
+    }
+    //only the flags, chromosome and CIGAR are needed
+    hts_set_opt(fh, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR);
+    hts_set_opt(fh, CRAM_OPT_DECODE_MD, 0);
+    hts_set_threads(fh, nthreads);
+    bam_hdr_t* hdr = sam_hdr_read(fh);
+    uint64_t mapped = 0;
+    bool from_index = false;
+    hts_idx_t* idx = sam_index_load(fh, bam_fn);
+    if(idx) {
+        from_index = true;
+        for(int32_t i = 0; i < hdr->n_targets && from_index; i++) {
+            uint64_t m = 0, u = 0;
+            if(hts_idx_get_stat(idx, i, &m, &u) < 0)
+                from_index = false;
+            mapped += m;
+        }
+        hts_idx_destroy(idx);
+    }
+    if(!from_index)
+        mapped = 0;
+    uint64_t sampled = 0;
+    uint64_t aligned_bases = 0;
+    if(!from_index || need_length) {
+        bam1_t* rec = bam_init1();
+        while(sam_read1(fh, hdr, rec) >= 0) {
+            if((rec->core.flag & BAM_FUNMAP) != 0 || rec->core.tid < 0)
+                continue;
+            if(!from_index)
+                mapped++;
+            if(need_length && sampled < RPGC_LENGTH_SAMPLE) {
+                const uint32_t* cigar = bam_get_cigar(rec);
+                for(uint32_t k = 0; k < rec->core.n_cigar; k++) {
+                    if((bam_cigar_type(bam_cigar_op(cigar[k])) & 3) == 3)
+                        aligned_bases += bam_cigar_oplen(cigar[k]);
+                }
+                sampled++;
+            }
+            else if(from_index)
+                break;
+        }
+        bam_destroy1(rec);
+    }
+    if(mean_aligned_bases)
+        *mean_aligned_bases = sampled > 0 ? (double) aligned_bases / sampled : 0.0;
+    fprintf(stderr, "%" PRIu64 " mapped reads (from the %s)\n", mapped, from_index ? "index" : "records");
+    bam_hdr_destroy(hdr);
+    hts_close(fh);
+    return mapped;
 }
 
-template <typename T2>
-static uint64_t print_array(const char* prefix,
-                        char* chrm,
-                        int32_t tid,
-                        const T2* arr,
-                        const long arr_sz,
-                        const bool skip_zeros,
-                        bigWigFile_t* bwfp,
-                        FILE* cov_fh,
-                        const bool dont_output_coverage = false,
-                        bool no_region=true,
-                        BGZF* gcov_fh = nullptr,
-                        hts_idx_t* cidx = nullptr,
-                        int* chrms_in_cidx = nullptr,
-                        FILE* wcov_fh=nullptr,
-                        BGZF* gwcov_fh=nullptr,
-                        int window_size=0,
-                        Op op = csum) {
+//summary of the coverage over one annotated interval, min is UINT32_MAX for an empty interval
+struct IntervalStats {
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+    uint64_t covered;
+};
 
-    bool first = true;
-    bool first_print = true;
-    uint32_t running_value = 0;
-    uint32_t last_pos = 0;
-    uint64_t auc = 0;
-    //from https://stackoverflow.com/questions/27401388/efficient-gzip-writing-with-gzprintf
-    int chrnamelen = strlen(chrm);
-    int total_line_len = chrnamelen + COORD_STR_LEN;
-    int num_lines_per_buf = round(OUT_BUFF_SZ / total_line_len) - 3;
-    int buf_written = 0;
-    char* buf = nullptr;
-    char* bufptr = nullptr;
-    int (*printPtr) (void* fh, char* buf, uint32_t buf_len) = &my_write;
-    void* cfh = nullptr;
-    if(!bwfp) {
-      buf = new char[OUT_BUFF_SZ];
-      bufptr = buf;
-      cfh = cov_fh;
-      //writing gzip
-      if(!cov_fh) {
-        printPtr = &my_gzwrite;
-        cfh = gcov_fh;
-      }
+//The SIMD kernels for the coverage arrays are built once per x86 ISA level (with target attributes)
+//and the best one the CPU supports is picked at startup, so a baseline x86-64 build (e.g. megadepth_static)
+//still gets the AVX2/AVX-512 versions. MEGADEPTH_SIMD=scalar|sse2|avx2|avx512 forces a level (e.g. for benchmarking).
+struct SimdKernels {
+    const char* name;
+    //adds v to arr[0,n)
+    void (*add)(uint32_t* arr, int n, int32_t v);
+    //adds v to both arr1[0,n) and arr2[0,n)
+    void (*add2)(uint32_t* arr1, uint32_t* arr2, int n, int32_t v);
+    //adds v to arrs[k][offset,offset+n) for each of the narrs arrays, two arrays per sweep
+    void (*addn)(uint32_t* const* arrs, int narrs, long offset, int n, int32_t v);
+    void (*zero)(uint32_t* arr, long n);
+    //index of the first nonzero count in arr at or after i (arr_sz if there isn't one)
+    uint32_t (*next_nonzero)(const uint32_t* arr, uint32_t i, uint32_t arr_sz);
+    //sum, min, max and # of counts >= min_depth of arr[0,n)
+    void (*interval_stats)(const uint32_t* arr, long n, uint32_t min_depth, IntervalStats* stats);
+};
+
+static void add_scalar(uint32_t* arr, int n, int32_t v) {
+    for(int i = 0; i < n; ++i)
+        arr[i] += v;
+}
+
+static void add2_scalar(uint32_t* arr1, uint32_t* arr2, int n, int32_t v) {
+    for(int i = 0; i < n; ++i) {
+        arr1[i] += v; arr2[i] += v;
     }
+}
 
-    //might only want to print windowed coverage
-    bool print_windowed_coverage = window_size > 0 && (gwcov_fh || wcov_fh);
-    void* wcfh = nullptr;
-    if(print_windowed_coverage) {
-      wcfh = wcov_fh; 
-      //this assumes we're never going to have coverage and windowed coverage be different in terms of --gzip
-      if(!wcov_fh) {
-        printPtr = &my_gzwrite;
-        wcfh = gwcov_fh; 
-      }
+static void addn_scalar(uint32_t* const* arrs, int narrs, long offset, int n, int32_t v) {
+    for(int k = 0; k < narrs; ++k) {
+        uint32_t* arr = arrs[k] + offset;
+        for(int i = 0; i < n; ++i)
+            arr[i] += v;
     }
+}
 
+static void zero_scalar(uint32_t* arr, long n) {
+    std::memset(arr, 0, sizeof(uint32_t) * n);
+}
 
-    uint32_t buf_len = 0;
-    int bytes_written = 0;
-    char* startp = new char[32];
-    char* endp = new char[32];
-    char* valuep = new char[32];
-    float running_value_ = 0.0;
-    uint32_t wcounter = 0;
-    int64_t wsum = 0;
-    char* wbuf = new char[1024];
-    int window_bytes_written = -1;
-    uint32_t window_start = 0;
-    //make sure we track this chromosome in whatever index we're building
-    //if we may it this far, means the chromosome had some alignments
+static uint32_t next_nonzero_scalar(const uint32_t* arr, uint32_t i, uint32_t arr_sz) {
+    while(i < arr_sz && arr[i] == 0)
+        i++;
+    return i;
+}
+
+static void interval_stats_scalar(const uint32_t* arr, long n, uint32_t min_depth, IntervalStats* stats) {
+    uint64_t sum = 0;
+    uint64_t covered = 0;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    for(long i = 0; i < n; ++i) {
+        const uint32_t v = arr[i];
+        sum += v;
+        min = v < min ? v : min;
+        max = v > max ? v : max;
+        covered += v >= min_depth;
+    }
+    stats->sum = sum;
+    stats->min = min;
+    stats->max = max;
+    stats->covered = covered;
+}
+
+//folds the vector kernels' per lane results into the scalar tail's already in stats (counts is optional)
+static inline void merge_interval_stats(IntervalStats* stats, const uint64_t* sums, int nsums, const uint32_t* mins, const uint32_t* maxs, const uint32_t* counts, int nlanes) {
+    for(int k = 0; k < nsums; k++)
+        stats->sum += sums[k];
+    for(int k = 0; k < nlanes; k++) {
+        stats->min = mins[k] < stats->min ? mins[k] : stats->min;
+        stats->max = maxs[k] > stats->max ? maxs[k] : stats->max;
+        if(counts)
+            stats->covered += counts[k];
+    }
+}
+
+static const SimdKernels SIMD_SCALAR = { "scalar", add_scalar, add2_scalar, addn_scalar, zero_scalar, next_nonzero_scalar, interval_stats_scalar };
+
+#if SIMD_DISPATCH
+__attribute__((target("sse2"))) static void add_sse2(uint32_t* arr, int n, int32_t v) {
+    const int nper = sizeof(__m128i) / sizeof(uint32_t);
+    const __m128i s1 = _mm_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper)
+        _mm_storeu_si128((__m128i *)(arr + i), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(arr + i))));
+    for(; i < n; ++i)
+        arr[i] += v;
+}
+
+__attribute__((target("sse2"))) static void add2_sse2(uint32_t* arr1, uint32_t* arr2, int n, int32_t v) {
+    const int nper = sizeof(__m128i) / sizeof(uint32_t);
+    const __m128i s1 = _mm_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper) {
+        _mm_storeu_si128((__m128i *)(arr1 + i), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(arr1 + i))));
+        _mm_storeu_si128((__m128i *)(arr2 + i), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(arr2 + i))));
+    }
+    for(; i < n; ++i) {
+        arr1[i] += v; arr2[i] += v;
+    }
+}
+
+__attribute__((target("sse2"))) static void addn_sse2(uint32_t* const* arrs, int narrs, long offset, int n, int32_t v) {
+    int k = 0;
+    for(; k + 2 <= narrs; k += 2)
+        add2_sse2(arrs[k] + offset, arrs[k + 1] + offset, n, v);
+    if(k < narrs)
+        add_sse2(arrs[k] + offset, n, v);
+}
+
+__attribute__((target("sse2"))) static void zero_sse2(uint32_t* arr, long n) {
+    const long nper = sizeof(__m128i) / sizeof(uint32_t);
+    const __m128i zero = _mm_setzero_si128();
+    long i = 0;
+    for(; i + 4 * nper <= n; i += 4 * nper) {
+        _mm_storeu_si128((__m128i *)(arr + i), zero);
+        _mm_storeu_si128((__m128i *)(arr + i + nper), zero);
+        _mm_storeu_si128((__m128i *)(arr + i + 2 * nper), zero);
+        _mm_storeu_si128((__m128i *)(arr + i + 3 * nper), zero);
+    }
+    for(; i + nper <= n; i += nper)
+        _mm_storeu_si128((__m128i *)(arr + i), zero);
+    for(; i < n; ++i)
+        arr[i] = 0;
+}
+
+__attribute__((target("sse2"))) static uint32_t next_nonzero_sse2(const uint32_t* arr, uint32_t i, uint32_t arr_sz) {
+    const uint32_t nper = sizeof(__m128i) / sizeof(uint32_t);
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + nper <= arr_sz; i += nper) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(arr + i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) != 0xFFFF)
+            break;
+    }
+    return next_nonzero_scalar(arr, i, arr_sz);
+}
+
+__attribute__((target("avx2"))) static void interval_stats_avx2(const uint32_t* arr, long n, uint32_t min_depth, IntervalStats* stats) {
+    const long nper = sizeof(__m256i) / sizeof(uint32_t);
+    const __m256i depth = _mm256_set1_epi32(min_depth);
+    __m256i sum = _mm256_setzero_si256();
+    __m256i min = _mm256_set1_epi32(-1);
+    __m256i max = _mm256_setzero_si256();
+    __m256i covered = _mm256_setzero_si256();
+    long i = 0;
+    for(; i + nper <= n; i += nper) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(arr + i));
+        //the sums are widened to 64 bits
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+        min = _mm256_min_epu32(min, v);
+        max = _mm256_max_epu32(max, v);
+        //v >= min_depth (unsigned) iff max(v, min_depth) == v, which sets the lane to -1
+        covered = _mm256_sub_epi32(covered, _mm256_cmpeq_epi32(_mm256_max_epu32(v, depth), v));
+    }
+    uint64_t sums[4];
+    uint32_t mins[8], maxs[8], counts[8];
+    _mm256_storeu_si256((__m256i *)sums, sum);
+    _mm256_storeu_si256((__m256i *)mins, min);
+    _mm256_storeu_si256((__m256i *)maxs, max);
+    _mm256_storeu_si256((__m256i *)counts, covered);
+    interval_stats_scalar(arr + i, n - i, min_depth, stats);
+    merge_interval_stats(stats, sums, 4, mins, maxs, counts, 8);
+}
+
+__attribute__((target("avx2"))) static void add_avx2(uint32_t* arr, int n, int32_t v) {
+    const int nper = sizeof(__m256i) / sizeof(uint32_t);
+    const __m256i s1 = _mm256_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper)
+        _mm256_storeu_si256((__m256i *)(arr + i), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(arr + i))));
+    for(; i < n; ++i)
+        arr[i] += v;
+}
+
+__attribute__((target("avx2"))) static void add2_avx2(uint32_t* arr1, uint32_t* arr2, int n, int32_t v) {
+    const int nper = sizeof(__m256i) / sizeof(uint32_t);
+    const __m256i s1 = _mm256_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper) {
+        _mm256_storeu_si256((__m256i *)(arr1 + i), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(arr1 + i))));
+        _mm256_storeu_si256((__m256i *)(arr2 + i), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(arr2 + i))));
+    }
+    for(; i < n; ++i) {
+        arr1[i] += v; arr2[i] += v;
+    }
+}
+
+__attribute__((target("avx2"))) static void addn_avx2(uint32_t* const* arrs, int narrs, long offset, int n, int32_t v) {
+    int k = 0;
+    for(; k + 2 <= narrs; k += 2)
+        add2_avx2(arrs[k] + offset, arrs[k + 1] + offset, n, v);
+    if(k < narrs)
+        add_avx2(arrs[k] + offset, n, v);
+}
+
+__attribute__((target("avx2"))) static void zero_avx2(uint32_t* arr, long n) {
+    const long nper = sizeof(__m256i) / sizeof(uint32_t);
+    const __m256i zero = _mm256_setzero_si256();
+    long i = 0;
+    for(; i + 4 * nper <= n; i += 4 * nper) {
+        _mm256_storeu_si256((__m256i *)(arr + i), zero);
+        _mm256_storeu_si256((__m256i *)(arr + i + nper), zero);
+        _mm256_storeu_si256((__m256i *)(arr + i + 2 * nper), zero);
+        _mm256_storeu_si256((__m256i *)(arr + i + 3 * nper), zero);
+    }
+    for(; i + nper <= n; i += nper)
+        _mm256_storeu_si256((__m256i *)(arr + i), zero);
+    for(; i < n; ++i)
+        arr[i] = 0;
+}
+
+__attribute__((target("avx2"))) static uint32_t next_nonzero_avx2(const uint32_t* arr, uint32_t i, uint32_t arr_sz) {
+    const uint32_t nper = sizeof(__m256i) / sizeof(uint32_t);
+    for(; i + nper <= arr_sz; i += nper) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(arr + i));
+        if(!_mm256_testz_si256(v, v))
+            break;
+    }
+    return next_nonzero_scalar(arr, i, arr_sz);
+}
+
+__attribute__((target("avx512f"))) static void interval_stats_avx512(const uint32_t* arr, long n, uint32_t min_depth, IntervalStats* stats) {
+    const long nper = sizeof(__m512i) / sizeof(uint32_t);
+    const __m512i depth = _mm512_set1_epi32(min_depth);
+    __m512i sum = _mm512_setzero_si512();
+    __m512i min = _mm512_set1_epi32(-1);
+    __m512i max = _mm512_setzero_si512();
+    uint64_t covered = 0;
+    long i = 0;
+    for(; i + nper <= n; i += nper) {
+        const __m512i v = _mm512_loadu_si512((const __m512i *)(arr + i));
+        sum = _mm512_add_epi64(sum, _mm512_cvtepu32_epi64(_mm512_castsi512_si256(v)));
+        sum = _mm512_add_epi64(sum, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+        min = _mm512_min_epu32(min, v);
+        max = _mm512_max_epu32(max, v);
+        covered += __builtin_popcount(_mm512_cmpge_epu32_mask(v, depth));
+    }
+    uint64_t sums[8];
+    uint32_t mins[16], maxs[16];
+    _mm512_storeu_si512((__m512i *)sums, sum);
+    _mm512_storeu_si512((__m512i *)mins, min);
+    _mm512_storeu_si512((__m512i *)maxs, max);
+    interval_stats_scalar(arr + i, n - i, min_depth, stats);
+    stats->covered += covered;
+    merge_interval_stats(stats, sums, 8, mins, maxs, nullptr, 16);
+}
+
+__attribute__((target("avx512f"))) static void add_avx512(uint32_t* arr, int n, int32_t v) {
+    const int nper = sizeof(__m512i) / sizeof(uint32_t);
+    const __m512i s1 = _mm512_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper)
+        _mm512_storeu_si512((__m512i *)(arr + i), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(arr + i))));
+    for(; i < n; ++i)
+        arr[i] += v;
+}
+
+__attribute__((target("avx512f"))) static void add2_avx512(uint32_t* arr1, uint32_t* arr2, int n, int32_t v) {
+    const int nper = sizeof(__m512i) / sizeof(uint32_t);
+    const __m512i s1 = _mm512_set1_epi32(v);
+    int i = 0;
+    #pragma GCC unroll 4
+    for(; i + nper <= n; i += nper) {
+        _mm512_storeu_si512((__m512i *)(arr1 + i), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(arr1 + i))));
+        _mm512_storeu_si512((__m512i *)(arr2 + i), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(arr2 + i))));
+    }
+    for(; i < n; ++i) {
+        arr1[i] += v; arr2[i] += v;
+    }
+}
+
+__attribute__((target("avx512f"))) static void addn_avx512(uint32_t* const* arrs, int narrs, long offset, int n, int32_t v) {
+    int k = 0;
+    for(; k + 2 <= narrs; k += 2)
+        add2_avx512(arrs[k] + offset, arrs[k + 1] + offset, n, v);
+    if(k < narrs)
+        add_avx512(arrs[k] + offset, n, v);
+}
+
+__attribute__((target("avx512f"))) static void zero_avx512(uint32_t* arr, long n) {
+    const long nper = sizeof(__m512i) / sizeof(uint32_t);
+    const __m512i zero = _mm512_setzero_si512();
+    long i = 0;
+    for(; i + 4 * nper <= n; i += 4 * nper) {
+        _mm512_storeu_si512((__m512i *)(arr + i), zero);
+        _mm512_storeu_si512((__m512i *)(arr + i + nper), zero);
+        _mm512_storeu_si512((__m512i *)(arr + i + 2 * nper), zero);
+        _mm512_storeu_si512((__m512i *)(arr + i + 3 * nper), zero);
+    }
+    for(; i + nper <= n; i += nper)
+        _mm512_storeu_si512((__m512i *)(arr + i), zero);
+    for(; i < n; ++i)
+        arr[i] = 0;
+}
+
+__attribute__((target("avx512f"))) static uint32_t next_nonzero_avx512(const uint32_t* arr, uint32_t i, uint32_t arr_sz) {
+    const uint32_t nper = sizeof(__m512i) / sizeof(uint32_t);
+    for(; i + nper <= arr_sz; i += nper) {
+        __m512i v = _mm512_loadu_si512((const __m512i *)(arr + i));
+        if(_mm512_test_epi32_mask(v, v) != 0)
+            break;
+    }
+    return next_nonzero_scalar(arr, i, arr_sz);
+}
+
+//SSE2 has no unsigned 32 bit min/max, the compiler's SSE2 code for the scalar loop is as good
+static const SimdKernels SIMD_SSE2 = { "sse2", add_sse2, add2_sse2, addn_sse2, zero_sse2, next_nonzero_sse2, interval_stats_scalar };
+static const SimdKernels SIMD_AVX2 = { "avx2", add_avx2, add2_avx2, addn_avx2, zero_avx2, next_nonzero_avx2, interval_stats_avx2 };
+static const SimdKernels SIMD_AVX512 = { "avx512", add_avx512, add2_avx512, addn_avx512, zero_avx512, next_nonzero_avx512, interval_stats_avx512 };
+#endif
+
+//the kernel sets this CPU can run, best first
+static std::vector<const SimdKernels*> supported_simd_kernels() {
+    std::vector<const SimdKernels*> sets;
+#if SIMD_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        sets.push_back(&SIMD_AVX512);
+    if(__builtin_cpu_supports("avx2"))
+        sets.push_back(&SIMD_AVX2);
+    if(__builtin_cpu_supports("sse2"))
+        sets.push_back(&SIMD_SSE2);
+#endif
+    sets.push_back(&SIMD_SCALAR);
+    return sets;
+}
+
+static SimdKernels select_simd_kernels() {
+    std::vector<const SimdKernels*> sets = supported_simd_kernels();
+    const char* forced = getenv("MEGADEPTH_SIMD");
+    if(forced && forced[0] != '\0' && strcmp(forced, "auto") != 0) {
+        for(const SimdKernels* k : sets) {
+            if(strcmp(k->name, forced) == 0)
+                return *k;
+        }
+        fprintf(stderr, "WARNING: MEGADEPTH_SIMD=%s is not supported on this CPU/build, using %s\n", forced, sets[0]->name);
+    }
+    return *sets[0];
+}
+
+//set before main() runs
+static SimdKernels SIMD = select_simd_kernels();
+
+//zeroes arr with explicit vector stores, only used by reset_array if USE_SIMD_ZERO is set
+static inline void reset_array_simd(uint32_t* arr, const long arr_sz) {
+    SIMD.zero(arr, arr_sz);
+}
+
+static void reset_array(uint32_t* arr, const long arr_sz) {
+#if USE_SIMD_ZERO
+    reset_array_simd(arr, arr_sz);
+#else
+    std::memset(arr, 0, sizeof(uint32_t) * arr_sz);
+#endif
+}
+
+//index of the first nonzero count in arr at or after i (arr_sz if there isn't one),
+//checks a whole vector's worth of counts at a time since most positions are 0
+static inline uint32_t next_nonzero(const uint32_t* arr, uint32_t i, const uint32_t arr_sz) {
+    return SIMD.next_nonzero(arr, i, arr_sz);
+}
+
+//number of intervals passed to libBigWig in one call
+static const uint32_t BW_BATCH_SZ = 4096;
+
+//a coverage BigWig value after --bigwig-quantize and --scale-factor/--normalize
+static inline float bigwig_value(double value) {
+    if(!BIGWIG_QUANTA.empty()) {
+        auto it = std::upper_bound(BIGWIG_QUANTA.begin(), BIGWIG_QUANTA.end(), value);
+        value = it == BIGWIG_QUANTA.begin() ? 0.0 : *(it - 1);
+    }
+    return static_cast<float>(value * BIGWIG_SCALE);
+}
+
+//collects one chromosome's intervals so they get added to a BigWig
+//BW_BATCH_SZ at a time rather than with one libBigWig call per interval
+class BigWigWriter {
+    bigWigFile_t* bwfp;
+    char* chrm;
+    bool first;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> ends;
+    std::vector<float> values;
+    //add_coverage's interval waiting to be extended by the next one with the same value
+    bool pending;
+    uint32_t pstart;
+    uint32_t pend;
+    float pvalue;
+    //and its --bigwig-bin bin being summed up, [bin_start,bin_last) so far
+    bool bin_open;
+    uint32_t bin_start;
+    uint32_t bin_last;
+    uint32_t bin_end;
+    uint64_t bin_sum;
+
+    inline void add_merged(const uint32_t start, const uint32_t end, const float value) {
+        if(pending && pend == start && pvalue == value) {
+            pend = end;
+            return;
+        }
+        if(pending)
+            add(pstart, pend, pvalue);
+        pending = true;
+        pstart = start;
+        pend = end;
+        pvalue = value;
+    }
+
+    inline void close_bin() {
+        if(!bin_open)
+            return;
+        add_merged(bin_start, bin_last, bigwig_value((double) bin_sum / (bin_last - bin_start)));
+        bin_open = false;
+    }
+
+public:
+    BigWigWriter(bigWigFile_t* bwfp_, char* chrm_) : bwfp(bwfp_),chrm(chrm_),first(true),pending(false),bin_open(false) {
+        if(bwfp) {
+            starts.reserve(BW_BATCH_SZ);
+            ends.reserve(BW_BATCH_SZ);
+            values.reserve(BW_BATCH_SZ);
+        }
+    }
+    ~BigWigWriter() { finish(); }
+
+    inline void add(uint32_t start, uint32_t end, float value) {
+        starts.push_back(start);
+        ends.push_back(end);
+        values.push_back(value);
+        if(starts.size() == BW_BATCH_SZ)
+            flush();
+    }
+
+    //the coverage is value across [start,end), binned (--bigwig-bin), quantized and scaled,
+    //then merged with the previous interval if that ends up with the same value,
+    //runs need to be passed in order
+    inline void add_coverage(uint32_t start, const uint32_t end, const uint32_t value) {
+        if(BIGWIG_BIN == 0) {
+            add_merged(start, end, bigwig_value(value));
+            return;
+        }
+        while(start < end) {
+            if(bin_open && start >= bin_end)
+                close_bin();
+            if(!bin_open) {
+                bin_open = true;
+                bin_start = start;
+                bin_end = (start / BIGWIG_BIN + 1) * BIGWIG_BIN;
+                bin_sum = 0;
+            }
+            const uint32_t run_end = end < bin_end ? end : bin_end;
+            bin_sum += (uint64_t) (run_end - start) * value;
+            bin_last = run_end;
+            start = run_end;
+            if(start == bin_end)
+                close_bin();
+        }
+    }
+
+    void flush() {
+        uint32_t n = starts.size();
+        if(n == 0)
+            return;
+        uint32_t i = 0;
+        int ret = 0;
+        //only the first call for a chromosome needs its name
+        if(first) {
+            ret = bwAddIntervals(bwfp, &chrm, starts.data(), ends.data(), values.data(), 1);
+            first = false;
+            i = 1;
+        }
+        if(ret == 0 && n > i)
+            ret = bwAppendIntervals(bwfp, starts.data() + i, ends.data() + i, values.data() + i, n - i);
+        if(ret != 0) {
+            fprintf(stderr, "Failed when writing intervals to BigWig for %s, exiting\n", chrm);
+            exit(-1);
+        }
+        starts.clear();
+        ends.clear();
+        values.clear();
+    }
+
+    //writes out whatever add_coverage is still holding on to and the last batch
+    void finish() {
+        close_bin();
+        if(pending) {
+            add(pstart, pend, pvalue);
+            pending = false;
+        }
+        flush();
+    }
+};
+
+//one windowed summary, from --annotation <bp>[,<bp>...] and --op <op>[,<op>...]
+struct WindowSpec {
+    uint32_t size;
+    Op op;
+};
+typedef std::vector<WindowSpec> window_specs;
+
+//summarizes coverage over contiguous windows for every window set (size + op) at once,
+//fed the runs of constant coverage that print_array reconstructs for a chromosome (or region),
+//each window set writes to its own buffered (and when BGZF'd, CSI indexed) output
+class WindowAggregator {
+    struct WindowSet {
+        WindowSpec spec;
+        BufferedWriter* out;
+        //start of the current window, relative to offset
+        uint32_t wstart;
+        uint64_t sum;
+        uint32_t min;
+        uint32_t max;
+        //# of bases >= BREADTH_MIN_DEPTH
+        uint32_t covered;
+    };
+    std::vector<WindowSet> sets;
+    const bam_hdr_t* hdr;
+    //chromosomes which have had windows written, [tid]
+    std::vector<bool> seen;
+    const char* chrm;
+    size_t chrnamelen;
+    int32_t tid;
+    uint32_t offset;
+    uint32_t len;
+
+    void write_window(WindowSet& ws, const uint32_t wend) {
+        BufferedWriter* out = ws.out;
+        out->reserve(chrnamelen + COORD_STR_LEN + 32);
+        out->put(chrm, chrnamelen);
+        out->put('\t');
+        out->put_u32(ws.wstart + offset, '\t');
+        out->put_u32(wend + offset, '\t');
+        char fraction[32];
+        switch(ws.spec.op) {
+            case cmean:
+                out->put(fraction, sprintf(fraction, "%.2f\n", (double) ws.sum / (double) (wend - ws.wstart)));
+                break;
+            case cbreadth:
+                out->put(fraction, sprintf(fraction, "%.4f\n", (double) ws.covered / (double) (wend - ws.wstart)));
+                break;
+            case cmin:
+                out->put_u32(ws.min, '\n');
+                break;
+            case cmax:
+                out->put_u32(ws.max, '\n');
+                break;
+            default:
+                out->put_u64(ws.sum, '\n');
+        }
+        out->end_record(tid, ws.wstart + offset, wend + offset);
+        ws.wstart = wend;
+        ws.sum = 0;
+        ws.min = UINT32_MAX;
+        ws.max = 0;
+        ws.covered = 0;
+    }
+
+public:
+    //a single window set writes to STDOUT (to_stdout) or <prefix>.window.tsv[.gz],
+    //otherwise each one goes to <prefix>.window.<size>.<op>.tsv[.gz]
+    WindowAggregator(const window_specs& specs, const char* prefix, const bam_hdr_t* hdr_, const bool gzip, const bool to_stdout)
+        : hdr(hdr_),seen(hdr_->n_targets, false),chrm(nullptr),chrnamelen(0),tid(-1),offset(0),len(0) {
+        char fn[1024];
+        for(auto const& spec : specs) {
+            WindowSet ws;
+            ws.spec = spec;
+            if(specs.size() == 1)
+                sprintf(fn, "%s.window.tsv%s", prefix, gzip ? ".gz" : "");
+            else
+                sprintf(fn, "%s.window.%u.%s.tsv%s", prefix, spec.size, OP_NAMES[spec.op], gzip ? ".gz" : "");
+            if(to_stdout && specs.size() == 1)
+                ws.out = new BufferedWriter(stdout, hdr);
+            else
+                ws.out = new BufferedWriter(fn, hdr, gzip, gzip);
+            sets.push_back(ws);
+        }
+    }
+
+    //starts the windows over [offset,offset+len) of chromosome tid
+    void begin(const char* chrm_, const int32_t tid_, const uint32_t offset_, const uint32_t len_) {
+        chrm = chrm_;
+        chrnamelen = strlen(chrm);
+        tid = tid_;
+        offset = offset_;
+        len = len_;
+        seen[tid] = true;
+        for(auto& ws : sets) {
+            ws.wstart = 0;
+            ws.sum = 0;
+            ws.min = UINT32_MAX;
+            ws.max = 0;
+            ws.covered = 0;
+        }
+    }
+
+    //coverage is value across [start,end) (relative to offset),
+    //runs need to be passed in order and together cover [0,len)
+    inline void add(const uint32_t start, const uint32_t end, const uint32_t value) {
+        for(auto& ws : sets) {
+            uint32_t pos = start;
+            while(pos < end) {
+                uint32_t wend = len;
+                if(len - ws.wstart > ws.spec.size)
+                    wend = ws.wstart + ws.spec.size;
+                uint32_t run_end = end < wend ? end : wend;
+                ws.sum += (uint64_t) (run_end - pos) * value;
+                if(value < ws.min)
+                    ws.min = value;
+                if(value > ws.max)
+                    ws.max = value;
+                if(value >= BREADTH_MIN_DEPTH)
+                    ws.covered += run_end - pos;
+                pos = run_end;
+                if(pos == wend)
+                    write_window(ws, wend);
+            }
+        }
+    }
+
+    //all 0 windows for every chromosome in the header which didn't get any
+    void add_missing_chromosomes() {
+        for(int32_t i = 0; i < hdr->n_targets; i++) {
+            if(seen[i])
+                continue;
+            begin(hdr->target_name[i], i, 0, hdr->target_len[i]);
+            add(0, hdr->target_len[i], 0);
+        }
+    }
+
+    void close() {
+        for(auto& ws : sets) {
+            ws.out->close();
+            delete ws.out;
+        }
+        sets.clear();
+    }
+};
+
+//--depth-dist and --callable: the depth histogram (per chromosome and genome wide) and the merged intervals
+//at or above each depth threshold, built from the same runs of constant coverage print_array reconstructs
+class DepthSummary {
+    struct Callable {
+        uint32_t min_depth;
+        BufferedWriter* out;
+        //start of the interval at or above min_depth currently open, -1 if none
+        int64_t start;
+    };
+    const bam_hdr_t* hdr;
+    BufferedWriter* dist_out;
+    std::vector<Callable> callables;
+    //# of bases at each depth for the current chromosome and for all of them
+    std::vector<uint64_t> hist;
+    std::vector<uint64_t> total_hist;
+    //chromosomes which have had coverage summarized, [tid]
+    std::vector<bool> seen;
+    const char* chrm;
+    size_t chrnamelen;
+    int32_t tid;
+    uint32_t offset;
+    //end of the last run added, absolute
+    int64_t last_end;
+
+    void write_interval(Callable& c, const int64_t end) {
+        BufferedWriter* out = c.out;
+        out->reserve(chrnamelen + COORD_STR_LEN);
+        out->put(chrm, chrnamelen);
+        out->put('\t');
+        out->put_u32(c.start, '\t');
+        out->put_u32(end, '\n');
+        out->end_record(tid, c.start, end);
+        c.start = -1;
+    }
+
+    //the # of bases at each depth and the fraction of them at or above it, from the highest depth down
+    void write_dist(const char* name, const std::vector<uint64_t>& h) {
+        uint64_t total = 0;
+        for(uint64_t n : h)
+            total += n;
+        if(total == 0)
+            return;
+        const size_t namelen = strlen(name);
+        char fraction[32];
+        uint64_t at_least = 0;
+        for(size_t d = h.size(); d-- > 0; ) {
+            at_least += h[d];
+            dist_out->reserve(namelen + COORD_STR_LEN + 32);
+            dist_out->put(name, namelen);
+            dist_out->put('\t');
+            dist_out->put_u32(d, '\t');
+            dist_out->put_u64(h[d], '\t');
+            dist_out->put(fraction, sprintf(fraction, "%.6f\n", (double) at_least / total));
+        }
+    }
+
+    //closes the open intervals, which only carry on into an adjacent run
+    void close_intervals() {
+        for(auto& c : callables) {
+            if(c.start != -1)
+                write_interval(c, last_end);
+        }
+    }
+
+    //writes out the current chromosome's histogram and adds it to the genome wide one
+    void end_chromosome() {
+        if(tid == -1)
+            return;
+        close_intervals();
+        if(dist_out)
+            write_dist(chrm, hist);
+        if(total_hist.size() < hist.size())
+            total_hist.resize(hist.size(), 0);
+        for(size_t d = 0; d < hist.size(); d++)
+            total_hist[d] += hist[d];
+        hist.clear();
+        tid = -1;
+    }
+
+public:
+    //with dist writes <prefix>.depth.dist.tsv[.gz], a single threshold's intervals go to <prefix>.callable.bed[.gz],
+    //otherwise each one's go to <prefix>.callable.<depth>.bed[.gz]
+    DepthSummary(const bool dist, const std::vector<uint32_t>& thresholds, const char* prefix, const bam_hdr_t* hdr_, const bool gzip)
+        : hdr(hdr_),dist_out(nullptr),seen(hdr_->n_targets, false),chrm(nullptr),chrnamelen(0),tid(-1),offset(0),last_end(0) {
+        char fn[1024];
+        if(dist) {
+            sprintf(fn, "%s.depth.dist.tsv%s", prefix, gzip ? ".gz" : "");
+            dist_out = new BufferedWriter(fn, hdr, gzip);
+        }
+        for(uint32_t min_depth : thresholds) {
+            Callable c;
+            c.min_depth = min_depth;
+            c.start = -1;
+            if(thresholds.size() == 1)
+                sprintf(fn, "%s.callable.bed%s", prefix, gzip ? ".gz" : "");
+            else
+                sprintf(fn, "%s.callable.%u.bed%s", prefix, min_depth, gzip ? ".gz" : "");
+            c.out = new BufferedWriter(fn, hdr, gzip, gzip);
+            callables.push_back(c);
+        }
+    }
+
+    //starts on the part of chromosome tid from offset on, with --region(s) a chromosome can have several of these
+    void begin(const char* chrm_, const int32_t tid_, const uint32_t offset_) {
+        if(tid_ != tid)
+            end_chromosome();
+        else if(offset_ != last_end)
+            close_intervals();
+        chrm = chrm_;
+        chrnamelen = strlen(chrm);
+        tid = tid_;
+        offset = offset_;
+        last_end = offset_;
+        seen[tid] = true;
+    }
+
+    //coverage is value across [start,end) (relative to offset), runs need to be passed in order
+    inline void add(const uint32_t start, const uint32_t end, const uint32_t value) {
+        if(value >= hist.size())
+            hist.resize(value + 1, 0);
+        hist[value] += end - start;
+        for(auto& c : callables) {
+            if(value >= c.min_depth) {
+                if(c.start == -1)
+                    c.start = (int64_t) offset + start;
+            }
+            else if(c.start != -1)
+                write_interval(c, (int64_t) offset + start);
+        }
+        last_end = (int64_t) offset + end;
+    }
+
+    //every chromosome in the header which didn't get any coverage is all depth 0
+    void add_missing_chromosomes() {
+        for(int32_t i = 0; i < hdr->n_targets; i++) {
+            if(seen[i])
+                continue;
+            begin(hdr->target_name[i], i, 0);
+            add(0, hdr->target_len[i], 0);
+        }
+    }
+
+    void close() {
+        end_chromosome();
+        if(dist_out) {
+            write_dist("total", total_hist);
+            dist_out->close();
+            delete dist_out;
+            dist_out = nullptr;
+        }
+        for(auto& c : callables) {
+            c.out->close();
+            delete c.out;
+        }
+        callables.clear();
+    }
+};
+
+template <typename T2>
+static uint64_t print_array(const char* prefix,
+                        char* chrm,
+                        int32_t tid,
+                        const T2* arr,
+                        const long arr_sz,
+                        const bool skip_zeros,
+                        bigWigFile_t* bwfp,
+                        FILE* cov_fh,
+                        const bool dont_output_coverage = false,
+                        bool no_region=true,
+                        BGZF* gcov_fh = nullptr,
+                        hts_idx_t* cidx = nullptr,
+                        int* chrms_in_cidx = nullptr,
+                        WindowAggregator* windows = nullptr,
+                        const uint32_t offset = 0,
+                        DepthSummary* depths = nullptr) {
+    //arr[0] is reference position offset (>0 only for a --region(s) cluster)
+
+    bool first = true;
+    uint32_t running_value = 0;
+    uint32_t last_pos = 0;
+    uint64_t auc = 0;
+    //from https://stackoverflow.com/questions/27401388/efficient-gzip-writing-with-gzprintf
+    int chrnamelen = strlen(chrm);
+    int total_line_len = chrnamelen + COORD_STR_LEN;
+    int num_lines_per_buf = round(OUT_BUFF_SZ / total_line_len) - 3;
+    int buf_written = 0;
+    char* buf = nullptr;
+    char* bufptr = nullptr;
+    int (*printPtr) (void* fh, char* buf, uint32_t buf_len) = &my_write;
+    void* cfh = nullptr;
+    if(!bwfp) {
+      buf = new char[OUT_BUFF_SZ];
+      bufptr = buf;
+      cfh = cov_fh;
+      //writing gzip
+      if(!cov_fh) {
+        printPtr = &my_gzwrite;
+        cfh = gcov_fh;
+      }
+    }
+
+    //window summaries come from the same runs of coverage as the printed intervals
+    if(windows)
+        windows->begin(chrm, tid, offset, arr_sz);
+    if(depths)
+        depths->begin(chrm, tid, offset);
+
+
+    uint32_t buf_len = 0;
+    int bytes_written = 0;
+    char* startp = new char[32];
+    char* endp = new char[32];
+    char* valuep = new char[32];
+    BigWigWriter bww(bwfp, chrm);
+    //make sure we track this chromosome in whatever index we're building
+    //if we may it this far, means the chromosome had some alignments
     if(chrms_in_cidx && chrms_in_cidx[tid+1] == 0)
         chrms_in_cidx[tid+1] = ++chrms_in_cidx[0];
 
     for(uint32_t i = 0; i < arr_sz; i++) {
         if(first || (!no_region && running_value != arr[i]) || (no_region && arr[i] != 0)) {
             if(!first) {
+                if(windows)
+                    windows->add(last_pos, i, running_value);
+                if(depths)
+                    depths->add(last_pos, i, running_value);
                 if(running_value > 0 || !skip_zeros) {
                     //based on wiggletools' AUC calculation
                     auc += (i - last_pos) * ((long) running_value);
                     if(not dont_output_coverage) {
-                        if(bwfp && first_print) {
-                            running_value_ = static_cast<float>(running_value);
-                            bwAddIntervals(bwfp, &chrm, &last_pos, &i, &running_value_, 1);
-                        }
-                        else if(bwfp) {
-                            running_value_ = static_cast<float>(running_value);
-                            bwAppendIntervals(bwfp, &last_pos, &i, &running_value_, 1);
-                        }
+                        if(bwfp)
+                            bww.add_coverage(last_pos + offset, i + offset, running_value);
                         else {
                             memcpy(bufptr, chrm, chrnamelen);
                             char *oldbufptr = bufptr;
@@ -960,10 +2467,10 @@ static uint64_t print_array(const char* prefix,
 
                             *bufptr++='\t';
                             //idea from https://github.com/brentp/mosdepth/releases/tag/v0.2.9
-                            uint32_t digits = u32toa_countlut(last_pos, bufptr, '\t');
+                            uint32_t digits = u32toa_countlut(last_pos + offset, bufptr, '\t');
                             bufptr+=digits+1;
 
-                            digits = u32toa_countlut(i, bufptr, '\t');
+                            digits = u32toa_countlut(i + offset, bufptr, '\t');
                             bufptr+=digits+1;
 
                             digits = u32toa_countlut(running_value, bufptr, '\n');
@@ -972,8 +2479,8 @@ static uint64_t print_array(const char* prefix,
                             bufptr[0]='\0';
                             (*printPtr)(cfh, buf, buf_len);
                             if(cidx) {
-                                if(hts_idx_push(cidx, chrms_in_cidx[tid+1]-1, last_pos, i, bgzf_tell((BGZF*) cfh), 1) < 0) {
-                                    fprintf(stderr,"error writing line in index at coordinates: %s:%u-%u, tid: %d idx tid: %d exiting\n",chrm,last_pos,i, tid, chrms_in_cidx[tid+1]-1);
+                                if(hts_idx_push(cidx, chrms_in_cidx[tid+1]-1, last_pos + offset, i + offset, bgzf_tell((BGZF*) cfh), 1) < 0) {
+                                    fprintf(stderr,"error writing line in index at coordinates: %s:%u-%u, tid: %d idx tid: %d exiting\n",chrm,last_pos + offset,i + offset, tid, chrms_in_cidx[tid+1]-1);
                                     exit(-1);
                                 }
                             }
@@ -982,7 +2489,6 @@ static uint64_t print_array(const char* prefix,
                             buf_written = 0;
                             buf_len = 0;
                         } 
-                        first_print = false;
                     }
                 }
             }
@@ -993,65 +2499,63 @@ static uint64_t print_array(const char* prefix,
                 running_value = arr[i];
             last_pos = i;
         }
-        if(print_windowed_coverage) {
-            if(wcounter == window_size) {
-                if(op == csum)
-                    window_bytes_written = sprintf(wbuf, "%s\t%u\t%u\t%ld\n", chrm, window_start, i, wsum); 
-                else if(op == cmean) {
-                    double wmean = (double)wsum / (double)window_size;
-                    //window_bytes_written = sprintf(wbuf, "%s\t%u\t%u\t%.2f\n", chrm, window_start, i, (round(wmean*100.)/100.)); 
-                    window_bytes_written = sprintf(wbuf, "%s\t%u\t%u\t%.2f\n", chrm, window_start, i, wmean); 
-                    //window_bytes_written = sprintf(wbuf, "%s\t%u\t%u\t%.2f\t%.11f\t%ld\n", chrm, window_start, i, (round(wmean*100.)/100.), wmean, wsum); 
-                }
-
-                (*printPtr)(wcfh, wbuf, window_bytes_written);
-                wsum = 0;
-                wcounter = 0;
-                window_start = i;
-            }
-            wsum += running_value;
-            wcounter++;
-        }
     }
     char last_line[1024];
     if(!first) {
+        if(windows)
+            windows->add(last_pos, arr_sz, running_value);
+        if(depths)
+            depths->add(last_pos, arr_sz, running_value);
         if(running_value > 0 || !skip_zeros) {
             auc += (arr_sz - last_pos) * ((long) running_value);
             if(not dont_output_coverage) {
                 if(bwfp) {
-                    running_value_ = static_cast<float>(running_value);
-                    if(first_print) {
-                        bwAddIntervals(bwfp, &chrm, &last_pos, (uint32_t*) &arr_sz, &running_value_, 1);
-                    } else {
-                        bwAppendIntervals(bwfp, &last_pos, (uint32_t*) &arr_sz, &running_value_, 1);
-                    }
+                    bww.add_coverage(last_pos + offset, arr_sz + offset, running_value);
+                    bww.finish();
                 } else {
                     if(buf_written > 0) 
                         (*printPtr)(cfh, buf, buf_len);
                     // This printing step could also be u32toa_countlut-ified
-                    buf_len = sprintf(last_line, "%s\t%u\t%lu\t%u\n", chrm, last_pos, arr_sz, running_value);
+                    buf_len = sprintf(last_line, "%s\t%u\t%lu\t%u\n", chrm, last_pos + offset, arr_sz + offset, running_value);
                     (*printPtr)(cfh, last_line, buf_len);
                     if(cidx)
-                        if(hts_idx_push(cidx, chrms_in_cidx[tid+1]-1, last_pos, arr_sz, bgzf_tell((BGZF*) cfh), 1) < 0)
-                            fprintf(stderr,"error writing last line of chromosome in index at coordinates: %s:%u-%ld, exiting\n",chrm,last_pos,arr_sz);
+                        if(hts_idx_push(cidx, chrms_in_cidx[tid+1]-1, last_pos + offset, arr_sz + offset, bgzf_tell((BGZF*) cfh), 1) < 0)
+                            fprintf(stderr,"error writing last line of chromosome in index at coordinates: %s:%u-%ld, exiting\n",chrm,last_pos + offset,arr_sz + offset);
                 }
             }
         }
-        if(print_windowed_coverage) {
-            if(op == csum)
-                window_bytes_written = sprintf(wbuf, "%s\t%u\t%lu\t%ld\n", chrm, window_start, arr_sz, wsum); 
-            else if(op == cmean) {
-                window_size = arr_sz - window_start;
-                double wmean = (double)wsum / (double)window_size;
-                window_bytes_written = sprintf(wbuf, "%s\t%u\t%lu\t%.2f\n", chrm, window_start, arr_sz, (round(wmean*100.)/100.)); 
-                //window_bytes_written = sprintf(wbuf, "%s\t%u\t%u\t%.2f\t%.11f\t%ld\t%ld\n", chrm, window_start, arr_sz, (round(wmean*100.)/100.), wmean, wsum, window_size); 
-            }
-            (*printPtr)(wcfh, wbuf, window_bytes_written);
-        }
     }
     return auc;
 }
 
+//sums up (and writes to the BigWig, if any) the coverage of one strand for --stranded,
+//which is never printed as TSV
+static uint64_t print_strand_array(char* chrm, int32_t tid, const uint32_t* arr, const long arr_sz, bigWigFile_t* bwfp, bool no_region) {
+    if(no_region)
+        return print_array("", chrm, tid, (const int32_t*) arr, arr_sz, false, bwfp, stdout, bwfp == nullptr, no_region);
+    return print_array("", chrm, tid, arr, arr_sz, false, bwfp, stdout, bwfp == nullptr, no_region);
+}
+
+//writes out the nonzero per-base counts of read starts or ends for one chromosome
+//either as TSV (1-based position) or as 1 base intervals in a BigWig,
+//arr[0] is reference position offset
+static void print_read_ends(BufferedWriter* out, bigWigFile_t* bwfp, char* chrm, int32_t tid, const uint32_t* arr, const uint32_t arr_sz, const uint32_t offset = 0) {
+    BigWigWriter bww(bwfp, chrm);
+    const size_t chrnamelen = strlen(chrm);
+    for(uint32_t j = next_nonzero(arr, 0, arr_sz); j < arr_sz; j = next_nonzero(arr, j + 1, arr_sz)) {
+        if(bwfp) {
+            bww.add(j + offset, j + 1 + offset, static_cast<float>(arr[j]));
+            continue;
+        }
+        out->reserve(chrnamelen + COORD_STR_LEN);
+        out->put(chrm, chrnamelen);
+        out->put('\t');
+        out->put_u32(j + 1 + offset, '\t');
+        out->put_u32(arr[j], '\n');
+        out->end_record(tid, j + offset, j + 1 + offset);
+    }
+}
+
 //generic function to loop through cigar
 //and for each operation/lenth, call a list of functions to process
 typedef std::vector<void*> args_list;
@@ -1112,64 +2616,6 @@ static void extract_junction(const int op, const int len, args_list* out) {
 
 
 
-static inline void decrement_coverages(uint32_t *coverages, uint32_t *unique_coverages, int start, int ninc, bool no_region=true) {
-    coverages += start;
-    unique_coverages += start;
-    
-    if(no_region) {
-        int32_t* coverages_ = (int32_t*) coverages;
-        int32_t* unique_coverages_ = (int32_t*) unique_coverages;
-
-        coverages_[0]--;
-        coverages_[ninc]++;
-
-        unique_coverages_[0]--;
-        unique_coverages_[ninc]++;
-        return;
-    }
-
-#if __AVX512F__
-    const size_t nper = sizeof(__m512) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __AVX2__
-    const size_t nper = sizeof(__m256) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __SSE2__
-    const size_t nper = sizeof(__m128) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#endif
-
-    int i = 0;
-#if __AVX512F__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm512_set1_epi32(-1);
-        _mm512_storeu_si512((__m512i *)(coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(coverages + i * nper))));
-        _mm512_storeu_si512((__m512i *)(unique_coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#elif __AVX2__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm256_set1_epi32(-1);
-        _mm256_storeu_si256((__m256i *)(coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(coverages + i * nper))));
-        _mm256_storeu_si256((__m256i *)(unique_coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#elif __SSE2__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm_set1_epi32(-1);
-        _mm_storeu_si128((__m128i *)(coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(coverages + i * nper))));
-        _mm_storeu_si128((__m128i *)(unique_coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#endif
-    for(; i < ninc; ++i) {
-        --coverages[i]; --unique_coverages[i];
-    }
-}
-
 static inline void decrement_coverages(uint32_t *coverages, int ninc, bool no_region=true) {
     if(no_region) {
         int32_t* coverages_ = (int32_t*) coverages;
@@ -1177,41 +2623,7 @@ static inline void decrement_coverages(uint32_t *coverages, int ninc, bool no_re
         coverages_[ninc]++;
         return;
     }
-#if __AVX512F__
-    const size_t nper = sizeof(__m512) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __AVX2__
-    const size_t nper = sizeof(__m256) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __SSE2__
-    const size_t nper = sizeof(__m128) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#endif
-
-    int i = 0;
-#if __AVX512F__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm512_set1_epi32(-1);
-        _mm512_storeu_si512((__m512i *)(coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#elif __AVX2__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm256_set1_epi32(-1);
-        _mm256_storeu_si256((__m256i *)(coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#elif __SSE2__
-    #pragma GCC unroll 4
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm_set1_epi32(-1);
-        _mm_storeu_si128((__m128i *)(coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#endif
-    for(; i < ninc; --coverages[i++]);
+    SIMD.add(coverages, ninc, -1);
 }
 
 static inline void increment_coverages(uint32_t *coverages, int ninc, bool no_region=true) {
@@ -1221,103 +2633,42 @@ static inline void increment_coverages(uint32_t *coverages, int ninc, bool no_re
         coverages_[ninc]--;
         return;
     }
-#if __AVX512F__
-    const size_t nper = sizeof(__m512) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __AVX2__
-    const size_t nper = sizeof(__m256) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __SSE2__
-    const size_t nper = sizeof(__m128) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#endif
-
-    int i = 0;
-#if __AVX512F__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm512_set1_epi32(1);
-        _mm512_storeu_si512((__m512i *)(coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#elif __AVX2__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm256_set1_epi32(1);
-        _mm256_storeu_si256((__m256i *)(coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#elif __SSE2__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm_set1_epi32(1);
-        _mm_storeu_si128((__m128i *)(coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(coverages + i * nper))));
-    }
-    i *= nper;
-#endif
-    for(; i < ninc; ++coverages[i++]);
+    SIMD.add(coverages, ninc, 1);
 }
 
-static inline void increment_coverages(uint32_t *coverages, uint32_t *unique_coverages, int start, int ninc, bool no_region=true) {
-    coverages += start;
-    unique_coverages += start;
+//adds v to the same span of narrs arrays at once (the coverage plus any --min-unique-qual tiers
+//and --stranded coverage an alignment counts toward)
+static inline void add_coverages(uint32_t* const* arrs, const int narrs, int start, int ninc, int32_t v, bool no_region=true) {
     if(no_region) {
-        int32_t* coverages_ = (int32_t*) coverages;
-        int32_t* unique_coverages_ = (int32_t*) unique_coverages;
-        coverages_[0]++;
-        coverages_[ninc]--;
-        
-        unique_coverages_[0]++;
-        unique_coverages_[ninc]--;
+        for(int k = 0; k < narrs; k++) {
+            int32_t* arr = (int32_t*) (arrs[k] + start);
+            arr[0] += v;
+            arr[ninc] -= v;
+        }
         return;
     }
-#if __AVX512F__
-    const size_t nper = sizeof(__m512) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __AVX2__
-    const size_t nper = sizeof(__m256) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#elif __SSE2__
-    const size_t nper = sizeof(__m128) / sizeof(int32_t);
-    size_t nsimd = ninc / nper;
-#endif
-
-    int i = 0;
-#if __AVX512F__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm512_set1_epi32(1);
-        _mm512_storeu_si512((__m512i *)(coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(coverages + i * nper))));
-        _mm512_storeu_si512((__m512i *)(unique_coverages + i * nper), _mm512_add_epi32(s1, _mm512_loadu_si512((__m512i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#elif __AVX2__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm256_set1_epi32(1);
-        _mm256_storeu_si256((__m256i *)(coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(coverages + i * nper))));
-        _mm256_storeu_si256((__m256i *)(unique_coverages + i * nper), _mm256_add_epi32(s1, _mm256_loadu_si256((__m256i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#elif __SSE2__
-    for(;i < nsimd; ++i) {
-        auto s1 = _mm_set1_epi32(1);
-        _mm_storeu_si128((__m128i *)(coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(coverages + i * nper))));
-        _mm_storeu_si128((__m128i *)(unique_coverages + i * nper), _mm_add_epi32(s1, _mm_loadu_si128((__m128i *)(unique_coverages + i * nper))));
-    }
-    i *= nper;
-#endif
-    for(; i < ninc; ++i) {
-        ++coverages[i]; ++unique_coverages[i];
-    }
+    if(narrs == 2)
+        SIMD.add2(arrs[0] + start, arrs[1] + start, ninc, v);
+    else
+        SIMD.addn(arrs, narrs, start, ninc, v);
 }
 
 static uint64_t num_overlapping_pairs = 0;
 //static uint32_t num_opairs[10024];
 
 struct MateInfo {
-    bool passing_qual;
+    //the --min-unique-qual tiers this mate counted toward
+    uint32_t passing_tiers;
     std::string qname;
     //char* qname;
     int32_t mrefpos;
     uint32_t n_cigar;
     uint32_t* cigar;
     bool erased;
+    //the --stranded coverage this mate was added to (nullptr if none)
+    uint32_t* strand_coverages;
+    //whether this mate's spans went to a --split-by group
+    bool grouped;
 };
 
 
@@ -1326,12 +2677,39 @@ struct MateInfo {
 //typedef hashmap<uint32_t, uint32_t*> read2len;
 typedef hashmap<uint32_t, std::vector<MateInfo*>*> read2len;
 typedef hashmap<std::string, std::vector<Coordinate>> read2overlaps;
-static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
-                                        uint32_t* unique_coverages, const bool double_count,
-                                        const int min_qual, read2len* overlapping_mates,
+
+//compile-time switches for calculate_coverage_<>(), each one stands in for a runtime check:
+//CC_COVERAGE: coverages != nullptr, CC_UNIQUE: tier_coverages != nullptr,
+//CC_NO_REGION: no_region (difference arrays), CC_OVERLAP_COORDS: overlap_coords != nullptr
+//CC_STRANDED: strand_coverages != nullptr
+static const int CC_COVERAGE = 1;
+static const int CC_UNIQUE = 2;
+static const int CC_NO_REGION = 4;
+static const int CC_OVERLAP_COORDS = 8;
+static const int CC_STRANDED = 16;
+
+//coverages[0] (and tier_coverages[k][0]) hold reference position coord_offset,
+//which is only non-0 for the region-sized buffers used with --region(s)
+//tiers_passed is the bitmask of the --min-unique-qual tier_coverages this alignment also adds to,
+//strand_coverages is the plus or minus strand coverage (--stranded) it adds to,
+//spans (--split-by) gets the (absolute start, length) of each segment added to the coverage
+//and (start, -length) of each mate overlap taken back out of it, for the alignment's group
+template <int CF>
+static const int32_t calculate_coverage_(const bam1_t *rec, uint32_t* coverages,
+                                        uint32_t* const* tier_coverages, const bool double_count,
+                                        const uint32_t tiers_passed, read2len* overlapping_mates,
                                         int32_t* total_intron_length, 
                                         read2overlaps* overlap_coords,
-                                        bool no_region=true) {
+                                        const int32_t coord_offset = 0,
+                                        uint32_t* strand_coverages = nullptr,
+                                        std::vector<int32_t>* spans = nullptr) {
+    const bool no_region = (CF & CC_NO_REGION) != 0;
+    const bool track_overlaps = (CF & CC_OVERLAP_COORDS) != 0;
+    const bool stranded = (CF & CC_STRANDED) != 0;
+    //only take the overlap out of this mate's strand coverage if the other mate was also added to one
+    bool mate_stranded = false;
+    //same for the --split-by group spans
+    bool mate_grouped = false;
     int32_t refpos = rec->core.pos;
     int32_t mrefpos = rec->core.mpos;
     int32_t refpos_to_hash = mrefpos;
@@ -1341,8 +2719,8 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
     int k, z;
     //check for overlapping mate and corect double counting if exists
     char* qname = bam_get_qname(rec);
-    bool unique = min_qual > 0;
-    bool passing_qual = rec->core.qual >= min_qual;
+    const bool unique = (CF & CC_UNIQUE) != 0;
+    const uint32_t passing = unique ? tiers_passed : 0;
     //fix paired mate overlap double counting
     //fix overlapping mate pair, only if 1) 2nd mate and
     //2) we're either not unique, or we're higher than the required quality
@@ -1353,7 +2731,7 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
     int mspans_idx = 0;
     int mspans_which_overlap_idx = 0;
     read2overlaps::iterator overlapping_coords_it;
-    if(overlap_coords)
+    if(track_overlaps)
         overlapping_coords_it = overlap_coords->begin();
     const std::string tn(qname);
     int32_t end_pos = bam_endpos(rec);
@@ -1363,7 +2741,7 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
     //we're avoiding double counting and we're a proper pair
     //and we overlap with our mate, then store our cigar + length
     //for the later mate to adjust its coverage appropriately
-    if(coverages && !double_count && (rec->core.flag & BAM_FPROPER_PAIR) == 2) {
+    if((CF & CC_COVERAGE) && !double_count && (rec->core.flag & BAM_FPROPER_PAIR) == 2) {
         bool possible_overlap = rec->core.tid == rec->core.mtid && end_pos > mrefpos;
         bool first_mate_w_overlap = possible_overlap && refpos <= mrefpos;
         bool second_mate = possible_overlap && refpos >= mrefpos;
@@ -1398,13 +2776,15 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                 const uint32_t* mcigar = bam_get_cigar(rec);
                 uint32_t n_cigar = rec->core.n_cigar;
                 mate_info = new MateInfo;
-                mate_info->passing_qual = unique && passing_qual;
+                mate_info->passing_tiers = passing;
                 mate_info->qname = tn;
                 mate_info->mrefpos = refpos;
                 mate_info->n_cigar = n_cigar;
                 mate_info->cigar = new uint32_t[n_cigar];
                 std::memcpy(mate_info->cigar, mcigar, 4*n_cigar);
                 mate_info->erased = false;
+                mate_info->strand_coverages = stranded ? strand_coverages : nullptr;
+                mate_info->grouped = spans != nullptr;
                 //if we didn't find a previous vector, create one
                 if(!potential_mate_found) {
                     mate_vec = new std::vector<MateInfo*>;
@@ -1416,10 +2796,13 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
             //-------Second Mate Check
             else if(second_mate && mate_info) {
                 //setup for tracking actual overlapping segments for alt base output
-                if(overlap_coords)
+                if(track_overlaps)
                     overlapping_coords_it = overlap_coords->emplace(tn, std::vector<Coordinate>()).first;
                 uint32_t mn_cigar = mate_info->n_cigar;
-                mate_passes_quality = mate_info->passing_qual;
+                //only the tiers both mates counted toward have the overlap counted twice
+                mate_passes_quality = mate_info->passing_tiers & passing;
+                mate_stranded = stranded && mate_info->strand_coverages != nullptr;
+                mate_grouped = spans && mate_info->grouped;
                 uint32_t* mcigar = mate_info->cigar;
                 int32_t real_mate_pos = mate_info->mrefpos;
                 int32_t malgn_end_pos = real_mate_pos;
@@ -1458,7 +2841,24 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
         }
     }
     mspans_idx = 0;
-    if(unique && passing_qual) {
+    if(passing) {
+        //the arrays this alignment adds to, and the ones its overlap with its mate comes back out of
+        uint32_t* arrs[MAX_COVERAGE_TIERS + 2];
+        uint32_t* overlap_arrs[MAX_COVERAGE_TIERS + 2];
+        int narrs = 0;
+        int noverlap_arrs = 0;
+        arrs[narrs++] = coverages;
+        overlap_arrs[noverlap_arrs++] = coverages;
+        for(int t = 0; (passing >> t) != 0; t++) {
+            if(passing & (1 << t))
+                arrs[narrs++] = tier_coverages[t];
+            if(mate_passes_quality & (1 << t))
+                overlap_arrs[noverlap_arrs++] = tier_coverages[t];
+        }
+        if(stranded)
+            arrs[narrs++] = strand_coverages;
+        if(mate_stranded)
+            overlap_arrs[noverlap_arrs++] = strand_coverages;
         int32_t lastref = 0;
         for (k = 0; k < rec->core.n_cigar; ++k) {
             const int cigar_op = bam_cigar_op(cigar[k]);
@@ -1468,8 +2868,12 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                 if(cigar_op == BAM_CREF_SKIP)
                     (*total_intron_length) = (*total_intron_length) + len;
                 //are we calc coverages && do we consume query?
-                if(coverages && bam_cigar_type(cigar_op)&1) {
-                    increment_coverages(coverages, unique_coverages, algn_end_pos, len, no_region);
+                if((CF & CC_COVERAGE) && bam_cigar_type(cigar_op)&1) {
+                    add_coverages(arrs, narrs, algn_end_pos - coord_offset, len, 1, no_region);
+                    if(spans) {
+                        spans->push_back(algn_end_pos);
+                        spans->push_back(len);
+                    }
                     //now fixup overlapping segment but only if mate passed quality
                     if(n_mspans > 0 && algn_end_pos < mendpos) {
                         //loop until we find the next overlapping span
@@ -1497,8 +2901,12 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                             else {
                                 next_left_end = mspans[mspans_idx * 2 + 1];
                             }
-                            decrement_coverages(coverages + left_end, right_end - left_end, no_region);
-                            if(overlap_coords) {
+                            add_coverages(overlap_arrs, noverlap_arrs, left_end - coord_offset, right_end - left_end, -1, no_region);
+                            if(mate_grouped) {
+                                spans->push_back(left_end);
+                                spans->push_back(left_end - right_end);
+                            }
+                            if(track_overlaps) {
                                 int32_t ostart = left_end;
                                 int32_t oend = (ostart + (right_end - left_end)) - 1;
                                 Coordinate coord;
@@ -1510,8 +2918,6 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                                 //mspans_which_overlap[mspans_which_overlap_idx * 2 + 1] = (ostart + (right_end - left_end)) - 1;
                                 //mspans_which_overlap_idx++;
                             }
-                            if(mate_passes_quality)
-                                decrement_coverages(unique_coverages + left_end, right_end - left_end, no_region);
                             left_end = next_left_end;
                         }
                     }
@@ -1528,8 +2934,14 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                 if(cigar_op == BAM_CREF_SKIP)
                     (*total_intron_length) = (*total_intron_length) + len;
                 //are we calc coverages && do we consume query?
-                if(coverages && bam_cigar_type(cigar_op)&1) {
-                    increment_coverages(&coverages[algn_end_pos], len, no_region);
+                if((CF & CC_COVERAGE) && bam_cigar_type(cigar_op)&1) {
+                    increment_coverages(&coverages[algn_end_pos - coord_offset], len, no_region);
+                    if(stranded)
+                        increment_coverages(&strand_coverages[algn_end_pos - coord_offset], len, no_region);
+                    if(spans) {
+                        spans->push_back(algn_end_pos);
+                        spans->push_back(len);
+                    }
                     //now fixup overlapping segment
                     if(n_mspans > 0 && algn_end_pos < mendpos) {
                         //loop until we find the next overlapping span
@@ -1558,7 +2970,13 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
                             else {
                                 next_left_end = mspans[mspans_idx * 2 + 1];
                             }
-                            decrement_coverages(&coverages[left_end], right_end - left_end, no_region);
+                            decrement_coverages(&coverages[left_end - coord_offset], right_end - left_end, no_region);
+                            if(mate_stranded)
+                                decrement_coverages(&strand_coverages[left_end - coord_offset], right_end - left_end, no_region);
+                            if(mate_grouped) {
+                                spans->push_back(left_end);
+                                spans->push_back(left_end - right_end);
+                            }
                             left_end = next_left_end;
                         }
                     }
@@ -1570,6 +2988,49 @@ static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
     return algn_end_pos;
 }
 
+static const int32_t calculate_coverage(const bam1_t *rec, uint32_t* coverages,
+                                        uint32_t* const* tier_coverages, const bool double_count,
+                                        const uint32_t tiers_passed, read2len* overlapping_mates,
+                                        int32_t* total_intron_length, 
+                                        read2overlaps* overlap_coords,
+                                        bool no_region=true,
+                                        const int32_t coord_offset = 0,
+                                        uint32_t* strand_coverages = nullptr,
+                                        std::vector<int32_t>* spans = nullptr) {
+    const int cf = (coverages ? CC_COVERAGE : 0) | (tier_coverages ? CC_UNIQUE : 0)
+                    | (no_region ? CC_NO_REGION : 0) | (overlap_coords ? CC_OVERLAP_COORDS : 0)
+                    | (coverages && strand_coverages ? CC_STRANDED : 0);
+    switch(cf) {
+#define CALCULATE_COVERAGE_CASE(n) case n: return calculate_coverage_<n>(rec, coverages, tier_coverages, double_count, tiers_passed, overlapping_mates, total_intron_length, overlap_coords, coord_offset, strand_coverages, spans);
+        CALCULATE_COVERAGE_CASE(0) CALCULATE_COVERAGE_CASE(1) CALCULATE_COVERAGE_CASE(2) CALCULATE_COVERAGE_CASE(3)
+        CALCULATE_COVERAGE_CASE(4) CALCULATE_COVERAGE_CASE(5) CALCULATE_COVERAGE_CASE(6) CALCULATE_COVERAGE_CASE(7)
+        CALCULATE_COVERAGE_CASE(8) CALCULATE_COVERAGE_CASE(9) CALCULATE_COVERAGE_CASE(10) CALCULATE_COVERAGE_CASE(11)
+        CALCULATE_COVERAGE_CASE(12) CALCULATE_COVERAGE_CASE(13) CALCULATE_COVERAGE_CASE(14) CALCULATE_COVERAGE_CASE(15)
+        //with --stranded
+        CALCULATE_COVERAGE_CASE(17) CALCULATE_COVERAGE_CASE(19) CALCULATE_COVERAGE_CASE(21) CALCULATE_COVERAGE_CASE(23)
+        CALCULATE_COVERAGE_CASE(25) CALCULATE_COVERAGE_CASE(27) CALCULATE_COVERAGE_CASE(29) CALCULATE_COVERAGE_CASE(31)
+#undef CALCULATE_COVERAGE_CASE
+    }
+    return -1;
+}
+
+//transcript strand of an alignment for --stranded: 0 for plus, 1 for minus, -1 if it can't be told
+static inline int transcript_strand(const bam1_t *rec, const int library) {
+    if(library == STRAND_XS) {
+        uint8_t* xs = bam_aux_get(rec, "XS");
+        if(!xs)
+            return -1;
+        char strand = bam_aux2A(xs);
+        return strand == '+' ? 0 : (strand == '-' ? 1 : -1);
+    }
+    bool reverse = (rec->core.flag & BAM_FREVERSE) != 0;
+    //for fr-firststrand read 1 (or a single end read) is antisense to the transcript, read 2 is sense
+    bool antisense = (rec->core.flag & BAM_FREAD2) == 0;
+    if(library == STRAND_FR_SECOND)
+        antisense = !antisense;
+    return reverse != antisense ? 1 : 0;
+}
+
 template <typename T>
 using annotation_map_t = hashmap<std::string, std::vector<T*>>;
 typedef std::vector<char*> strlist;
@@ -1596,7 +3057,8 @@ static const int process_region_line(char* line, const char* delim, annotation_m
         tok = strtok(nullptr, delim);
     }
     //if we need to keep the order, then we'll store values here
-    const int alen = keep_order?4:2;
+    //start, end, then the values for all alignments, each --min-unique-qual tier and each strand
+    const int alen = keep_order?annotation_vals_idx(1 + COVERAGE_TIERS.size() + (LIBRARY_STRAND != STRAND_NONE ? 2 : 0)):2;
     T* coords = new T[alen];
     coords[0] = start;
     coords[1] = end;
@@ -1634,36 +3096,43 @@ static const int read_annotation(FILE* fin, annotation_map_t<T>* amap, strlist*
 
 typedef hashmap<std::string, int> str2op;
 
+//computes ANNOTATION_OPS over each annotated interval from one (vectorized) sweep of its coverage,
+//either printing them or storing them starting at keep_order_idx in the interval's array
 template <typename T>
-static void sum_annotations(const uint32_t* coverages, const std::vector<T*>& annotations, const long chr_size, const char* chrm, FILE* ofp, uint64_t* annotated_auc, Op op, bool just_auc = false, int keep_order_idx = -1) {
-    unsigned long z, j;
-    int (*printPtr) (char* buf, const char*, long, long, T, double*, long) = &print_shared;
+static void sum_annotations(const uint32_t* coverages, const std::vector<T*>& annotations, const long chr_size, const char* chrm, FILE* ofp, uint64_t* annotated_auc, bool just_auc = false, int keep_order_idx = -1) {
     int (*outputFunc)(void* fh, char* buf, uint32_t buf_len) = &my_write;
-    if(SUMS_ONLY)
-        printPtr = &print_shared_sums_only;
+    const size_t num_stats = ANNOTATION_OPS.size();
+    T* vals = new T[num_stats];
     char* buf = new char[1024];
-    for(z = 0; z < annotations.size(); z++) {
-        T sum = 0;
+    IntervalStats stats;
+    for(unsigned long z = 0; z < annotations.size(); z++) {
         T start = annotations[z][0];
         T end = annotations[z][1];
-        T local_sum = 0;
-        for(j = start; j < end; j++) {
-            assert(j < chr_size);
-            local_sum += coverages[j];
-        }
-        sum += local_sum;
-        (*annotated_auc) = (*annotated_auc) + sum;
-        if(!just_auc) {
-            if(op == cmean) 
-                sum = (double)local_sum / ((double)(end-start));
-            if(keep_order_idx == -1) {
-                int buf_len = (*printPtr)(buf, chrm, (long) start, (long) end, sum, nullptr, 0);
-                (*outputFunc)(ofp, buf, buf_len);
+        assert(end <= chr_size);
+        SIMD.interval_stats(coverages + (long) start, (long) (end - start), BREADTH_MIN_DEPTH, &stats);
+        (*annotated_auc) = (*annotated_auc) + stats.sum;
+        if(just_auc)
+            continue;
+        T* out = vals;
+        if(keep_order_idx != -1)
+            out = annotations[z] + keep_order_idx;
+        const double len = (double) (end - start);
+        for(size_t k = 0; k < num_stats; k++) {
+            switch(ANNOTATION_OPS[k]) {
+                case cmean: out[k] = (double) stats.sum / len; break;
+                case cmin: out[k] = end > start ? stats.min : 0; break;
+                case cmax: out[k] = stats.max; break;
+                case cbreadth: out[k] = (double) stats.covered / len; break;
+                default: out[k] = stats.sum;
             }
-            else
-                annotations[z][keep_order_idx] = sum;
+        }
+        if(keep_order_idx == -1) {
+            int buf_len = print_annotation_stats(buf, chrm, (long) start, (long) end, vals);
+            (*outputFunc)(ofp, buf, buf_len);
         }
     }
+    delete[] vals;
+    delete[] buf;
 }
 
 
@@ -1679,6 +3148,7 @@ static bigWigFile_t* create_bigwig_file(const bam_hdr_t *hdr, const char* out_fn
         fprintf(stderr, "Failed when attempting to open BigWig file %s for writing\n", fn);
         exit(-1);
     }
+    OUTPUT_FILES.add(fn);
     //create with up to 10 zoom levels (though probably less in practice)
     bwCreateHdr(bwfp, 10);
     bwfp->cl = bwCreateChromList(hdr->target_name, hdr->target_len, hdr->n_targets);
@@ -1790,6 +3260,105 @@ static int process_bigwig_for_total_auc(const char* fn, double* all_auc, FILE* e
 }
 
 
+//sum (or mean/min/max) the BigWig intervals of one chromosome over each of its annotated intervals
+//these are either printed to afp or, if keeping the BED's order, stored in local_vals (if passed in) or the annotation itself
+template <typename T>
+static void sum_bigwig_intervals(const bwOverlappingIntervals_t* intervals, std::vector<T*>& annotations, const char* chrm, double* annotated_auc, FILE* afp, int keep_order_idx, Op op, double* local_vals, char* buf) {
+    int (*printPtr) (char* buf, const char*, long, long, T, double*, long) = &print_shared;
+    int (*outputFunc)(void* fh, char* buf, uint32_t buf_len) = &my_write;
+    if(SUMS_ONLY)
+        printPtr = &print_shared_sums_only;
+    uint32_t num_intervals = intervals->l;
+    uint32_t istart = intervals->start[0];
+    uint32_t iend = intervals->end[num_intervals-1];
+    long z, j, k;
+    long last_j = 0;
+    long asz = annotations.size();
+    //loop through annotation intervals as outer loop
+    for(z = 0; z < asz; z++) {
+        const auto &az = annotations[z];
+        double sum = 0;
+        double min = MAX_INT;
+        double max = 0;
+        T start = az[0];
+        T ostart = start;
+        T end = az[1];
+        //find the first BW interval starting *before* our annotation interval
+        //this is if we have overlapping/out-of-order intervals in the annotation
+        while(start < intervals->start[last_j])
+            last_j--;
+        for(j = last_j; j < num_intervals; j++)
+        {
+            istart = intervals->start[j];
+            iend = intervals->end[j];
+            //is our start overlapping?
+            if(start >= istart && start < iend)
+            {
+                long last_k = end > iend ? iend : end;
+                //stat mode
+                //avoid having if's in the inner loops as much as possible
+                switch(op) {
+                    case csum:
+                    case cmean:
+                        for(k = start; k < last_k; k++)
+                            sum += intervals->value[j];
+                        break;
+                    case cmin:
+                        for(k = start; k < last_k; k++)
+                            min = intervals->value[j] < min ? intervals->value[j]:min;
+                        break;
+                    case cmax:
+                        for(k = start; k < last_k; k++)
+                            max = intervals->value[j] > max ? intervals->value[j]:max;
+                        break;
+                    //BigWigs don't have the base level coverage for this, main() already refuses it
+                    case cbreadth:
+                        fprintf(stderr, "--op breadth is only supported for BAM/CRAM files, exiting\n");
+                        exit(-1);
+                }
+
+                //move start up
+                if(k < end)
+                    start = k;
+                //break out if we've hit the end of this annotation interval
+                if(k >= end)
+                    break;
+            }
+        }
+        last_j = j;
+        if(op == csum)
+            (*annotated_auc) += sum;
+        //0-based start
+        double annot_length = end - ostart;
+        T value = sum;
+        switch(op) {
+            case cmean:
+                value = (double)sum / (double)annot_length;
+                break;
+            case cmin:
+                value = min;
+                break;
+            case cmax:
+                value = max;
+                break;
+            //not reached, see above
+            case cbreadth:
+                fprintf(stderr, "--op breadth is only supported for BAM/CRAM files, exiting\n");
+                exit(-1);
+            case csum:; // do nothing
+        }
+        //not trying to keep the order in the BED file, just print them as we find them
+        if(keep_order_idx == -1) {
+            int buf_len = (*printPtr)(buf, chrm, (long) ostart, (long) end, value, nullptr, 0);
+            (*outputFunc)(afp, buf, buf_len);
+        }
+        else if(local_vals)
+            local_vals[z] = value;
+        else
+            az[keep_order_idx] = value;
+    }
+}
+
 using chr2bool = hashset<std::string>;
 template <typename T>
 static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_t<T>* amap, chr2bool* annotation_chrs_seen, FILE* afp, int keep_order_idx = -1, Op op = csum, FILE* errfp = stderr, str2dblist* store_local=nullptr) {
@@ -1803,10 +3372,6 @@ static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_
         fprintf(errfp, "Error in opening %s as BigWig file, exiting\n", fn);
         return -1;
     }
-    int (*printPtr) (char* buf, const char*, long, long, T, double*, long) = &print_shared;
-    int (*outputFunc)(void* fh, char* buf, uint32_t buf_len) = &my_write;
-    if(SUMS_ONLY)
-        printPtr = &print_shared_sums_only;
     char* buf = new char[1024];
     uint32_t tid, blocksPerIteration;
     //ask for huge # of blocks per chromosome to ensure we get all in one go
@@ -1838,13 +3403,9 @@ static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_
                 for(unsigned int i = 0; i < intervals_seen.size(); i++)
                     intervals_seen[i] = false;
             }
-            uint32_t istart = iter->intervals->start[0];
-            uint32_t iend = iter->intervals->end[num_intervals-1];
             std::vector<T*>& annotations = amap->operator[](fp->cl->chrom[tid]);
-            long z, j, k;
-            long last_j = 0;
             long asz = annotations.size();
-            double* local_vals;
+            double* local_vals = nullptr;
             //if running in multithreaded mode, want to store the values locally
             //but also don't want to reallocate for every new bigwig file, so
             //we allocate once per thread per chromosome
@@ -1855,81 +3416,7 @@ static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_
                     local_vals = (*store_local)[fp->cl->chrom[tid]];
                 std::fill(local_vals, local_vals + asz, 0.);
             }
-            //loop through annotation intervals as outer loop
-            for(z = 0; z < asz; z++) {
-                const auto &az = annotations[z];
-                double sum = 0;
-                double min = MAX_INT;
-                double max = 0;
-                T start = az[0];
-                T ostart = start;
-                T end = az[1];
-                //find the first BW interval starting *before* our annotation interval
-                //this is if we have overlapping/out-of-order intervals in the annotation
-                while(start < iter->intervals->start[last_j])
-                    last_j--;
-                for(j = last_j; j < num_intervals; j++)
-                {
-                    istart = iter->intervals->start[j];
-                    iend = iter->intervals->end[j];
-                    //is our start overlapping?
-                    if(start >= istart && start < iend)
-                    {
-                        long last_k = end > iend ? iend : end;
-                        //stat mode
-                        //avoid having if's in the inner loops as much as possible
-                        switch(op) {
-                            case csum:
-                            case cmean:
-                                for(k = start; k < last_k; k++)
-                                    sum += iter->intervals->value[j];
-                                break;
-                            case cmin:
-                                for(k = start; k < last_k; k++)
-                                    min = iter->intervals->value[j] < min ? iter->intervals->value[j]:min;
-                                break;
-                            case cmax:
-                                for(k = start; k < last_k; k++)
-                                    max = iter->intervals->value[j] > max ? iter->intervals->value[j]:max;
-                                break;
-                        }
-
-                        //move start up
-                        if(k < end)
-                            start = k;
-                        //break out if we've hit the end of this annotation interval
-                        if(k >= end)
-                            break;
-                    }
-                }
-                last_j = j;
-                if(op == csum)
-                    (*annotated_auc) += sum;
-                //0-based start
-                double annot_length = end - ostart;
-                T value = sum;
-                switch(op) {
-                    case cmean:
-                        value = (double)sum / (double)annot_length;
-                        break;
-                    case cmin:
-                        value = min;
-                        break;
-                    case cmax:
-                        value = max;
-                        break;
-                    case csum:; // do nothing
-                }
-                //not trying to keep the order in the BED file, just print them as we find them
-                if(keep_order_idx == -1) {
-                    int buf_len = (*printPtr)(buf, fp->cl->chrom[tid], (long) ostart, (long) end, value, nullptr, 0);
-                    (*outputFunc)(afp, buf, buf_len);
-                }
-                else if(store_local)
-                    local_vals[z] = value;
-                else
-                    az[keep_order_idx] = value;
-            }
+            sum_bigwig_intervals(iter->intervals, annotations, fp->cl->chrom[tid], annotated_auc, afp, keep_order_idx, op, local_vals, buf);
             annotation_chrs_seen->insert(fp->cl->chrom[tid]);
             if(store_local)
                 (*store_local)[fp->cl->chrom[tid]] = local_vals;
@@ -1944,9 +3431,11 @@ static int process_bigwig(const char* fn, double* annotated_auc, annotation_map_
 
 
 template <typename T>
-static void output_missing_annotations(const annotation_map_t<T>* annotations, const chr2bool* annotations_seen, FILE* ofp, Op op = csum) {
+static void output_missing_annotations(const annotation_map_t<T>* annotations, const chr2bool* annotations_seen, FILE* ofp, Op op = csum, bool all_stats = false) {
     //check if we're doing means output doubles, otherwise output longs
     T val = 0;
+    //all_stats (BAM/CRAM) has a column per ANNOTATION_OPS
+    std::vector<T> vals(ANNOTATION_OPS.size(), 0);
     int (*printPtr) (char* buf, const char*, long, long, T, double*, long) = &print_shared;
     int (*outputFunc)(void* fh, char* buf, uint32_t buf_len) = &my_write;
     if(SUMS_ONLY)
@@ -1957,15 +3446,20 @@ static void output_missing_annotations(const annotation_map_t<T>* annotations, c
             const auto &ants = kv.second;
             for(unsigned long z = 0; z < kv.second.size(); z++) {
                 const auto p = ants[z];
-                int buf_len = (*printPtr)(buf, kv.first.c_str(), p[0], p[1], val, nullptr, z);
+                int buf_len = 0;
+                if(all_stats)
+                    buf_len = print_annotation_stats(buf, kv.first.c_str(), p[0], p[1], vals.data());
+                else
+                    buf_len = (*printPtr)(buf, kv.first.c_str(), p[0], p[1], val, nullptr, z);
                 (*outputFunc)(ofp, buf, buf_len);
             }
         }
     }
 }
 
+//with all_stats the values for afp start at vals_idx in each interval's array, the ones for uafp right after them
 template <typename T>
-void output_all_coverage_ordered_by_BED(const strlist* chrm_order, annotation_map_t<T>* annotations, FILE* afp, BGZF* afpz, FILE* uafp,BGZF* uafpz, Op op = csum, str2dblist* store_local = nullptr) {
+void output_all_coverage_ordered_by_BED(const strlist* chrm_order, annotation_map_t<T>* annotations, FILE* afp, BGZF* afpz, FILE* uafp,BGZF* uafpz, Op op = csum, str2dblist* store_local = nullptr, bool all_stats = false, int vals_idx = 2) {
     int (*outputFunc)(void* fh, char* buf, uint32_t buf_len) = &my_write;
     void* out_fh = afp;
     void* uout_fh = uafp;
@@ -1996,38 +3490,48 @@ void output_all_coverage_ordered_by_BED(const strlist* chrm_order, annotation_ma
         int buf_written = 0;
         //unique
         char* ubuf = nullptr;
-        if(uafp)
+        if(uout_fh)
             ubuf = new char[OUT_BUFF_SZ];
         char* ubufptr = ubuf;
         int ubuf_len = 0;
         int ubuf_written = 0;
-        int num_lines_per_buf = round(OUT_BUFF_SZ / COORD_STR_LEN) - 3;
+        //all_stats (BAM/CRAM) has a column per ANNOTATION_OPS, the unique values come after the ones for all alignments
+        const size_t num_stats = ANNOTATION_OPS.size();
+        //leaves room for the longest line
+        const int max_buf_len = OUT_BUFF_SZ - 1024;
         for(long z = 0; z < annotations_for_chr.size(); z++) {
             const auto &item = annotations_for_chr[z];
             const T start = item[0], end = item[1];
             T val = item[2];
-            if(buf_written >= num_lines_per_buf) {
+            if(buf_len >= max_buf_len) {
                 bufptr[0]='\0';
                 (*outputFunc)(out_fh, buf, buf_len);
                 bufptr = buf;
                 buf_written = 0;
                 buf_len = 0;
             }
-            int written = (*printPtr)(bufptr, c, (long) start, (long) end, val, local_vals, z);
+            int written = 0;
+            if(all_stats)
+                written = print_annotation_stats(bufptr, c, (long) start, (long) end, item + vals_idx);
+            else
+                written = (*printPtr)(bufptr, c, (long) start, (long) end, val, local_vals, z);
             bufptr += written;
             buf_len += written;
             buf_written++;
             //do uniques if asked to
-            if(uafp) {
+            if(uout_fh) {
                 val = item[3];
-                if(ubuf_written >= num_lines_per_buf) {
+                if(ubuf_len >= max_buf_len) {
                     ubufptr[0]='\0';
                     (*outputFunc)(uout_fh, ubuf, ubuf_len);
                     ubufptr = ubuf;
                     ubuf_written = 0;
                     ubuf_len = 0;
                 }
-                written = (*printPtr)(ubufptr, c, (long) start, (long) end, val, local_vals, z);
+                if(all_stats)
+                    written = print_annotation_stats(ubufptr, c, (long) start, (long) end, item + vals_idx + num_stats);
+                else
+                    written = (*printPtr)(ubufptr, c, (long) start, (long) end, val, local_vals, z);
                 ubufptr += written;
                 ubuf_len += written;
                 ubuf_written++;
@@ -2057,6 +3561,59 @@ void split_string(std::string line, char delim, strvec* tokens) {
     }
 }
 
+//a further BED file passed to --annotation (in a comma separated list), summed over the same coverage arrays
+//as the first one but with its own output, <prefix>.<label>.annotation.tsv[.gz], and annotated AUC
+template <typename T>
+struct AnnotationSet {
+    std::string label;
+    annotation_map_t<T> annotations;
+    strlist chrm_order;
+    chr2bool chrs_seen;
+    uint64_t num_annotations = 0;
+    char afn[1024];
+    FILE* afp = nullptr;
+    BGZF* afpz = nullptr;
+    uint64_t annotated_auc = 0;
+};
+template <typename T>
+using annotation_sets = std::vector<AnnotationSet<T>>;
+
+//sums the chromosome's coverage over each further set's intervals on it
+template <typename T>
+static void sum_annotation_sets(annotation_sets<T>* sets, const uint32_t* coverages, const long chr_size, const char* chrm, bool just_auc, bool keep_order) {
+    for(auto& set : *sets) {
+        auto it = set.annotations.find(chrm);
+        if(it == set.annotations.end())
+            continue;
+        sum_annotations(coverages, it->second, chr_size, chrm, set.afp, &set.annotated_auc, just_auc, keep_order ? 2 : -1);
+        if(!keep_order)
+            set.chrs_seen.insert(chrm);
+    }
+}
+
+//writes out the rest of each further set (all of it, in BED order, with keep_order), its annotated AUC and closes (and indexes) its output
+template <typename T>
+static void close_annotation_sets(annotation_sets<T>* sets, bool keep_order, Op op, FILE* auc_file) {
+    for(auto& set : *sets) {
+        if(keep_order)
+            output_all_coverage_ordered_by_BED(&set.chrm_order, &set.annotations, set.afp, set.afpz, nullptr, nullptr, op, nullptr, true);
+        else
+            output_missing_annotations(&set.annotations, &set.chrs_seen, set.afp, op, true);
+        if(auc_file)
+            fprintf(auc_file, "ALL_READS_ANNOTATED_BASES_%s\t%" PRIu64 "\n", set.label.c_str(), set.annotated_auc);
+        if(set.afpz) {
+            bgzf_close(set.afpz);
+            tbx_conf_t tconf = tbx_conf_bed;
+            if(index_output(set.afn, 14, &tconf) != 0)
+                fprintf(stderr,"Error dumping BGZF index for annotation coverage (%s), skipping\n", set.label.c_str());
+        }
+        if(set.afp)
+            fclose(set.afp);
+        set.afp = nullptr;
+        set.afpz = nullptr;
+    }
+}
+
 template <typename T>
 void process_bigwig_worker(strvec& bwfns, annotation_map_t<T>* annotations, strlist* chrm_order, int keep_order_idx, Op op) {
     //want to just get the filename itself, no path
@@ -2070,9 +3627,9 @@ void process_bigwig_worker(strvec& bwfns, annotation_map_t<T>* annotations, strl
         char afn[1024];
         FILE* afp = nullptr;
         sprintf(afn, "%s.err", tokens.back().c_str());
-        FILE* errfp = fopen(afn, "w");
+        FILE* errfp = fopen_output(afn);
         sprintf(afn, "%s.all.tsv", tokens.back().c_str());
-        afp = fopen(afn, "w");
+        afp = fopen_output(afn);
         chr2bool annotation_chrs_seen;
         double annotated_auc = 0.0;
 
@@ -2109,9 +3666,95 @@ Op get_operation(const char* opstr) {
         return cmin;
     if(strcmp(opstr, "max") == 0)
         return cmax;
+    if(strcmp(opstr, "breadth") == 0)
+        return cbreadth;
     return csum;
 }
 
+//--op can be a comma separated list of ops (e.g. "sum,mean") for windowed coverage
+void parse_operations(const char* opstr, std::vector<Op>* ops) {
+    strvec tokens;
+    split_string(std::string(opstr), ',', &tokens);
+    for(auto const& token : tokens) {
+        Op op = get_operation(token.c_str());
+        if(std::find(ops->begin(), ops->end(), op) == ops->end())
+            ops->push_back(op);
+    }
+    if(ops->empty())
+        ops->push_back(csum);
+}
+
+//--min-unique-qual is a comma separated list of MAPQ thresholds and/or nh1 (e.g. 10,255,nh1), one coverage tier each
+int parse_coverage_tiers(const char* tierstr, std::vector<CoverageTier>* tiers) {
+    strvec tokens;
+    split_string(std::string(tierstr), ',', &tokens);
+    for(auto const& token : tokens) {
+        CoverageTier tier = { 0, false, "", "" };
+        char* endp = nullptr;
+        if(token == "nh1")
+            tier.nh1 = true;
+        else {
+            tier.min_qual = strtol(token.c_str(), &endp, 10);
+            if(endp == token.c_str() || *endp != '\0' || tier.min_qual < 0) {
+                fprintf(stderr, "ERROR: bad MAPQ tier \"%s\" passed to --min-unique-qual, exiting\n", token.c_str());
+                return -1;
+            }
+        }
+        bool dup = false;
+        for(auto const& t : *tiers)
+            dup = dup || (t.min_qual == tier.min_qual && t.nh1 == tier.nh1);
+        if(!dup)
+            tiers->push_back(tier);
+    }
+    if(tiers->empty() || tiers->size() > MAX_COVERAGE_TIERS) {
+        fprintf(stderr, "ERROR: --min-unique-qual needs 1 to %d MAPQ tiers, exiting\n", MAX_COVERAGE_TIERS);
+        return -1;
+    }
+    //a single tier keeps the original output names
+    for(auto& t : *tiers) {
+        std::string tag = t.nh1 ? "nh1" : "q" + std::to_string(t.min_qual);
+        t.name = tiers->size() == 1 ? "unique" : "unique." + tag;
+        std::transform(tag.begin(), tag.end(), tag.begin(), ::toupper);
+        t.label = tiers->size() == 1 ? "UNIQUE" : "UNIQUE_" + tag;
+    }
+    return 0;
+}
+
+//bitmask of the --min-unique-qual tiers this alignment counts toward
+static inline uint32_t passing_tiers(const bam1_t *rec, const std::vector<CoverageTier>& tiers) {
+    uint32_t mask = 0;
+    int nh = -1;
+    for(size_t k = 0; k < tiers.size(); k++) {
+        if(rec->core.qual < tiers[k].min_qual)
+            continue;
+        if(tiers[k].nh1) {
+            if(nh == -1) {
+                uint8_t* nhp = bam_aux_get(rec, "NH");
+                nh = nhp ? bam_aux2i(nhp) : 1;
+            }
+            if(nh != 1)
+                continue;
+        }
+        mask |= 1 << k;
+    }
+    return mask;
+}
+
+//--subsample: whether this read name's template is kept, from FNV-1a over the name (started from the seed)
+//and then the splitmix64 finalizer so that similar names still spread out evenly
+static inline bool subsample_keep(const char* qname) {
+    uint64_t h = 14695981039346656037ULL ^ SUBSAMPLE_SEED;
+    for(const char* p = qname; *p; p++) {
+        h ^= (uint8_t) *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h < SUBSAMPLE_THRESHOLD;
+}
 
 typedef hashmap<std::string, uint8_t*> str2str;
 static const uint64_t frag_lens_mask = 0x00000000FFFFFFFF;
@@ -2192,110 +3835,931 @@ int go_bw(const char* bw_arg, int argc, const char** argv, Op op, htsFile *bam_f
             files_per_thread[thread_i]->push_back(files[i]);
             num_files_current_thread++;
         }
-        std::vector<std::thread> threads;
-        for(int i=0; i < nthreads; i++) {
-                threads.push_back(std::thread(process_bigwig_worker<T>, std::ref(*(files_per_thread[i])), annotations, chrm_order, keep_order_idx, op=op));
+        std::vector<std::thread> threads;
+        for(int i=0; i < nthreads; i++) {
+                threads.push_back(std::thread(process_bigwig_worker<T>, std::ref(*(files_per_thread[i])), annotations, chrm_order, keep_order_idx, op=op));
+        }
+        for(auto &t: threads) t.join();
+        fclose(bw_list_fp);
+        if(afp && afp != stdout)
+            fclose(afp);
+        if(afpz)
+            bgzf_close(afpz);
+        std::free(bwfn);
+        return 0;
+    }
+    //don't have a list of BigWigs, so just process the single one
+    int ret = process_bigwig(bw_arg, &annotated_total_auc, annotations, annotation_chrs_seen, afp, keep_order_idx, op=op);
+    //if we wanted to keep the chromosome order of the annotation output matching the input BED file
+    if(keep_order)
+        output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, afpz, nullptr, nullptr, op);
+    else
+        output_missing_annotations(annotations, annotation_chrs_seen, afp, op = op);
+    if(afp && afp != stdout)
+        fclose(afp);
+    if(ret == 0 && auc_file)
+        fprintf(auc_file, "AUC_ANNOTATED_BASES\t%.3f\n", annotated_total_auc);
+    if(auc_file && auc_file != stdout)
+        fclose(auc_file);
+    return ret;
+}
+
+int sam_index_iterator_wrapper(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) {
+    return sam_itr_next(bfh, sam_itr, b);
+}
+
+int sam_scan_iterator_wrapper(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) {
+    return sam_read1(bfh, bhdr, b);
+}
+
+//one merged --region/--regions interval, base-0 half-open
+struct GenomicRegion {
+    int32_t tid;
+    int64_t start;
+    int64_t end;
+    bool operator<(const GenomicRegion& other) const {
+        return tid < other.tid || (tid == other.tid && start < other.start);
+    }
+};
+typedef std::vector<GenomicRegion> region_list;
+
+static void add_region(const bam_hdr_t* hdr, const char* chrm, int64_t start, int64_t end, region_list* regions) {
+    int32_t tid = bam_name2id((bam_hdr_t*) hdr, chrm);
+    if(tid < 0) {
+        fprintf(stderr, "WARNING: region's chromosome \"%s\" is not in the BAM header, skipping\n", chrm);
+        return;
+    }
+    if(start < 0)
+        start = 0;
+    if(end > hdr->target_len[tid])
+        end = hdr->target_len[tid];
+    if(start < end)
+        regions->push_back({tid, start, end});
+}
+
+//samtools style: chr, chr:start or chr:start-end (base-1, inclusive, commas allowed)
+static void parse_region_str(const bam_hdr_t* hdr, const char* region_str, region_list* regions) {
+    std::string reg(region_str);
+    reg.erase(std::remove(reg.begin(), reg.end(), ','), reg.end());
+    size_t colon = reg.rfind(':');
+    //chromosome names can have ':' in them
+    if(colon == std::string::npos || bam_name2id((bam_hdr_t*) hdr, reg.c_str()) >= 0) {
+        add_region(hdr, reg.c_str(), 0, INT64_MAX, regions);
+        return;
+    }
+    const char* coords = reg.c_str() + colon + 1;
+    char* cend = nullptr;
+    int64_t start = strtoll(coords, &cend, 10);
+    int64_t end = INT64_MAX;
+    if(cend != coords && *cend == '-')
+        end = strtoll(cend + 1, &cend, 10);
+    if(cend == coords || *cend != '\0' || start < 1 || end < start) {
+        fprintf(stderr, "bad region \"%s\", needs to be chr, chr:start or chr:start-end (base-1), exiting\n", region_str);
+        exit(-1);
+    }
+    add_region(hdr, reg.substr(0, colon).c_str(), start - 1, end, regions);
+}
+
+//reads --region and --regions <BED> (base-0, half-open) and merges them
+//into sorted, non-overlapping intervals, adjacent ones are merged too
+static void read_regions(int argc, const char** argv, const bam_hdr_t* hdr, region_list* regions) {
+    if(has_option(argv, argv+argc, "--region"))
+        parse_region_str(hdr, *(get_option(argv, argv+argc, "--region")), regions);
+    if(has_option(argv, argv+argc, "--regions")) {
+        const char* fn = *(get_option(argv, argv+argc, "--regions"));
+        FILE* fin = fopen(fn, "r");
+        if(!fin) {
+            fprintf(stderr, "couldn't open regions file %s, exiting\n", fn);
+            exit(-1);
+        }
+        char* line = nullptr;
+        size_t length = 0;
+        char chrm[1024];
+        long start, end;
+        while(getline(&line, &length, fin) != -1) {
+            if(line[0] == '#' || strncmp(line, "track", 5) == 0 || strncmp(line, "browser", 7) == 0)
+                continue;
+            if(sscanf(line, "%1023s %ld %ld", chrm, &start, &end) != 3) {
+                if(line[strspn(line, " \t\r\n")] == '\0')
+                    continue;
+                fprintf(stderr, "bad line in regions file %s: %s", fn, line);
+                exit(-1);
+            }
+            add_region(hdr, chrm, start, end, regions);
+        }
+        free(line);
+        fclose(fin);
+    }
+    std::sort(regions->begin(), regions->end());
+    size_t n = 0;
+    for(const GenomicRegion& reg : *regions) {
+        if(n > 0 && (*regions)[n-1].tid == reg.tid && reg.start <= (*regions)[n-1].end)
+            (*regions)[n-1].end = std::max((*regions)[n-1].end, reg.end);
+        else
+            (*regions)[n++] = reg;
+    }
+    regions->resize(n);
+}
+
+static long get_longest_region_size(const region_list& regions) {
+    long max = 0;
+    for(const GenomicRegion& reg : regions) {
+        if(reg.end - reg.start > max)
+            max = reg.end - reg.start;
+    }
+    return max;
+}
+
+static bool interval_start_less(const hts_pair_pos_t& p1, const hts_pair_pos_t& p2) {
+    return p1.beg < p2.beg;
+}
+
+//sorted, merged (overlapping or adjacent) base-0 half-open intervals of one chromosome's annotations
+template <typename T>
+static void merge_annotation_intervals(const std::vector<T*>& annotations_for_chr, std::vector<hts_pair_pos_t>* merged) {
+    merged->clear();
+    merged->reserve(annotations_for_chr.size());
+    for(const auto& item : annotations_for_chr)
+        merged->push_back({(hts_pos_t) item[0], (hts_pos_t) item[1]});
+    std::sort(merged->begin(), merged->end(), interval_start_less);
+    size_t n = 0;
+    for(const hts_pair_pos_t& p : *merged) {
+        if(n > 0 && p.beg <= (*merged)[n-1].end)
+            (*merged)[n-1].end = std::max((*merged)[n-1].end, p.end);
+        else
+            (*merged)[n++] = p;
+    }
+    merged->resize(n);
+}
+
+//a random seek through the index costs roughly as much as sequentially reading this many (compressed) bytes,
+//this includes the partial BGZF block read at the start of each chunk
+static const uint64_t FETCH_SEEK_COST = 256*1024;
+
+//compressed bytes the chunks of an index iterator cover and the seeks needed to get to them
+static uint64_t index_chunk_bytes(const hts_itr_t* itr, uint64_t* seeks) {
+    uint64_t bytes = 0;
+    uint64_t last_end = 0;
+    for(int i = 0; i < itr->n_off; i++) {
+        uint64_t start = itr->off[i].u >> 16;
+        uint64_t end = itr->off[i].v >> 16;
+        if(end > start)
+            bytes += end - start;
+        //chunks starting in the block where the last one ended are read without a seek
+        if(i == 0 || start != last_end)
+            (*seeks)++;
+        last_end = end;
+    }
+    return bytes;
+}
+
+//one hts_reglist_t entry per chromosome (in the header) with annotations, holding its merged intervals,
+//allocated the way htslib expects since the iterator created from it takes ownership
+//adds the intervals (the same arrays, not copies) of one BED file's annotations to all,
+//for fetching the union of several
+template <typename T>
+static void add_annotations_for_fetch(annotation_map_t<T>* annotations, strlist* chrm_order, annotation_map_t<T>* all, strlist* all_chrm_order) {
+    for(auto const c : *chrm_order) {
+        auto it = all->find(c);
+        if(it == all->end()) {
+            all_chrm_order->push_back(c);
+            it = all->emplace(c, std::vector<T*>()).first;
+        }
+        const std::vector<T*>& intervals = (*annotations)[c];
+        it->second.insert(it->second.end(), intervals.begin(), intervals.end());
+    }
+}
+
+template <typename T>
+static hts_reglist_t* annotation_reglist(bam_hdr_t* hdr, annotation_map_t<T>* annotations, strlist* chrm_order, int* count) {
+    hts_reglist_t* reglist = (hts_reglist_t*) calloc(chrm_order->size() + 1, sizeof(hts_reglist_t));
+    std::vector<hts_pair_pos_t> merged;
+    int n = 0;
+    for(auto const c : *chrm_order) {
+        int32_t tid = bam_name2id(hdr, c);
+        if(tid < 0)
+            continue;
+        merge_annotation_intervals((*annotations)[c], &merged);
+        if(merged.size() == 0)
+            continue;
+        hts_reglist_t& reg = reglist[n++];
+        reg.reg = hdr->target_name[tid];
+        reg.tid = tid;
+        reg.count = merged.size();
+        reg.intervals = (hts_pair_pos_t*) malloc(sizeof(hts_pair_pos_t) * merged.size());
+        std::copy(merged.begin(), merged.end(), reg.intervals);
+        reg.min_beg = merged.front().beg;
+        reg.max_end = merged.back().end;
+    }
+    *count = n;
+    return reglist;
+}
+
+//for each chromosome with annotations, the estimated cost (in bytes read) of fetching just the annotated
+//regions via the index vs. reading the whole chromosome sequentially, then pick the cheaper per chromosome
+//(whole[tid] = 1) unless a linear scan of the whole file is cheaper still (scan = true).
+//The estimates come from the index's chunk offsets, CRAM indices don't expose comparable offsets
+//so for CRAMs this always sticks with the index.
+struct FetchPlan {
+    bool scan = false;
+    std::vector<char> whole;
+    uint64_t scan_cost = 0;
+    uint64_t index_cost = 0;
+    uint64_t index_seeks = 0;
+    uint64_t hybrid_cost = 0;
+    int num_chrms = 0;
+    int num_whole = 0;
+};
+
+static FetchPlan plan_annotation_fetch(hts_idx_t* idx, bam_hdr_t* hdr, htsFile* bfh, const char* bam_fn, const hts_reglist_t* reglist, int reglist_count) {
+    FetchPlan plan;
+    plan.whole.assign(hdr->n_targets, 0);
+    struct stat st;
+    const bool have_size = stat(bam_fn, &st) == 0 && S_ISREG(st.st_mode);
+    const uint64_t file_size = have_size ? st.st_size : 0;
+    plan.scan_cost = file_size + FETCH_SEEK_COST;
+    //no way to tell, stick with the index
+    if(bfh->format.format == cram)
+        return plan;
+    for(int i = 0; i < reglist_count; i++) {
+        const hts_reglist_t& reg = reglist[i];
+        const int32_t tid = reg.tid;
+        uint64_t idx_cost = 0, chrm_cost = 0, seeks = 0;
+        //a copy of just this chromosome's entry, the iterator owns (and frees) it
+        hts_reglist_t* reg_copy = (hts_reglist_t*) malloc(sizeof(hts_reglist_t));
+        *reg_copy = reg;
+        reg_copy->intervals = (hts_pair_pos_t*) malloc(sizeof(hts_pair_pos_t) * reg.count);
+        std::copy(reg.intervals, reg.intervals + reg.count, reg_copy->intervals);
+        hts_itr_t* itr = sam_itr_regions(idx, hdr, reg_copy, 1);
+        if(itr) {
+            idx_cost = index_chunk_bytes(itr, &seeks) + seeks * FETCH_SEEK_COST;
+            hts_itr_destroy(itr);
+        }
+        uint64_t chrm_seeks = 0;
+        if((itr = sam_itr_queryi(idx, tid, 0, hdr->target_len[tid]))) {
+            //one seek, then sequential
+            chrm_cost = index_chunk_bytes(itr, &chrm_seeks) + FETCH_SEEK_COST;
+            hts_itr_destroy(itr);
+        }
+        plan.num_chrms++;
+        plan.index_cost += idx_cost;
+        plan.index_seeks += seeks;
+        if(chrm_cost < idx_cost) {
+            plan.whole[tid] = 1;
+            plan.num_whole++;
+            plan.hybrid_cost += chrm_cost;
+        }
+        else
+            plan.hybrid_cost += idx_cost;
+    }
+    plan.scan = have_size && plan.num_chrms > 0 && plan.scan_cost <= plan.hybrid_cost;
+    return plan;
+}
+
+//based on http://www.cplusplus.com/reference/iterator/iterator/
+template <typename T>
+class BAMIterator : public std::iterator<std::input_iterator_tag, bam1_t>
+{
+    bam1_t* b;
+    htsFile* bfh;
+    bam_hdr_t* bhdr;
+    hts_idx_t* bidx;
+    hts_itr_t* sam_itr;
+    int (*itrPtr)(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) = &sam_scan_iterator_wrapper;
+    //--region(s): queried one at a time, in order
+    const region_list* regions = nullptr;
+    int32_t region_idx = -1;
+    //if the plan reads more than the intervals (whole chromosomes or a full scan), the merged intervals per chromosome,
+    //so only the alignments the index would've returned are passed on and the outputs don't depend on the plan
+    bool filter = false;
+    std::vector<std::vector<hts_pair_pos_t>> keep;
+    //per chromosome, the first interval which doesn't end before the current alignment
+    std::vector<size_t> keep_idx;
+
+    //whether rec overlaps one of the intervals, the alignments come sorted so the intervals are only walked forward
+    bool wanted(const bam1_t* rec) {
+        const int32_t tid = rec->core.tid;
+        if(tid < 0)
+            return false;
+        const std::vector<hts_pair_pos_t>& ivs = keep[tid];
+        size_t& k = keep_idx[tid];
+        while(k < ivs.size() && ivs[k].end <= rec->core.pos)
+            k++;
+        return k < ivs.size() && ivs[k].beg < bam_endpos(rec);
+    }
+
+    void keep_intervals(const hts_reglist_t* reglist, int reglist_count) {
+        filter = true;
+        keep.assign(bhdr->n_targets, std::vector<hts_pair_pos_t>());
+        keep_idx.assign(bhdr->n_targets, 0);
+        for(int i = 0; i < reglist_count; i++)
+            keep[reglist[i].tid].assign(reglist[i].intervals, reglist[i].intervals + reglist[i].count);
+    }
+
+    //picks between the index, reading whole chromosomes and a full scan for the intervals in reglist (which this takes ownership of)
+    void fetch(const char* bam_fn, hts_reglist_t* reglist, int reglist_count) {
+        //given a set of regions, check to see if we have an accompaning BAM index file (.bai)
+        //check if BAI exists, if not proceed with linear scan through BAM iterator
+        if((bidx = sam_index_load(bfh, bam_fn)) == 0) {
+            fprintf(stderr,"no index for BAM/CRAM file, doing full scan\n");
+            hts_reglist_free(reglist, reglist_count);
+            return;
+        }
+        FetchPlan plan = plan_annotation_fetch(bidx, bhdr, bfh, bam_fn, reglist, reglist_count);
+        const double mb = 1024.0*1024.0;
+        fprintf(stderr, "estimated reads: index %.1f MB (%" PRIu64 " seeks), per chromosome best of index/whole %.1f MB (%d of %d chromosomes whole), full scan %.1f MB: ",
+                plan.index_cost/mb, plan.index_seeks, plan.hybrid_cost/mb, plan.num_whole, plan.num_chrms, plan.scan_cost/mb);
+        if(plan.scan || plan.num_whole > 0)
+            keep_intervals(reglist, reglist_count);
+        if(plan.scan) {
+            fprintf(stderr, "doing full scan\n");
+            hts_reglist_free(reglist, reglist_count);
+            hts_idx_destroy(bidx);
+            bidx = nullptr;
+            return;
+        }
+        fprintf(stderr, "using the index\n");
+        for(int i = 0; i < reglist_count; i++) {
+            hts_reglist_t& reg = reglist[i];
+            //cheaper to read all of this one than to jump around in it
+            if(plan.whole[reg.tid]) {
+                reg.count = 1;
+                reg.intervals[0].beg = reg.min_beg = 0;
+                reg.intervals[0].end = reg.max_end = bhdr->target_len[reg.tid];
+            }
+        }
+        //the iterator takes ownership of reglist
+        sam_itr = sam_itr_regions(bidx, bhdr, reglist, reglist_count);
+        if(!sam_itr) {
+            fprintf(stderr,"failed to create SAM file iterator, exiting\n");
+            exit(-1);
+        }
+        itrPtr = &sam_index_iterator_wrapper;
+    }
+
+public:
+    BAMIterator(bam1_t* z, htsFile* bam_fh, bam_hdr_t* bam_hdr) :b(z),bfh(bam_fh),bhdr(bam_hdr),bidx(nullptr),sam_itr(nullptr) {}
+    BAMIterator(bam1_t* z, htsFile* bam_fh, bam_hdr_t* bam_hdr, const char* bam_fn, annotation_map_t<T>* annotations, uint32_t annotations_count, strlist* chrm_order, const region_list* regions_ = nullptr) :b(z),bfh(bam_fh),bhdr(bam_hdr),bidx(nullptr),sam_itr(nullptr),regions(regions_) {
+        if(regions) {
+            if((bidx = sam_index_load(bfh, bam_fn)) == 0) {
+                fprintf(stderr,"--region(s) needs an index for the BAM/CRAM file, exiting\n");
+                exit(-1);
+            }
+            itrPtr = &sam_index_iterator_wrapper;
+            return;
+        }
+        if(annotations_count == 0)
+            return;
+        //annotations merged into disjoint intervals per chromosome, so the index gives us each chunk once
+        int reglist_count = 0;
+        hts_reglist_t* reglist = annotation_reglist(bhdr, annotations, chrm_order, &reglist_count);
+        fetch(bam_fn, reglist, reglist_count);
+    }
+    //--sites: same as for the annotations but for already merged intervals,
+    //takes ownership of reglist, a null reglist means a full scan
+    BAMIterator(bam1_t* z, htsFile* bam_fh, bam_hdr_t* bam_hdr, const char* bam_fn, hts_reglist_t* reglist, int reglist_count) :b(z),bfh(bam_fh),bhdr(bam_hdr),bidx(nullptr),sam_itr(nullptr) {
+        if(reglist)
+            fetch(bam_fn, reglist, reglist_count);
+    }
+    BAMIterator(const BAMIterator& bitr) : b(bitr.b),bfh(bitr.bfh),bhdr(bitr.bhdr),bidx(bitr.bidx),sam_itr(bitr.sam_itr),itrPtr(bitr.itrPtr),regions(bitr.regions),region_idx(bitr.region_idx),
+                filter(bitr.filter),keep(bitr.keep),keep_idx(bitr.keep_idx) {}
+
+    BAMIterator& operator++() {
+        int r = -1;
+        if(sam_itr || !regions) {
+            do {
+                r = itrPtr(b, bfh, bhdr, sam_itr);
+            } while(r >= 0 && filter && !wanted(b));
+        }
+        //move on to the next region once the current one runs out
+        while(r < 0 && regions && ++region_idx < (int32_t) regions->size()) {
+            if(sam_itr)
+                hts_itr_destroy(sam_itr);
+            const GenomicRegion& reg = (*regions)[region_idx];
+            if(!(sam_itr = sam_itr_queryi(bidx, reg.tid, reg.start, reg.end))) {
+                fprintf(stderr,"failed to create SAM file iterator for region %s:%" PRId64 "-%" PRId64 ", exiting\n", bhdr->target_name[reg.tid], reg.start + 1, reg.end);
+                exit(-1);
+            }
+            r = itrPtr(b, bfh, bhdr, sam_itr);
+        }
+        if(r < 0)
+            b = nullptr;
+        return *this;
+    }
+    //index into the --region(s) list of the region the current alignment was fetched for
+    int32_t region() const { return region_idx; }
+
+    BAMIterator operator++(int) {BAMIterator temp(*this); operator++(); return temp;}
+    bool operator==(const BAMIterator& rhs) const {return b==rhs.b;}
+    bool operator!=(const BAMIterator& rhs) const {return b!=rhs.b;}
+    bam1_t* operator*() {return b;}
+    ~BAMIterator() { if(sam_itr) { hts_itr_destroy(sam_itr);} }
+};
+
+//--region(s) output: writes each merged region's coverage (and read starts/ends) with its own coordinates
+//once the alignments have moved past it, regions without any alignments still get written (as 0's).
+//The coverage buffers are difference arrays covering [wstart, wend) on the region's chromosome,
+//i.e. the region plus whatever its alignments stick out on either side,
+//the starts/ends buffers only cover the region itself.
+class RegionCoverage {
+    const region_list& regions;
+    const bam_hdr_t* hdr;
+    std::unique_ptr<uint32_t[]>& coverages;
+    //one per --min-unique-qual tier
+    std::vector<std::unique_ptr<uint32_t[]>>& tier_coverages;
+    uint32_t* starts;
+    uint32_t* ends;
+    long capacity;
+    int32_t current;
+    int64_t wstart;
+    int64_t wend;
+    char prefix[50];
+
+    //coverage outputs, same as go_bam's for whole chromosomes
+    bigWigFile_t* bwfp = nullptr;
+    std::vector<bigWigFile_t*> tier_bwfps;
+    FILE* cov_fh = nullptr;
+    bool dont_output_coverage = true;
+    BGZF* gcov_fh = nullptr;
+    hts_idx_t* cidx = nullptr;
+    int* chrms_in_cidx = nullptr;
+    WindowAggregator* windows = nullptr;
+    DepthSummary* depths = nullptr;
+    //read starts/ends outputs
+    BufferedWriter* rsfp = nullptr;
+    BufferedWriter* refp = nullptr;
+    bigWigFile_t* rsbwfp = nullptr;
+    bigWigFile_t* rebwfp = nullptr;
+
+    static void grow(std::unique_ptr<uint32_t[]>& buf, const long old_sz, const long new_sz) {
+        uint32_t* grown = new uint32_t[new_sz];
+        std::memcpy(grown, buf.get(), sizeof(uint32_t) * old_sz);
+        reset_array(grown + old_sz, new_sz - old_sz);
+        buf.reset(grown);
+    }
+
+public:
+    //coverages/tier_coverages (if allocated) and starts/ends (if not null) need to be
+    //at least get_longest_region_size(regions) + 1 long
+    RegionCoverage(const region_list& regions_, const bam_hdr_t* hdr_, std::unique_ptr<uint32_t[]>& coverages_, std::vector<std::unique_ptr<uint32_t[]>>& tier_coverages_, uint32_t* starts_, uint32_t* ends_)
+        : regions(regions_),hdr(hdr_),coverages(coverages_),tier_coverages(tier_coverages_),starts(starts_),ends(ends_),
+          capacity(get_longest_region_size(regions_) + 1),current(-1),wstart(0),wend(0) {
+        if(coverages)
+            reset_array(coverages.get(), capacity);
+        for(auto& tier : tier_coverages)
+            reset_array(tier.get(), capacity);
+        if(starts) {
+            reset_array(starts, capacity);
+            reset_array(ends, capacity);
+        }
+    }
+
+    void set_coverage_output(bigWigFile_t* bwfp_, const std::vector<bigWigFile_t*>& tier_bwfps_, FILE* cov_fh_, bool dont_output_coverage_, BGZF* gcov_fh_, hts_idx_t* cidx_, int* chrms_in_cidx_, WindowAggregator* windows_, DepthSummary* depths_) {
+        bwfp = bwfp_; tier_bwfps = tier_bwfps_; cov_fh = cov_fh_; dont_output_coverage = dont_output_coverage_;
+        gcov_fh = gcov_fh_; cidx = cidx_; chrms_in_cidx = chrms_in_cidx_;
+        windows = windows_; depths = depths_;
+    }
+
+    void set_read_ends_output(BufferedWriter* rsfp_, BufferedWriter* refp_, bigWigFile_t* rsbwfp_, bigWigFile_t* rebwfp_) {
+        rsfp = rsfp_; refp = refp_; rsbwfp = rsbwfp_; rebwfp = rebwfp_;
+    }
+
+    int32_t region() const { return current; }
+    //reference position of coverages[0]
+    int64_t offset() const { return wstart; }
+
+    //called with the first alignment fetched for region k (after finish(k))
+    void start(const int32_t k, const int64_t pos) {
+        current = k;
+        wstart = std::min(regions[k].start, pos);
+        wend = wstart;
+        fit(regions[k].end);
+    }
+
+    //make room in the coverage buffers for an alignment ending at end (base-1)
+    void fit(const int64_t end) {
+        if(end <= wend)
+            return;
+        //+1 for the difference array's decrement at the end
+        const long needed = end - wstart + 1;
+        if(needed > capacity) {
+            const long sz = std::max(needed, capacity * 2);
+            if(coverages)
+                grow(coverages, capacity, sz);
+            for(auto& tier : tier_coverages)
+                grow(tier, capacity, sz);
+            capacity = sz;
+        }
+        wend = end;
+    }
+
+    //only counts the starts/ends which fall in the current region
+    inline void count_read_ends(const int64_t start, const int64_t end) {
+        const GenomicRegion& reg = regions[current];
+        if(start >= reg.start && start < reg.end)
+            starts[start - reg.start]++;
+        if(end > reg.start && end <= reg.end)
+            ends[end - 1 - reg.start]++;
+    }
+
+    //writes out the current region and then any regions (without alignments) after it, up to but not including k
+    void finish(const int32_t k, uint64_t* all_auc, uint64_t* tier_aucs) {
+        for(int32_t j = std::max(current, 0); j < k; j++) {
+            const GenomicRegion& reg = regions[j];
+            const long len = reg.end - reg.start;
+            //the buffers are all 0's for a region which didn't get any alignments
+            if(j != current) {
+                wstart = reg.start;
+                wend = reg.end;
+            }
+            char* chrm = hdr->target_name[reg.tid];
+            const long skipped = reg.start - wstart;
+            if(coverages) {
+                int32_t* cov = (int32_t*) coverages.get();
+                //fold the running count from before the region into its first position
+                for(long i = 0; i < skipped; i++)
+                    cov[skipped] += cov[i];
+                sprintf(prefix, "cov\t%d", reg.tid);
+                *all_auc += print_array(prefix, chrm, reg.tid, cov + skipped, len, false, bwfp, cov_fh, dont_output_coverage, true, gcov_fh, cidx, chrms_in_cidx, windows, reg.start, depths);
+                reset_array(coverages.get(), wend - wstart + 1);
+            }
+            for(size_t t = 0; t < tier_coverages.size(); t++) {
+                int32_t* cov = (int32_t*) tier_coverages[t].get();
+                for(long i = 0; i < skipped; i++)
+                    cov[skipped] += cov[i];
+                sprintf(prefix, "ucov\t%d", reg.tid);
+                tier_aucs[t] += print_array(prefix, chrm, reg.tid, cov + skipped, len, false, tier_bwfps[t], cov_fh, dont_output_coverage, true, nullptr, nullptr, nullptr, nullptr, reg.start);
+                reset_array(tier_coverages[t].get(), wend - wstart + 1);
+            }
+            if(starts) {
+                print_read_ends(rsfp, rsbwfp, chrm, reg.tid, starts, len, reg.start);
+                print_read_ends(refp, rebwfp, chrm, reg.tid, ends, len, reg.start);
+                reset_array(starts, len);
+                reset_array(ends, len);
+            }
+        }
+        current = k;
+    }
+};
+
+//--split-by: one group's coverage, kept in PAGE_SZ base pages (direct counts, not differences)
+//which are only allocated once an alignment of the group covers them,
+//so memory scales with the bases a group covers rather than with the chromosome length;
+//pages come from (and go back to) a free list shared by all the groups
+class PagedCoverage {
+    static const int PAGE_SHIFT = 12;
+    static const long PAGE_SZ = 1L << PAGE_SHIFT;
+    hashmap<uint32_t, uint32_t*> pages;
+    std::vector<uint32_t*>* pool;
+
+    uint32_t* page(const uint32_t p) {
+        auto it = pages.find(p);
+        if(it != pages.end())
+            return it->second;
+        uint32_t* arr = nullptr;
+        if(pool->empty())
+            arr = new uint32_t[PAGE_SZ];
+        else {
+            arr = pool->back();
+            pool->pop_back();
+        }
+        reset_array(arr, PAGE_SZ);
+        pages.emplace(p, arr);
+        return arr;
+    }
+
+public:
+    PagedCoverage(std::vector<uint32_t*>* pool_) : pool(pool_) { }
+    ~PagedCoverage() { reset(); }
+
+    bool empty() const { return pages.empty(); }
+
+    //gives all the pages back to the free list
+    void reset() {
+        for(auto const& kv : pages)
+            pool->push_back(kv.second);
+        pages.clear();
+    }
+
+    //adds v to [start,start+n)
+    void add(long start, long n, int32_t v) {
+        while(n > 0) {
+            const long off = start & (PAGE_SZ - 1);
+            const long run = std::min(n, PAGE_SZ - off);
+            SIMD.add(page(start >> PAGE_SHIFT) + off, run, v);
+            start += run;
+            n -= run;
+        }
+    }
+
+    //same as SIMD.interval_stats over [start,end), bases without a page are 0
+    void stats(long start, const long end, IntervalStats* s) const {
+        s->sum = 0;
+        s->min = UINT32_MAX;
+        s->max = 0;
+        s->covered = 0;
+        IntervalStats ps;
+        while(start < end) {
+            const long off = start & (PAGE_SZ - 1);
+            const long run = std::min(end - start, PAGE_SZ - off);
+            auto it = pages.find(start >> PAGE_SHIFT);
+            if(it == pages.end()) {
+                s->min = 0;
+                if(BREADTH_MIN_DEPTH == 0)
+                    s->covered += run;
+            }
+            else {
+                SIMD.interval_stats(it->second + off, run, BREADTH_MIN_DEPTH, &ps);
+                s->sum += ps.sum;
+                s->min = std::min(s->min, ps.min);
+                s->max = std::max(s->max, ps.max);
+                s->covered += ps.covered;
+            }
+            start += run;
         }
-        for(auto &t: threads) t.join();
-        fclose(bw_list_fp);
-        if(afp && afp != stdout)
-            fclose(afp);
-        if(afpz)
-            bgzf_close(afpz);
-        std::free(bwfn);
-        return 0;
     }
-    //don't have a list of BigWigs, so just process the single one
-    int ret = process_bigwig(bw_arg, &annotated_total_auc, annotations, annotation_chrs_seen, afp, keep_order_idx, op=op);
-    //if we wanted to keep the chromosome order of the annotation output matching the input BED file
-    if(keep_order)
-        output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, afpz, nullptr, nullptr, op);
-    else
-        output_missing_annotations(annotations, annotation_chrs_seen, afp, op = op);
-    if(afp && afp != stdout)
-        fclose(afp);
-    if(ret == 0 && auc_file)
-        fprintf(auc_file, "AUC_ANNOTATED_BASES\t%.3f\n", annotated_total_auc);
-    if(auc_file && auc_file != stdout)
-        fclose(auc_file);
-    return ret;
-}
 
-int sam_index_iterator_wrapper(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) {
-    return sam_itr_next(bfh, sam_itr, b);
-}
+    //returns the AUC of [0,len) and writes its runs of constant coverage to the BigWig (if any),
+    //same intervals as print_array writes for the whole chromosome's coverage
+    uint64_t output(char* chrm, const long len, bigWigFile_t* bwfp) const {
+        std::vector<uint32_t> idxs;
+        idxs.reserve(pages.size());
+        for(auto const& kv : pages)
+            idxs.push_back(kv.first);
+        std::sort(idxs.begin(), idxs.end());
+        BigWigWriter bww(bwfp, chrm);
+        uint64_t auc = 0;
+        long run_start = 0;
+        uint32_t run_value = 0;
+        long next = 0;
+        for(uint32_t p : idxs) {
+            const long base = (long) p << PAGE_SHIFT;
+            //the bases between the last page and this one are all 0
+            if(base > next && run_value != 0) {
+                if(bwfp)
+                    bww.add(run_start, next, static_cast<float>(run_value));
+                run_start = next;
+                run_value = 0;
+            }
+            const uint32_t* arr = pages.find(p)->second;
+            const long n = std::min(PAGE_SZ, len - base);
+            for(long i = 0; i < n; i++) {
+                if(arr[i] != run_value) {
+                    if(bwfp)
+                        bww.add(run_start, base + i, static_cast<float>(run_value));
+                    run_start = base + i;
+                    run_value = arr[i];
+                }
+                auc += arr[i];
+            }
+            next = base + n;
+        }
+        if(run_value != 0) {
+            if(bwfp)
+                bww.add(run_start, next, static_cast<float>(run_value));
+            run_start = next;
+        }
+        if(bwfp && len > run_start)
+            bww.add(run_start, len, 0.0);
+        return auc;
+    }
+};
 
-int sam_scan_iterator_wrapper(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) {
-    return sam_read1(bfh, bhdr, b);
-}
+//--split-by: puts each alignment into a group by the value of one of its aux tags (RG or e.g. a cell barcode,
+//which --split-groups can map to pseudobulk groups) and keeps each group's coverage alongside the overall one,
+//so per group AUCs, BigWigs and annotation values all come out of the same decode of the BAM
+class GroupSplitter {
+    struct Group {
+        std::string name;
+        PagedCoverage coverage;
+        bigWigFile_t* bwfp;
+        uint64_t auc;
+        uint64_t annotated_auc;
+        //a value per ANNOTATION_OPS for each annotated interval, in BED order
+        std::vector<double> vals;
+        Group(const std::string& name_, std::vector<uint32_t*>* pool) : name(name_),coverage(pool),bwfp(nullptr),auc(0),annotated_auc(0) { }
+    };
+    const bam_hdr_t* hdr;
+    const char* prefix;
+    bool bigwig;
+    //tag value -> group, either all read from --split-groups or added as new values are seen
+    hashmap<std::string, int> value2group;
+    bool fixed_groups;
+    std::vector<std::unique_ptr<Group>> groups;
+    std::vector<uint32_t*> page_pool;
+    //where each chromosome's annotated intervals start in the BED order
+    hashmap<std::string, uint64_t> annotation_offsets;
+    uint64_t num_annotations;
+    std::string value;
+
+    static bool group_name_lt(const Group* a, const Group* b) {
+        return a->name < b->name;
+    }
 
-int NUM_CHARS_IN_REGION_STR = 1000;
-//based on http://www.cplusplus.com/reference/iterator/iterator/
-template <typename T>
-class BAMIterator : public std::iterator<std::input_iterator_tag, bam1_t>
-{
-    bam1_t* b;
-    htsFile* bfh;
-    bam_hdr_t* bhdr;
-    hts_idx_t* bidx;
-    hts_itr_t* sam_itr;
-    int (*itrPtr)(bam1_t* b, htsFile* bfh, bam_hdr_t* bhdr, hts_itr_t* sam_itr) = &sam_scan_iterator_wrapper;
-    char* amap;
-    char** amap_ptr;
+    int add_group(const std::string& name) {
+        groups.emplace_back(new Group(name, &page_pool));
+        Group* g = groups.back().get();
+        g->vals.resize(num_annotations * ANNOTATION_OPS.size(), 0);
+        if(bigwig) {
+            //keep the group name from making a path
+            std::string suffix = "group." + name + ".bw";
+            for(size_t i = 6; i < suffix.size() - 3; i++) {
+                if(!isalnum(suffix[i]) && suffix[i] != '-' && suffix[i] != '.')
+                    suffix[i] = '_';
+            }
+            g->bwfp = create_bigwig_file(hdr, prefix, suffix.c_str());
+        }
+        return groups.size() - 1;
+    }
 
 public:
-    BAMIterator(bam1_t* z, htsFile* bam_fh, bam_hdr_t* bam_hdr) :b(z),bfh(bam_fh),bhdr(bam_hdr),bidx(nullptr),sam_itr(nullptr) {}
-    BAMIterator(bam1_t* z, htsFile* bam_fh, bam_hdr_t* bam_hdr, const char* bam_fn, annotation_map_t<T>* annotations, uint32_t annotations_count, strlist* chrm_order) :b(z),bfh(bam_fh),bhdr(bam_hdr),bidx(nullptr),sam_itr(nullptr) {
-        if(annotations_count == 0)
-            return;
-        //given a set of regions, check to see if we have an accompaning BAM index file (.bai)
-        //check if BAI exists, if not proceed with linear scan through BAM iterator
-        if((bidx = sam_index_load(bfh, bam_fn)) == 0) {
-            fprintf(stderr,"no index for BAM/CRAM file, doing full scan\n");
+    template <typename T>
+    GroupSplitter(const bam_hdr_t* hdr_, const char* prefix_, bool bigwig_, const char* groups_fn, const strlist* chrm_order, annotation_map_t<T>* annotations) :
+            hdr(hdr_),prefix(prefix_),bigwig(bigwig_),fixed_groups(groups_fn != nullptr),num_annotations(0) {
+        if(annotations) {
+            for(auto const c : *chrm_order) {
+                annotation_offsets[c] = num_annotations;
+                num_annotations += (*annotations)[c].size();
+            }
+        }
+        if(!groups_fn)
             return;
+        //2 columns: tag value, group
+        FILE* fin = fopen(groups_fn, "r");
+        if(!fin) {
+            fprintf(stderr, "couldn't open --split-groups file %s, exiting\n", groups_fn);
+            exit(-1);
         }
-        uint32_t amap_count = annotations_count;
-        amap = new char[amap_count*NUM_CHARS_IN_REGION_STR];
-        amap_ptr = new char*[amap_count];
-        uint64_t k = 0;
-        for(auto const c : *chrm_order) {
-            std::vector<T*>& annotations_for_chr = (*annotations)[c];
-            for(long z = 0; z < annotations_for_chr.size(); z++) {
-                const auto &item = annotations_for_chr[z];
-                const T start = item[0], end = item[1];
-                //keep the auto null char
-                amap_ptr[k++] = amap;
-                amap += (sprintf(amap, "%s:%lu-%lu", c, (long) start, (long) end)+1);
+        hashmap<std::string, int> name2group;
+        char* line = nullptr;
+        size_t length = 0;
+        while(getline(&line, &length, fin) != -1) {
+            char* val = strtok(line, "\t\r\n");
+            char* name = strtok(nullptr, "\t\r\n");
+            if(!val)
+                continue;
+            if(!name) {
+                fprintf(stderr, "missing group for %s in --split-groups file %s, exiting\n", val, groups_fn);
+                exit(-1);
             }
+            auto it = name2group.find(name);
+            if(it == name2group.end())
+                it = name2group.emplace(name, add_group(name)).first;
+            value2group[val] = it->second;
         }
-        assert(k==amap_count);
-        sam_itr = sam_itr_regarray(bidx, bhdr, amap_ptr, amap_count);
-        if(!sam_itr) {
-            fprintf(stderr,"failed to create SAM file iterator, exiting\n");
-            exit(-1);
+        std::free(line);
+        fclose(fin);
+        fprintf(stderr, "%lu tag values mapped to %lu group(s) for --split-by\n", value2group.size(), groups.size());
+    }
+    ~GroupSplitter() {
+        groups.clear();
+        for(uint32_t* arr : page_pool)
+            delete[] arr;
+    }
+
+    //group of the alignment, -1 if it doesn't have the tag (or its value isn't in --split-groups)
+    int group(const bam1_t* rec) {
+        uint8_t* aux = bam_aux_get(rec, SPLIT_TAG);
+        if(!aux)
+            return -1;
+        if(*aux == 'Z')
+            value.assign(bam_aux2Z(aux));
+        else if(strchr("cCsSiI", *aux))
+            value = std::to_string(bam_aux2i(aux));
+        else
+            return -1;
+        auto it = value2group.find(value);
+        if(it != value2group.end())
+            return it->second;
+        if(fixed_groups)
+            return -1;
+        int g = add_group(value);
+        value2group.emplace(value, g);
+        return g;
+    }
+
+    //applies the spans calculate_coverage recorded for an alignment of group g
+    void add(const int g, const std::vector<int32_t>& spans) {
+        PagedCoverage& cov = groups[g]->coverage;
+        for(size_t i = 0; i < spans.size(); i += 2) {
+            if(spans[i + 1] > 0)
+                cov.add(spans[i], spans[i + 1], 1);
+            else
+                cov.add(spans[i], -spans[i + 1], -1);
         }
-        //delete amap;
-        //delete amap_ptr;
-        itrPtr = &sam_index_iterator_wrapper;
     }
-    BAMIterator(const BAMIterator& bitr) : b(bitr.b),bfh(bitr.bfh),bhdr(bitr.bhdr),bidx(bitr.bidx),sam_itr(bitr.sam_itr),itrPtr(bitr.itrPtr) {}
 
-    BAMIterator& operator++() {
-        int r = itrPtr(b, bfh, bhdr, sam_itr);
-        if(r < 0)
-            b = nullptr;
-        return *this;
+    //outputs every group's coverage of chromosome tid and computes its annotation values, then frees it
+    template <typename T>
+    void finish_chromosome(const int32_t tid, annotation_map_t<T>* annotations) {
+        char* chrm = hdr->target_name[tid];
+        const long len = hdr->target_len[tid];
+        const std::vector<T*>* intervals = nullptr;
+        uint64_t offset = 0;
+        if(annotations) {
+            auto it = annotations->find(chrm);
+            if(it != annotations->end()) {
+                intervals = &(it->second);
+                offset = annotation_offsets[chrm];
+            }
+        }
+        const size_t num_stats = ANNOTATION_OPS.size();
+        IntervalStats stats;
+        for(auto& g : groups) {
+            if(g->coverage.empty())
+                continue;
+            g->auc += g->coverage.output(chrm, len, g->bwfp);
+            if(intervals) {
+                for(size_t z = 0; z < intervals->size(); z++) {
+                    const T start = (*intervals)[z][0];
+                    const T end = (*intervals)[z][1];
+                    g->coverage.stats(start, end, &stats);
+                    g->annotated_auc += stats.sum;
+                    double* out = g->vals.data() + (offset + z) * num_stats;
+                    const double ilen = (double) (end - start);
+                    for(size_t k = 0; k < num_stats; k++) {
+                        switch(ANNOTATION_OPS[k]) {
+                            case cmean: out[k] = (double) stats.sum / ilen; break;
+                            case cmin: out[k] = end > start ? stats.min : 0; break;
+                            case cmax: out[k] = stats.max; break;
+                            case cbreadth: out[k] = (double) stats.covered / ilen; break;
+                            default: out[k] = stats.sum;
+                        }
+                    }
+                }
+            }
+            g->coverage.reset();
+        }
     }
 
-    BAMIterator operator++(int) {BAMIterator temp(*this); operator++(); return temp;}
-    bool operator==(const BAMIterator& rhs) const {return b==rhs.b;}
-    bool operator!=(const BAMIterator& rhs) const {return b!=rhs.b;}
-    bam1_t* operator*() {return b;}
-    //~BAMIterator() { if(sam_itr) { hts_itr_destroy(sam_itr); delete amap; delete amap_ptr;} }
-    ~BAMIterator() { if(sam_itr) { hts_itr_destroy(sam_itr);} }
+    //writes <prefix>.groups.auc.tsv and, with an annotation, the <prefix>.groups.annotation.tsv(.gz) matrix
+    //of annotated intervals (in BED order) by group (a column per group or per group and op), groups sorted by name
+    template <typename T>
+    void close(const strlist* chrm_order, annotation_map_t<T>* annotations, bool gzip) {
+        std::vector<Group*> sorted;
+        for(auto& g : groups)
+            sorted.push_back(g.get());
+        std::sort(sorted.begin(), sorted.end(), group_name_lt);
+        char fn[1024];
+        sprintf(fn, "%s.groups.auc.tsv", prefix);
+        FILE* afp = fopen_output(fn);
+        fprintf(afp, "group\tall_bases%s\n", annotations ? "\tannotated_bases" : "");
+        for(Group* g : sorted) {
+            fprintf(afp, "%s\t%" PRIu64, g->name.c_str(), g->auc);
+            if(annotations)
+                fprintf(afp, "\t%" PRIu64, g->annotated_auc);
+            fprintf(afp, "\n");
+        }
+        fclose(afp);
+        //--bigwig also writes the all.bw, go_bam cleans up libBigWig after closing that
+        for(Group* g : sorted) {
+            if(g->bwfp) {
+                bwClose(g->bwfp);
+                g->bwfp = nullptr;
+            }
+        }
+        if(!annotations)
+            return;
+        const size_t num_stats = ANNOTATION_OPS.size();
+        sprintf(fn, "%s.groups.annotation.tsv%s", prefix, gzip ? ".gz" : "");
+        BufferedWriter out(fn, hdr, gzip);
+        char buf[1024];
+        out.reserve(64);
+        out.put("#chrom\tstart\tend");
+        for(Group* g : sorted) {
+            for(size_t k = 0; k < num_stats; k++) {
+                out.reserve(g->name.size() + 16);
+                out.put('\t');
+                out.put(g->name.c_str(), g->name.size());
+                if(num_stats > 1) {
+                    out.put('.');
+                    out.put(OP_NAMES[ANNOTATION_OPS[k]]);
+                }
+            }
+        }
+        out.put('\n');
+        uint64_t idx = 0;
+        for(auto const c : *chrm_order) {
+            for(T* coords : (*annotations)[c]) {
+                int len = sprintf(buf, "%s\t%lu\t%lu", c, (long) coords[0], (long) coords[1]);
+                out.reserve(len + sorted.size() * num_stats * 24 + 1);
+                out.put(buf, len);
+                for(Group* g : sorted) {
+                    const double* vals = g->vals.data() + idx * num_stats;
+                    for(size_t k = 0; k < num_stats; k++) {
+                        out.put('\t');
+                        out.put(buf, print_annotation_stat(buf, ANNOTATION_OPS[k], vals[k]));
+                    }
+                }
+                out.put('\n');
+                idx++;
+            }
+        }
+        out.close();
+    }
 };
 
-int finalize_tabix_index(const char* fname, const char* ifname, BGZF* bfh, hts_idx_t* cidx, int* chrms_in_cidx, const bam_hdr_t *hdr) {
+int finalize_tabix_index(const char* fname, const char* ifname, BGZF* bfh, hts_idx_t* cidx, int* chrms_in_cidx, const bam_hdr_t *hdr, const tbx_conf_t* conf) {
     //this function assumes that the chromosome (chrm) order indexes have been tracked while adding
     //intervals to the BGZip file we're finalizing the index for here
     //but now we need to create the final array of chrm order indexes mapped to chrm names
@@ -2312,7 +4776,7 @@ int finalize_tabix_index(const char* fname, const char* ifname, BGZF* bfh, hts_i
     //largely lifted from: https://github.com/samtools/htslib/blob/4162046b28a7d9d8a104ce28086d9467cc05c212/tbx.c#L216
     tbx_t *tbx;
     tbx = (tbx_t*)calloc(1, sizeof(tbx_t));
-    tbx->conf = tbx_conf_bed; 
+    tbx->conf = *conf;
     tbx->idx = cidx;
     //first slot is the number of chromosomes present in the index
     int num_chrms = chrms_in_cidx[0]; 
@@ -2352,17 +4816,753 @@ int finalize_tabix_index(const char* fname, const char* ifname, BGZF* bfh, hts_i
         fprintf(stderr,"Error saving BGZF index for base coverage, skipping\n");
         return -1;
     }
+    OUTPUT_FILES.add(ifname);
     return 0;
 }
 
 
-template <typename T>
-int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, FILE* afp, BGZF* afpz, annotation_map_t<T>* annotations, chr2bool* annotation_chrs_seen, const char* prefix, bool sum_annotation, strlist* chrm_order, FILE* auc_file, uint64_t num_annotations, uint32_t window_size = 0) {
+//--read-counts: featureCounts style read (fragment for pairs) counts per annotated interval and,
+//if the BED has a 4th (name) column, e.g. gene IDs, per name as well, from the same pass as the base sums.
+//Each chromosome's intervals are sorted by start along with the running maximum of their ends, so the
+//ones overlapping an aligned block are found with a binary search and a scan back which stops as soon as
+//nothing further back can reach the block.
+//A fragment gets the union of what its mates' aligned blocks (split at introns) overlap,
+//with READ_COUNT_OVERLAP deciding what happens when that's more than one interval (or name)
+class ReadCounter {
+    struct Feature {
+        int32_t start;
+        int32_t end;
+        //line in the BED file
+        uint32_t id;
+    };
+    struct ChrmFeatures {
+        std::vector<Feature> features;
+        //maximum end of features[0..i]
+        std::vector<int32_t> max_ends;
+    };
+    struct Line {
+        std::string chrm;
+        int32_t start;
+        int32_t end;
+        uint32_t name;
+    };
+    //a mate which came first, waiting for the other one
+    struct PendingMate {
+        int32_t mtid;
+        std::vector<uint32_t> hits;
+    };
+    const bam_hdr_t* hdr;
+    std::vector<ChrmFeatures> chrms;
+    std::vector<Line> lines;
+    std::vector<double> counts;
+    bool has_names;
+    std::vector<std::string> names;
+    std::vector<double> name_counts;
+    hashmap<std::string, PendingMate> pending;
+    int32_t tid;
+    std::vector<uint32_t> hits;
+    std::vector<uint32_t> name_hits;
+    uint64_t fragments;
+    uint64_t assigned;
+    uint64_t ambiguous;
+    uint64_t no_features;
+    uint64_t names_assigned;
+    uint64_t names_ambiguous;
+
+    static bool feature_start_less(const Feature& f, const int32_t pos) {
+        return f.start < pos;
+    }
+
+    static bool feature_less(const Feature& f1, const Feature& f2) {
+        return f1.start < f2.start;
+    }
+
+    void query(const ChrmFeatures& cf, const int32_t start, const int32_t end, std::vector<uint32_t>* out) {
+        //everything from the first one starting at or after end on can't overlap
+        size_t i = std::lower_bound(cf.features.begin(), cf.features.end(), end, feature_start_less) - cf.features.begin();
+        while(i-- > 0 && cf.max_ends[i] > start) {
+            if(cf.features[i].end > start)
+                out->push_back(cf.features[i].id);
+        }
+    }
+
+    //the intervals the aligned blocks (matches and deletions, split at introns) of rec overlap
+    void overlaps(const bam1_t* rec, std::vector<uint32_t>* out) {
+        const ChrmFeatures& cf = chrms[rec->core.tid];
+        if(cf.features.empty())
+            return;
+        const uint32_t* cigar = bam_get_cigar(rec);
+        int32_t block_start = rec->core.pos;
+        int32_t refpos = rec->core.pos;
+        for(uint32_t k = 0; k < rec->core.n_cigar; k++) {
+            const int op = bam_cigar_op(cigar[k]);
+            if(!(bam_cigar_type(op) & 2))
+                continue;
+            if(op == BAM_CREF_SKIP) {
+                if(refpos > block_start)
+                    query(cf, block_start, refpos, out);
+                block_start = refpos + bam_cigar_oplen(cigar[k]);
+            }
+            refpos += bam_cigar_oplen(cigar[k]);
+        }
+        if(refpos > block_start)
+            query(cf, block_start, refpos, out);
+    }
+
+    //returns false if the fragment is ambiguous under READ_COUNT_OVERLAP
+    bool count(const std::vector<uint32_t>& ids, std::vector<double>& cnts) {
+        if(ids.size() > 1 && READ_COUNT_OVERLAP == OVERLAP_UNIQUE)
+            return false;
+        const double w = READ_COUNT_OVERLAP == OVERLAP_FRACTION ? 1.0 / ids.size() : 1.0;
+        for(uint32_t id : ids)
+            cnts[id] += w;
+        return true;
+    }
+
+    void assign(std::vector<uint32_t>& ids) {
+        fragments++;
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if(ids.empty()) {
+            no_features++;
+            return;
+        }
+        if(count(ids, counts))
+            assigned++;
+        else
+            ambiguous++;
+        if(!has_names)
+            return;
+        name_hits.clear();
+        for(uint32_t id : ids)
+            name_hits.push_back(lines[id].name);
+        std::sort(name_hits.begin(), name_hits.end());
+        name_hits.erase(std::unique(name_hits.begin(), name_hits.end()), name_hits.end());
+        if(count(name_hits, name_counts))
+            names_assigned++;
+        else
+            names_ambiguous++;
+    }
+
+    //mates which are still waiting but whose mate would've been before before_tid
+    //(filtered out, or not fetched through the index) count on their own
+    void flush_pending(const int32_t before_tid) {
+        for(auto it = pending.begin(); it != pending.end(); ) {
+            if(before_tid == -1 || it->second.mtid < before_tid) {
+                assign(it->second.hits);
+                it = pending.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    void write_count(BufferedWriter* out, const double count) {
+        char buf[64];
+        if(READ_COUNT_OVERLAP == OVERLAP_FRACTION)
+            out->put(buf, sprintf(buf, "%.3f\n", count));
+        else
+            out->put_u64((uint64_t) count, '\n');
+    }
+
+public:
+    //reads the BED file passed to --annotation again, this time keeping the (optional) name column
+    ReadCounter(const char* bed_fn, const bam_hdr_t* hdr_) : hdr(hdr_),chrms(hdr_->n_targets),has_names(false),tid(-1),
+            fragments(0),assigned(0),ambiguous(0),no_features(0),names_assigned(0),names_ambiguous(0) {
+        FILE* fin = fopen(bed_fn, "r");
+        if(!fin) {
+            fprintf(stderr, "couldn't open annotation file %s for --read-counts, exiting\n", bed_fn);
+            exit(-1);
+        }
+        hashmap<std::string, uint32_t> name_ids;
+        char* line = nullptr;
+        size_t length = 0;
+        while(getline(&line, &length, fin) != -1) {
+            line[strcspn(line, "\r\n")] = '\0';
+            char* saveptr = nullptr;
+            char* chrm = strtok_r(line, "\t", &saveptr);
+            char* start = chrm ? strtok_r(nullptr, "\t", &saveptr) : nullptr;
+            char* end = start ? strtok_r(nullptr, "\t", &saveptr) : nullptr;
+            char* name = end ? strtok_r(nullptr, "\t", &saveptr) : nullptr;
+            if(!end) {
+                fprintf(stderr, "bad line in annotation file %s: %s\n", bed_fn, line);
+                exit(-1);
+            }
+            Line l = { chrm, (int32_t) atol(start), (int32_t) atol(end), 0 };
+            has_names = has_names || name;
+            //unnamed intervals are their own name
+            std::string key = name ? std::string(name) : l.chrm + ":" + std::to_string(l.start) + "-" + std::to_string(l.end);
+            auto nit = name_ids.find(key);
+            if(nit == name_ids.end()) {
+                nit = name_ids.emplace(key, names.size()).first;
+                names.push_back(key);
+            }
+            l.name = nit->second;
+            int32_t ltid = bam_name2id((bam_hdr_t*) hdr, chrm);
+            if(ltid >= 0)
+                chrms[ltid].features.push_back({l.start, l.end, (uint32_t) lines.size()});
+            lines.push_back(l);
+        }
+        free(line);
+        fclose(fin);
+        for(auto& cf : chrms) {
+            std::stable_sort(cf.features.begin(), cf.features.end(), feature_less);
+            cf.max_ends.resize(cf.features.size());
+            int32_t max_end = 0;
+            for(size_t i = 0; i < cf.features.size(); i++)
+                cf.max_ends[i] = max_end = std::max(max_end, cf.features[i].end);
+        }
+        counts.assign(lines.size(), 0.0);
+        name_counts.assign(names.size(), 0.0);
+    }
+
+    //one (filtered) alignment, expects them sorted by position
+    void add(const bam1_t* rec) {
+        const bam1_core_t* c = &rec->core;
+        if(c->tid < 0 || (c->flag & BAM_FUNMAP) != 0)
+            return;
+        if(c->tid != tid) {
+            flush_pending(c->tid);
+            tid = c->tid;
+        }
+        hits.clear();
+        overlaps(rec, &hits);
+        if((c->flag & BAM_FPAIRED) != 0 && (c->flag & (BAM_FMUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) == 0 && c->mtid >= 0) {
+            char* qname = bam_get_qname(rec);
+            auto it = pending.find(qname);
+            if(it != pending.end()) {
+                it->second.hits.insert(it->second.hits.end(), hits.begin(), hits.end());
+                assign(it->second.hits);
+                pending.erase(it);
+                return;
+            }
+            //otherwise the mate is only still to come if it's further along
+            if(c->mtid > c->tid || (c->mtid == c->tid && c->mpos >= c->pos)) {
+                PendingMate& pm = pending[qname];
+                pm.mtid = c->mtid;
+                pm.hits = hits;
+                return;
+            }
+        }
+        assign(hits);
+    }
+
+    //writes <prefix>.read_counts.tsv[.gz] (in BED order), <prefix>.read_counts.names.tsv[.gz] if there were names
+    //and <prefix>.read_counts.summary.tsv
+    void close(const char* prefix, const bool gzip) {
+        flush_pending(-1);
+        char fn[1024];
+        sprintf(fn, "%s.read_counts.tsv%s", prefix, gzip ? ".gz" : "");
+        BufferedWriter out(fn, hdr, gzip);
+        for(size_t i = 0; i < lines.size(); i++) {
+            const Line& l = lines[i];
+            out.reserve(l.chrm.size() + names[l.name].size() + COORD_STR_LEN + 64);
+            out.put(l.chrm.c_str(), l.chrm.size());
+            out.put('\t');
+            out.put_i32(l.start, '\t');
+            out.put_i32(l.end, '\t');
+            if(has_names) {
+                out.put(names[l.name].c_str(), names[l.name].size());
+                out.put('\t');
+            }
+            write_count(&out, counts[i]);
+        }
+        out.close();
+        if(has_names) {
+            sprintf(fn, "%s.read_counts.names.tsv%s", prefix, gzip ? ".gz" : "");
+            BufferedWriter nout(fn, hdr, gzip);
+            for(size_t i = 0; i < names.size(); i++) {
+                nout.reserve(names[i].size() + 64);
+                nout.put(names[i].c_str(), names[i].size());
+                nout.put('\t');
+                write_count(&nout, name_counts[i]);
+            }
+            nout.close();
+        }
+        sprintf(fn, "%s.read_counts.summary.tsv", prefix);
+        FILE* sfp = fopen_output(fn);
+        fprintf(sfp, "fragments\t%" PRIu64 "\n", fragments);
+        fprintf(sfp, "assigned\t%" PRIu64 "\n", assigned);
+        fprintf(sfp, "ambiguous\t%" PRIu64 "\n", ambiguous);
+        fprintf(sfp, "no_features\t%" PRIu64 "\n", no_features);
+        if(has_names) {
+            fprintf(sfp, "names_assigned\t%" PRIu64 "\n", names_assigned);
+            fprintf(sfp, "names_ambiguous\t%" PRIu64 "\n", names_ambiguous);
+        }
+        fclose(sfp);
+    }
+};
+
+//--max-depth: drops an alignment when max_depth of the alignments already let through still overlap its start,
+//the alignments come sorted by start so only the ends of those let through need to be kept (in a min heap)
+class DepthCap {
+    typedef std::priority_queue<int64_t, std::vector<int64_t>, std::greater<int64_t>> end_heap;
+    const size_t max_depth;
+    int32_t tid;
+    int32_t region;
+    uint64_t dropped;
+    end_heap ends;
+
+public:
+    DepthCap(const uint32_t max_depth_) : max_depth(max_depth_), tid(-1), region(-1), dropped(0) {}
+
+    //false if rec is dropped, otherwise it now counts toward the depth up to its end
+    //region is the --region(s) index rec was fetched for (-1 without), the depth starts over with each
+    bool admit(const bam1_t* rec, const int32_t region_) {
+        if(rec->core.tid != tid || region_ != region) {
+            ends = end_heap();
+            tid = rec->core.tid;
+            region = region_;
+        }
+        const int64_t pos = rec->core.pos;
+        while(!ends.empty() && ends.top() <= pos)
+            ends.pop();
+        if(ends.size() >= max_depth) {
+            dropped++;
+            return false;
+        }
+        ends.push(bam_endpos(rec));
+        return true;
+    }
+
+    uint64_t num_dropped() const { return dropped; }
+};
+
+//--stats: wall/CPU time per phase and per chromosome plus memory/size counters for one BAM/CRAM run,
+//written out as JSON at the end.
+//The per-record phases partition the main loop with lap() (one steady_clock read each, no CPU time),
+//the once-per-chromosome/once-per-run phases are bracketed with begin()/end() which also take the process CPU time.
+class RunStats {
+public:
+    enum Phase { SETUP, READ, COVERAGE, OTHER, PILEUP, ALTS, JUNCTIONS,
+                 COVERAGE_OUTPUT, ANNOTATION_OUTPUT, READ_ENDS_OUTPUT, FRAG_DIST_OUTPUT,
+                 BIGWIG_CLOSE, INDEX, NUM_PHASES };
+    enum Table { OVERLAPPING_MATES, FRAG_MATES, JX_PAIRS, ALTS_SAVED_MATES, OVERLAP_COORDS, NUM_TABLES };
+
+private:
+    typedef std::chrono::steady_clock clk;
+    struct ChromStats {
+        uint64_t records = 0;
+        uint64_t sequence_bases = 0;
+        double wall = 0;
+        double cpu = 0;
+        //coverage/annotation/read ends output done when this chromosome was finished
+        double output_wall = 0;
+    };
+    const char* fn;
+    clk::time_point start;
+    clk::time_point last;
+    clk::time_point chrm_start;
+    std::clock_t cpu_start;
+    std::clock_t cpu_mark;
+    std::clock_t chrm_cpu_start;
+    double wall[NUM_PHASES] = {};
+    double cpu[NUM_PHASES] = {};
+    bool has_cpu[NUM_PHASES] = {};
+    size_t table_peaks[NUM_TABLES] = {};
+    std::vector<ChromStats> chrms;
+    int32_t cur_tid;
+    const bam_hdr_t* hdr;
+
+    static double secs(clk::duration d) { return std::chrono::duration<double>(d).count(); }
+    static double cpu_secs(std::clock_t d) { return ((double) d) / CLOCKS_PER_SEC; }
+
+public:
+    uint64_t records = 0;
+    uint64_t records_processed = 0;
+    uint64_t coverage_array_bytes = 0;
+
+    RunStats(const char* fname, const bam_hdr_t* hdr_) : fn(fname),cur_tid(-1),hdr(hdr_) {
+        start = last = chrm_start = clk::now();
+        cpu_start = cpu_mark = chrm_cpu_start = std::clock();
+        chrms.resize(hdr->n_targets);
+    }
+
+    //charge the time since the previous lap/begin/end to phase
+    inline void lap(Phase phase) {
+        clk::time_point now = clk::now();
+        wall[phase] += secs(now - last);
+        last = now;
+    }
+    //start of a coarse phase, the time up to here goes to prev
+    void begin(Phase prev) {
+        lap(prev);
+        cpu_mark = std::clock();
+    }
+    //end of a coarse phase, if tid >= 0 the time is also counted as that chromosome's output time
+    void end(Phase phase, int32_t tid = -1) {
+        clk::time_point before = last;
+        lap(phase);
+        cpu[phase] += cpu_secs(std::clock() - cpu_mark);
+        has_cpu[phase] = true;
+        if(tid >= 0)
+            chrms[tid].output_wall += secs(last - before);
+    }
+
+    inline void record(const bam1_t* rec) {
+        int32_t tid = rec->core.tid;
+        if(tid != cur_tid)
+            switch_chrm(tid);
+        if(tid >= 0) {
+            chrms[tid].records++;
+            chrms[tid].sequence_bases += rec->core.l_qseq;
+        }
+    }
+    //time spent on a chromosome runs from its first record to the first record of the next one
+    void switch_chrm(int32_t tid) {
+        clk::time_point now = clk::now();
+        std::clock_t cnow = std::clock();
+        if(cur_tid >= 0) {
+            chrms[cur_tid].wall += secs(now - chrm_start);
+            chrms[cur_tid].cpu += cpu_secs(cnow - chrm_cpu_start);
+        }
+        chrm_start = now;
+        chrm_cpu_start = cnow;
+        cur_tid = tid;
+    }
+
+    inline void table_size(Table t, size_t sz) {
+        if(sz > table_peaks[t])
+            table_peaks[t] = sz;
+    }
+
+    void write(const char* input) {
+        static const char* phase_names[NUM_PHASES] = { "setup", "read_decompress", "calculate_coverage", "other_per_record",
+                    "pileup", "alts", "junctions", "coverage_output", "annotation_output", "read_ends_output",
+                    "frag_dist_output", "bigwig_close", "close_and_index" };
+        static const char* table_names[NUM_TABLES] = { "overlapping_mates", "frag_mates", "jx_pairs",
+                    "alts_saved_mates", "overlap_coords" };
+        switch_chrm(-1);
+        double total_wall = secs(clk::now() - start);
+        double total_cpu = cpu_secs(std::clock() - cpu_start);
+        long peak_rss_kb = -1;
+#ifndef WINDOWS_MINGW
+        struct rusage ru;
+        if(getrusage(RUSAGE_SELF, &ru) == 0)
+            peak_rss_kb = ru.ru_maxrss;
+#endif
+        std::vector<std::pair<std::string, uint64_t>> files;
+        OUTPUT_FILES.sizes(fn, files);
+
+        FILE* fh = fopen(fn, "w");
+        if(!fh) {
+            fprintf(stderr, "Failed to open %s for writing the run stats, skipping\n", fn);
+            return;
+        }
+        fprintf(fh, "{\n  \"megadepth_version\": \"%s\",\n  \"input\": ", MEGADEPTH_VERSION);
+        json_string(fh, input);
+        fprintf(fh, ",\n  \"simd\": \"%s\"", SIMD.name);
+        fprintf(fh, ",\n  \"wall_s\": %.6f,\n  \"cpu_s\": %.6f,\n  \"peak_rss_kb\": %ld,\n", total_wall, total_cpu, peak_rss_kb);
+        fprintf(fh, "  \"records\": %" PRIu64 ",\n  \"records_passed_filters\": %" PRIu64 ",\n", records, records_processed);
+        fprintf(fh, "  \"records_per_s\": %.1f,\n", total_wall > 0 ? records / total_wall : 0.0);
+        fprintf(fh, "  \"coverage_array_bytes\": %" PRIu64 ",\n", coverage_array_bytes);
+        fprintf(fh, "  \"phases\": {");
+        for(int i = 0; i < NUM_PHASES; i++) {
+            fprintf(fh, "%s\n    \"%s\": {\"wall_s\": %.6f, \"cpu_s\": ", i > 0 ? "," : "", phase_names[i], wall[i]);
+            if(has_cpu[i])
+                fprintf(fh, "%.6f}", cpu[i]);
+            else
+                fprintf(fh, "null}");
+        }
+        fprintf(fh, "\n  },\n  \"hash_table_peaks\": {");
+        for(int i = 0; i < NUM_TABLES; i++)
+            fprintf(fh, "%s\n    \"%s\": %zu", i > 0 ? "," : "", table_names[i], table_peaks[i]);
+        fprintf(fh, "\n  },\n  \"chromosomes\": [");
+        bool first = true;
+        for(int32_t i = 0; i < (int32_t) chrms.size(); i++) {
+            const ChromStats& cs = chrms[i];
+            if(cs.records == 0)
+                continue;
+            fprintf(fh, "%s\n    {\"name\": ", first ? "" : ",");
+            json_string(fh, hdr->target_name[i]);
+            fprintf(fh, ", \"records\": %" PRIu64 ", \"sequence_bases\": %" PRIu64 ", \"wall_s\": %.6f, \"cpu_s\": %.6f, \"output_wall_s\": %.6f, \"records_per_s\": %.1f}",
+                    cs.records, cs.sequence_bases, cs.wall, cs.cpu, cs.output_wall, cs.wall > 0 ? cs.records / cs.wall : 0.0);
+            first = false;
+        }
+        fprintf(fh, "\n  ],\n  \"outputs\": [");
+        for(size_t i = 0; i < files.size(); i++) {
+            fprintf(fh, "%s\n    {\"file\": ", i > 0 ? "," : "");
+            json_string(fh, files[i].first.c_str());
+            fprintf(fh, ", \"bytes\": %" PRIu64 "}", files[i].second);
+        }
+        fprintf(fh, "\n  ]\n}\n");
+        fclose(fh);
+    }
+
+    static void json_string(FILE* fh, const char* s) {
+        fputc('"', fh);
+        for(; *s; s++) {
+            if(*s == '"' || *s == '\\')
+                fprintf(fh, "\\%c", *s);
+            else if((unsigned char) *s < 0x20)
+                fprintf(fh, "\\u%04x", (unsigned char) *s);
+            else
+                fputc(*s, fh);
+        }
+        fputc('"', fh);
+    }
+};
+
+//--progress/--progress-file: heartbeat for long BAM/CRAM runs.
+//The record loop publishes its counters with relaxed atomic stores every PROGRESS_SAMPLE_MASK+1 records (no locks),
+//a background thread picks them up every interval seconds and reports the rate and ETA
+//to stderr and/or a Prometheus textfile (for node_exporter's textfile collector).
+static const uint64_t PROGRESS_SAMPLE_MASK = 4095;
+class ProgressReporter {
+    typedef std::chrono::steady_clock clk;
+    std::atomic<uint64_t> records;
+    std::atomic<int32_t> tid;
+    std::atomic<int64_t> pos;
+    //compressed offset into the input, only known for BAM
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<bool> reading_done;
+    std::atomic<bool> done;
+    BGZF* bgzf;
+    uint64_t input_size;
+    const bam_hdr_t* hdr;
+    //sum of the lengths of the targets before each one, for the ETA when bytes read isn't available
+    std::vector<uint64_t> chrm_offsets;
+    std::string input;
+    bool to_stderr;
+    const char* textfile;
+    int interval;
+    clk::time_point start_time;
+    double last_elapsed;
+    uint64_t last_records;
+    std::thread worker;
+
+    void run() {
+        int ticks = 0;
+        while(!done.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if(++ticks < interval * 10)
+                continue;
+            ticks = 0;
+            report();
+        }
+    }
+
+    static void format_duration(char* buf, double secs) {
+        long s = (long) secs;
+        sprintf(buf, "%02ld:%02ld:%02ld", s / 3600, (s / 60) % 60, s % 60);
+    }
+
+    void report() {
+        double elapsed = std::chrono::duration<double>(clk::now() - start_time).count();
+        uint64_t recs = records.load(std::memory_order_relaxed);
+        int32_t cur_tid = tid.load(std::memory_order_relaxed);
+        int64_t cur_pos = pos.load(std::memory_order_relaxed);
+        uint64_t cur_bytes = bytes_read.load(std::memory_order_relaxed);
+        bool finishing = reading_done.load();
+        bool finished = done.load();
+
+        double rate = elapsed > last_elapsed ? (recs - last_records) / (elapsed - last_elapsed) : 0.0;
+        last_elapsed = elapsed;
+        last_records = recs;
+        double fraction = 0.0;
+        if(finishing)
+            fraction = 1.0;
+        else if(bgzf && input_size > 0)
+            fraction = ((double) cur_bytes) / input_size;
+        else if(cur_tid >= 0 && chrm_offsets.back() > 0)
+            fraction = ((double) (chrm_offsets[cur_tid] + cur_pos)) / chrm_offsets.back();
+        if(fraction > 1.0)
+            fraction = 1.0;
+        double eta = fraction > 0.0 ? elapsed * (1.0 - fraction) / fraction : -1.0;
+
+        uint64_t output_bytes = 0;
+        std::vector<std::pair<std::string, uint64_t>> files;
+        OUTPUT_FILES.sizes(textfile, files);
+        for(auto& f : files)
+            output_bytes += f.second;
+
+        if(to_stderr && !finished) {
+            char eta_str[32] = "unknown";
+            if(eta >= 0.0)
+                format_duration(eta_str, eta);
+            if(finishing)
+                fprintf(stderr, "progress: %" PRIu64 " records read, writing outputs, %" PRIu64 " bytes written\n", recs, output_bytes);
+            else
+                fprintf(stderr, "progress: %" PRIu64 " records (%.0f/s) at %s:%" PRId64 ", %.1f%% done, ETA %s, %" PRIu64 " bytes written\n",
+                        recs, rate, cur_tid >= 0 ? hdr->target_name[cur_tid] : "*", cur_pos+1, fraction*100.0, eta_str, output_bytes);
+        }
+        if(textfile)
+            write_textfile(elapsed, recs, rate, cur_tid, cur_pos, cur_bytes, fraction, eta, output_bytes, finished);
+    }
+
+    void write_textfile(double elapsed, uint64_t recs, double rate, int32_t cur_tid, int64_t cur_pos, uint64_t cur_bytes,
+                        double fraction, double eta, uint64_t output_bytes, bool finished) {
+        //written to a temporary file first and renamed so the collector never sees a partial file
+        std::string tmp = std::string(textfile) + ".tmp";
+        FILE* fh = fopen(tmp.c_str(), "w");
+        if(!fh) {
+            fprintf(stderr, "Failed to open %s for writing the progress metrics, skipping\n", tmp.c_str());
+            return;
+        }
+        std::string label = "{input=\"";
+        for(char c : input) {
+            if(c == '"' || c == '\\')
+                label += '\\';
+            if(c == '\n')
+                label += "\\n";
+            else
+                label += c;
+        }
+        label += "\"}";
+        const char* l = label.c_str();
+        fprintf(fh, "# HELP megadepth_records_read_total Alignment records read so far.\n# TYPE megadepth_records_read_total counter\n");
+        fprintf(fh, "megadepth_records_read_total%s %" PRIu64 "\n", l, recs);
+        fprintf(fh, "# HELP megadepth_records_per_second Records read per second since the last report.\n# TYPE megadepth_records_per_second gauge\n");
+        fprintf(fh, "megadepth_records_per_second%s %.1f\n", l, rate);
+        if(bgzf && input_size > 0) {
+            fprintf(fh, "# HELP megadepth_input_bytes_read Compressed bytes of the input read so far.\n# TYPE megadepth_input_bytes_read gauge\n");
+            fprintf(fh, "megadepth_input_bytes_read%s %" PRIu64 "\n", l, cur_bytes);
+            fprintf(fh, "# HELP megadepth_input_bytes Compressed size of the input.\n# TYPE megadepth_input_bytes gauge\n");
+            fprintf(fh, "megadepth_input_bytes%s %" PRIu64 "\n", l, input_size);
+        }
+        fprintf(fh, "# HELP megadepth_current_tid Target ID of the last record read.\n# TYPE megadepth_current_tid gauge\n");
+        fprintf(fh, "megadepth_current_tid%s %d\n", l, cur_tid);
+        fprintf(fh, "# HELP megadepth_current_position Start position (0-based) of the last record read.\n# TYPE megadepth_current_position gauge\n");
+        fprintf(fh, "megadepth_current_position%s %" PRId64 "\n", l, cur_pos);
+        fprintf(fh, "# HELP megadepth_progress_ratio Estimated fraction of the input read.\n# TYPE megadepth_progress_ratio gauge\n");
+        fprintf(fh, "megadepth_progress_ratio%s %.4f\n", l, fraction);
+        fprintf(fh, "# HELP megadepth_eta_seconds Estimated seconds left reading the input, -1 if unknown.\n# TYPE megadepth_eta_seconds gauge\n");
+        fprintf(fh, "megadepth_eta_seconds%s %.0f\n", l, eta);
+        fprintf(fh, "# HELP megadepth_output_bytes Bytes written to the output files so far.\n# TYPE megadepth_output_bytes gauge\n");
+        fprintf(fh, "megadepth_output_bytes%s %" PRIu64 "\n", l, output_bytes);
+        fprintf(fh, "# HELP megadepth_elapsed_seconds Seconds since processing started.\n# TYPE megadepth_elapsed_seconds gauge\n");
+        fprintf(fh, "megadepth_elapsed_seconds%s %.1f\n", l, elapsed);
+        fprintf(fh, "# HELP megadepth_done 1 once all the outputs have been written.\n# TYPE megadepth_done gauge\n");
+        fprintf(fh, "megadepth_done%s %d\n", l, finished ? 1 : 0);
+        fclose(fh);
+        if(rename(tmp.c_str(), textfile) != 0)
+            fprintf(stderr, "Failed to rename %s to %s for the progress metrics\n", tmp.c_str(), textfile);
+    }
+
+public:
+    ProgressReporter(const char* input_, htsFile* fh, const bam_hdr_t* hdr_, bool to_stderr_, const char* textfile_, int interval_) :
+            records(0),tid(-1),pos(0),bytes_read(0),reading_done(false),done(false),bgzf(nullptr),input_size(0),hdr(hdr_),
+            input(input_),to_stderr(to_stderr_),textfile(textfile_),interval(interval_),last_elapsed(0),last_records(0) {
+        if(fh->format.format == bam) {
+            bgzf = fh->fp.bgzf;
+            struct stat st;
+            if(stat(input_, &st) == 0)
+                input_size = st.st_size;
+        }
+        chrm_offsets.resize(hdr->n_targets+1, 0);
+        for(int32_t i = 0; i < hdr->n_targets; i++)
+            chrm_offsets[i+1] = chrm_offsets[i] + hdr->target_len[i];
+        start_time = clk::now();
+        worker = std::thread(&ProgressReporter::run, this);
+    }
+
+    //called from the record loop
+    inline void sample(uint64_t recs, const bam1_t* rec) {
+        records.store(recs, std::memory_order_relaxed);
+        tid.store(rec->core.tid, std::memory_order_relaxed);
+        pos.store(rec->core.pos, std::memory_order_relaxed);
+        if(bgzf)
+            bytes_read.store(bgzf_tell(bgzf) >> 16, std::memory_order_relaxed);
+    }
+
+    void finished_reading(uint64_t recs) {
+        records.store(recs);
+        reading_done.store(true);
+    }
+
+    //stops the thread and writes the final metrics
+    void finish() {
+        done.store(true);
+        worker.join();
+        if(textfile)
+            report();
+    }
+};
+
+//the per-record work go_bam does, as a bitmask so the record loop can be instantiated
+//for the common option sets with every check folded away at compile time
+static const int F_COVERAGE = 1;
+//--min-unique-qual > 0 (with coverage)
+static const int F_UNIQUE = 2;
+//no --annotation, coverage is kept as difference arrays
+static const int F_NO_REGION = 4;
+static const int F_ALTS = 8;
+static const int F_PILEUP = 16;
+static const int F_FRAG_DIST = 32;
+static const int F_READ_ENDS = 64;
+static const int F_JUNCTIONS = 128;
+//any process_cigar() callbacks (--junctions, --num-bases)
+static const int F_CIGAR_OPS = 256;
+static const int F_SOFTCLIP = 512;
+static const int F_ECHO_SAM = 1024;
+static const int F_END_COORD = 2048;
+//checks everything at runtime, used for any option set not listed in go_bam_dispatch()
+static const int F_GENERIC = -1;
+
+//if this is the F_GENERIC instantiation, falls back to the runtime flag
+static constexpr bool has_feature(int features, int feature, bool runtime) {
+    return features == F_GENERIC ? runtime : (features & feature) != 0;
+}
+
+static constexpr int coverage_kernel_flags(int features) {
+    return features == F_GENERIC ? 0 :
+            (((features & F_COVERAGE) ? CC_COVERAGE : 0) | ((features & F_UNIQUE) ? CC_UNIQUE : 0)
+            | ((features & F_NO_REGION) ? CC_NO_REGION : 0) | ((features & (F_ALTS | F_PILEUP)) ? CC_OVERLAP_COORDS : 0));
+}
+
+//which of the per-record work the options ask for, go_bam sets itself up from this
+//and go_bam_dispatch() picks the instantiation from it
+static int option_features(int argc, const char** argv, uint64_t num_annotations) {
+    bool bigwig_opt = has_option(argv, argv+argc, "--bigwig");
+#ifdef WINDOWS_MINGW
+    bigwig_opt = false;
+#endif
+    bool compute_coverage = has_option(argv, argv+argc, "--coverage") || has_option(argv, argv+argc, "--auc") || argc == 1
+                    || has_option(argv, argv+argc, "--annotation") || bigwig_opt || has_option(argv, argv+argc, "--pileup-af")
+                    || has_option(argv, argv+argc, "--depth-dist") || has_option(argv, argv+argc, "--callable")
+                    || has_option(argv, argv+argc, "--split-by");
+    int features = 0;
+    if(compute_coverage) {
+        features |= F_COVERAGE;
+        if(has_option(argv, argv+argc, "--min-unique-qual"))
+            features |= F_UNIQUE;
+    }
+    if(num_annotations == 0)
+        features |= F_NO_REGION;
+    if(has_option(argv, argv+argc, "--alts"))
+        features |= F_ALTS;
+    if(has_option(argv, argv+argc, "--pileup") || has_option(argv, argv+argc, "--pileup-af"))
+        features |= F_PILEUP;
+    if(has_option(argv, argv+argc, "--frag-dist"))
+        features |= F_FRAG_DIST;
+    if(has_option(argv, argv+argc, "--read-ends"))
+        features |= F_READ_ENDS;
+    if(has_option(argv, argv+argc, "--junctions"))
+        features |= F_JUNCTIONS | F_CIGAR_OPS;
+    if(has_option(argv, argv+argc, "--num-bases"))
+        features |= F_CIGAR_OPS;
+    if(has_option(argv, argv+argc, "--include-softclip"))
+        features |= F_SOFTCLIP;
+    if(has_option(argv, argv+argc, "--echo-sam"))
+        features |= F_ECHO_SAM;
+    if(has_option(argv, argv+argc, "--ends"))
+        features |= F_END_COORD;
+    return features;
+}
+
+template <typename T, int FEATURES = F_GENERIC>
+int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, FILE* afp, BGZF* afpz, annotation_map_t<T>* annotations, chr2bool* annotation_chrs_seen, const char* prefix, bool sum_annotation, strlist* chrm_order, FILE* auc_file, uint64_t num_annotations, const window_specs* windows = nullptr, annotation_sets<T>* extra_sets = nullptr) {
     //only calculate AUC across either the BAM or the BigWig, but could be restricting to an annotation as well
     uint64_t all_auc = 0;
-    uint64_t unique_auc = 0;
     uint64_t annotated_auc = 0;
-    uint64_t unique_annotated_auc = 0;
+    //one per --min-unique-qual tier
+    std::vector<uint64_t> tier_aucs(COVERAGE_TIERS.size(), 0);
+    std::vector<uint64_t> tier_annotated_aucs(COVERAGE_TIERS.size(), 0);
+    //--stranded
+    uint64_t plus_auc = 0;
+    uint64_t minus_auc = 0;
+    uint64_t plus_annotated_auc = 0;
+    uint64_t minus_annotated_auc = 0;
 
     std::cerr << "Processing BAM: \"" << bam_arg << "\"" << std::endl;
 
@@ -2375,8 +5575,31 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     if(has_option(argv, argv+argc, "--head")) {
         print_header(hdr);
     }
-    hts_set_threads(bam_fh, nthreads);
-
+    hts_set_threads(bam_fh, nthreads);
+    RunStats* stats = nullptr;
+    if(has_option(argv, argv+argc, "--stats"))
+        stats = new RunStats(*(get_option(argv, argv+argc, "--stats")), hdr);
+    //the same mask go_bam_dispatch() picked FEATURES from
+    const int features = option_features(argc, argv, num_annotations);
+
+    //--region(s): only the merged regions are fetched (via the index) and reported,
+    //the per-base buffers are then sized to the longest region rather than to the longest chromosome
+    region_list regions;
+    const bool regions_mode = has_option(argv, argv+argc, "--region") || has_option(argv, argv+argc, "--regions");
+    if(regions_mode) {
+        if(num_annotations > 0 || has_option(argv, argv+argc, "--pileup") || has_option(argv, argv+argc, "--pileup-af") || LIBRARY_STRAND != STRAND_NONE) {
+            fprintf(stderr, "--region(s) can't be used with a BED file passed to --annotation, with --pileup(-af) or with --stranded, exiting\n");
+            exit(-1);
+        }
+        read_regions(argc, argv, hdr, &regions);
+        fprintf(stderr, "restricting to %lu merged region(s)\n", regions.size());
+    }
+    //--split-by keeps its groups' coverage at absolute (whole chromosome) positions
+    const bool split = SPLIT_TAG[0] != '\0';
+    if(split && regions_mode) {
+        fprintf(stderr, "--split-by can't be used with --region(s), exiting\n");
+        exit(-1);
+    }
 
     //setup list of callbacks for the process_cigar()
     //this is so we only have to walk the cigar for each alignment ~1 time
@@ -2397,24 +5620,23 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     FILE* softclip_file = nullptr;
     uint64_t total_softclip_count = 0;
     uint64_t total_number_sequence_bases_processed = 0;
-    if(has_option(argv, argv+argc, "--include-softclip")) {
+    if((features & F_SOFTCLIP) != 0) {
         include_sc = true;
         char afn[1024];
         sprintf(afn, "%s.softclip.tsv", prefix);
-        softclip_file = fopen(afn, "w");
+        softclip_file = fopen_output(afn);
     }
     const bool only_polya_sc = has_option(argv, argv+argc, "--only-polya");
     const bool include_n_mms = has_option(argv, argv+argc, "--include-n");
     //might change double_count later based on other options
     bool double_count = has_option(argv, argv+argc, "--double-count");
-    const bool report_end_coord = has_option(argv, argv+argc, "--ends");
+    const bool report_end_coord = (features & F_END_COORD) != 0;
     if(has_option(argv, argv+argc, "--test-polya")) {
         SOFTCLIP_POLYA_TOTAL_COUNT_MIN=1;
         SOFTCLIP_POLYA_RATIO_MIN=0.01;
     }
 
     size_t recs = 0;
-    std::vector<MdzOp> mdzbuf;
     bam1_t *rec = bam_init1();
     if(!rec) {
         std::cerr << "ERROR: Could not initialize BAM object: "
@@ -2426,15 +5648,21 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     //largest human chromosome is ~249M bases
     //long chr_size = 250000000;
     long chr_size = -1;
-    std::unique_ptr<uint32_t[]> coverages, unique_coverages;
+    std::unique_ptr<uint32_t[]> coverages;
+    //--min-unique-qual: coverage of just the alignments which pass each tier's filter
+    std::vector<std::unique_ptr<uint32_t[]>> tier_coverages;
+    uint32_t* tier_arrays[MAX_COVERAGE_TIERS];
+    //--stranded: coverage of the alignments on the plus/minus strand of the transcript
+    std::unique_ptr<uint32_t[]> plus_coverages, minus_coverages;
     bool compute_coverage = false;
-    int bw_unique_min_qual = 0;
     read2len overlapping_mates;
     read2len alts_overlapping_mates;
     read2overlaps* overlap_coords = nullptr;
     read2cigarops* first_mate_saved_ops = nullptr;
     bigWigFile_t *bwfp = nullptr;
-    bigWigFile_t *ubwfp = nullptr;
+    std::vector<bigWigFile_t*> tier_bwfps;
+    bigWigFile_t *pbwfp = nullptr;
+    bigWigFile_t *mbwfp = nullptr;
     //--coverage -> output perbase coverage to STDOUT (compute_coverage=true)
     //--bigwig -> output perbase coverage to bigwig (compute_coverage=true),
     //  this option overrides --coverage=>coverage will be *only* written to the bigwig
@@ -2444,6 +5672,7 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     bool auc_opt = has_option(argv, argv+argc, "--auc") || argc == 1;
     bool coverage_opt = has_option(argv, argv+argc, "--coverage");
     bool annotation_opt = has_option(argv, argv+argc, "--annotation");
+    const bool windowed = windows && !windows->empty();
     bool bigwig_opt = has_option(argv, argv+argc, "--bigwig");
 #ifdef WINDOWS_MINGW
     if(bigwig_opt) {
@@ -2452,6 +5681,29 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     }
 #endif
     bool dont_output_coverage = !(coverage_opt || bigwig_opt);
+    //the read count comes up front so the BigWigs get written scaled in the same pass
+    if(bigwig_opt && NORMALIZE != NORM_NONE) {
+        double mean_aligned_bases = 0.0;
+        //only the --subsample fraction of them make it into the coverage
+        const double mapped = count_mapped_reads(bam_arg, nthreads, NORMALIZE == NORM_RPGC, &mean_aligned_bases) * SUBSAMPLE_FRACTION;
+        double norm = 1.0;
+        if(NORMALIZE == NORM_CPM && mapped > 0)
+            norm = 1000000.0 / mapped;
+        else if(NORMALIZE == NORM_RPGC && mapped > 0 && mean_aligned_bases > 0) {
+            uint64_t genome_size = 0;
+            if(has_option(argv, argv+argc, "--effective-genome-size"))
+                genome_size = strtoull(*(get_option(argv, argv+argc, "--effective-genome-size")), nullptr, 10);
+            else {
+                for(int32_t i = 0; i < hdr->n_targets; i++)
+                    genome_size += hdr->target_len[i];
+            }
+            norm = genome_size / (mapped * mean_aligned_bases);
+        }
+        else
+            fprintf(stderr, "WARNING: no mapped reads to --normalize by, the BigWig(s) will only be scaled by --scale-factor\n");
+        BIGWIG_SCALE *= norm;
+        fprintf(stderr, "scaling the coverage BigWig(s) by %g\n", BIGWIG_SCALE);
+    }
     FILE* cov_fh = stdout;
     bool gzip = has_option(argv, argv+argc, "--gzip");
     bool no_coverage_stdout = gzip || has_option(argv, argv+argc, "--no-coverage-stdout");
@@ -2459,41 +5711,98 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     BGZF* gcov_fh = nullptr;
     hts_idx_t* cidx = nullptr;
     
-    bool unique = has_option(argv, argv+argc, "--min-unique-qual");
-    FILE* uafp = nullptr;
-    BGZF* uafpz = nullptr;
-    if(coverage_opt || auc_opt || annotation_opt || bigwig_opt) {
+    bool unique = false;
+    std::vector<FILE*> tier_afps;
+    std::vector<BGZF*> tier_afpzs;
+    const bool stranded = LIBRARY_STRAND != STRAND_NONE;
+    FILE* pafp = nullptr;
+    BGZF* pafpz = nullptr;
+    FILE* mafp = nullptr;
+    BGZF* mafpz = nullptr;
+    //--pileup-af needs the coverage for the depth at each position
+    const bool pileup_af = has_option(argv, argv+argc, "--pileup-af");
+    //--callable <depth>[,<depth>...]: merged intervals with at least each depth
+    std::vector<uint32_t> callable_depths;
+    if(has_option(argv, argv+argc, "--callable")) {
+        const char* depths_arg = *(get_option(argv, argv+argc, "--callable"));
+        char* depths_ = strdup(depths_arg ? depths_arg : "");
+        for(char* tok = strtok(depths_, ","); tok != nullptr; tok = strtok(nullptr, ",")) {
+            char* end = nullptr;
+            long depth = strtol(tok, &end, 10);
+            if(end == tok || *end != '\0' || depth < 1 || depth > UINT32_MAX) {
+                fprintf(stderr, "--callable needs a comma separated list of depths >= 1, not %s, exiting\n", depths_arg);
+                exit(-1);
+            }
+            callable_depths.push_back(depth);
+        }
+        std::free(depths_);
+        if(callable_depths.empty()) {
+            fprintf(stderr, "--callable needs a comma separated list of depths >= 1, exiting\n");
+            exit(-1);
+        }
+    }
+    const bool depth_opt = has_option(argv, argv+argc, "--depth-dist") || !callable_depths.empty();
+    if((features & F_COVERAGE) != 0) {
         compute_coverage = true;
-        chr_size = get_longest_target_size(hdr);
+        chr_size = regions_mode ? get_longest_region_size(regions) + 1 : get_longest_target_size(hdr);
         coverages.reset(new uint32_t[chr_size]);
         if(bigwig_opt)
             bwfp = create_bigwig_file(hdr, prefix,"all.bw");
-        if(unique) {
-            if(annotation_opt && window_size == 0) {
-                uafp = stdout;
-                if(gzip || has_option(argv, argv+argc, "--no-annotation-stdout")) {
+        unique = (features & F_UNIQUE) != 0;
+        for(auto const& tier : COVERAGE_TIERS) {
+            FILE* tafp = nullptr;
+            BGZF* tafpz = nullptr;
+            if(annotation_opt && !windowed) {
+                //only a single tier's sums can go to STDOUT
+                tafp = stdout;
+                if(gzip || has_option(argv, argv+argc, "--no-annotation-stdout") || COVERAGE_TIERS.size() > 1) {
                     char afn[1024];
                     if(gzip) {
-                        sprintf(afn, "%s.unique.tsv.gz", prefix);
-                        uafpz = bgzf_open(afn,"w10");
-                        uafp = nullptr;
+                        sprintf(afn, "%s.%s.tsv.gz", prefix, tier.name.c_str());
+                        tafpz = bgzf_open_output(afn);
+                        tafp = nullptr;
                     }
                     else {
-                        sprintf(afn, "%s.unique.tsv", prefix);
-                        uafp = fopen(afn, "w");
+                        sprintf(afn, "%s.%s.tsv", prefix, tier.name.c_str());
+                        tafp = fopen_output(afn);
                     }
                 }
             }
-            if(bigwig_opt)
-                ubwfp = create_bigwig_file(hdr, prefix, "unique.bw");
-            bw_unique_min_qual = atoi(*(get_option(argv, argv+argc, "--min-unique-qual")));
-            unique_coverages.reset(new uint32_t[chr_size]);
+            tier_afps.push_back(tafp);
+            tier_afpzs.push_back(tafpz);
+            tier_bwfps.push_back(bigwig_opt ? create_bigwig_file(hdr, prefix, (tier.name + ".bw").c_str()) : nullptr);
+            tier_coverages.emplace_back(new uint32_t[chr_size]);
+            tier_arrays[tier_coverages.size() - 1] = tier_coverages.back().get();
+        }
+        if(stranded) {
+            //the per strand annotation sums always go to their own files
+            if(annotation_opt && !windowed) {
+                char afn[1024];
+                if(gzip) {
+                    sprintf(afn, "%s.annotation.plus.tsv.gz", prefix);
+                    pafpz = bgzf_open_output(afn);
+                    sprintf(afn, "%s.annotation.minus.tsv.gz", prefix);
+                    mafpz = bgzf_open_output(afn);
+                }
+                else {
+                    sprintf(afn, "%s.annotation.plus.tsv", prefix);
+                    pafp = fopen_output(afn);
+                    sprintf(afn, "%s.annotation.minus.tsv", prefix);
+                    mafp = fopen_output(afn);
+                }
+            }
+            if(bigwig_opt) {
+                pbwfp = create_bigwig_file(hdr, prefix, "plus.bw");
+                mbwfp = create_bigwig_file(hdr, prefix, "minus.bw");
+            }
+            plus_coverages.reset(new uint32_t[chr_size]);
+            minus_coverages.reset(new uint32_t[chr_size]);
         }
         if(coverage_opt && !bigwig_opt && no_coverage_stdout) {
             char cov_fn[1024];
             if(gzip) {
                 sprintf(cov_fn, "%s.coverage.tsv.gz", prefix);
-                gcov_fh = bgzf_open(cov_fn,"w10");
+                gcov_fh = bgzf_open_output(cov_fn);
                 cov_fh = nullptr;
                 //from https://github.com/samtools/htslib/blob/c9175183c42382f1030503e88ca7e60cb9c08536/sam.c#L923
                 //and https://github.com/brentp/hts-nim/blob/0eaa867e747d3bc844b5ecb575796e4688b966f5/src/hts/csi.nim#L34
@@ -2504,45 +5813,98 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
             }
             else {
                 sprintf(cov_fn, "%s.coverage.tsv", prefix);
-                cov_fh = fopen(cov_fn,"w");
+                cov_fh = fopen_output(cov_fn);
             }
         }
     }
+    GroupSplitter* splitter = nullptr;
+    //the spans calculate_coverage adds for the current alignment's group
+    std::vector<int32_t> group_spans;
+    if(split) {
+        const char* groups_fn = has_option(argv, argv+argc, "--split-groups") ? *(get_option(argv, argv+argc, "--split-groups")) : nullptr;
+        splitter = new GroupSplitter(hdr, prefix, bigwig_opt, groups_fn, chrm_order, sum_annotation ? annotations : nullptr);
+    }
+    //--read-counts: per interval (and name) read/fragment counts over the same annotation
+    ReadCounter* read_counter = nullptr;
+    if(has_option(argv, argv+argc, "--read-counts")) {
+        if(!sum_annotation) {
+            fprintf(stderr, "--read-counts needs a BED file passed to --annotation, exiting\n");
+            exit(-1);
+        }
+        //only over the first BED file if more than one was passed in
+        std::string bed = *(get_option(argv, argv+argc, "--annotation"));
+        read_counter = new ReadCounter(bed.substr(0, bed.find(',')).c_str(), hdr);
+    }
+    const bool subsample = SUBSAMPLE_FRACTION < 1.0;
+    DepthCap* depth_cap = nullptr;
+    if(has_option(argv, argv+argc, "--max-depth")) {
+        const char* max_depth = *(get_option(argv, argv+argc, "--max-depth"));
+        long max_depth_ = max_depth ? atol(max_depth) : 0;
+        if(max_depth_ <= 0) {
+            fprintf(stderr, "--max-depth needs a depth > 0, exiting\n");
+            exit(-1);
+        }
+        depth_cap = new DepthCap(max_depth_);
+    }
     fraglen2count* frag_dist = new fraglen2count(1);
     mate2len* frag_mates = new mate2len(1);
     char cov_prefix[50]="";
     int32_t ptid = -1;
     std::unique_ptr<uint32_t[]> starts, ends;
     bool compute_ends = false;
-    FILE* rsfp = nullptr;
-    FILE* refp = nullptr;
-    if(has_option(argv, argv+argc, "--read-ends")) {
+    BufferedWriter* rsfp = nullptr;
+    BufferedWriter* refp = nullptr;
+    bigWigFile_t* rsbwfp = nullptr;
+    bigWigFile_t* rebwfp = nullptr;
+    if((features & F_READ_ENDS) != 0) {
         compute_ends = true;
-        char refn[1024];
-        sprintf(refn, "%s.starts.tsv", prefix);
-        rsfp = fopen(refn,"w");
-        sprintf(refn, "%s.ends.tsv", prefix);
-        refp = fopen(refn,"w");
+        bool read_ends_bigwig = has_option(argv, argv+argc, "--read-ends-bigwig");
+#ifdef WINDOWS_MINGW
+        if(read_ends_bigwig) {
+            read_ends_bigwig = false;
+            fprintf(stderr,"WARNING: writing BigWigs (--read-ends-bigwig) is not supported on Windows at this time, read starts/ends will be written as TSVs instead.\n");
+        }
+#endif
+        if(read_ends_bigwig) {
+            rsbwfp = create_bigwig_file(hdr, prefix, "starts.bw");
+            rebwfp = create_bigwig_file(hdr, prefix, "ends.bw");
+        }
+        else {
+            bool gzip_ends = has_option(argv, argv+argc, "--gzip-read-ends");
+            char refn[1024];
+            sprintf(refn, "%s.starts.tsv%s", prefix, gzip_ends?".gz":"");
+            rsfp = new BufferedWriter(refn, hdr, gzip_ends, gzip_ends);
+            sprintf(refn, "%s.ends.tsv%s", prefix, gzip_ends?".gz":"");
+            refp = new BufferedWriter(refn, hdr, gzip_ends, gzip_ends);
+            rsfp->set_index_conf(TBX_CONF_READ_ENDS);
+            refp->set_index_conf(TBX_CONF_READ_ENDS);
+        }
         if(chr_size == -1)
-            chr_size = get_longest_target_size(hdr);
+            chr_size = regions_mode ? get_longest_region_size(regions) + 1 : get_longest_target_size(hdr);
         starts.reset(new uint32_t[chr_size]);
         ends.reset(new uint32_t[chr_size]);
     }
     bool print_frag_dist = false;
     FILE* fragdist_file = nullptr;
-    if(has_option(argv, argv+argc, "--frag-dist")) {
+    if((features & F_FRAG_DIST) != 0) {
         char afn[1024];
         sprintf(afn, "%s.frags.tsv", prefix);
-        fragdist_file = fopen(afn, "w");
+        fragdist_file = fopen_output(afn);
         print_frag_dist = true;
     }
-    const bool echo_sam = has_option(argv, argv+argc, "--echo-sam");
-    std::fstream alts_file;
+    const bool echo_sam = (features & F_ECHO_SAM) != 0;
+    BufferedWriter* alts_file = nullptr;
+    //bases/quals of the alts saved from 1st mates
+    OpArena saved_ops_arena;
+    //start positions of 1st mates which still have alts waiting on their 2nd mate,
+    //used to keep the start coordinates in the alts index non-decreasing
+    std::multiset<int32_t> pending_mate_starts;
     bool compute_alts = false;
-    if(has_option(argv, argv+argc, "--alts")) {
+    if((features & F_ALTS) != 0) {
         char afn[1024];
-        sprintf(afn, "%s.alts.tsv", prefix);
-        alts_file.open(afn, std::fstream::out);
+        bool gzip_alts = has_option(argv, argv+argc, "--gzip-alts");
+        sprintf(afn, "%s.alts.tsv%s", prefix, gzip_alts?".gz":"");
+        alts_file = new BufferedWriter(afn, hdr, gzip_alts, gzip_alts);
         compute_alts = true;
         overlap_coords = new read2overlaps[1]();
         first_mate_saved_ops = new read2cigarops[1]();
@@ -2553,6 +5915,20 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         if(!compute_coverage)
             double_count = true;
     }
+    BufferedWriter* pileup_file = nullptr;
+    AltPileup* pileup = nullptr;
+    if((features & F_PILEUP) != 0) {
+        char afn[1024];
+        sprintf(afn, "%s.pileup.tsv", prefix);
+        pileup_file = new BufferedWriter(afn, hdr);
+        pileup = new AltPileup(pileup_file, hdr, pileup_af ? coverages.get() : nullptr, num_annotations == 0);
+        //same as for --alts, we need the overlapping segments between mates to avoid counting them twice
+        //and those only come from the coverage computation
+        if(!overlap_coords)
+            overlap_coords = new read2overlaps[1]();
+        if(!compute_coverage)
+            double_count = true;
+    }
     FILE* jxs_file = nullptr;
     bool extract_junctions = false;
     uint32_t len = 0;
@@ -2560,12 +5936,12 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     coords jx_coords;
     str2cstr jx_pairs;
     str2int jx_counts;
-    if(has_option(argv, argv+argc, "--junctions")) {
+    if((features & F_JUNCTIONS) != 0) {
         junctions.push_back(&len);
         junctions.push_back(&jx_coords);
         char afn[1024];
         sprintf(afn, "%s.jxs.tsv", prefix);
-        jxs_file = fopen(afn, "w");
+        jxs_file = fopen_output(afn);
         extract_junctions = true;
         process_cigar_callbacks.push_back(extract_junction);
         process_cigar_output_args.push_back(&junctions);
@@ -2603,9 +5979,17 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
 
     //init to 0's
     int* chrms_in_cidx = new int[hdr->n_targets+1]{};
-
-    //TODO: also implement automatic detection of >=80% region coverage of genome
-    //AND automatically turn this on if we're doing windowed regions as windowed regions never use the index
+    //all the window sets are summarized from the same pass over the coverage
+    WindowAggregator* window_agg = nullptr;
+    if(windowed)
+        window_agg = new WindowAggregator(*windows, prefix, hdr, gzip, !gzip && !has_option(argv, argv+argc, "--no-annotation-stdout"));
+    //so are the depth distribution and callable intervals
+    DepthSummary* depths = nullptr;
+    if(depth_opt)
+        depths = new DepthSummary(has_option(argv, argv+argc, "--depth-dist"), callable_depths, prefix, hdr, gzip);
+
+    //BAMIterator decides between the index and a full scan (or a mix) from the estimated bytes to read,
+    //--no-index forces the full scan, windowed regions never use the index
     bool skip_index = has_option(argv, argv+argc, "--no-index");
     int num_annotations_for_index = num_annotations;
     if(skip_index)
@@ -2617,11 +6001,72 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     //default of empty string for read name for alts
     char* qname_for_alts = emptystr;
 
-    BAMIterator<T> bitr(rec_, bam_fh, hdr, bam_arg, annotations, num_annotations_for_index, chrm_order);
+    //with more than one BED file the index fetches the union of their intervals
+    annotation_map_t<T>* fetch_annotations = annotations;
+    strlist* fetch_chrm_order = chrm_order;
+    annotation_map_t<T> all_annotations;
+    strlist all_chrm_order;
+    if(extra_sets && !extra_sets->empty()) {
+        add_annotations_for_fetch(annotations, chrm_order, &all_annotations, &all_chrm_order);
+        for(auto& set : *extra_sets) {
+            add_annotations_for_fetch(&set.annotations, &set.chrm_order, &all_annotations, &all_chrm_order);
+            if(num_annotations_for_index > 0)
+                num_annotations_for_index += set.num_annotations;
+        }
+        fetch_annotations = &all_annotations;
+        fetch_chrm_order = &all_chrm_order;
+    }
+    BAMIterator<T> bitr(rec_, bam_fh, hdr, bam_arg, fetch_annotations, num_annotations_for_index, fetch_chrm_order, regions_mode ? &regions : nullptr);
     BAMIterator<T> end(nullptr, nullptr, nullptr);
+    RegionCoverage* region_cov = nullptr;
+    if(regions_mode) {
+        region_cov = new RegionCoverage(regions, hdr, coverages, tier_coverages, starts.get(), ends.get());
+        region_cov->set_coverage_output(bwfp, tier_bwfps, cov_fh, dont_output_coverage, gcov_fh, cidx, chrms_in_cidx, window_agg, depths);
+        region_cov->set_read_ends_output(rsfp, refp, rsbwfp, rebwfp);
+    }
+    if(stats) {
+        uint64_t array_bytes = chr_size > 0 ? chr_size * sizeof(uint32_t) : 0;
+        stats->coverage_array_bytes = array_bytes * ((coverages ? 1 : 0) + tier_coverages.size() + (plus_coverages ? 2 : 0) + (starts ? 2 : 0));
+        stats->lap(RunStats::SETUP);
+    }
+    //per-record switches, compile-time constants unless this is the F_GENERIC instantiation
+    //the runtime flags were all set up from features, which go_bam_dispatch() picked FEATURES from
+    assert(FEATURES == F_GENERIC || FEATURES == features);
+    const bool do_coverage = has_feature(FEATURES, F_COVERAGE, compute_coverage);
+    const bool do_unique = has_feature(FEATURES, F_UNIQUE, unique);
+    const bool do_no_region = has_feature(FEATURES, F_NO_REGION, no_region);
+    const bool do_alts = has_feature(FEATURES, F_ALTS, compute_alts);
+    const bool do_pileup = has_feature(FEATURES, F_PILEUP, pileup != nullptr);
+    const bool do_frag_dist = has_feature(FEATURES, F_FRAG_DIST, print_frag_dist);
+    const bool do_ends = has_feature(FEATURES, F_READ_ENDS, compute_ends);
+    const bool do_junctions = has_feature(FEATURES, F_JUNCTIONS, extract_junctions);
+    const bool do_cigar_ops = has_feature(FEATURES, F_CIGAR_OPS, num_cigar_ops > 0);
+    const bool do_softclip = has_feature(FEATURES, F_SOFTCLIP, softclip_file != nullptr);
+    const bool do_echo_sam = has_feature(FEATURES, F_ECHO_SAM, echo_sam);
+    const bool do_end_coord = has_feature(FEATURES, F_END_COORD, report_end_coord);
+
+    ProgressReporter* progress = nullptr;
+    const bool progress_stderr = has_option(argv, argv+argc, "--progress");
+    const char* progress_file = nullptr;
+    if(has_option(argv, argv+argc, "--progress-file"))
+        progress_file = *(get_option(argv, argv+argc, "--progress-file"));
+    if(progress_stderr || progress_file) {
+        int interval = 30;
+        if(progress_stderr)
+            interval = atoi(*(get_option(argv, argv+argc, "--progress")));
+        if(interval <= 0)
+            interval = 30;
+        progress = new ProgressReporter(bam_arg, bam_fh, hdr, progress_stderr, progress_file, interval);
+    }
     for(++bitr; bitr != end; ++bitr) {
         recs++;
         rec = *bitr;
+        if(progress && (recs & PROGRESS_SAMPLE_MASK) == 0)
+            progress->sample(recs, rec);
+        if(stats) {
+            stats->lap(RunStats::READ);
+            stats->record(rec);
+        }
         bam1_core_t *c = &rec->core;
         //read name
         char* qname = bam_get_qname(rec);
@@ -2630,11 +6075,26 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         //filter OUT unmapped and secondary alignments
         //if((c->flag & BAM_FUNMAP) == 0 && (c->flag & BAM_FSECONDARY) == 0) {
         //catch case where c-flag is 0 and we've specified an all inclusive filter-in option (default)
-        if(((c->flag & filter_in_mask) != 0 && (c->flag & filter_out_mask) == 0)
-                                        || (c->flag == 0 && filter_in_mask == 0xFFFFFFFF)) {
-            reads_processed++;
+        //--subsample drops the rest of the templates here, before any of the per-alignment work
+        if((((c->flag & filter_in_mask) != 0 && (c->flag & filter_out_mask) == 0)
+                                        || (c->flag == 0 && filter_in_mask == 0xFFFFFFFF))
+                                        && (!subsample || subsample_keep(qname))) {
             //base-0 start coordinate
             int32_t refpos = rec->core.pos;
+            //with --region(s) an alignment overlapping 2 (or more) regions is fetched for each of them,
+            //it adds to the coverage and read starts/ends of each (clipped to the region) but everything else only counts it once
+            int32_t region = -1;
+            bool already_seen = false;
+            if(regions_mode) {
+                region = bitr.region();
+                const GenomicRegion& prev = regions[region > 0 ? region - 1 : 0];
+                already_seen = region > 0 && prev.tid == rec->core.tid && refpos < prev.end;
+            }
+            //the depth is only ever saturated on the chromosome (and region) of the alignments before, so ptid is already tid
+            if(depth_cap && !depth_cap->admit(rec, region))
+                continue;
+            if(!already_seen)
+                reads_processed++;
             //size of aligned portion of the read (start to end on the reference)
             uint32_t maplen = -1;
             //base-1 end coordinate
@@ -2646,64 +6106,151 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
             //ref chrm/contig ID
             int32_t tid = rec->core.tid;
             int32_t tlen = rec->core.isize;
+            //the --min-unique-qual tiers this alignment counts toward
+            const uint32_t tiers_passed = do_unique ? passing_tiers(rec, COVERAGE_TIERS) : 0;
 
             if(tid != ptid && ptid != -1)
                 chr_size = hdr->target_len[ptid];
             
-            if(softclip_file)
+            if(do_softclip && !already_seen)
                 total_number_sequence_bases_processed += c->l_qseq;
 
+            //finish the previous region(s) before the buffers are reused for this one
+            if(regions_mode && region != region_cov->region()) {
+                if(stats)
+                    stats->begin(RunStats::COVERAGE);
+                region_cov->finish(region, &all_auc, tier_aucs.data());
+                region_cov->start(region, refpos);
+                overlapping_mates.clear();
+                if(stats)
+                    stats->end(RunStats::COVERAGE_OUTPUT, ptid);
+            }
+
+            //finish the previous chromosome's pileup before its coverage is reset
+            if(do_pileup && tid != ptid) {
+                if(stats)
+                    stats->begin(RunStats::OTHER);
+                pileup->reset(tid);
+                if(stats)
+                    stats->end(RunStats::PILEUP, ptid);
+            }
+
+            if(read_counter)
+                read_counter->add(rec);
+
             //*******Reference coverage tracking
-            if(compute_coverage) {
-                if(tid != ptid) {
+            if(do_coverage) {
+                if(!regions_mode && tid != ptid) {
                     if(ptid != -1) {
+                        if(stats)
+                            stats->begin(RunStats::COVERAGE);
                         overlapping_mates.clear();
                         sprintf(cov_prefix, "cov\t%d", ptid);
-                        if(coverage_opt || bigwig_opt || auc_opt || window_size > 0) {
-                            if(no_region) {
-                                all_auc += print_array<int32_t>(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, afp, afpz, window_size, op);
-                                if(unique) {
+                        if(coverage_opt || bigwig_opt || auc_opt || windowed || depths) {
+                            if(do_no_region) {
+                                all_auc += print_array<int32_t>(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, window_agg, 0, depths);
+                                if(do_unique) {
                                     sprintf(cov_prefix, "ucov\t%d", ptid);
-                                    unique_auc += print_array<int32_t>(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) unique_coverages.get(), chr_size, false, ubwfp, cov_fh, dont_output_coverage, no_region);
+                                    for(size_t t = 0; t < tier_coverages.size(); t++)
+                                        tier_aucs[t] += print_array<int32_t>(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) tier_coverages[t].get(), chr_size, false, tier_bwfps[t], cov_fh, dont_output_coverage, no_region);
                                 }
                             }
                             else {
-                                all_auc += print_array<uint32_t>(cov_prefix, hdr->target_name[ptid], ptid, coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, afp, afpz, window_size, op);
-                                if(unique) {
+                                all_auc += print_array<uint32_t>(cov_prefix, hdr->target_name[ptid], ptid, coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, window_agg, 0, depths);
+                                if(do_unique) {
                                     sprintf(cov_prefix, "ucov\t%d", ptid);
-                                    unique_auc += print_array<uint32_t>(cov_prefix, hdr->target_name[ptid], ptid, unique_coverages.get(), chr_size, false, ubwfp, cov_fh, dont_output_coverage, no_region);
+                                    for(size_t t = 0; t < tier_coverages.size(); t++)
+                                        tier_aucs[t] += print_array<uint32_t>(cov_prefix, hdr->target_name[ptid], ptid, tier_coverages[t].get(), chr_size, false, tier_bwfps[t], cov_fh, dont_output_coverage, no_region);
                                 }
                             }
+                            if(stranded) {
+                                plus_auc += print_strand_array(hdr->target_name[ptid], ptid, plus_coverages.get(), chr_size, pbwfp, do_no_region);
+                                minus_auc += print_strand_array(hdr->target_name[ptid], ptid, minus_coverages.get(), chr_size, mbwfp, do_no_region);
+                            }
+                        }
+                        if(stats) {
+                            stats->end(RunStats::COVERAGE_OUTPUT, ptid);
+                            stats->begin(RunStats::ANNOTATION_OUTPUT);
                         }
                         //if we also want to sum coverage across a user supplied file of annotated regions
                         int keep_order_idx = keep_order?2:-1;
                         if(sum_annotation && annotations->find(hdr->target_name[ptid]) != annotations->end()) {
-                            sum_annotations(coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], afp, &annotated_auc, op, !annotation_opt, keep_order_idx);
-                            if(unique) {
-                                keep_order_idx = keep_order?3:-1;
-                                sum_annotations(unique_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], uafp, &unique_annotated_auc, op, !annotation_opt, keep_order_idx);
+                            sum_annotations(coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], afp, &annotated_auc, !annotation_opt, keep_order_idx);
+                            if(do_unique) {
+                                for(size_t t = 0; t < tier_coverages.size(); t++) {
+                                    keep_order_idx = keep_order?annotation_vals_idx(1 + t):-1;
+                                    sum_annotations(tier_coverages[t].get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], tier_afps[t], &tier_annotated_aucs[t], !annotation_opt, keep_order_idx);
+                                }
+                            }
+                            if(stranded) {
+                                keep_order_idx = keep_order?annotation_vals_idx(1 + tier_coverages.size()):-1;
+                                sum_annotations(plus_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], pafp, &plus_annotated_auc, !annotation_opt, keep_order_idx);
+                                keep_order_idx = keep_order?annotation_vals_idx(2 + tier_coverages.size()):-1;
+                                sum_annotations(minus_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], mafp, &minus_annotated_auc, !annotation_opt, keep_order_idx);
                             }
                             if(!keep_order)
                                 annotation_chrs_seen->insert(hdr->target_name[ptid]);
                         }
+                        if(sum_annotation && extra_sets)
+                            sum_annotation_sets(extra_sets, coverages.get(), chr_size, hdr->target_name[ptid], !annotation_opt, keep_order);
+                        if(splitter)
+                            splitter->finish_chromosome(ptid, sum_annotation ? annotations : nullptr);
+                        if(stats)
+                            stats->end(RunStats::ANNOTATION_OUTPUT, ptid);
                     }
                     //need to reset the array for the *current* chromosome's size, not the past one
                     reset_array(coverages.get(), hdr->target_len[tid]);
-                    if(unique)
-                        reset_array(unique_coverages.get(), hdr->target_len[tid]);
+                    if(do_unique) {
+                        for(auto& tier : tier_coverages)
+                            reset_array(tier.get(), hdr->target_len[tid]);
+                    }
+                    if(stranded) {
+                        reset_array(plus_coverages.get(), hdr->target_len[tid]);
+                        reset_array(minus_coverages.get(), hdr->target_len[tid]);
+                    }
+                }
+                if(regions_mode) {
+                    region_cov->fit(bam_endpos(rec));
+                    //the buffers might have grown
+                    for(size_t t = 0; t < tier_coverages.size(); t++)
+                        tier_arrays[t] = tier_coverages[t].get();
+                }
+                //--stranded only runs through the F_GENERIC instantiation
+                uint32_t* strand_coverages = nullptr;
+                if(stranded) {
+                    int strand = transcript_strand(rec, LIBRARY_STRAND);
+                    if(strand != -1)
+                        strand_coverages = strand == 0 ? plus_coverages.get() : minus_coverages.get();
                 }
-                end_refpos = calculate_coverage(rec, coverages.get(), unique_coverages.get(), double_count, bw_unique_min_qual, &overlapping_mates, &total_intron_len, overlap_coords, no_region);
+                //--split-by also only runs through F_GENERIC
+                int group = -1;
+                if(splitter) {
+                    group = splitter->group(rec);
+                    group_spans.clear();
+                }
+                if(FEATURES == F_GENERIC)
+                    end_refpos = calculate_coverage(rec, coverages.get(), unique ? tier_arrays : nullptr, double_count, tiers_passed, &overlapping_mates, &total_intron_len, overlap_coords, no_region, regions_mode ? region_cov->offset() : 0, strand_coverages, group != -1 ? &group_spans : nullptr);
+                else
+                    end_refpos = calculate_coverage_<coverage_kernel_flags(FEATURES)>(rec, coverages.get(), tier_arrays, double_count, tiers_passed, &overlapping_mates, &total_intron_len, overlap_coords);
+                if(group != -1)
+                    splitter->add(group, group_spans);
             }
+            if(stats)
+                stats->lap(RunStats::COVERAGE);
             //additional counting options which make use of knowing the end coordinate/maplen
             //however, if we're already running calculate_coverage, we don't need to redo this
-            if(end_refpos == -1 && (report_end_coord || print_frag_dist))
-                end_refpos = calculate_coverage(rec, nullptr, nullptr, double_count, bw_unique_min_qual, nullptr, &total_intron_len, overlap_coords, no_region);
+            if(end_refpos == -1 && (do_end_coord || do_frag_dist)) {
+                if(FEATURES == F_GENERIC)
+                    end_refpos = calculate_coverage(rec, nullptr, nullptr, double_count, 0, nullptr, &total_intron_len, overlap_coords, no_region);
+                else
+                    end_refpos = calculate_coverage_<0>(rec, nullptr, nullptr, double_count, 0, nullptr, &total_intron_len, nullptr);
+            }
 
-            if(report_end_coord)
+            if(do_end_coord && !already_seen)
                 fprintf(stdout, "%s\t%d\n", qname, end_refpos);
 
             //*******Fragment length distribution (per chromosome)
-            if(print_frag_dist) {
+            if(do_frag_dist && !already_seen) {
                 //csaw's getPESizes criteria
                 //first, don't count read that's got problems
                 if((c->flag & BAM_FSECONDARY) == 0 && (c->flag & BAM_FSUPPLEMENTARY) == 0 &&
@@ -2735,31 +6282,36 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
             //*******Start/end positions (for TSS,TES)
             //track read starts/ends
             //if minimum quality is set, then we only track starts/ends for alignments that pass
-            if(compute_ends) {
+            if(do_ends) {
                 int32_t refpos = rec->core.pos;
-                if(tid != ptid) {
+                if(!regions_mode && tid != ptid) {
                     if(ptid != -1) {
-                        for(uint32_t j = 0; j < chr_size; j++) {
-                            if(starts[j] > 0)
-                                fprintf(rsfp,"%s\t%d\t%d\n", hdr->target_name[ptid], j+1, starts[j]);
-                            if(ends[j] > 0)
-                                fprintf(refp,"%s\t%d\t%d\n", hdr->target_name[ptid], j+1, ends[j]);
-                        }
+                        if(stats)
+                            stats->begin(RunStats::OTHER);
+                        print_read_ends(rsfp, rsbwfp, hdr->target_name[ptid], ptid, starts.get(), chr_size);
+                        print_read_ends(refp, rebwfp, hdr->target_name[ptid], ptid, ends.get(), chr_size);
+                        if(stats)
+                            stats->end(RunStats::READ_ENDS_OUTPUT, ptid);
                     }
                     reset_array(starts.get(), hdr->target_len[tid]);
                     reset_array(ends.get(), hdr->target_len[tid]);
                 }
-                if(bw_unique_min_qual == 0 || rec->core.qual >= bw_unique_min_qual) {
-                    starts[refpos]++;
+                //only counts the alignments passing the first --min-unique-qual tier
+                if(!do_unique || (tiers_passed & 1) != 0) {
                     if(end_refpos == -1)
                         end_refpos = refpos + align_length(rec);
-                    //offset by 1
-                    ends[end_refpos-1]++;
+                    if(regions_mode)
+                        region_cov->count_read_ends(refpos, end_refpos);
+                    else {
+                        starts[refpos]++;
+                        //offset by 1
+                        ends[end_refpos-1]++;
+                    }
                 }
             }
 
             //echo back the sam record
-            if(echo_sam) {
+            if(do_echo_sam && !already_seen) {
                 int ret = sam_format1(hdr, rec, &sambuf);
                 if(ret < 0) {
                     std::cerr << "Could not format SAM record: " << std::strerror(errno) << std::endl;
@@ -2769,9 +6321,34 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
                 std::cout << '\n';
             }
 
+            if(stats)
+                stats->lap(RunStats::OTHER);
+
+            const uint8_t *mdz = nullptr;
+            if(do_alts || do_pileup) {
+                mdz = bam_aux_get(rec, "MD");
+                if(mdz)
+                    mdz++; // skip type character at beginning
+            }
+
+            //*******Per-position alt. base counts
+            if(do_pileup) {
+                pileup->flush(refpos);
+                const std::vector<Coordinate>* overlapping_coords = nullptr;
+                auto mit = overlap_coords->find(qname);
+                if(mit != overlap_coords->end())
+                    overlapping_coords = &(mit->second);
+                pileup_from_cigar(rec, mdz, pileup, overlapping_coords, include_n_mms);
+                //--alts will clean this up below if it's also running
+                if(!do_alts && mit != overlap_coords->end())
+                    overlap_coords->erase(mit);
+            }
+            if(stats)
+                stats->lap(RunStats::PILEUP);
+
             //*******Alternate base coverages, soft clipping output
             //track alt. base coverages
-            if(compute_alts) {
+            if(do_alts && !already_seen) {
                 //TODO: need to test the mate pair detection here
                 char* qname_for_alts_ = qname_for_alts;
                 bool track_qname = false;
@@ -2790,6 +6367,8 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
                 if(!double_count) {
                     if(tid != ptid) {
                         first_mate_saved_ops->clear();
+                        saved_ops_arena.clear();
+                        pending_mate_starts.clear();
                         overlap_coords->clear();
                     }
                     if(end_refpos == -1)
@@ -2827,38 +6406,46 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
                     }
                     first = false;
                 }
-                const uint8_t *mdz = bam_aux_get(rec, "MD");
+                if(alts_file->indexed())
+                    alts_file->set_index_floor(pending_mate_starts.empty() ? refpos : std::min(refpos, *pending_mate_starts.begin()));
                 if(!mdz) {
                     if(require_mdz) {
                         std::stringstream ss;
                         ss << "No MD:Z extra field for aligned read \"" << hdr->target_name[c->tid] << "\"";
                         throw std::runtime_error(ss.str());
                     }
-                    track_qname = output_from_cigar(rec, alts_file, &total_softclip_count, include_sc, only_polya_sc, qname, &overlapping_coords, &saved_ops, save_ops); // just use CIGAR
+                    track_qname = output_from_cigar(rec, *alts_file, &total_softclip_count, include_sc, only_polya_sc, qname, &overlapping_coords, &saved_ops, &saved_ops_arena, save_ops); // just use CIGAR
                 } else {
-                    mdzbuf.clear();
-                    parse_mdz(mdz + 1, mdzbuf); // skip type character at beginning
                     track_qname = output_from_cigar_mdz(
-                            rec, mdzbuf, alts_file, &total_softclip_count, qname, 
-                            &overlapping_coords, &saved_ops, save_ops = save_ops, 
+                            rec, mdz, *alts_file, &total_softclip_count, qname, 
+                            &overlapping_coords, &saved_ops, &saved_ops_arena, save_ops = save_ops, 
                             print_qual, include_sc, only_polya_sc, include_n_mms); // use CIGAR and MD:Z
                 }
-                if(save_ops && first_mate_saved_ops) 
+                if(save_ops && first_mate_saved_ops) {
                     first_mate_saved_ops->emplace(tn, saved_ops);
+                    if(saved_ops.size() > 0)
+                        pending_mate_starts.insert(refpos);
+                }
                 //cleanup
-                if(second_mate && saved_ops.size() > 0)
+                if(second_mate && saved_ops.size() > 0) {
                     first_mate_saved_ops->erase(qname);
+                    auto pit = pending_mate_starts.find(mrefpos);
+                    if(pit != pending_mate_starts.end())
+                        pending_mate_starts.erase(pit);
+                }
                 if(second_mate && potential_mate_found)
                     overlap_coords->erase(qname);
             }
+            if(stats)
+                stats->lap(RunStats::ALTS);
             ptid = tid;
 
             //*******Run various cigar-related functions for 1 pass through the cigar string
-            if(num_cigar_ops > 0)
+            if(do_cigar_ops && !already_seen)
                 process_cigar(rec->core.n_cigar, bam_get_cigar(rec), &cigar_str, &process_cigar_callbacks, &process_cigar_output_args);
 
             //*******Extract jx co-occurrences (not all junctions though)
-            if(extract_junctions) {
+            if(do_junctions && !already_seen) {
                 bool paired = (c->flag & BAM_FPAIRED) != 0;
                 int32_t tlen_orig = tlen;
                 int32_t mtid = c->mtid;
@@ -2930,8 +6517,22 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
                 *((uint32_t*) junctions[0]) = 0;
                 cl->clear();
             }
+            if(stats) {
+                stats->lap(RunStats::JUNCTIONS);
+                stats->table_size(RunStats::OVERLAPPING_MATES, overlapping_mates.size());
+                stats->table_size(RunStats::FRAG_MATES, frag_mates->size());
+                stats->table_size(RunStats::JX_PAIRS, jx_pairs.size());
+                if(first_mate_saved_ops)
+                    stats->table_size(RunStats::ALTS_SAVED_MATES, first_mate_saved_ops->size());
+                if(overlap_coords)
+                    stats->table_size(RunStats::OVERLAP_COORDS, overlap_coords->size());
+            }
         }
     }
+    if(stats)
+        stats->lap(RunStats::READ);
+    if(progress)
+        progress->finished_reading(recs);
     if(ptid != -1)
         chr_size = hdr->target_len[ptid];
     delete(cigar_str);
@@ -2939,123 +6540,203 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         fclose(jxs_file);
     }
     if(print_frag_dist) {
+        if(stats)
+            stats->begin(RunStats::OTHER);
         if(ptid != -1)
             print_frag_distribution(frag_dist, fragdist_file);
         fclose(fragdist_file);
+        if(stats)
+            stats->end(RunStats::FRAG_DIST_OUTPUT);
+    }
+    if(read_counter) {
+        read_counter->close(prefix, has_option(argv, argv+argc, "--gzip"));
+        delete read_counter;
+    }
+    if(pileup) {
+        if(stats)
+            stats->begin(RunStats::OTHER);
+        pileup->reset(-1);
+        pileup_file->close();
+        delete pileup;
+        delete pileup_file;
+        if(stats)
+            stats->end(RunStats::PILEUP, ptid);
+    }
+    if(region_cov) {
+        if(stats)
+            stats->begin(RunStats::OTHER);
+        region_cov->finish(regions.size(), &all_auc, tier_aucs.data());
+        delete region_cov;
+        if(stats)
+            stats->end(RunStats::COVERAGE_OUTPUT, ptid);
     }
     if(compute_coverage) {
-        if(ptid != -1) {
+        if(stats)
+            stats->begin(RunStats::OTHER);
+        if(ptid != -1 && !regions_mode) {
             sprintf(cov_prefix, "cov\t%d", ptid);
-            if(coverage_opt || bigwig_opt || auc_opt || window_size > 0) {
+            if(coverage_opt || bigwig_opt || auc_opt || windowed || depths) {
                 if(no_region)
-                    all_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, afp, afpz, window_size, op);
+                    all_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, window_agg, 0, depths);
                 else
-                    all_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, afp, afpz, window_size, op);
-                if(coverage_opt || window_size > 0) {
-                    //now print out all contigs/chrms in header which had 0 coverage, only do this for the "all reads" coverage
+                    all_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, coverages.get(), chr_size, false, bwfp, cov_fh, dont_output_coverage, no_region, gcov_fh, cidx, chrms_in_cidx, window_agg, 0, depths);
+                //now print out all contigs/chrms in header which had 0 coverage, only do this for the "all reads" coverage
+                //each window set tracks which chromosomes it's written on its own
+                if(window_agg)
+                    window_agg->add_missing_chromosomes();
+                if(depths)
+                    depths->add_missing_chromosomes();
+                if(coverage_opt) {
                     char* last_interval_line = new char[1024];
                     int line_len = 0;
                     int ret = 0;
-                    int (*printPtr) (void* fh, char* buf, uint32_t buf_len) = &my_write;
-                    void* wcfh = afp; 
-                    if(!afp) {
-                        printPtr = &my_gzwrite;
-                        wcfh = afpz; 
-                    }
-                    uint32_t wi = 0;
-                    char* val = new char[10];
-                    sprintf(val,"%d",0);
-                    if(op == cmean)
-                        sprintf(val,"%.2f",0.00);
-                    uint32_t wend = 0;
                     for(int ci=0; ci < hdr->n_targets; ci++) {
                         uint32_t chr_len = hdr->target_len[ci];
                         char* chr_name = hdr->target_name[ci];
                         if(chrms_in_cidx[ci+1] == 0) {
                             chrms_in_cidx[ci+1] = ++chrms_in_cidx[0];
-                            if(window_size > 0) {
-                                for(wi=0; wi < chr_len; wi+=window_size) {
-                                    wend = wi+window_size; 
-                                    if(wend > chr_len)
-                                        wend = chr_len;
-                                    line_len = sprintf(last_interval_line, "%s\t%u\t%u\t%s\n", chr_name, wi, wend, val); 
-                                    (*printPtr)(wcfh, last_interval_line, line_len);
-                                }
-                            }
-                            if(coverage_opt) {
-                                line_len = sprintf(last_interval_line, "%s\t0\t%u\t0\n", chr_name, chr_len); 
-                                if(gcov_fh) {
-                                    ret = bgzf_write(gcov_fh, last_interval_line, line_len);
-                                    if(cidx) {
-                                        if(hts_idx_push(cidx, chrms_in_cidx[ci+1]-1, 0, hdr->target_len[ci], bgzf_tell(gcov_fh), 1) < 0) {
-                                            fprintf(stderr,"error writing line in index at coordinates: %s:%u-%u, tid: %d idx tid: %d exiting\n", hdr->target_name[ci], 0, hdr->target_len[ci], ci, chrms_in_cidx[ci+1]-1);
-                                            exit(-1);
-                                        }
+                            line_len = sprintf(last_interval_line, "%s\t0\t%u\t0\n", chr_name, chr_len); 
+                            if(gcov_fh) {
+                                ret = bgzf_write(gcov_fh, last_interval_line, line_len);
+                                if(cidx) {
+                                    if(hts_idx_push(cidx, chrms_in_cidx[ci+1]-1, 0, hdr->target_len[ci], bgzf_tell(gcov_fh), 1) < 0) {
+                                        fprintf(stderr,"error writing line in index at coordinates: %s:%u-%u, tid: %d idx tid: %d exiting\n", hdr->target_name[ci], 0, hdr->target_len[ci], ci, chrms_in_cidx[ci+1]-1);
+                                        exit(-1);
                                     }
                                 }
-                                else
-                                    ret = fwrite(last_interval_line, sizeof(char), line_len, cov_fh);
                             }
+                            else
+                                ret = fwrite(last_interval_line, sizeof(char), line_len, cov_fh);
                         }
                     }
                 }
-                if(unique) {
-                    sprintf(cov_prefix, "ucov\t%d", ptid);
+                sprintf(cov_prefix, "ucov\t%d", ptid);
+                for(size_t t = 0; t < tier_coverages.size(); t++) {
                     if(no_region)
-                        unique_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) unique_coverages.get(), chr_size, false, ubwfp, cov_fh, dont_output_coverage, no_region);
+                        tier_aucs[t] += print_array(cov_prefix, hdr->target_name[ptid], ptid, (int32_t*) tier_coverages[t].get(), chr_size, false, tier_bwfps[t], cov_fh, dont_output_coverage, no_region);
                     else
-                        unique_auc += print_array(cov_prefix, hdr->target_name[ptid], ptid, unique_coverages.get(), chr_size, false, ubwfp, cov_fh, dont_output_coverage, no_region);
+                        tier_aucs[t] += print_array(cov_prefix, hdr->target_name[ptid], ptid, tier_coverages[t].get(), chr_size, false, tier_bwfps[t], cov_fh, dont_output_coverage, no_region);
                 }
+                if(stranded) {
+                    plus_auc += print_strand_array(hdr->target_name[ptid], ptid, plus_coverages.get(), chr_size, pbwfp, no_region);
+                    minus_auc += print_strand_array(hdr->target_name[ptid], ptid, minus_coverages.get(), chr_size, mbwfp, no_region);
+                }
+            }
+            if(stats) {
+                stats->end(RunStats::COVERAGE_OUTPUT, ptid);
+                stats->begin(RunStats::ANNOTATION_OUTPUT);
             }
             if(sum_annotation && annotations->find(hdr->target_name[ptid]) != annotations->end()) {
                 int keep_order_idx = keep_order?2:-1;
-                sum_annotations(coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], afp, &annotated_auc, op, false, keep_order_idx);
-                if(unique) {
-                    keep_order_idx = keep_order?3:-1;
-                    sum_annotations(unique_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], uafp, &unique_annotated_auc, op, false, keep_order_idx);
+                sum_annotations(coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], afp, &annotated_auc, false, keep_order_idx);
+                for(size_t t = 0; t < tier_coverages.size(); t++) {
+                    keep_order_idx = keep_order?annotation_vals_idx(1 + t):-1;
+                    sum_annotations(tier_coverages[t].get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], tier_afps[t], &tier_annotated_aucs[t], false, keep_order_idx);
+                }
+                if(stranded) {
+                    keep_order_idx = keep_order?annotation_vals_idx(1 + tier_coverages.size()):-1;
+                    sum_annotations(plus_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], pafp, &plus_annotated_auc, false, keep_order_idx);
+                    keep_order_idx = keep_order?annotation_vals_idx(2 + tier_coverages.size()):-1;
+                    sum_annotations(minus_coverages.get(), (*annotations)[hdr->target_name[ptid]], chr_size, hdr->target_name[ptid], mafp, &minus_annotated_auc, false, keep_order_idx);
                 }
                 if(!keep_order)
                     annotation_chrs_seen->insert(hdr->target_name[ptid]);
             }
+            if(sum_annotation && extra_sets)
+                sum_annotation_sets(extra_sets, coverages.get(), chr_size, hdr->target_name[ptid], false, keep_order);
+            if(splitter)
+                splitter->finish_chromosome(ptid, sum_annotation ? annotations : nullptr);
             //if we wanted to keep the chromosome order of the annotation output matching the input BED file
             //assert(afpz == uafpz || (afpz != nullptr && uafpz != nullptr));
-            if(keep_order)
-                output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, afpz, uafp, uafpz);
+            if(keep_order) {
+                //the first tier's sums are written along with the ones for all alignments, same as before there were tiers
+                output_all_coverage_ordered_by_BED(chrm_order, annotations, afp, afpz, unique ? tier_afps[0] : nullptr, unique ? tier_afpzs[0] : nullptr, op, nullptr, true);
+                for(size_t t = 1; t < tier_coverages.size(); t++)
+                    output_all_coverage_ordered_by_BED(chrm_order, annotations, tier_afps[t], tier_afpzs[t], nullptr, nullptr, op, nullptr, true, annotation_vals_idx(1 + t));
+                if(stranded && (pafp || pafpz))
+                    output_all_coverage_ordered_by_BED(chrm_order, annotations, pafp, pafpz, mafp, mafpz, op, nullptr, true, annotation_vals_idx(1 + tier_coverages.size()));
+            }
+        }
+        //flushes (and indexes) the windows before the AUCs, which might also go to STDOUT
+        if(depths) {
+            depths->close();
+            delete depths;
+        }
+        if(window_agg) {
+            window_agg->close();
+            delete window_agg;
         }
         if(sum_annotation && auc_file) {
             fprintf(auc_file, "ALL_READS_ANNOTATED_BASES\t%" PRIu64 "\n", annotated_auc);
-            if(unique)
-                fprintf(auc_file, "UNIQUE_READS_ANNOTATED_BASES\t%" PRIu64 "\n", unique_annotated_auc);
+            if(subsample)
+                fprintf(auc_file, "ALL_READS_ANNOTATED_BASES_SCALED\t%.3f\n", annotated_auc / SUBSAMPLE_FRACTION);
+            for(size_t t = 0; t < tier_coverages.size(); t++)
+                fprintf(auc_file, "%s_READS_ANNOTATED_BASES\t%" PRIu64 "\n", COVERAGE_TIERS[t].label.c_str(), tier_annotated_aucs[t]);
+            if(stranded) {
+                fprintf(auc_file, "PLUS_READS_ANNOTATED_BASES\t%" PRIu64 "\n", plus_annotated_auc);
+                fprintf(auc_file, "MINUS_READS_ANNOTATED_BASES\t%" PRIu64 "\n", minus_annotated_auc);
+            }
         }
         if(sum_annotation && !keep_order) {
-            output_missing_annotations(annotations, annotation_chrs_seen, afp);
-            if(unique)
-                output_missing_annotations(annotations, annotation_chrs_seen, uafp);
+            output_missing_annotations(annotations, annotation_chrs_seen, afp, op, true);
+            for(FILE* tafp : tier_afps)
+                output_missing_annotations(annotations, annotation_chrs_seen, tafp, op, true);
+            if(pafp) {
+                output_missing_annotations(annotations, annotation_chrs_seen, pafp, op, true);
+                output_missing_annotations(annotations, annotation_chrs_seen, mafp, op, true);
+            }
+        }
+        if(sum_annotation && extra_sets)
+            close_annotation_sets(extra_sets, keep_order, op, auc_file);
+        if(splitter) {
+            splitter->close(chrm_order, sum_annotation ? annotations : nullptr, gzip);
+            delete splitter;
         }
         if(auc_file) {
             fprintf(auc_file, "ALL_READS_ALL_BASES\t%" PRIu64 "\n", all_auc);
-            if(unique)
-                fprintf(auc_file, "UNIQUE_READS_ALL_BASES\t%" PRIu64 "\n", unique_auc);
+            //what the AUC over all the reads would have been, roughly
+            if(subsample)
+                fprintf(auc_file, "ALL_READS_ALL_BASES_SCALED\t%.3f\n", all_auc / SUBSAMPLE_FRACTION);
+            for(size_t t = 0; t < tier_coverages.size(); t++)
+                fprintf(auc_file, "%s_READS_ALL_BASES\t%" PRIu64 "\n", COVERAGE_TIERS[t].label.c_str(), tier_aucs[t]);
+            if(stranded) {
+                fprintf(auc_file, "PLUS_READS_ALL_BASES\t%" PRIu64 "\n", plus_auc);
+                fprintf(auc_file, "MINUS_READS_ALL_BASES\t%" PRIu64 "\n", minus_auc);
+            }
         }
+        if(stats)
+            stats->end(RunStats::ANNOTATION_OUTPUT, ptid);
     }
     if(compute_ends) {
-        if(ptid != -1) {
-            for(uint32_t j = 0; j < chr_size; j++) {
-                if(starts[j] > 0)
-                    fprintf(rsfp,"%s\t%d\t%d\n", hdr->target_name[ptid], j+1, starts[j]);
-                if(ends[j] > 0)
-                    fprintf(refp,"%s\t%d\t%d\n", hdr->target_name[ptid], j+1, ends[j]);
-            }
+        if(stats)
+            stats->begin(RunStats::OTHER);
+        if(ptid != -1 && !regions_mode) {
+            print_read_ends(rsfp, rsbwfp, hdr->target_name[ptid], ptid, starts.get(), chr_size);
+            print_read_ends(refp, rebwfp, hdr->target_name[ptid], ptid, ends.get(), chr_size);
+        }
+        if(stats)
+            stats->end(RunStats::READ_ENDS_OUTPUT, ptid);
+    }
+    if(stats)
+        stats->begin(RunStats::OTHER);
+    bool bw_written = false;
+    for(bigWigFile_t* fp : tier_bwfps) {
+        if(fp) {
+            bwClose(fp);
+            bw_written = true;
         }
     }
-    if(bwfp) {
-        bwClose(bwfp);
-        if(!ubwfp)
-            bwCleanup();
+    for(bigWigFile_t* fp : {bwfp, pbwfp, mbwfp, rsbwfp, rebwfp}) {
+        if(fp) {
+            bwClose(fp);
+            bw_written = true;
+        }
     }
-    if(ubwfp) {
-        bwClose(ubwfp);
+    if(bw_written)
         bwCleanup();
+    if(stats) {
+        stats->end(RunStats::BIGWIG_CLOSE);
+        stats->begin(RunStats::OTHER);
     }
     //for writing out an index for BGZipped coverage BED files
     char temp_afn[1024];
@@ -3072,32 +6753,52 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
     }
     if(gzip && afpz) {
         sprintf(temp_afn, "%s.annotation.tsv.gz", prefix);
-        if(window_size > 0)
-            sprintf(temp_afn, "%s.window.tsv.gz", prefix);
         bgzf_close(afpz);
-        if(tbx_index_build(temp_afn, min_shift, &tconf) != 0) {
+        if(index_output(temp_afn, min_shift, &tconf) != 0) {
             fprintf(stderr,"Error dumping BGZF index for annotation coverage (all alignments), skipping\n");
         }
     }
-    if(gzip && uafpz) {
-        sprintf(temp_afn, "%s.unique.tsv.gz", prefix);
-        bgzf_close(uafpz);
-        if(tbx_index_build(temp_afn, min_shift, &tconf) != 0) {
-            fprintf(stderr,"Error dumping BGZF index for annotation coverage (unique alignments), skipping\n");
+    for(size_t t = 0; t < tier_afpzs.size(); t++) {
+        if(!tier_afpzs[t])
+            continue;
+        sprintf(temp_afn, "%s.%s.tsv.gz", prefix, COVERAGE_TIERS[t].name.c_str());
+        bgzf_close(tier_afpzs[t]);
+        if(index_output(temp_afn, min_shift, &tconf) != 0) {
+            fprintf(stderr,"Error dumping BGZF index for annotation coverage (%s alignments), skipping\n", COVERAGE_TIERS[t].name.c_str());
+        }
+    }
+    if(pafpz) {
+        for(const char* strand : {"plus", "minus"}) {
+            sprintf(temp_afn, "%s.annotation.%s.tsv.gz", prefix, strand);
+            bgzf_close(strand[0] == 'p' ? pafpz : mafpz);
+            if(index_output(temp_afn, min_shift, &tconf) != 0) {
+                fprintf(stderr,"Error dumping BGZF index for annotation coverage (%s strand alignments), skipping\n", strand);
+            }
+        }
+    }
+    for(BufferedWriter* fp : {rsfp, refp}) {
+        if(fp) {
+            fp->close();
+            delete fp;
         }
     }
-    if(rsfp)
-        fclose(rsfp);
-    if(refp)
-        fclose(refp);
-    if(compute_alts && alts_file)
-        alts_file.close();
+    if(alts_file) {
+        alts_file->close();
+        delete alts_file;
+    }
     if(auc_file && auc_file != stdout)
         fclose(auc_file);
     if(afp && afp != stdout)
         fclose(afp);
-    if(uafp)
-        fclose(uafp);
+    for(FILE* tafp : tier_afps)
+        if(tafp && tafp != stdout)
+            fclose(tafp);
+    if(pafp) {
+        fclose(pafp);
+        fclose(mafp);
+    }
+    if(stats)
+        stats->end(RunStats::INDEX);
     fprintf(stderr,"Read %" PRIu64 " records\n",recs);
     if(count_bases) {
         fprintf(stdout,"%" PRIu64 " records passed filters\n",reads_processed);
@@ -3110,6 +6811,381 @@ int go_bam(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam
         fclose(softclip_file);
     }
     fprintf(stderr,"# of overlapping pairs: %" PRIu64 "\n", num_overlapping_pairs);
+    if(depth_cap) {
+        fprintf(stderr,"%" PRIu64 " records dropped by --max-depth\n", depth_cap->num_dropped());
+        delete depth_cap;
+    }
+    if(progress) {
+        progress->finish();
+        delete progress;
+    }
+    if(stats) {
+        stats->records = recs;
+        stats->records_processed = reads_processed;
+        stats->write(bam_arg);
+        delete stats;
+    }
+    return 0;
+}
+
+//the features go_bam_dispatch() specializes on, F_GENERIC for the options which aren't worth it
+static int requested_features(int argc, const char** argv, uint64_t num_annotations) {
+    //per-region buffers and duplicate fetches aren't worth specializing for, nor are the per read strand of --stranded
+    //and the per read group of --split-by
+    if(has_option(argv, argv+argc, "--region") || has_option(argv, argv+argc, "--regions") || has_option(argv, argv+argc, "--stranded")
+            || has_option(argv, argv+argc, "--split-by"))
+        return F_GENERIC;
+    return option_features(argc, argv, num_annotations);
+}
+
+//picks the go_bam instantiation for the option set, the common ones get their own record loop
+template <typename T>
+int go_bam_dispatch(const char* bam_arg, int argc, const char** argv, Op op, htsFile *bam_fh, int nthreads, bool keep_order, bool has_annotation, FILE* afp, BGZF* afpz, annotation_map_t<T>* annotations, chr2bool* annotation_chrs_seen, const char* prefix, bool sum_annotation, strlist* chrm_order, FILE* auc_file, uint64_t num_annotations, const window_specs* windows, annotation_sets<T>* extra_sets) {
+    //AUC only, or whole genome coverage (TSV/BigWig)
+    static const int AUC = F_COVERAGE | F_NO_REGION;
+    //sums over an annotation
+    static const int ANNOTATION = F_COVERAGE;
+    //recount's set: --bigwig --auc --min-unique-qual --annotation --frag-dist --alts --include-softclip --read-ends [--junctions]
+    static const int RECOUNT = F_COVERAGE | F_UNIQUE | F_FRAG_DIST | F_ALTS | F_SOFTCLIP | F_READ_ENDS;
+    static const int RECOUNT_JXS = RECOUNT | F_JUNCTIONS | F_CIGAR_OPS;
+#define GO_BAM(features) go_bam<T, features>(bam_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, afpz, annotations, annotation_chrs_seen, prefix, sum_annotation, chrm_order, auc_file, num_annotations, windows, extra_sets)
+    switch(requested_features(argc, argv, num_annotations)) {
+        case AUC: return GO_BAM(AUC);
+        case AUC | F_UNIQUE: return GO_BAM(AUC | F_UNIQUE);
+        case ANNOTATION: return GO_BAM(ANNOTATION);
+        case ANNOTATION | F_UNIQUE: return GO_BAM(ANNOTATION | F_UNIQUE);
+        case RECOUNT: return GO_BAM(RECOUNT);
+        case RECOUNT_JXS: return GO_BAM(RECOUNT_JXS);
+        default: return GO_BAM(F_GENERIC);
+    }
+#undef GO_BAM
+}
+
+//--sites: base counts at a list of known positions (e.g. SNPs) only.
+//The sites are loaded into a sorted array per chromosome and each alignment only walks its CIGAR
+//as far as is needed to look up its bases at the sites it overlaps, nothing is kept per base of the genome,
+//so memory (and, when the index is used, time) goes with the number of sites
+struct Site {
+    int32_t pos;
+    //'.' if not known (BED) or not a single base (e.g. indels in a VCF)
+    char ref;
+    char alt;
+    //A, C, G, T, N then deletions, same columns as --pileup
+    uint32_t n[PILEUP_DEL + 1];
+};
+typedef std::vector<std::vector<Site>> site_lists;
+
+static bool site_pos_less(const Site& s1, const Site& s2) {
+    return s1.pos < s2.pos;
+}
+
+static inline char site_base(const char* allele) {
+    if(strlen(allele) != 1 || !strchr("ACGTNacgtn", allele[0]))
+        return '.';
+    return toupper(allele[0]);
+}
+
+//reads the sites from a VCF (CHROM, POS, ID, REF, ALT, base-1) or a BED file (every base of each interval, base-0 half-open),
+//either can be gzipped, sites are kept per chromosome (by tid) and sorted by position
+static uint64_t read_sites(const char* fn, const bam_hdr_t* hdr, site_lists* sites) {
+    gzFile fin = gzopen(fn, "r");
+    if(!fin) {
+        fprintf(stderr, "couldn't open sites file %s, exiting\n", fn);
+        exit(-1);
+    }
+    bool vcf = strstr(fn, ".vcf") != nullptr;
+    char* line = new char[LINE_BUFFER_LENGTH];
+    uint64_t num_sites = 0;
+    uint64_t num_skipped = 0;
+    sites->assign(hdr->n_targets, std::vector<Site>());
+    while(gzgets(fin, line, LINE_BUFFER_LENGTH) != nullptr) {
+        size_t len = strlen(line);
+        //only the first few columns are needed, drop the rest of lines longer than the buffer (e.g. VCFs with many samples)
+        if(len > 0 && line[len-1] != '\n') {
+            char rest[4096];
+            while(gzgets(fin, rest, sizeof(rest)) != nullptr && rest[strlen(rest)-1] != '\n');
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if(strncmp(line, "##fileformat=VCF", 16) == 0)
+            vcf = true;
+        if(line[0] == '#' || line[0] == '\0' || strncmp(line, "track", 5) == 0 || strncmp(line, "browser", 7) == 0)
+            continue;
+        char* fields[5];
+        int nfields = 0;
+        char* saveptr = nullptr;
+        for(char* tok = strtok_r(line, vcf ? "\t" : " \t", &saveptr); tok && nfields < 5; tok = strtok_r(nullptr, vcf ? "\t" : " \t", &saveptr))
+            fields[nfields++] = tok;
+        char* endp = nullptr;
+        long start = nfields >= 2 ? strtol(fields[1], &endp, 10) : -1;
+        if(nfields < (vcf ? 5 : 3) || endp == fields[1] || *endp != '\0' || start < (vcf ? 1 : 0)) {
+            fprintf(stderr, "bad line in sites file %s: %s\n", fn, line);
+            exit(-1);
+        }
+        int32_t tid = bam_name2id((bam_hdr_t*) hdr, fields[0]);
+        if(tid < 0) {
+            num_skipped++;
+            continue;
+        }
+        std::vector<Site>& csites = (*sites)[tid];
+        if(vcf) {
+            //only the first of multiple ALT alleles
+            char* comma = strchr(fields[4], ',');
+            if(comma)
+                *comma = '\0';
+            csites.push_back({(int32_t) (start - 1), site_base(fields[3]), site_base(fields[4]), {}});
+            num_sites++;
+            continue;
+        }
+        long end = strtol(fields[2], &endp, 10);
+        if(endp == fields[2] || *endp != '\0' || end < start) {
+            fprintf(stderr, "bad line in sites file %s: %s\n", fn, line);
+            exit(-1);
+        }
+        for(long pos = start; pos < end; pos++)
+            csites.push_back({(int32_t) pos, '.', '.', {}});
+        num_sites += end - start;
+    }
+    delete[] line;
+    gzclose(fin);
+    for(auto& csites : *sites)
+        std::stable_sort(csites.begin(), csites.end(), site_pos_less);
+    if(num_skipped > 0)
+        fprintf(stderr, "WARNING: skipped %" PRIu64 " sites on chromosomes which aren't in the BAM header\n", num_skipped);
+    return num_sites;
+}
+
+//sites closer than this are fetched as one interval, the same alignments are likely to overlap both
+static const int32_t SITE_MERGE_GAP = 1000;
+
+//the sites as hts_reglist_t intervals (one entry per chromosome with sites), allocated the way htslib expects
+static hts_reglist_t* site_reglist(const bam_hdr_t* hdr, const site_lists& sites, int* count) {
+    hts_reglist_t* reglist = (hts_reglist_t*) calloc(hdr->n_targets + 1, sizeof(hts_reglist_t));
+    std::vector<hts_pair_pos_t> merged;
+    int n = 0;
+    for(int32_t tid = 0; tid < hdr->n_targets; tid++) {
+        const std::vector<Site>& csites = sites[tid];
+        if(csites.empty())
+            continue;
+        merged.clear();
+        for(const Site& site : csites) {
+            if(!merged.empty() && site.pos < merged.back().end + SITE_MERGE_GAP)
+                merged.back().end = std::max(merged.back().end, (hts_pos_t) site.pos + 1);
+            else
+                merged.push_back({site.pos, site.pos + 1});
+        }
+        hts_reglist_t& reg = reglist[n++];
+        reg.reg = hdr->target_name[tid];
+        reg.tid = tid;
+        reg.count = merged.size();
+        reg.intervals = (hts_pair_pos_t*) malloc(sizeof(hts_pair_pos_t) * merged.size());
+        std::copy(merged.begin(), merged.end(), reg.intervals);
+        reg.min_beg = merged.front().beg;
+        reg.max_end = merged.back().end;
+    }
+    *count = n;
+    return reglist;
+}
+
+//counts one alignment's bases (and deletions) at the sites it overlaps, starting with the site at index first
+//(the first one at or after the alignment's start), skip is the sorted list of site indices already counted
+//from this alignment's overlapping mate, the sites where a base was counted here are appended to counted (if passed in),
+//as for the coverage only the bases both mates align are counted once, not a deletion in one against a base in the other
+static void count_sites(const bam1_t* rec, std::vector<Site>& sites, size_t first, const std::vector<uint32_t>* skip, std::vector<uint32_t>* counted) {
+    const uint8_t* seq = bam_get_seq(rec);
+    const uint32_t* cigar = bam_get_cigar(rec);
+    const bool has_seq = rec->core.l_qseq > 0;
+    size_t i = first;
+    size_t skip_idx = 0;
+    size_t seq_off = 0;
+    int32_t ref_off = rec->core.pos;
+    for(uint32_t k = 0; k < rec->core.n_cigar && i < sites.size(); k++) {
+        int op = bam_cigar_op(cigar[k]);
+        int run = bam_cigar_oplen(cigar[k]);
+        int type = bam_cigar_type(op);
+        //consumes the reference
+        if(type & 2) {
+            int32_t ref_end = ref_off + run;
+            for(; i < sites.size() && sites[i].pos < ref_end; i++) {
+                //introns don't count toward anything
+                if(op == BAM_CREF_SKIP)
+                    continue;
+                if(skip) {
+                    while(skip_idx < skip->size() && (*skip)[skip_idx] < i)
+                        skip_idx++;
+                    if(skip_idx < skip->size() && (*skip)[skip_idx] == i)
+                        continue;
+                }
+                int col = PILEUP_DEL;
+                if(type & 1)
+                    col = has_seq ? pileup_col(bam_seqi(seq, seq_off + (sites[i].pos - ref_off))) : PILEUP_N;
+                sites[i].n[col]++;
+                if(counted && col != PILEUP_DEL)
+                    counted->push_back(i);
+            }
+            ref_off = ref_end;
+        }
+        //consumes the read
+        if(type & 1)
+            seq_off += run;
+    }
+}
+
+static void print_site_counts(BufferedWriter* out, const char* chrm, const Site& site) {
+    out->reserve(1024 + strlen(chrm));
+    out->put(chrm);
+    out->put('\t');
+    out->put_u32(site.pos, '\t');
+    out->put_u32(site.pos + 1, '\t');
+    out->put(site.ref);
+    out->put('\t');
+    out->put(site.alt);
+    out->put('\t');
+    uint32_t depth = 0;
+    for(int c = PILEUP_A; c <= PILEUP_N; c++)
+        depth += site.n[c];
+    out->put_u32(depth, '\t');
+    if(site.ref != '.')
+        out->put_u32(site.n[pileup_col(seq_nt16_table[(int) site.ref])], '\t');
+    else
+        out->put(".\t");
+    if(site.alt != '.')
+        out->put_u32(site.n[pileup_col(seq_nt16_table[(int) site.alt])], '\t');
+    else
+        out->put(".\t");
+    for(int c = PILEUP_A; c < PILEUP_DEL; c++)
+        out->put_u32(site.n[c], '\t');
+    out->put_u32(site.n[PILEUP_DEL], '\n');
+}
+
+//--sites mode: one row per site with its depth and ref/alt/per base counts, written to <prefix>.sites.tsv(.gz),
+//the alignments are fetched through the index when the sites are sparse enough for that to read less than a full scan
+template <typename T>
+int go_sites(const char* bam_arg, int argc, const char** argv, htsFile *bam_fh, int nthreads, const char* prefix) {
+    std::cerr << "Processing BAM: \"" << bam_arg << "\"" << std::endl;
+    bam_hdr_t *hdr = sam_hdr_read(bam_fh);
+    if(!hdr) {
+        std::cerr << "ERROR: Could not read header for " << bam_arg
+                  << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    hts_set_threads(bam_fh, nthreads);
+    const char* sites_fn = *(get_option(argv, argv+argc, "--sites"));
+    site_lists sites;
+    uint64_t num_sites = read_sites(sites_fn, hdr, &sites);
+    fprintf(stderr, "%" PRIu64 " sites read\n", num_sites);
+
+    int filter_in_mask = 0xFFFFFFFF;
+    if(has_option(argv, argv+argc, "--filter-in"))
+        filter_in_mask = atoi(*(get_option(argv, argv+argc, "--filter-in")));
+    int filter_out_mask = 260;
+    if(has_option(argv, argv+argc, "--filter-out"))
+        filter_out_mask = atoi(*(get_option(argv, argv+argc, "--filter-out")));
+
+    int reglist_count = 0;
+    hts_reglist_t* reglist = site_reglist(hdr, sites, &reglist_count);
+    if(has_option(argv, argv+argc, "--no-index")) {
+        hts_reglist_free(reglist, reglist_count);
+        reglist = nullptr;
+    }
+    bam1_t* rec_ = bam_init1();
+    BAMIterator<T> bitr(rec_, bam_fh, hdr, bam_arg, reglist, reglist_count);
+    BAMIterator<T> end(nullptr, nullptr, nullptr);
+    //for the first mate of an overlapping (proper) pair, the sites it counted a base at, so the second mate skips them
+    hashmap<std::string, std::vector<uint32_t>> mate_sites;
+    int32_t ptid = -1;
+    int32_t ppos = -1;
+    //index of the first site at or after the current alignment's start, since the alignments are sorted
+    //nothing before it is looked at again
+    size_t first = 0;
+    uint64_t recs = 0;
+    for(++bitr; bitr != end; ++bitr) {
+        recs++;
+        bam1_t* rec = *bitr;
+        bam1_core_t *c = &rec->core;
+        if(!(((c->flag & filter_in_mask) != 0 && (c->flag & filter_out_mask) == 0)
+                                        || (c->flag == 0 && filter_in_mask == 0xFFFFFFFF)))
+            continue;
+        if(SUBSAMPLE_FRACTION < 1.0 && !subsample_keep(bam_get_qname(rec)))
+            continue;
+        if(c->tid < 0)
+            continue;
+        if(c->tid != ptid) {
+            mate_sites.clear();
+            first = 0;
+            ptid = c->tid;
+        }
+        else if(c->pos < ppos) {
+            fprintf(stderr, "--sites requires a coordinate sorted BAM/CRAM, found alignment at %s:%" PRId64 " after %d, exiting\n", hdr->target_name[c->tid], c->pos+1, ppos+1);
+            exit(-1);
+        }
+        ppos = c->pos;
+        std::vector<Site>& csites = sites[c->tid];
+        while(first < csites.size() && csites[first].pos < c->pos)
+            first++;
+        if(first == csites.size())
+            continue;
+        std::vector<uint32_t>* skip = nullptr;
+        std::vector<uint32_t>* counted = nullptr;
+        hashmap<std::string, std::vector<uint32_t>>::iterator mit = mate_sites.end();
+        if((c->flag & BAM_FPROPER_PAIR) != 0 && (c->flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) == 0 && c->mtid == c->tid) {
+            char* qname = bam_get_qname(rec);
+            mit = mate_sites.find(qname);
+            if(mit != mate_sites.end())
+                skip = &(mit->second);
+            else if(c->mpos >= c->pos && c->mpos < bam_endpos(rec))
+                counted = &(mate_sites[qname]);
+        }
+        count_sites(rec, csites, first, skip, counted);
+        if(skip)
+            mate_sites.erase(mit);
+    }
+    bam_destroy1(rec_);
+
+    char sfn[1024];
+    const bool gzip = has_option(argv, argv+argc, "--gzip");
+    sprintf(sfn, "%s.sites.tsv%s", prefix, gzip ? ".gz" : "");
+    BufferedWriter out(sfn, hdr, gzip);
+    for(int32_t tid = 0; tid < hdr->n_targets; tid++) {
+        for(const Site& site : sites[tid])
+            print_site_counts(&out, hdr->target_name[tid], site);
+    }
+    out.close();
+    fprintf(stderr, "Read %" PRIu64 " records\n", recs);
+    bam_hdr_destroy(hdr);
+    return 0;
+}
+
+//--annotation can also be a comma separated list of window sizes (e.g. 25,1000,100000),
+//each of which is summarized with each op passed to --op (e.g. sum,mean), all from the same pass
+//leaves windows empty if afile isn't a window size, i.e. it's a BED file
+static int parse_window_sizes(const char* afile, int argc, const char** argv, window_specs* windows) {
+    strvec tokens;
+    split_string(std::string(afile), ',', &tokens);
+    std::vector<uint32_t> sizes;
+    for(auto const& token : tokens) {
+        char* endp = nullptr;
+        long size = strtol(token.c_str(), &endp, 10);
+        bool is_size = endp != token.c_str() && *endp == '\0';
+        if(!is_size && sizes.empty())
+            return 0;
+        if(!is_size || size <= 0 || size > UINT32_MAX) {
+            fprintf(stderr, "ERROR: bad window size \"%s\" passed to --annotation, exiting\n", token.c_str());
+            return -1;
+        }
+        if(std::find(sizes.begin(), sizes.end(), size) == sizes.end())
+            sizes.push_back(size);
+    }
+    std::vector<Op> ops;
+    if(has_option(argv, argv+argc, "--op"))
+        parse_operations(*(get_option(argv, argv+argc, "--op")), &ops);
+    else
+        ops.push_back(csum);
+    for(auto size : sizes) {
+        for(auto op : ops) {
+            windows->push_back({size, op});
+            fprintf(stderr, "computing coverage windows of length %u (%s)\n", size, OP_NAMES[op]);
+        }
+    }
     return 0;
 }
 
@@ -3141,40 +7217,94 @@ int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_f
     if(has_option(argv, argv+argc, "--prefix"))
             prefix = *(get_option(argv, argv+argc, "--prefix"));
     BGZF* afpz = nullptr;
-    uint32_t window_size = 0;
+    window_specs windows;
+    annotation_sets<T> extra_sets;
+    //--sites is its own pass, only looking at the alignments' bases at the sites
+    if(is_bam && has_option(argv, argv+argc, "--sites")) {
+        if(has_annotation || has_option(argv, argv+argc, "--region") || has_option(argv, argv+argc, "--regions")
+                || has_option(argv, argv+argc, "--max-depth")) {
+            std::cerr << "ERROR: --sites can't be used with --annotation, --region(s) or --max-depth" << std::endl;
+            return -1;
+        }
+        return go_sites<T>(fname_arg, argc, argv, bam_fh, nthreads, prefix);
+    }
     if(has_annotation) {
         const char* afile = *(get_option(argv, argv+argc, "--annotation"));
         if(!afile) {
             std::cerr << "No argument to --annotation" << std::endl;
             return -1;
         }
-        //TODO: parse afile for a window size (e.g. 200) if doing windowed regions
-        char* output_prefix = new char[100];
-        sprintf(output_prefix, "window");
-        window_size = strtol(afile, nullptr, 10);
-        if(window_size == 0) {
+        if(parse_window_sizes(afile, argc, argv, &windows) != 0)
+            return -1;
+        if(windows.empty()) {
+            //a comma separated list of BED files, the first is summed as it would be on its own,
+            //the others (optionally <label>=<BED>) each get their own <prefix>.<label>.annotation.tsv[.gz]
+            strvec beds;
+            split_string(std::string(afile), ',', &beds);
+            if(beds.size() > 1 && !is_bam) {
+                std::cerr << "ERROR: more than one BED file passed to --annotation is only supported for BAM/CRAM files" << std::endl;
+                return -1;
+            }
+            extra_sets.resize(beds.size() - 1);
+            for(size_t i = 1; i < beds.size(); i++) {
+                AnnotationSet<T>& set = extra_sets[i - 1];
+                std::string bed = beds[i];
+                size_t eq = bed.find('=');
+                if(eq != std::string::npos) {
+                    set.label = bed.substr(0, eq);
+                    bed = bed.substr(eq + 1);
+                }
+                else {
+                    //the file name without its directory or .bed extension
+                    set.label = bed.substr(bed.rfind('/') == std::string::npos ? 0 : bed.rfind('/') + 1);
+                    if(set.label.size() > 4 && set.label.compare(set.label.size() - 4, 4, ".bed") == 0)
+                        set.label.resize(set.label.size() - 4);
+                }
+                for(size_t j = 0; j < i - 1; j++) {
+                    if(extra_sets[j].label == set.label) {
+                        std::cerr << "ERROR: more than one BED file passed to --annotation with the label \"" << set.label << "\", use <label>=<BED> to tell them apart" << std::endl;
+                        return -1;
+                    }
+                }
+                FILE* bfp = fopen(bed.c_str(), "r");
+                if(!bfp) {
+                    std::cerr << "ERROR: couldn't open annotation file " << bed << std::endl;
+                    return -1;
+                }
+                err = read_annotation(bfp, &set.annotations, &set.chrm_order, keep_order, &set.num_annotations);
+                fclose(bfp);
+                if(gzip) {
+                    sprintf(set.afn, "%s.%s.annotation.tsv.gz", prefix, set.label.c_str());
+                    set.afpz = bgzf_open_output(set.afn);
+                }
+                else {
+                    sprintf(set.afn, "%s.%s.annotation.tsv", prefix, set.label.c_str());
+                    set.afp = fopen_output(set.afn);
+                }
+                std::cerr << set.annotations.size() << " chromosomes for annotated regions (" << set.label << ") read\n";
+            }
+            afile = beds[0].c_str();
             afp = fopen(afile, "r");
             err = read_annotation(afp, &annotations, &chrm_order, keep_order, &num_annotations);
             fclose(afp);
             assert(!annotations.empty());
             std::cerr << annotations.size() << " chromosomes for annotated regions read\n";
-            sprintf(output_prefix, "annotation");
             sum_annotation = true;
         }
-        else
-            fprintf(stderr, "computing coverage windows of length %u\n", window_size);
-
+    }
+    //window outputs are opened by go_bam, one per window set
+    if(sum_annotation) {
         afp = stdout;
         if(gzip || no_annotation_stdout) {
             char afn[1024];
             if(gzip) {
-                sprintf(afn, "%s.%s.tsv.gz", prefix, output_prefix);
-                afpz = bgzf_open(afn,"w10");
+                sprintf(afn, "%s.annotation.tsv.gz", prefix);
+                afpz = bgzf_open_output(afn);
                 afp = nullptr;
             }
             else {
-                sprintf(afn, "%s.%s.tsv", prefix, output_prefix);
-                afp = fopen(afn, "w");
+                sprintf(afn, "%s.annotation.tsv", prefix);
+                afp = fopen_output(afn);
             }
         }
     }
@@ -3189,13 +7319,13 @@ int go(const char* fname_arg, int argc, const char** argv, Op op, htsFile *bam_f
         if(has_option(argv, argv+argc, "--no-auc-stdout")) {
             char afn[1024];
             sprintf(afn, "%s.auc.tsv", prefix);
-            auc_file = fopen(afn, "w");
+            auc_file = fopen_output(afn);
         }
     }
 
     assert(err == 0);
     if(is_bam)
-        return go_bam(fname_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, afpz, &annotations, &annotation_chrs_seen, prefix, sum_annotation, &chrm_order, auc_file, num_annotations, window_size = window_size);
+        return go_bam_dispatch(fname_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, afpz, &annotations, &annotation_chrs_seen, prefix, sum_annotation, &chrm_order, auc_file, num_annotations, &windows, &extra_sets);
     else
         return go_bw(fname_arg, argc, argv, op, bam_fh, nthreads, keep_order, has_annotation, afp, afpz, &annotations, &annotation_chrs_seen, prefix, sum_annotation, &chrm_order, auc_file, num_annotations);
 }
@@ -3210,11 +7340,15 @@ int get_file_format_extension(const char* fname) {
             || strcmp("BW", &(fname[slen-2])) == 0
             || strcmp("bigwig", &(fname[slen-6])) == 0
             || strcmp("bigWig", &(fname[slen-6])) == 0
-            || strcmp("BigWig", &(fname[slen-6])) == 0)
+            || strcmp("BigWig", &(fname[slen-6])) == 0
+            //list of BigWigs to process in parallel (--threads)
+            || strcmp("txt", &(fname[slen-3])) == 0)
         return BW_FORMAT;
     return UNKNOWN_FORMAT;
 }
 
+//bench/microbench.cpp includes this file to time the kernels directly
+#ifndef MEGADEPTH_NO_MAIN
 int main(int argc, const char** argv) {
     argv++; argc--;  // skip binary name
     if(argc == 0 || has_option(argv, argv + argc, "--help") || has_option(argv, argv + argc, "--usage")) {
@@ -3260,10 +7394,18 @@ int main(int argc, const char** argv) {
             //from https://github.com/samtools/samtools/pull/299/files
             //and https://github.com/brentp/mosdepth/blob/389ca702c5709654a5d4c1608073d26315ce3e35/mosdepth.nim#L867
             //turn off decoding of unused base qualities and other unused fields for just base coverage
-            //but only if --alts isn't passed in
+            //but only if --alts/--pileup/--sites isn't passed in
             hts_set_opt(bam_fh, CRAM_OPT_DECODE_MD, 0);
             hts_set_opt(bam_fh, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT);
-            if(has_option(argv, argv+argc, "--alts")) {
+            //--stranded xs needs the XS:A tag, a --min-unique-qual nh1 tier the NH:i tag
+            if(has_option(argv, argv+argc, "--stranded")
+                    || (has_option(argv, argv+argc, "--min-unique-qual") && strstr(*(get_option(argv, argv+argc, "--min-unique-qual")), "nh1")))
+                hts_set_opt(bam_fh, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_AUX);
+            //and --split-by its tag, which for RG is decoded separately
+            if(has_option(argv, argv+argc, "--split-by"))
+                hts_set_opt(bam_fh, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_RNEXT | SAM_PNEXT | SAM_AUX | SAM_RGAUX);
+            if(has_option(argv, argv+argc, "--alts") || has_option(argv, argv+argc, "--pileup") || has_option(argv, argv+argc, "--pileup-af")
+                    || has_option(argv, argv+argc, "--sites")) {
                 //we want everything decoded
                 hts_set_opt(bam_fh, CRAM_OPT_DECODE_MD, 1);
                 hts_set_opt(bam_fh, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_MAPQ | SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_QUAL | SAM_AUX | SAM_RGAUX | SAM_SEQ);
@@ -3279,13 +7421,149 @@ int main(int argc, const char** argv) {
         }
     }
     Op op = csum;
+    bool fractional_stats = false;
     if(has_option(argv, argv+argc, "--op")) {
-        const char* opstr = *(get_option(argv, argv+argc, "--op"));
-        op = get_operation(opstr);
+        std::vector<Op> ops;
+        parse_operations(*(get_option(argv, argv+argc, "--op")), &ops);
+        op = ops[0];
+        if(!is_bam && (ops.size() > 1 || op == cbreadth)) {
+            std::cerr << "ERROR: more than one --op and --op breadth are only supported for BAM/CRAM files" << std::endl;
+            return -1;
+        }
+        //every op is computed per annotation in the same pass and output as its own column
+        ANNOTATION_OPS = ops;
+        fractional_stats = std::find(ops.begin(), ops.end(), cmean) != ops.end()
+                            || std::find(ops.begin(), ops.end(), cbreadth) != ops.end();
+    }
+    if(has_option(argv, argv+argc, "--breadth-depth"))
+        BREADTH_MIN_DEPTH = atoi(*(get_option(argv, argv+argc, "--breadth-depth")));
+    if(has_option(argv, argv+argc, "--min-unique-qual")) {
+        if(parse_coverage_tiers(*(get_option(argv, argv+argc, "--min-unique-qual")), &COVERAGE_TIERS) != 0)
+            return -1;
+    }
+    if(has_option(argv, argv+argc, "--stranded")) {
+        const char* library = *(get_option(argv, argv+argc, "--stranded"));
+        if(library && strcmp(library, "fr-firststrand") == 0)
+            LIBRARY_STRAND = STRAND_FR_FIRST;
+        else if(library && strcmp(library, "fr-secondstrand") == 0)
+            LIBRARY_STRAND = STRAND_FR_SECOND;
+        else if(library && strcmp(library, "xs") == 0)
+            LIBRARY_STRAND = STRAND_XS;
+        else {
+            std::cerr << "ERROR: --stranded needs one of fr-firststrand, fr-secondstrand or xs" << std::endl;
+            return -1;
+        }
+        if(!is_bam) {
+            std::cerr << "ERROR: --stranded is only supported for BAM/CRAM files" << std::endl;
+            return -1;
+        }
+    }
+    if(has_option(argv, argv+argc, "--split-by")) {
+        const char* split_by = *(get_option(argv, argv+argc, "--split-by"));
+        if(split_by && strcmp(split_by, "RG") == 0)
+            strcpy(SPLIT_TAG, "RG");
+        else if(split_by && strncmp(split_by, "tag:", 4) == 0 && strlen(split_by) == 6)
+            strcpy(SPLIT_TAG, split_by + 4);
+        else {
+            std::cerr << "ERROR: --split-by needs either RG or tag:XX where XX is a 2 character aux tag" << std::endl;
+            return -1;
+        }
+        if(!is_bam) {
+            std::cerr << "ERROR: --split-by is only supported for BAM/CRAM files" << std::endl;
+            return -1;
+        }
+    }
+    if(has_option(argv, argv+argc, "--scale-factor")) {
+        BIGWIG_SCALE = atof(*(get_option(argv, argv+argc, "--scale-factor")));
+        if(BIGWIG_SCALE <= 0) {
+            std::cerr << "ERROR: --scale-factor needs a number > 0" << std::endl;
+            return -1;
+        }
+    }
+    if(has_option(argv, argv+argc, "--bigwig-bin")) {
+        const char* bin = *(get_option(argv, argv+argc, "--bigwig-bin"));
+        long bin_size = bin ? atol(bin) : 0;
+        if(bin_size <= 0 || bin_size > INT32_MAX) {
+            std::cerr << "ERROR: --bigwig-bin needs a bin size > 0" << std::endl;
+            return -1;
+        }
+        BIGWIG_BIN = bin_size;
+    }
+    if(has_option(argv, argv+argc, "--bigwig-quantize")) {
+        const char* quanta = *(get_option(argv, argv+argc, "--bigwig-quantize"));
+        //same format as mosdepth's --quantize, e.g. 0:1:5:150: (the trailing : is optional)
+        char* quanta_ = strdup(quanta ? quanta : "");
+        for(char* tok = strtok(quanta_, ":"); tok != nullptr; tok = strtok(nullptr, ":")) {
+            char* end = nullptr;
+            double boundary = strtod(tok, &end);
+            if(end == tok || *end != '\0' || boundary < 0 || (!BIGWIG_QUANTA.empty() && boundary <= BIGWIG_QUANTA.back())) {
+                std::cerr << "ERROR: --bigwig-quantize needs increasing bucket boundaries >= 0 separated by :, e.g. 0:1:5:150:" << std::endl;
+                return -1;
+            }
+            BIGWIG_QUANTA.push_back(boundary);
+        }
+        std::free(quanta_);
+        if(BIGWIG_QUANTA.empty()) {
+            std::cerr << "ERROR: --bigwig-quantize needs increasing bucket boundaries >= 0 separated by :, e.g. 0:1:5:150:" << std::endl;
+            return -1;
+        }
+    }
+    if(has_option(argv, argv+argc, "--read-count-overlap")) {
+        const char* overlap = *(get_option(argv, argv+argc, "--read-count-overlap"));
+        if(overlap && strcmp(overlap, "unique") == 0)
+            READ_COUNT_OVERLAP = OVERLAP_UNIQUE;
+        else if(overlap && strcmp(overlap, "all") == 0)
+            READ_COUNT_OVERLAP = OVERLAP_ALL;
+        else if(overlap && strcmp(overlap, "fraction") == 0)
+            READ_COUNT_OVERLAP = OVERLAP_FRACTION;
+        else {
+            std::cerr << "ERROR: --read-count-overlap needs one of unique, all or fraction" << std::endl;
+            return -1;
+        }
+    }
+    if(has_option(argv, argv+argc, "--subsample")) {
+        const char* fraction = *(get_option(argv, argv+argc, "--subsample"));
+        char* end = nullptr;
+        SUBSAMPLE_FRACTION = fraction ? strtod(fraction, &end) : 0.0;
+        if(!fraction || end == fraction || *end != '\0' || SUBSAMPLE_FRACTION <= 0 || SUBSAMPLE_FRACTION > 1) {
+            std::cerr << "ERROR: --subsample needs a fraction > 0 and <= 1" << std::endl;
+            return -1;
+        }
+        if(!is_bam) {
+            std::cerr << "ERROR: --subsample is only supported for BAM/CRAM files" << std::endl;
+            return -1;
+        }
+        //2^64 * fraction, short of the fraction rounding up to 1
+        const double threshold = std::ldexp(SUBSAMPLE_FRACTION, 64);
+        SUBSAMPLE_THRESHOLD = threshold >= 18446744073709551615.0 ? UINT64_MAX : (uint64_t) threshold;
+        if(has_option(argv, argv+argc, "--subsample-seed")) {
+            const char* seed = *(get_option(argv, argv+argc, "--subsample-seed"));
+            SUBSAMPLE_SEED = seed ? strtoull(seed, nullptr, 10) : 0;
+        }
+    }
+    if(has_option(argv, argv+argc, "--max-depth") && !is_bam) {
+        std::cerr << "ERROR: --max-depth is only supported for BAM/CRAM files" << std::endl;
+        return -1;
+    }
+    if(has_option(argv, argv+argc, "--normalize")) {
+        const char* norm = *(get_option(argv, argv+argc, "--normalize"));
+        if(norm && strcmp(norm, "cpm") == 0)
+            NORMALIZE = NORM_CPM;
+        else if(norm && strcmp(norm, "rpgc") == 0)
+            NORMALIZE = NORM_RPGC;
+        else {
+            std::cerr << "ERROR: --normalize needs one of cpm or rpgc" << std::endl;
+            return -1;
+        }
+        if(!is_bam) {
+            std::cerr << "ERROR: --normalize is only supported for BAM/CRAM files" << std::endl;
+            return -1;
+        }
     }
     std::ios::sync_with_stdio(false);
-    if(!is_bam || op == cmean)
+    if(!is_bam || fractional_stats)
         return go<double>(fname_arg, argc, argv, op, bam_fh, is_bam);
     else
         return go<long>(fname_arg, argc, argv, op, bam_fh, is_bam);
 }
+#endif
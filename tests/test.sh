@@ -16,6 +16,10 @@ fi
 diff <(sort tests/test.bam.orig.frags.tsv) <(sort test.bam.frags.tsv)
 diff tests/test.bam.orig.alts.tsv test.bam.alts.tsv
 diff tests/test.bam.orig.softclip.tsv test.bam.softclip.tsv
+#same alts but BGZF'd + CSI indexed
+./md_runner tests/test.bam --prefix test.bam.gz --coverage --no-coverage-stdout --alts --include-softclip --only-polya --test-polya --filter-out 260 --gzip-alts
+diff tests/test.bam.orig.alts.tsv <(zcat test.bam.gz.alts.tsv.gz)
+test -s test.bam.gz.alts.tsv.gz.csi
 for f in annotation unique; do
     diff tests/test.bam.mosdepth.${f}.per-base.exon_sums.tsv test.bam.${f}.tsv
 done
@@ -28,10 +32,66 @@ diff tests/test.cram.coverage.tsv test.cram.coverage.tsv
 cut -f 1,4 test.cram.window.tsv | perl -ne 'chomp; ($c,$v)=split(/\t/,$_); $h{$c}+=$v; END { for $c (sort keys %h) { print "$c\t".$h{$c}."\n"; }}' > test.cram.window.summed.tsv
 diff tests/test.cram.window.summed.tsv test.cram.window.summed.tsv
 
+#multiple window sizes and ops in one pass, same as one run per window size and op
+./md_runner tests/test.bam --annotation 400,1000 --op sum,mean --prefix test.bam.windows --no-annotation-stdout
+for w in 400 1000; do
+    for o in sum mean; do
+        diff test.bam.windows.window.${w}.${o}.tsv <(./md_runner tests/test.bam --annotation $w --op $o)
+    done
+done
+
 #check --op mean with BAMs
 ./md_runner tests/test.bam --annotation tests/test_exons.bed --op mean > test.bam.mean
 paste <(cut -f 4 test.bam.annotation.tsv) <(cut -f 2- test.bam.mean) | perl -ne 'chomp; $f=$_; ($sum,$s,$e,$m)=split(/\t/,$_); $d=($e-$s); $m2=$sum/$d; $m2=sprintf("%.2f",$m2); if($m != $m2) { print "$f\n"; $ret=1;} END { exit($ret); }'
 
+#several statistics per annotation in one pass, each column is the same as its own run
+./md_runner tests/test.bam --annotation tests/test_exons.bed --op sum,mean,max > test.bam.stats
+diff <(cut -f 1-4 test.bam.stats) <(./md_runner tests/test.bam --annotation tests/test_exons.bed)
+diff <(cut -f 1-3,5 test.bam.stats) test.bam.mean
+diff <(cut -f 1-3,6 test.bam.stats) <(./md_runner tests/test.bam --annotation tests/test_exons.bed --op max)
+
+#with just chr10's exons, fetching them through the index is cheaper than a full scan (test.bam is one BGZF block),
+#the sums are the same as when reading the whole BAM
+awk '$1 == "chr10"' tests/test_exons.bed > test.bam.chr10.bed
+./md_runner tests/test.bam --annotation test.bam.chr10.bed --prefix test.bam.chr10 --no-annotation-stdout 2> test.bam.chr10.err
+grep "^estimated reads: .*using the index$" test.bam.chr10.err
+./md_runner tests/test.bam --annotation test.bam.chr10.bed --no-index --prefix test.bam.chr10.scan --no-annotation-stdout
+diff test.bam.chr10.annotation.tsv test.bam.chr10.scan.annotation.tsv
+
+#several BED files in one pass, each the same as its own run
+./md_runner tests/test.bam --annotation tests/test_exons.bed,tests/testbw2.bed,bw1=tests/testbw1.bed --op sum,mean --auc --prefix test.bam.beds --no-annotation-stdout > test.bam.beds.auc
+diff test.bam.beds.annotation.tsv <(./md_runner tests/test.bam --annotation tests/test_exons.bed --op sum,mean)
+diff test.bam.beds.testbw2.annotation.tsv <(./md_runner tests/test.bam --annotation tests/testbw2.bed --op sum,mean)
+diff test.bam.beds.bw1.annotation.tsv <(./md_runner tests/test.bam --annotation tests/testbw1.bed --op sum,mean)
+diff <(fgrep "ANNOTATED_BASES_bw1" test.bam.beds.auc | cut -f 2) <(./md_runner tests/test.bam --annotation tests/testbw1.bed --auc --no-annotation-stdout --prefix test.bam.bw1only | fgrep "ANNOTATED_BASES" | cut -f 2)
+
+#several --min-unique-qual tiers in one pass, each the same as its own run
+./md_runner tests/test.bam --annotation tests/test_exons.bed --min-unique-qual 10,255,nh1 --prefix test.bam.tiers --no-annotation-stdout
+for q in 10 255 nh1; do
+    ./md_runner tests/test.bam --annotation tests/test_exons.bed --min-unique-qual $q --prefix test.bam.tier --no-annotation-stdout
+    t=$q; if [[ $q != "nh1" ]]; then t=q$q; fi
+    diff test.bam.tiers.unique.${t}.tsv test.bam.tier.unique.tsv
+done
+
+#per strand annotation sums in one pass, the plus and minus strands add up to the unstranded sums
+#and fr-secondstrand just swaps them
+./md_runner tests/test.bam --annotation tests/test_exons.bed --stranded fr-firststrand --prefix test.bam.first --no-annotation-stdout
+./md_runner tests/test.bam --annotation tests/test_exons.bed --stranded fr-secondstrand --prefix test.bam.second --no-annotation-stdout
+paste test.bam.first.annotation.tsv test.bam.first.annotation.plus.tsv test.bam.first.annotation.minus.tsv | awk '$4 != $8 + $12 {ret=1} END {exit ret}'
+diff test.bam.first.annotation.plus.tsv test.bam.second.annotation.minus.tsv
+diff test.bam.first.annotation.minus.tsv test.bam.second.annotation.plus.tsv
+
+#per group annotation sums in one pass, every alignment in test.bam has either an RG (BWA) or an NH (STAR) tag
+#so the groups from both splits add up to the overall sums
+./md_runner tests/test.bam --annotation tests/test_exons.bed --split-by RG --prefix test.bam.rg --no-annotation-stdout
+./md_runner tests/test.bam --annotation tests/test_exons.bed --split-by tag:NH --prefix test.bam.nh --no-annotation-stdout
+paste <(tail -n +2 test.bam.rg.groups.annotation.tsv) <(tail -n +2 test.bam.nh.groups.annotation.tsv | cut -f 4-) | awk -v OFS='\t' '{s=0; for(i=4;i<=NF;i++) s+=$i; print $1,$2,$3,s}' | diff - test.bam.rg.annotation.tsv
+
+#depth distribution and callable intervals come from the same runs as the coverage
+./md_runner tests/test.bam --coverage --no-coverage-stdout --depth-dist --callable 1,5 --prefix test.bam.depth
+diff <(awk -v OFS='\t' '{h[$1"\t"$4]+=$3-$2} END {for(k in h) print k,h[k]}' test.bam.depth.coverage.tsv | sort) <(awk -v OFS='\t' '$1 != "total" && $3 > 0 {print $1,$2,$3}' test.bam.depth.depth.dist.tsv | sort)
+diff <(awk -v OFS='\t' '$4 >= 5 { if($1 == c && $2 == e) e=$3; else { if(c != "") print c,s,e; c=$1; s=$2; e=$3 } } END { if(c != "") print c,s,e }' test.bam.depth.coverage.tsv) test.bam.depth.callable.5.bed
+
 ./md_runner tests/test.bam | fgrep "ALL_READS_ALL_BASES" > auc.single
 diff auc.single <(fgrep "ALL_READS_ALL_BASES" tests/test.bam.mosdepth.bwtool.all_aucs)
 
@@ -42,10 +102,40 @@ time ./md_runner tests/test2.bam --threads 4 --junctions --prefix test2.bam > te
 
 diff tests/test2.bam.jxs.tsv test2.bam.jxs.tsv
 
+#read starts/ends as BGZF'd TSVs and as BigWigs should have the same totals
+./md_runner tests/test.bam --read-ends --gzip-read-ends --min-unique-qual 10 --prefix test.bam.reg
+./md_runner tests/test.bam --read-ends --read-ends-bigwig --min-unique-qual 10 --prefix test.bam.re
+for f in starts ends; do
+    diff <(./md_runner test.bam.re.${f}.bw | fgrep "AUC_ALL_BASES" | cut -f 2) <(zcat test.bam.reg.${f}.tsv.gz | perl -ne '@f=split(/\t/); $s+=$f[2]; END { printf("%.3f\n", $s); }')
+done
+
 #test just total auc
 time ./md_runner test.bam.all.bw | grep "AUC" > test.bw1.total_auc
 diff test.bw1.total_auc tests/testbw1.total_auc
 
+#BigWig values scaled on the way out
+./md_runner tests/test.bam --bigwig --scale-factor 2 --prefix test.bam.scaled
+diff <(./md_runner test.bam.scaled.all.bw | grep "AUC" | perl -ne 'chomp; ($k,$v)=split(/\t/); printf("%s\t%.3f\n", $k, $v/2);') tests/testbw1.total_auc
+#--normalize cpm, with the # of mapped reads from the index and, for a copy without one, from a pass over the records
+mapped=$(perl -ne 'next if /^@/; @f=split(/\t/); print "1\n" if(!($f[1] & 4) && $f[2] ne "*")' tests/test.sam | wc -l)
+cp tests/test.bam test.bam.noidx.bam
+for f in tests/test.bam test.bam.noidx.bam; do
+    ./md_runner $f --bigwig --normalize cpm --prefix test.bam.cpm
+    ./md_runner test.bam.cpm.all.bw | fgrep "AUC_ALL_BASES" | perl -ne 'chomp; ($k,$v)=split(/\t/); $e='$(cut -f 2 tests/testbw1.total_auc)'*1000000/'$mapped'; exit(abs($v-$e) > 1e-6*$e);'
+done
+
+#binned BigWig keeps the AUC (bin mean * bin length), quantized to 0:1: its AUC is the number of covered bases
+./md_runner tests/test.bam --bigwig --bigwig-bin 100 --prefix test.bam.binned
+diff <(./md_runner test.bam.binned.all.bw | grep "AUC" | perl -ne 'chomp; ($k,$v)=split(/\t/); printf("%s\t%.0f\n", $k, $v);') <(perl -ne 'chomp; ($k,$v)=split(/\t/); printf("%s\t%.0f\n", $k, $v);' tests/testbw1.total_auc)
+./md_runner tests/test.bam --bigwig --bigwig-quantize 0:1: --prefix test.bam.quantized
+diff <(./md_runner test.bam.quantized.all.bw | grep "AUC" | cut -f 2) <(./md_runner tests/test.bam --coverage | awk -F'\t' '$4 > 0 { s += $3 - $2 } END { printf("%.3f\n", s) }')
+
+#featureCounts style read counts from the same pass, split by fraction the counts add up to the assigned fragments,
+#and every fragment is either assigned, ambiguous or overlaps nothing
+./md_runner tests/test.bam --annotation tests/test_exons.bed --read-counts --read-count-overlap fraction --no-annotation-stdout --prefix test.bam.rc
+diff <(awk -F'\t' '{ s += $4 } END { printf("%.0f\n", s) }' test.bam.rc.read_counts.tsv) <(grep "^assigned" test.bam.rc.read_counts.summary.tsv | cut -f 2)
+diff <(grep "^fragments" test.bam.rc.read_counts.summary.tsv | cut -f 2) <(egrep "^(assigned|ambiguous|no_features)" test.bam.rc.read_counts.summary.tsv | awk '{ s += $2 } END { print s }')
+
 #test bigwig2sums/auc
 time ./md_runner test.bam.all.bw --annotation tests/testbw1.bed --auc --prefix test.bam.bw1 --no-annotation-stdout --no-auc-stdout
 diff test.bam.bw1.annotation.tsv tests/testbw1.bed.out.tsv
@@ -77,10 +167,54 @@ diff <(tail -n1 tests/test3.out.tsv) t3.auc.tsv
 ./md_runner tests/test3.bam --coverage  --min-unique-qual 10 --bigwig --auc --prefix test3 --no-auc-stdout
 diff tests/test3.auc.out.tsv test3.auc.tsv
 
+#per-position alt. base counts
+./md_runner tests/test3.bam --pileup-af --prefix t3
+diff tests/test3.pileup.tsv t3.pileup.tsv
+#test3.bam's alignments are ~100Mbp into chr1, the pileup window shouldn't grow to cover the gap before them
+./md_runner tests/test3.bam --pileup --prefix t3.mem --stats t3.mem.json > /dev/null
+awk '/"peak_rss_kb"/ { exit !($2 + 0 < 200000) }' t3.mem.json
+./md_runner tests/test.bam --pileup-af --prefix test.bam.pileup
+diff tests/test.bam.pileup.tsv test.bam.pileup.pileup.tsv
+
+#base counts at a list of sites, the depth at each matches the coverage there, whether fetched through the index or not
+#(just chr10's exons, as for the annotation sums above, so the index is picked)
+./md_runner tests/test.bam --sites test.bam.chr10.bed --prefix test.bam.sites 2> test.bam.sites.err
+grep "^estimated reads: .*using the index$" test.bam.sites.err
+./md_runner tests/test.bam --sites test.bam.chr10.bed --no-index --prefix test.bam.sites.scan
+diff test.bam.sites.sites.tsv test.bam.sites.scan.sites.tsv
+diff <(cut -f 1,2,6 test.bam.sites.sites.tsv) <(./md_runner tests/test.bam --coverage | awk -F'\t' 'NR==FNR { if($4 > 0) for(p = $2; p < $3; p++) d[$1"\t"p] = $4; next } { print $1"\t"$2"\t"(d[$1"\t"$2]+0) }' - test.bam.sites.sites.tsv)
+#same for the CRAM, which has to decode the read sequences for the base counts
+./md_runner tests/test.cram --sites tests/test_exons.bed --prefix test.cram.sites
+diff <(cut -f 1,2,6 test.cram.sites.sites.tsv) <(./md_runner tests/test.cram --coverage | awk -F'\t' 'NR==FNR { if($4 > 0) for(p = $2; p < $3; p++) d[$1"\t"p] = $4; next } { print $1"\t"$2"\t"(d[$1"\t"$2]+0) }' - test.cram.sites.sites.tsv)
+awk -F'\t' '{ n += $9 + $10 + $11 + $12 } END { exit !(n > 0) }' test.cram.sites.sites.tsv
+
+#--subsample keeps or drops both mates of a template together, the same ones each run, and scales the AUC back up
+./md_runner tests/test.bam --ends --subsample 0.5 | cut -f 1 | sort | uniq -c > test.subsample.names
+diff test.subsample.names <(./md_runner tests/test.bam --ends | cut -f 1 | sort | uniq -c | grep -w -F -f <(awk '{print $2}' test.subsample.names))
+diff test.subsample.names <(./md_runner tests/test.bam --ends --subsample 0.5 | cut -f 1 | sort | uniq -c)
+./md_runner tests/test.bam --auc --subsample 0.5 | awk -F'\t' '{ a[$1] = $2 } END { exit !(a["ALL_READS_ALL_BASES_SCALED"] == 2 * a["ALL_READS_ALL_BASES"]) }'
+diff <(./md_runner tests/test.bam --auc) <(./md_runner tests/test.bam --auc --subsample 1)
+#--max-depth caps the coverage
+./md_runner tests/test.bam --coverage --max-depth 2 | awk -F'\t' '$4 > 2 { exit 1 }'
+
 #long reads support for junctions
 ./md_runner tests/long_reads.bam --junctions --prefix long_reads.bam --long-reads
 diff tests/long_reads.bam.jxs.tsv long_reads.bam.jxs.tsv
 
+#coverage restricted to a region via the index, same as the whole genome coverage clipped to the region
+./md_runner tests/test.bam --coverage --region GL000219.1:168601-168700 > test.region.tsv
+diff test.region.tsv <(./md_runner tests/test.bam --coverage | awk -v OFS='\t' '$1=="GL000219.1" && $3>168600 && $2<168700 {if($2<168600)$2=168600; if($3>168700)$3=168700; print}')
+
+#per-phase timing/memory report
+./md_runner tests/test.bam --coverage --prefix test.stats --no-coverage-stdout --stats test.stats.json
+grep -q '^  "records": 96,$' test.stats.json
+grep -q '"file": "test.stats.coverage.tsv"' test.stats.json
+./md_runner tests/test.bam --coverage --stats test.stats.stdout.json > test.stats.stdout.tsv
+grep -q "\"file\": \"STDOUT\", \"bytes\": $(wc -c < test.stats.stdout.tsv)}" test.stats.stdout.json
+./md_runner tests/test.bam --auc --progress-file test.progress.prom > /dev/null
+grep -q '^megadepth_records_read_total{input="tests/test.bam"} 96$' test.progress.prom
+grep -q '^megadepth_done{input="tests/test.bam"} 1$' test.progress.prom
+
 #test bigwig2sum on remote BW
 if [[ -z $static ]]; then
     time ./md_runner http://stingray.cs.jhu.edu/data/temp/megadepth.test.bam.all.bw --op mean --annotation tests/testbw2.bed --prefix bw2.remote.mean --no-annotation-stdout >> test_run_out 2>&1
@@ -92,5 +226,5 @@ time ./md_runner test.bam.all.bw --sums-only --annotation tests/testbw2.bed --pr
 diff test.bam.bw2.annotation.tsv <(cut -f 4 tests/testbw2.bed.out.tsv)
 
 #clean up any previous test files
-rm -f test*tsv test*auc bw2* test3* test2* t3.* long_reads.bam.jxs.tsv test_run_out *null*.unique.tsv test.*.bw auc.single test.bam.mean test.cram.coverage.tsv test_cram_run_out test.cram.coverage.tsv.summed
+rm -f test*tsv test*auc bw2* test3* test2* t3.* long_reads.bam.jxs.tsv test_run_out *null*.unique.tsv test.*.bw auc.single test.bam.mean test.cram.coverage.tsv test_cram_run_out test.cram.coverage.tsv.summed test.bam.gz.* test.bam.re* test.stats.json test.stats.stdout.json test.progress.prom test.subsample.names test.bam.depth.callable.*.bed test.bam.stats test.bam.chr10.bed test.bam.chr10.err test.bam.sites.err test.bam.noidx.bam
 